@@ -0,0 +1,419 @@
+#include "AppendOnlyFile.h"
+
+#include <cerrno>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "Collections.h"
+#include "RespParser.h"
+
+namespace {
+constexpr auto kEverySecInterval = std::chrono::seconds(1);
+
+void appendBulk(std::string& out, std::string_view s) {
+    char len[24];
+    auto r = std::to_chars(len, len + sizeof(len), s.size());
+    out += '$';
+    out.append(len, r.ptr);
+    out += "\r\n";
+    out.append(s.data(), s.size());
+    out += "\r\n";
+}
+
+std::runtime_error systemError(const std::string& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+std::string rewritePathFor(const std::string& path) {
+    return path + ".rewrite";
+}
+}
+
+void AppendOnlyFile::encodeSet(std::string& out, std::string_view key, std::string_view value,
+                               int64_t expireAtMs) {
+    if (expireAtMs) {
+        out += "*5\r\n$3\r\nSET\r\n";
+        appendBulk(out, key);
+        appendBulk(out, value);
+        out += "$4\r\nPXAT\r\n";
+        appendBulk(out, std::to_string(expireAtMs));
+    } else {
+        out += "*3\r\n$3\r\nSET\r\n";
+        appendBulk(out, key);
+        appendBulk(out, value);
+    }
+}
+
+void AppendOnlyFile::encodeDel(std::string& out, std::string_view key) {
+    out += "*2\r\n$3\r\nDEL\r\n";
+    appendBulk(out, key);
+}
+
+// As Redis rewrites collections: the value is the DUMP payload
+void AppendOnlyFile::encodeRestore(std::string& out, std::string_view key,
+                                   std::string_view payload, int64_t expireAtMs) {
+    out += "*6\r\n$7\r\nRESTORE\r\n";
+    appendBulk(out, key);
+    appendBulk(out, std::to_string(expireAtMs));
+    appendBulk(out, payload);
+    out += "$7\r\nREPLACE\r\n$6\r\nABSTTL\r\n";
+}
+
+void AppendOnlyFile::encodeCommand(std::string& out, std::string_view name, std::string_view key,
+                                   const std::vector<std::string_view>& args) {
+    out += '*';
+    out += std::to_string(args.size() + 2);
+    out += "\r\n";
+    appendBulk(out, name);
+    appendBulk(out, key);
+    for (std::string_view arg : args)
+        appendBulk(out, arg);
+}
+
+bool AppendOnlyFile::decode(const std::vector<std::string_view>& args, Record& rec) {
+    rec.del = false;
+    rec.key = rec.value = {};
+    rec.expireAtMs = 0;
+    rec.type = CommandType::SET;
+    rec.args.clear();
+    if (args.size() == 2 && args[0] == "DEL") {
+        rec.del = true;
+        rec.key = args[1];
+        return true;
+    }
+    if (args.size() == 6 && args[0] == "RESTORE") {
+        auto p = std::from_chars(args[2].data(), args[2].data() + args[2].size(),
+                                 rec.expireAtMs);
+        if (args[4] != "REPLACE" || args[5] != "ABSTTL" || p.ec != std::errc() ||
+            rec.expireAtMs < 0)
+            return false;
+        rec.type = CommandType::RESTORE;
+        rec.key = args[1];
+        rec.value = args[3];
+        return true;
+    }
+    if (!args.empty() && args[0] != "SET") {
+        const CollectionCommand* command = findCollectionCommand(args[0]);
+        if (!command || !command->write || !arityMatches(*command, args.size()))
+            return false;
+        rec.type = command->type;
+        rec.key = args[1];
+        rec.args.assign(args.begin() + 2, args.end());
+        return true;
+    }
+    if ((args.size() != 3 && args.size() != 5) || args[0] != "SET")
+        return false;
+    rec.key = args[1];
+    rec.value = args[2];
+    if (args.size() == 5) {
+        auto p = std::from_chars(args[4].data(), args[4].data() + args[4].size(),
+                                 rec.expireAtMs);
+        if (args[3] != "PXAT" || p.ec != std::errc() || rec.expireAtMs <= 0)
+            return false;
+    }
+    return true;
+}
+
+void AppendOnlyFile::replay(const std::function<void(const Record&)>& fn) {
+    int in = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+        throw systemError("open " + path);
+
+    std::string data;
+    char chunk[64 * 1024];
+    ssize_t n;
+    while ((n = read(in, chunk, sizeof(chunk))) > 0)
+        data.append(chunk, static_cast<size_t>(n));
+    close(in);
+    if (n < 0)
+        throw systemError("read " + path);
+
+    // First pass validates and finds where the last whole record ends
+    RespParser parser;
+    std::vector<std::string_view> args;
+    Record rec;
+    RespParser::Result r;
+    while ((r = parser.next(data.data(), data.size(), args)) == RespParser::Result::Command) {
+        if (!decode(args, rec))
+            throw std::runtime_error("corrupt append-only file: " + path);
+    }
+    if (r == RespParser::Result::Error)
+        throw std::runtime_error("corrupt append-only file: " + path);
+
+    // Drop a record torn by a crash before anything new is appended
+    size_t valid = parser.pendingStart();
+    if (valid < data.size() && ftruncate(fd, static_cast<off_t>(valid)) < 0)
+        throw systemError("truncate " + path);
+    statSize.store(valid, std::memory_order_relaxed);
+    statBaseSize.store(valid, std::memory_order_relaxed);
+
+    {
+        std::lock_guard<std::mutex> lock(rewriteStartMutex);
+        replaying = true;
+    }
+    RespParser replayer;
+    while (replayer.next(data.data(), valid, args) == RespParser::Result::Command) {
+        decode(args, rec);
+        fn(rec);
+    }
+    std::lock_guard<std::mutex> lock(rewriteStartMutex);
+    replaying = false;
+}
+
+AppendOnlyFile::AppendOnlyFile(const RedisLiteConfig& config, size_t shards,
+                               std::function<void()> startRewrite)
+    : path(config.aofPath),
+      fsyncPolicy(config.aofFsync),
+      rewritePercentage(config.aofRewritePercentage),
+      rewriteMinSize(config.aofRewriteMinSize),
+      startRewrite(std::move(startRewrite)),
+      shardCount(shards),
+      scanStarted(shards, false) {
+    fd = open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw systemError("open " + path);
+
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        statSize.store(static_cast<uint64_t>(st.st_size), std::memory_order_relaxed);
+        statBaseSize.store(static_cast<uint64_t>(st.st_size), std::memory_order_relaxed);
+    }
+    lastFsync = std::chrono::steady_clock::now();
+    writer = std::thread(&AppendOnlyFile::run, this);
+}
+
+AppendOnlyFile::~AppendOnlyFile() {
+    stopRewrites();
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+    }
+    cv.notify_one();
+    writer.join();
+
+    if (rewriteFd >= 0)
+        abortRewrite();
+    if (fsyncPolicy != AofFsync::No)
+        fsync(fd);
+    close(fd);
+}
+
+void AppendOnlyFile::push(size_t shard, ChunkKind kind, std::string&& data) {
+    bool wasEmpty;
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        wasEmpty = pending.empty();
+        pending.push_back(Chunk{shard, kind, std::move(data)});
+    }
+    if (wasEmpty)
+        cv.notify_one();
+}
+
+void AppendOnlyFile::append(size_t shard, std::string&& records) {
+    push(shard, ChunkKind::Log, std::move(records));
+}
+
+void AppendOnlyFile::beginBase(size_t shard) {
+    push(shard, ChunkKind::ScanStart, std::string());
+}
+
+void AppendOnlyFile::appendBase(size_t shard, std::string&& records) {
+    push(shard, ChunkKind::Base, std::move(records));
+}
+
+void AppendOnlyFile::endBase(size_t shard) {
+    push(shard, ChunkKind::ScanDone, std::string());
+}
+
+bool AppendOnlyFile::tryBeginRewrite() {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (rewriting || stopping)
+        return false;
+    rewriting = true;
+    return true;
+}
+
+void AppendOnlyFile::stopRewrites() {
+    std::lock_guard<std::mutex> lock(rewriteStartMutex);
+    rewritesStopped = true;
+}
+
+AofStats AppendOnlyFile::stats() {
+    AofStats s;
+    s.currentSize = statSize.load(std::memory_order_relaxed);
+    s.baseSize = statBaseSize.load(std::memory_order_relaxed);
+    s.groupCommits = statGroupCommits.load(std::memory_order_relaxed);
+    s.fsyncs = statFsyncs.load(std::memory_order_relaxed);
+    s.rewrites = statRewrites.load(std::memory_order_relaxed);
+    s.writeErrors = statWriteErrors.load(std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutex);
+    s.rewriting = rewriting;
+    return s;
+}
+
+bool AppendOnlyFile::writeAll(int to, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t n = write(to, data.data(), data.size());
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            statWriteErrors.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        data.remove_prefix(static_cast<size_t>(n));
+    }
+    return true;
+}
+
+void AppendOnlyFile::run() {
+    std::vector<Chunk> chunks;
+    std::string out;
+
+    while (true) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            auto ready = [&]() { return stopping || !pending.empty(); };
+            // An everysec fsync is still owed even if no more writes come
+            if (unsynced && fsyncPolicy == AofFsync::EverySec)
+                cv.wait_for(lock, kEverySecInterval, ready);
+            else
+                cv.wait(lock, ready);
+            chunks.swap(pending);
+            if (chunks.empty() && stopping)
+                break;
+        }
+
+        // Group commit: everything that piled up goes out in one write
+        out.clear();
+        for (auto& chunk : chunks)
+            handle(chunk, out);
+        chunks.clear();
+
+        if (!out.empty()) {
+            if (writeAll(fd, out))
+                statSize.fetch_add(out.size(), std::memory_order_relaxed);
+            statGroupCommits.fetch_add(1, std::memory_order_relaxed);
+            unsynced = true;
+        }
+        syncIfDue(false);
+
+        if (rewriteFd >= 0 && scansDone == shardCount)
+            finishRewrite();
+        maybeAutoRewrite();
+    }
+}
+
+void AppendOnlyFile::handle(Chunk& chunk, std::string& out) {
+    switch (chunk.kind) {
+    case ChunkKind::Log:
+        out += chunk.data;
+        if (rewriteFd >= 0 && scanStarted[chunk.shard])
+            diff += chunk.data;
+        break;
+    case ChunkKind::ScanStart:
+        if (rewriteFd < 0) {
+            std::string tmp = rewritePathFor(path);
+            rewriteFd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+            if (rewriteFd < 0) {
+                // Leave the flag set until the shards are done scanning
+                statWriteErrors.fetch_add(1, std::memory_order_relaxed);
+                break;
+            }
+        }
+        scanStarted[chunk.shard] = true;
+        break;
+    case ChunkKind::Base:
+        if (rewriteFd >= 0)
+            writeAll(rewriteFd, chunk.data);
+        break;
+    case ChunkKind::ScanDone:
+        scansDone++;
+        if (rewriteFd < 0 && scansDone == shardCount) {
+            // The temp file could not be created; give up on this round
+            scansDone = 0;
+            std::lock_guard<std::mutex> lock(mutex);
+            rewriting = false;
+        }
+        break;
+    }
+}
+
+void AppendOnlyFile::syncIfDue(bool force) {
+    if (!unsynced || fsyncPolicy == AofFsync::No)
+        return;
+    auto now = std::chrono::steady_clock::now();
+    if (!force && fsyncPolicy == AofFsync::EverySec && now - lastFsync < kEverySecInterval)
+        return;
+    fdatasync(fd);
+    lastFsync = now;
+    unsynced = false;
+    statFsyncs.fetch_add(1, std::memory_order_relaxed);
+}
+
+void AppendOnlyFile::finishRewrite() {
+    std::string tmp = rewritePathFor(path);
+    bool ok = writeAll(rewriteFd, diff) && fsync(rewriteFd) == 0 &&
+              rename(tmp.c_str(), path.c_str()) == 0;
+    if (!ok) {
+        statWriteErrors.fetch_add(1, std::memory_order_relaxed);
+        abortRewrite();
+        return;
+    }
+
+    // Everything in the old file is covered by base + diff
+    syncIfDue(true);
+    close(fd);
+    fd = rewriteFd;
+    rewriteFd = -1;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0) {
+        statSize.store(static_cast<uint64_t>(st.st_size), std::memory_order_relaxed);
+        statBaseSize.store(static_cast<uint64_t>(st.st_size), std::memory_order_relaxed);
+    }
+    // The rename is only durable once the directory is synced too
+    std::string dir = path.find('/') == std::string::npos
+                          ? std::string(".") : path.substr(0, path.rfind('/') + 1);
+    int dirFd = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd >= 0) {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    diff.clear();
+    diff.shrink_to_fit();
+    scanStarted.assign(shardCount, false);
+    scansDone = 0;
+    statRewrites.fetch_add(1, std::memory_order_relaxed);
+    std::lock_guard<std::mutex> lock(mutex);
+    rewriting = false;
+}
+
+void AppendOnlyFile::abortRewrite() {
+    close(rewriteFd);
+    rewriteFd = -1;
+    unlink(rewritePathFor(path).c_str());
+    diff.clear();
+    diff.shrink_to_fit();
+    scanStarted.assign(shardCount, false);
+    scansDone = 0;
+    std::lock_guard<std::mutex> lock(mutex);
+    rewriting = false;
+}
+
+void AppendOnlyFile::maybeAutoRewrite() {
+    if (!rewritePercentage)
+        return;
+    uint64_t size = statSize.load(std::memory_order_relaxed);
+    uint64_t base = statBaseSize.load(std::memory_order_relaxed);
+    if (size < rewriteMinSize || size < base + base * rewritePercentage / 100)
+        return;
+
+    std::lock_guard<std::mutex> lock(rewriteStartMutex);
+    if (!rewritesStopped && !replaying && tryBeginRewrite())
+        startRewrite();
+}
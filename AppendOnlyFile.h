@@ -0,0 +1,155 @@
+#pragma once
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+#include "Command.h"
+#include "Config.h"
+
+// Snapshot of the AOF writer's counters
+struct AofStats {
+    uint64_t currentSize = 0;  // bytes in the live file
+    uint64_t baseSize = 0;     // its size right after the last rewrite
+    uint64_t groupCommits = 0; // write() rounds, each covering many batches
+    uint64_t fsyncs = 0;
+    uint64_t rewrites = 0;
+    uint64_t writeErrors = 0;
+    bool rewriting = false;
+};
+
+// Append-only log of the mutations the shard workers execute. Workers
+// encode records into a local buffer during a batch and hand the whole
+// buffer over with append(); a dedicated thread writes everything that
+// piled up with one write() and fsyncs according to AofFsync, so the
+// workers never wait for the disk.
+//
+// Records are RESP arrays (SET key value [PXAT unix-ms], DEL key, the
+// collection writes as they were issued, RESTORE key unix-ms payload
+// REPLACE ABSTTL for a whole collection), with absolute expiry times so
+// replaying an old log never extends a TTL.
+//
+// Rewrite compacts the log without stopping the workers: each shard scans
+// its store incrementally (FlatHashMap::scan) and streams the entries it
+// finds as a base. Log records a shard produces after its scan began are
+// also kept in memory as a diff. Once every shard finished, base + diff
+// replace the old file. A base entry may be newer than the scan start, but
+// the diff replayed after it always ends on the latest write.
+class AppendOnlyFile {
+public:
+    // One record as replayed by replay(); expireAtMs is unix time, 0 = none.
+    // `type` is SET for a SET or DEL, otherwise RESTORE (the payload in
+    // `value`) or a collection write with its arguments after the key.
+    struct Record {
+        bool del;
+        std::string_view key;
+        std::string_view value;
+        int64_t expireAtMs;
+        CommandType type = CommandType::SET;
+        std::vector<std::string_view> args;
+    };
+
+    static void encodeSet(std::string& out, std::string_view key, std::string_view value,
+                          int64_t expireAtMs);
+    static void encodeDel(std::string& out, std::string_view key);
+    static void encodeRestore(std::string& out, std::string_view key, std::string_view payload,
+                              int64_t expireAtMs);
+    static void encodeCommand(std::string& out, std::string_view name, std::string_view key,
+                              const std::vector<std::string_view>& args);
+    // Parses one record's arguments (views into the caller's buffer);
+    // false if they are not a record this class writes
+    static bool decode(const std::vector<std::string_view>& args, Record& rec);
+
+private:
+    enum class ChunkKind { Log, ScanStart, Base, ScanDone };
+
+    struct Chunk {
+        size_t shard;
+        ChunkKind kind;
+        std::string data;
+    };
+
+    std::string path;
+    AofFsync fsyncPolicy;
+    size_t rewritePercentage;
+    size_t rewriteMinSize;
+    std::function<void()> startRewrite; // asks every shard to begin a scan
+
+    int fd = -1;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<Chunk> pending;
+    bool stopping = false;
+    bool rewriting = false;
+
+    std::mutex rewriteStartMutex; // held while startRewrite runs
+    bool rewritesStopped = false;
+    // Replayed commands are not logged, so no scan may start before they
+    // are all queued ahead of it
+    bool replaying = false;
+
+    // Writer thread only
+    size_t shardCount;
+    int rewriteFd = -1;
+    std::vector<bool> scanStarted;
+    size_t scansDone = 0;
+    std::string diff;
+    bool unsynced = false;
+    std::chrono::steady_clock::time_point lastFsync;
+
+    std::atomic<uint64_t> statSize{0};
+    std::atomic<uint64_t> statBaseSize{0};
+    std::atomic<uint64_t> statGroupCommits{0};
+    std::atomic<uint64_t> statFsyncs{0};
+    std::atomic<uint64_t> statRewrites{0};
+    std::atomic<uint64_t> statWriteErrors{0};
+
+    std::thread writer;
+
+    void push(size_t shard, ChunkKind kind, std::string&& data);
+    void run();
+    bool writeAll(int to, std::string_view data);
+    void handle(Chunk& chunk, std::string& out);
+    void syncIfDue(bool force);
+    void finishRewrite();
+    void abortRewrite();
+    void maybeAutoRewrite();
+
+public:
+    // Opens (or creates) the file for appending, then starts the writer.
+    // Throws std::runtime_error if it cannot be opened.
+    AppendOnlyFile(const RedisLiteConfig& config, size_t shards,
+                   std::function<void()> startRewrite);
+    // Writes and fsyncs whatever is still queued; abandons a rewrite that
+    // has not finished
+    ~AppendOnlyFile();
+
+    AppendOnlyFile(const AppendOnlyFile&) = delete;
+    AppendOnlyFile& operator=(const AppendOnlyFile&) = delete;
+
+    // Calls fn for every record already in the file. Must run before
+    // anything is appended: a record torn by a crash at the end is cut
+    // off first. Anything else that does not parse throws
+    // std::runtime_error.
+    void replay(const std::function<void(const Record&)>& fn);
+
+    // Shard workers
+    void append(size_t shard, std::string&& records);
+    void beginBase(size_t shard);
+    void appendBase(size_t shard, std::string&& records);
+    void endBase(size_t shard);
+
+    // Claims the rewrite; false if one is already running. The caller then
+    // starts the shard scans.
+    bool tryBeginRewrite();
+    // No rewrite is started after this returns
+    void stopRewrites();
+
+    AofStats stats();
+};
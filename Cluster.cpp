@@ -0,0 +1,90 @@
+#include "Cluster.h"
+
+ClusterState::ClusterState(std::string self) : selfAddress(std::move(self)) {
+    auto view = std::make_shared<View>();
+    view->nodes.push_back(selfAddress);
+    view->slots.resize(kHashSlots);
+    current = std::move(view);
+}
+
+std::shared_ptr<const ClusterState::View> ClusterState::view() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return current;
+}
+
+int32_t ClusterState::nodeIndex(View& view, const std::string& address) {
+    for (size_t i = 0; i < view.nodes.size(); i++) {
+        if (view.nodes[i] == address)
+            return static_cast<int32_t>(i);
+    }
+    view.nodes.push_back(address);
+    return static_cast<int32_t>(view.nodes.size() - 1);
+}
+
+// mutex held
+void ClusterState::publish(std::shared_ptr<const View> next) {
+    current = std::move(next);
+    changes.fetch_add(1, std::memory_order_release);
+}
+
+bool ClusterState::addSlots(const std::vector<uint32_t>& slots) {
+    std::lock_guard<std::mutex> lock(mutex);
+    // Every slot is checked before the View is copied, so a busy one
+    // leaves the others unassigned, as in Redis
+    for (uint32_t s : slots) {
+        if (s >= kHashSlots || (current->slots[s].owner >= 0 && current->slots[s].owner != 0))
+            return false;
+    }
+    auto next = std::make_shared<View>(*current);
+    for (uint32_t s : slots)
+        next->slots[s] = Slot{0, SlotState::Stable, -1};
+    publish(std::move(next));
+    return true;
+}
+
+bool ClusterState::setSlotNode(uint32_t slot, const std::string& node) {
+    if (slot >= kHashSlots || node.empty())
+        return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto next = std::make_shared<View>(*current);
+    next->slots[slot] = Slot{nodeIndex(*next, node), SlotState::Stable, -1};
+    publish(std::move(next));
+    return true;
+}
+
+bool ClusterState::setSlotMigrating(uint32_t slot, const std::string& target) {
+    if (slot >= kHashSlots || target.empty())
+        return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (current->slots[slot].owner != 0)
+        return false; // only the owner migrates a slot away
+    auto next = std::make_shared<View>(*current);
+    next->slots[slot].state = SlotState::Migrating;
+    next->slots[slot].peer = nodeIndex(*next, target);
+    publish(std::move(next));
+    return true;
+}
+
+bool ClusterState::setSlotImporting(uint32_t slot, const std::string& source) {
+    if (slot >= kHashSlots || source.empty())
+        return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    if (current->slots[slot].owner == 0)
+        return false; // already ours
+    auto next = std::make_shared<View>(*current);
+    next->slots[slot].state = SlotState::Importing;
+    next->slots[slot].peer = nodeIndex(*next, source);
+    publish(std::move(next));
+    return true;
+}
+
+bool ClusterState::setSlotStable(uint32_t slot) {
+    if (slot >= kHashSlots)
+        return false;
+    std::lock_guard<std::mutex> lock(mutex);
+    auto next = std::make_shared<View>(*current);
+    next->slots[slot].state = SlotState::Stable;
+    next->slots[slot].peer = -1;
+    publish(std::move(next));
+    return true;
+}
@@ -0,0 +1,56 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+#include "HashSlot.h"
+
+// Which node serves each hash slot, as this node has been told through
+// CLUSTER ADDSLOTS / SETSLOT (there is no gossip: an operator or script
+// configures every node). Nodes are named by their "host:port", and a
+// slot on the move is Migrating on its owner and Importing on the target
+// until SETSLOT NODE settles it, as in Redis Cluster.
+//
+// Readers take an immutable View and only come back for a new one when
+// version() changed, so the per-request check costs one atomic load.
+class ClusterState {
+public:
+    enum class SlotState : uint8_t { Stable, Migrating, Importing };
+
+    struct Slot {
+        int32_t owner = -1; // index into View::nodes, -1 = unassigned
+        SlotState state = SlotState::Stable;
+        int32_t peer = -1;  // migration target / import source
+    };
+
+    struct View {
+        std::vector<std::string> nodes; // nodes[0] is this node
+        std::vector<Slot> slots;        // kHashSlots entries
+    };
+
+private:
+    std::string selfAddress;
+    mutable std::mutex mutex;
+    std::shared_ptr<const View> current;
+    std::atomic<uint64_t> changes{0};
+
+    int32_t nodeIndex(View& view, const std::string& address);
+    void publish(std::shared_ptr<const View> next);
+
+public:
+    explicit ClusterState(std::string self);
+
+    const std::string& self() const { return selfAddress; }
+    std::shared_ptr<const View> view() const;
+    uint64_t version() const { return changes.load(std::memory_order_acquire); }
+
+    // Each returns false (and changes nothing) if an argument is invalid
+    // To this node, all or none, in a single new View
+    bool addSlots(const std::vector<uint32_t>& slots);
+    bool setSlotNode(uint32_t slot, const std::string& node);
+    bool setSlotMigrating(uint32_t slot, const std::string& target);
+    bool setSlotImporting(uint32_t slot, const std::string& source);
+    bool setSlotStable(uint32_t slot);
+};
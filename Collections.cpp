@@ -0,0 +1,1398 @@
+#include "Collections.h"
+#include "Compression.h"
+
+#include <algorithm>
+#include <array>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+
+namespace {
+// Rough per-element cost of a container node, for memory accounting
+constexpr size_t kElementOverhead = 48;
+constexpr size_t kNone = static_cast<size_t>(-1);
+
+const CollectionCommand kCommands[] = {
+    {"HSET", CommandType::HSET, ValueType::Hash, -4, 2, true},
+    {"HGET", CommandType::HGET, ValueType::Hash, 3, 1, false},
+    {"HMGET", CommandType::HMGET, ValueType::Hash, -3, 1, false},
+    {"HDEL", CommandType::HDEL, ValueType::Hash, -3, 1, true},
+    {"HLEN", CommandType::HLEN, ValueType::Hash, 2, 1, false},
+    {"HEXISTS", CommandType::HEXISTS, ValueType::Hash, 3, 1, false},
+    {"HGETALL", CommandType::HGETALL, ValueType::Hash, 2, 1, false},
+    {"HINCRBY", CommandType::HINCRBY, ValueType::Hash, 4, 1, true},
+    {"LPUSH", CommandType::LPUSH, ValueType::List, -3, 1, true},
+    {"RPUSH", CommandType::RPUSH, ValueType::List, -3, 1, true},
+    {"LPOP", CommandType::LPOP, ValueType::List, 2, 1, true},
+    {"RPOP", CommandType::RPOP, ValueType::List, 2, 1, true},
+    {"LLEN", CommandType::LLEN, ValueType::List, 2, 1, false},
+    {"LINDEX", CommandType::LINDEX, ValueType::List, 3, 1, false},
+    {"LRANGE", CommandType::LRANGE, ValueType::List, 4, 1, false},
+    {"LSET", CommandType::LSET, ValueType::List, 4, 1, true},
+    {"SADD", CommandType::SADD, ValueType::Set, -3, 1, true},
+    {"SREM", CommandType::SREM, ValueType::Set, -3, 1, true},
+    {"SISMEMBER", CommandType::SISMEMBER, ValueType::Set, 3, 1, false},
+    {"SCARD", CommandType::SCARD, ValueType::Set, 2, 1, false},
+    {"SMEMBERS", CommandType::SMEMBERS, ValueType::Set, 2, 1, false},
+    {"ZADD", CommandType::ZADD, ValueType::ZSet, -4, 2, true},
+    {"ZREM", CommandType::ZREM, ValueType::ZSet, -3, 1, true},
+    {"ZSCORE", CommandType::ZSCORE, ValueType::ZSet, 3, 1, false},
+    {"ZCARD", CommandType::ZCARD, ValueType::ZSet, 2, 1, false},
+    {"ZINCRBY", CommandType::ZINCRBY, ValueType::ZSet, 4, 1, true},
+    {"ZRANK", CommandType::ZRANK, ValueType::ZSet, 3, 1, false},
+    {"ZRANGE", CommandType::ZRANGE, ValueType::ZSet, -4, 1, false},
+    {"ZRANGEBYSCORE", CommandType::ZRANGEBYSCORE, ValueType::ZSet, -4, 1, false},
+};
+
+void putVarint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out += static_cast<char>((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    out += static_cast<char>(v);
+}
+
+bool readVarint(const char*& p, const char* end, uint64_t& out) {
+    out = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t b = static_cast<uint8_t>(*p++);
+        out |= uint64_t(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+
+// Listpack: varint count | (varint length | bytes) per element
+size_t listpackCount(std::string_view packed) {
+    const char* p = packed.data();
+    uint64_t count = 0;
+    if (!packed.empty())
+        readVarint(p, p + packed.size(), count);
+    return static_cast<size_t>(count);
+}
+
+void unpackListpack(std::string_view packed, std::vector<std::string_view>& items) {
+    items.clear();
+    if (packed.empty())
+        return;
+    const char* p = packed.data();
+    const char* end = p + packed.size();
+    uint64_t count, length;
+    readVarint(p, end, count);
+    items.reserve(count);
+    for (uint64_t i = 0; i < count; i++) {
+        readVarint(p, end, length);
+        items.emplace_back(p, length);
+        p += length;
+    }
+}
+
+// Element sizes, or false if the bytes are not a whole listpack
+bool validListpack(std::string_view packed, std::vector<std::string_view>& items) {
+    items.clear();
+    const char* p = packed.data();
+    const char* end = p + packed.size();
+    uint64_t count, length;
+    if (!readVarint(p, end, count) || count > packed.size())
+        return false;
+    for (uint64_t i = 0; i < count; i++) {
+        if (!readVarint(p, end, length) || static_cast<uint64_t>(end - p) < length)
+            return false;
+        items.emplace_back(p, length);
+        p += length;
+    }
+    return p == end;
+}
+
+void packListpack(const std::vector<std::string_view>& items, std::string& out) {
+    out.clear();
+    putVarint(out, items.size());
+    for (std::string_view item : items) {
+        putVarint(out, item.size());
+        out.append(item.data(), item.size());
+    }
+}
+
+// Intset: u8 width | count * width bytes, signed, ascending
+size_t intsetCount(std::string_view packed) {
+    return packed.size() > 1 ? (packed.size() - 1) / static_cast<uint8_t>(packed[0]) : 0;
+}
+
+int64_t intsetAt(std::string_view packed, size_t i) {
+    const char* p = packed.data() + 1 + i * static_cast<uint8_t>(packed[0]);
+    switch (packed[0]) {
+    case 2: {
+        int16_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    case 4: {
+        int32_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    default: {
+        int64_t v;
+        std::memcpy(&v, p, sizeof(v));
+        return v;
+    }
+    }
+}
+
+// Index of the first value >= v
+size_t intsetLowerBound(std::string_view packed, int64_t v) {
+    size_t lo = 0, hi = intsetCount(packed);
+    while (lo < hi) {
+        size_t mid = (lo + hi) / 2;
+        if (intsetAt(packed, mid) < v)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+bool intsetContains(std::string_view packed, int64_t v) {
+    size_t i = intsetLowerBound(packed, v);
+    return i < intsetCount(packed) && intsetAt(packed, i) == v;
+}
+
+// The narrowest width holding every value, as intsetUpgrade picks it
+void packIntset(const std::vector<int64_t>& values, std::string& out) {
+    uint8_t width = 2;
+    for (int64_t v : values) {
+        if (v < INT32_MIN || v > INT32_MAX)
+            width = 8;
+        else if ((v < INT16_MIN || v > INT16_MAX) && width < 4)
+            width = 4;
+    }
+    out.assign(1, static_cast<char>(width));
+    for (int64_t v : values) {
+        if (width == 2) {
+            int16_t n = static_cast<int16_t>(v);
+            out.append(reinterpret_cast<const char*>(&n), sizeof(n));
+        } else if (width == 4) {
+            int32_t n = static_cast<int32_t>(v);
+            out.append(reinterpret_cast<const char*>(&n), sizeof(n));
+        } else {
+            out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+        }
+    }
+}
+
+bool parseInt64(std::string_view s, int64_t& out) {
+    auto r = std::from_chars(s.data(), s.data() + s.size(), out);
+    return r.ec == std::errc() && r.ptr == s.data() + s.size() && !s.empty();
+}
+
+// Only integers that print back the same go into an intset
+bool canonicalInt(std::string_view s, int64_t& out) {
+    return s.size() <= 20 && parseInt64(s, out) && std::to_string(out) == s;
+}
+
+bool parseScore(std::string_view s, double& out) {
+    if (s.empty() || s.size() > 64)
+        return false;
+    char buf[65];
+    std::memcpy(buf, s.data(), s.size());
+    buf[s.size()] = '\0';
+    char* end;
+    out = std::strtod(buf, &end);
+    return end == buf + s.size() && !std::isnan(out);
+}
+
+// "(" makes a ZRANGEBYSCORE bound exclusive
+bool parseBound(std::string_view s, double& out, bool& exclusive) {
+    exclusive = !s.empty() && s[0] == '(';
+    return parseScore(exclusive ? s.substr(1) : s, out);
+}
+
+std::string formatScore(double score) {
+    if (std::isinf(score))
+        return score > 0 ? "inf" : "-inf";
+    char buf[32];
+    int n = std::snprintf(buf, sizeof(buf), "%.17g", score);
+    return std::string(buf, static_cast<size_t>(n));
+}
+
+// Zset listpacks hold each score as its 8 raw bytes after the member
+using ScoreBytes = std::array<char, sizeof(double)>;
+
+std::string_view scoreView(const ScoreBytes& bytes) {
+    return std::string_view(bytes.data(), bytes.size());
+}
+
+ScoreBytes scoreBytes(double score) {
+    ScoreBytes bytes;
+    std::memcpy(bytes.data(), &score, sizeof(score));
+    return bytes;
+}
+
+double scoreOf(std::string_view bytes) {
+    double score;
+    std::memcpy(&score, bytes.data(), sizeof(score));
+    return score;
+}
+
+bool equalsIgnoreCase(std::string_view s, std::string_view upper) {
+    if (s.size() != upper.size())
+        return false;
+    for (size_t i = 0; i < s.size(); i++) {
+        if (std::toupper(static_cast<unsigned char>(s[i])) != upper[i])
+            return false;
+    }
+    return true;
+}
+
+void replyInt(std::string& out, long long n) {
+    out += ':';
+    out += std::to_string(n);
+    out += "\r\n";
+}
+
+void replyBulk(std::string& out, std::string_view s) {
+    out += '$';
+    out += std::to_string(s.size());
+    out += "\r\n";
+    out.append(s.data(), s.size());
+    out += "\r\n";
+}
+
+void replyNil(std::string& out) {
+    out += "$-1\r\n";
+}
+
+void replyArray(std::string& out, size_t n) {
+    out += '*';
+    out += std::to_string(n);
+    out += "\r\n";
+}
+
+void replyError(std::string& out, const char* message) {
+    out += '-';
+    out += message;
+    out += "\r\n";
+}
+
+const char* const kNotInteger = "ERR value is not an integer or out of range";
+const char* const kNotFloat = "ERR value is not a valid float";
+const char* const kSyntaxError = "ERR syntax error";
+
+// LRANGE / ZRANGE indices, negative from the end: false if the range is
+// empty, otherwise [first, last] clamped to the collection
+bool clampRange(int64_t start, int64_t stop, size_t size, size_t& first, size_t& last) {
+    int64_t n = static_cast<int64_t>(size);
+    if (start < 0)
+        start += n;
+    if (stop < 0)
+        stop += n;
+    if (start < 0)
+        start = 0;
+    if (start > stop || start >= n)
+        return false;
+    if (stop >= n)
+        stop = n - 1;
+    first = static_cast<size_t>(start);
+    last = static_cast<size_t>(stop);
+    return true;
+}
+
+// WITHSCORES as the one optional argument after `required` ones
+bool withScores(const std::vector<std::string_view>& args, size_t required, bool& with) {
+    with = args.size() > required;
+    return args.size() == required ||
+           (args.size() == required + 1 && equalsIgnoreCase(args[required], "WITHSCORES"));
+}
+
+bool zsetBefore(double score, std::string_view member, double otherScore,
+                std::string_view otherMember) {
+    return score < otherScore || (score == otherScore && member < otherMember);
+}
+
+void replyRange(std::string& out, const std::vector<std::pair<std::string_view, double>>& range,
+                bool scores) {
+    replyArray(out, range.size() * (scores ? 2 : 1));
+    for (const auto& element : range) {
+        replyBulk(out, element.first);
+        if (scores)
+            replyBulk(out, formatScore(element.second));
+    }
+}
+}
+
+const CollectionCommand* findCollectionCommand(std::string_view name) {
+    for (const auto& command : kCommands) {
+        if (name == command.name)
+            return &command;
+    }
+    return nullptr;
+}
+
+const CollectionCommand* collectionCommand(CommandType type) {
+    for (const auto& command : kCommands) {
+        if (command.type == type)
+            return &command;
+    }
+    return nullptr;
+}
+
+bool arityMatches(const CollectionCommand& command, size_t argc) {
+    if (command.arity > 0)
+        return argc == static_cast<size_t>(command.arity);
+    return argc >= static_cast<size_t>(-command.arity) &&
+           (argc - 2) % static_cast<size_t>(command.step) == 0;
+}
+
+const char* typeName(ValueType type) {
+    switch (type) {
+    case ValueType::String:
+        return "string";
+    case ValueType::Hash:
+        return "hash";
+    case ValueType::List:
+        return "list";
+    case ValueType::Set:
+        return "set";
+    case ValueType::ZSet:
+        return "zset";
+    }
+    return "none";
+}
+
+// The names OBJECT ENCODING reports in Redis for the equivalent layout
+const char* encodingName(ValueType type, Encoding encoding) {
+    switch (encoding) {
+    case Encoding::Raw:
+        return "raw";
+    case Encoding::Listpack:
+        return "listpack";
+    case Encoding::Intset:
+        return "intset";
+    case Encoding::Int:
+        return "int";
+    case Encoding::Compressed:
+        return "compressed";
+    case Encoding::Expanded:
+        break;
+    }
+    return type == ValueType::List ? "quicklist" : type == ValueType::ZSet ? "skiplist"
+                                                                            : "hashtable";
+}
+
+CollectionOp::CollectionOp(ValueType type, Encoding encoding, std::string_view packed,
+                           Collection* expanded, const CollectionLimits& limits)
+    : encoding(encoding), type(type), packed(packed), expanded(expanded), limits(limits) {}
+
+size_t CollectionOp::size() const {
+    if (encoding == Encoding::Expanded) {
+        switch (type) {
+        case ValueType::Hash:
+            return expanded->hash.size();
+        case ValueType::List:
+            return expanded->list.size();
+        case ValueType::Set:
+            return expanded->set.size();
+        case ValueType::ZSet:
+            return expanded->zset.size();
+        case ValueType::String:
+            break;
+        }
+        return 0;
+    }
+    if (encoding == Encoding::Intset)
+        return intsetCount(packed);
+    size_t count = listpackCount(packed);
+    return type == ValueType::Hash || type == ValueType::ZSet ? count / 2 : count;
+}
+
+void CollectionOp::unpack() {
+    unpackListpack(packed, items);
+}
+
+void CollectionOp::repack() {
+    packListpack(items, repacked);
+    packed = repacked;
+}
+
+// Elements (pairs for a hash or zset) after a write, and the arguments it
+// added: both must be within the listpack limits to stay packed
+bool CollectionOp::fitsPacked(size_t count, const std::vector<std::string_view>& added) const {
+    if (count > limits.listpackMaxEntries)
+        return false;
+    for (std::string_view s : added) {
+        if (s.size() > limits.listpackMaxValue)
+            return false;
+    }
+    return true;
+}
+
+// Builds the Collection from `items` (or the intset in `packed`)
+void CollectionOp::expand() {
+    auto c = std::make_unique<Collection>();
+    switch (type) {
+    case ValueType::Hash:
+        for (size_t i = 0; i + 1 < items.size(); i += 2) {
+            c->hash.emplace(items[i], items[i + 1]);
+            c->bytes += items[i].size() + items[i + 1].size() + kElementOverhead;
+        }
+        break;
+    case ValueType::List:
+        for (std::string_view item : items) {
+            c->list.emplace_back(item);
+            c->bytes += item.size() + kElementOverhead;
+        }
+        break;
+    case ValueType::Set:
+        if (encoding == Encoding::Intset) {
+            for (size_t i = 0; i < intsetCount(packed); i++) {
+                std::string member = std::to_string(intsetAt(packed, i));
+                c->bytes += member.size() + kElementOverhead;
+                c->set.insert(std::move(member));
+            }
+        } else {
+            for (std::string_view item : items) {
+                c->set.emplace(item);
+                c->bytes += item.size() + kElementOverhead;
+            }
+        }
+        break;
+    case ValueType::ZSet:
+        for (size_t i = 0; i + 1 < items.size(); i += 2) {
+            double score = scoreOf(items[i + 1]);
+            c->zset.insert(score, items[i]);
+            c->scores.emplace(items[i], score);
+            c->bytes += 2 * (items[i].size() + kElementOverhead);
+        }
+        break;
+    case ValueType::String:
+        break;
+    }
+    converted = std::move(c);
+    expanded = converted.get();
+    encoding = Encoding::Expanded;
+}
+
+bool CollectionOp::run(CommandType command, const std::vector<std::string_view>& args,
+                       std::string& reply) {
+    switch (type) {
+    case ValueType::Hash:
+        return runHash(command, args, reply);
+    case ValueType::List:
+        return runList(command, args, reply);
+    case ValueType::Set:
+        return runSet(command, args, reply);
+    case ValueType::ZSet:
+        return runZSet(command, args, reply);
+    case ValueType::String:
+        break;
+    }
+    return false;
+}
+
+bool CollectionOp::runHash(CommandType command, const std::vector<std::string_view>& args,
+                           std::string& reply) {
+    // HINCRBY checks its increment before looking at the value
+    int64_t by = 0;
+    if (command == CommandType::HINCRBY && !parseInt64(args[1], by)) {
+        replyError(reply, kNotInteger);
+        return false;
+    }
+
+    if (encoding == Encoding::Listpack) {
+        unpack();
+        auto find = [&](std::string_view field) {
+            for (size_t i = 0; i + 1 < items.size(); i += 2) {
+                if (items[i] == field)
+                    return i;
+            }
+            return kNone;
+        };
+        switch (command) {
+        case CommandType::HSET: {
+            size_t created = 0;
+            for (size_t i = 0; i + 1 < args.size(); i += 2) {
+                size_t at = find(args[i]);
+                if (at == kNone) {
+                    items.push_back(args[i]);
+                    items.push_back(args[i + 1]);
+                    created++;
+                } else {
+                    items[at + 1] = args[i + 1];
+                }
+            }
+            replyInt(reply, static_cast<long long>(created));
+            if (fitsPacked(items.size() / 2, args))
+                repack();
+            else
+                expand();
+            return true;
+        }
+        case CommandType::HGET: {
+            size_t at = find(args[0]);
+            if (at == kNone)
+                replyNil(reply);
+            else
+                replyBulk(reply, items[at + 1]);
+            return false;
+        }
+        case CommandType::HMGET:
+            replyArray(reply, args.size());
+            for (std::string_view field : args) {
+                size_t at = find(field);
+                if (at == kNone)
+                    replyNil(reply);
+                else
+                    replyBulk(reply, items[at + 1]);
+            }
+            return false;
+        case CommandType::HDEL: {
+            size_t removed = 0;
+            for (std::string_view field : args) {
+                size_t at = find(field);
+                if (at != kNone) {
+                    items.erase(items.begin() + static_cast<std::ptrdiff_t>(at),
+                                items.begin() + static_cast<std::ptrdiff_t>(at) + 2);
+                    removed++;
+                }
+            }
+            replyInt(reply, static_cast<long long>(removed));
+            if (removed)
+                repack();
+            return removed > 0;
+        }
+        case CommandType::HLEN:
+            replyInt(reply, static_cast<long long>(items.size() / 2));
+            return false;
+        case CommandType::HEXISTS:
+            replyInt(reply, find(args[0]) != kNone);
+            return false;
+        case CommandType::HGETALL:
+            replyArray(reply, items.size());
+            for (std::string_view item : items)
+                replyBulk(reply, item);
+            return false;
+        case CommandType::HINCRBY: {
+            size_t at = find(args[0]);
+            int64_t current = 0;
+            if (at != kNone && !parseInt64(items[at + 1], current)) {
+                replyError(reply, "ERR hash value is not an integer");
+                return false;
+            }
+            int64_t result;
+            if (__builtin_add_overflow(current, by, &result)) {
+                replyError(reply, "ERR increment or decrement would overflow");
+                return false;
+            }
+            std::string number = std::to_string(result);
+            if (at == kNone) {
+                items.push_back(args[0]);
+                items.push_back(number);
+            } else {
+                items[at + 1] = number;
+            }
+            replyInt(reply, result);
+            if (fitsPacked(items.size() / 2, {args[0]}))
+                repack();
+            else
+                expand();
+            return true;
+        }
+        default:
+            return false;
+        }
+    }
+
+    Collection& c = *expanded;
+    switch (command) {
+    case CommandType::HSET: {
+        size_t created = 0;
+        for (size_t i = 0; i + 1 < args.size(); i += 2) {
+            auto result = c.hash.try_emplace(std::string(args[i]));
+            if (result.second) {
+                c.bytes += args[i].size() + kElementOverhead;
+                created++;
+            } else {
+                c.bytes -= result.first->second.size();
+            }
+            result.first->second.assign(args[i + 1].data(), args[i + 1].size());
+            c.bytes += args[i + 1].size();
+        }
+        replyInt(reply, static_cast<long long>(created));
+        return true;
+    }
+    case CommandType::HGET: {
+        auto it = c.hash.find(std::string(args[0]));
+        if (it == c.hash.end())
+            replyNil(reply);
+        else
+            replyBulk(reply, it->second);
+        return false;
+    }
+    case CommandType::HMGET:
+        replyArray(reply, args.size());
+        for (std::string_view field : args) {
+            auto it = c.hash.find(std::string(field));
+            if (it == c.hash.end())
+                replyNil(reply);
+            else
+                replyBulk(reply, it->second);
+        }
+        return false;
+    case CommandType::HDEL: {
+        size_t removed = 0;
+        for (std::string_view field : args) {
+            auto it = c.hash.find(std::string(field));
+            if (it != c.hash.end()) {
+                c.bytes -= it->first.size() + it->second.size() + kElementOverhead;
+                c.hash.erase(it);
+                removed++;
+            }
+        }
+        replyInt(reply, static_cast<long long>(removed));
+        return removed > 0;
+    }
+    case CommandType::HLEN:
+        replyInt(reply, static_cast<long long>(c.hash.size()));
+        return false;
+    case CommandType::HEXISTS:
+        replyInt(reply, c.hash.count(std::string(args[0])) != 0);
+        return false;
+    case CommandType::HGETALL:
+        replyArray(reply, c.hash.size() * 2);
+        for (const auto& entry : c.hash) {
+            replyBulk(reply, entry.first);
+            replyBulk(reply, entry.second);
+        }
+        return false;
+    case CommandType::HINCRBY: {
+        auto it = c.hash.find(std::string(args[0]));
+        int64_t current = 0;
+        if (it != c.hash.end() && !parseInt64(it->second, current)) {
+            replyError(reply, "ERR hash value is not an integer");
+            return false;
+        }
+        int64_t result;
+        if (__builtin_add_overflow(current, by, &result)) {
+            replyError(reply, "ERR increment or decrement would overflow");
+            return false;
+        }
+        if (it == c.hash.end()) {
+            it = c.hash.emplace(std::string(args[0]), std::string()).first;
+            c.bytes += args[0].size() + kElementOverhead;
+        }
+        c.bytes -= it->second.size();
+        it->second = std::to_string(result);
+        c.bytes += it->second.size();
+        replyInt(reply, result);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+bool CollectionOp::runList(CommandType command, const std::vector<std::string_view>& args,
+                           std::string& reply) {
+    int64_t index = 0, stop = 0;
+    if ((command == CommandType::LINDEX || command == CommandType::LSET ||
+         command == CommandType::LRANGE) && !parseInt64(args[0], index)) {
+        replyError(reply, kNotInteger);
+        return false;
+    }
+    if (command == CommandType::LRANGE && !parseInt64(args[1], stop)) {
+        replyError(reply, kNotInteger);
+        return false;
+    }
+
+    if (encoding == Encoding::Listpack) {
+        unpack();
+        size_t n = items.size();
+        switch (command) {
+        case CommandType::LPUSH:
+        case CommandType::RPUSH:
+            for (std::string_view element : args) {
+                if (command == CommandType::LPUSH)
+                    items.insert(items.begin(), element);
+                else
+                    items.push_back(element);
+            }
+            replyInt(reply, static_cast<long long>(items.size()));
+            if (fitsPacked(items.size(), args))
+                repack();
+            else
+                expand();
+            return true;
+        case CommandType::LPOP:
+        case CommandType::RPOP:
+            if (items.empty()) {
+                replyNil(reply);
+                return false;
+            }
+            if (command == CommandType::LPOP) {
+                replyBulk(reply, items.front());
+                items.erase(items.begin());
+            } else {
+                replyBulk(reply, items.back());
+                items.pop_back();
+            }
+            repack();
+            return true;
+        case CommandType::LLEN:
+            replyInt(reply, static_cast<long long>(n));
+            return false;
+        case CommandType::LINDEX:
+            if (index < 0)
+                index += static_cast<int64_t>(n);
+            if (index < 0 || index >= static_cast<int64_t>(n))
+                replyNil(reply);
+            else
+                replyBulk(reply, items[static_cast<size_t>(index)]);
+            return false;
+        case CommandType::LRANGE: {
+            size_t first, last;
+            if (!clampRange(index, stop, n, first, last)) {
+                replyArray(reply, 0);
+                return false;
+            }
+            replyArray(reply, last - first + 1);
+            for (size_t i = first; i <= last; i++)
+                replyBulk(reply, items[i]);
+            return false;
+        }
+        case CommandType::LSET:
+            if (n == 0) {
+                replyError(reply, "ERR no such key");
+                return false;
+            }
+            if (index < 0)
+                index += static_cast<int64_t>(n);
+            if (index < 0 || index >= static_cast<int64_t>(n)) {
+                replyError(reply, "ERR index out of range");
+                return false;
+            }
+            items[static_cast<size_t>(index)] = args[1];
+            reply += "+OK\r\n";
+            if (fitsPacked(n, {args[1]}))
+                repack();
+            else
+                expand();
+            return true;
+        default:
+            return false;
+        }
+    }
+
+    Collection& c = *expanded;
+    size_t n = c.list.size();
+    switch (command) {
+    case CommandType::LPUSH:
+    case CommandType::RPUSH:
+        for (std::string_view element : args) {
+            if (command == CommandType::LPUSH)
+                c.list.emplace_front(element);
+            else
+                c.list.emplace_back(element);
+            c.bytes += element.size() + kElementOverhead;
+        }
+        replyInt(reply, static_cast<long long>(c.list.size()));
+        return true;
+    case CommandType::LPOP:
+    case CommandType::RPOP: {
+        if (c.list.empty()) {
+            replyNil(reply);
+            return false;
+        }
+        std::string& element = command == CommandType::LPOP ? c.list.front() : c.list.back();
+        replyBulk(reply, element);
+        c.bytes -= element.size() + kElementOverhead;
+        if (command == CommandType::LPOP)
+            c.list.pop_front();
+        else
+            c.list.pop_back();
+        return true;
+    }
+    case CommandType::LLEN:
+        replyInt(reply, static_cast<long long>(n));
+        return false;
+    case CommandType::LINDEX:
+        if (index < 0)
+            index += static_cast<int64_t>(n);
+        if (index < 0 || index >= static_cast<int64_t>(n))
+            replyNil(reply);
+        else
+            replyBulk(reply, c.list[static_cast<size_t>(index)]);
+        return false;
+    case CommandType::LRANGE: {
+        size_t first, last;
+        if (!clampRange(index, stop, n, first, last)) {
+            replyArray(reply, 0);
+            return false;
+        }
+        replyArray(reply, last - first + 1);
+        for (size_t i = first; i <= last; i++)
+            replyBulk(reply, c.list[i]);
+        return false;
+    }
+    case CommandType::LSET: {
+        if (index < 0)
+            index += static_cast<int64_t>(n);
+        if (index < 0 || index >= static_cast<int64_t>(n)) {
+            replyError(reply, "ERR index out of range");
+            return false;
+        }
+        std::string& element = c.list[static_cast<size_t>(index)];
+        c.bytes += args[1].size() - element.size();
+        element.assign(args[1].data(), args[1].size());
+        reply += "+OK\r\n";
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+bool CollectionOp::runSet(CommandType command, const std::vector<std::string_view>& args,
+                          std::string& reply) {
+    std::deque<std::string> numbers; // backs `items` for a set leaving its intset
+    if (encoding == Encoding::Intset) {
+        int64_t v;
+        size_t n = intsetCount(packed);
+        bool stays = command != CommandType::SADD;
+        if (!stays) {
+            stays = n + args.size() <= limits.intsetMaxEntries;
+            for (size_t i = 0; stays && i < args.size(); i++)
+                stays = canonicalInt(args[i], v);
+        }
+        if (stays) {
+            switch (command) {
+            case CommandType::SADD:
+            case CommandType::SREM: {
+                std::vector<int64_t> values;
+                values.reserve(n + args.size());
+                for (size_t i = 0; i < n; i++)
+                    values.push_back(intsetAt(packed, i));
+                size_t changed = 0;
+                for (std::string_view member : args) {
+                    if (!canonicalInt(member, v))
+                        continue;
+                    auto it = std::lower_bound(values.begin(), values.end(), v);
+                    bool present = it != values.end() && *it == v;
+                    if (command == CommandType::SADD && !present) {
+                        values.insert(it, v);
+                        changed++;
+                    } else if (command == CommandType::SREM && present) {
+                        values.erase(it);
+                        changed++;
+                    }
+                }
+                replyInt(reply, static_cast<long long>(changed));
+                if (changed) {
+                    packIntset(values, repacked);
+                    packed = repacked;
+                }
+                return changed > 0;
+            }
+            case CommandType::SISMEMBER:
+                replyInt(reply, canonicalInt(args[0], v) && intsetContains(packed, v));
+                return false;
+            case CommandType::SCARD:
+                replyInt(reply, static_cast<long long>(n));
+                return false;
+            case CommandType::SMEMBERS:
+                replyArray(reply, n);
+                for (size_t i = 0; i < n; i++)
+                    replyBulk(reply, std::to_string(intsetAt(packed, i)));
+                return false;
+            default:
+                return false;
+            }
+        }
+        // A member that is not an integer, or too many: on as a listpack
+        items.clear();
+        for (size_t i = 0; i < n; i++) {
+            numbers.push_back(std::to_string(intsetAt(packed, i)));
+            items.push_back(numbers.back());
+        }
+        encoding = Encoding::Listpack;
+    } else if (encoding == Encoding::Listpack) {
+        unpack();
+    }
+
+    if (encoding == Encoding::Listpack) {
+        auto find = [&](std::string_view member) {
+            for (size_t i = 0; i < items.size(); i++) {
+                if (items[i] == member)
+                    return i;
+            }
+            return kNone;
+        };
+        switch (command) {
+        case CommandType::SADD: {
+            size_t added = 0;
+            for (std::string_view member : args) {
+                if (find(member) == kNone) {
+                    items.push_back(member);
+                    added++;
+                }
+            }
+            replyInt(reply, static_cast<long long>(added));
+            // An intset that just turned into a listpack changed too
+            if (!added && numbers.empty())
+                return false;
+            if (fitsPacked(items.size(), args))
+                repack();
+            else
+                expand();
+            return true;
+        }
+        case CommandType::SREM: {
+            size_t removed = 0;
+            for (std::string_view member : args) {
+                size_t at = find(member);
+                if (at != kNone) {
+                    items.erase(items.begin() + static_cast<std::ptrdiff_t>(at));
+                    removed++;
+                }
+            }
+            replyInt(reply, static_cast<long long>(removed));
+            if (removed)
+                repack();
+            return removed > 0;
+        }
+        case CommandType::SISMEMBER:
+            replyInt(reply, find(args[0]) != kNone);
+            return false;
+        case CommandType::SCARD:
+            replyInt(reply, static_cast<long long>(items.size()));
+            return false;
+        case CommandType::SMEMBERS:
+            replyArray(reply, items.size());
+            for (std::string_view item : items)
+                replyBulk(reply, item);
+            return false;
+        default:
+            return false;
+        }
+    }
+
+    Collection& c = *expanded;
+    switch (command) {
+    case CommandType::SADD: {
+        size_t added = 0;
+        for (std::string_view member : args) {
+            if (c.set.emplace(member).second) {
+                c.bytes += member.size() + kElementOverhead;
+                added++;
+            }
+        }
+        replyInt(reply, static_cast<long long>(added));
+        return added > 0;
+    }
+    case CommandType::SREM: {
+        size_t removed = 0;
+        for (std::string_view member : args) {
+            if (c.set.erase(std::string(member))) {
+                c.bytes -= member.size() + kElementOverhead;
+                removed++;
+            }
+        }
+        replyInt(reply, static_cast<long long>(removed));
+        return removed > 0;
+    }
+    case CommandType::SISMEMBER:
+        replyInt(reply, c.set.count(std::string(args[0])) != 0);
+        return false;
+    case CommandType::SCARD:
+        replyInt(reply, static_cast<long long>(c.set.size()));
+        return false;
+    case CommandType::SMEMBERS:
+        replyArray(reply, c.set.size());
+        for (const auto& member : c.set)
+            replyBulk(reply, member);
+        return false;
+    default:
+        return false;
+    }
+}
+
+bool CollectionOp::runZSet(CommandType command, const std::vector<std::string_view>& args,
+                           std::string& reply) {
+    // Arguments are checked before anything changes
+    std::vector<double> scores;
+    int64_t start = 0, stop = 0;
+    double min = 0, max = 0;
+    bool minExclusive = false, maxExclusive = false, scoresToo = false;
+    switch (command) {
+    case CommandType::ZADD:
+        for (size_t i = 0; i + 1 < args.size(); i += 2) {
+            scores.push_back(0);
+            if (!parseScore(args[i], scores.back())) {
+                replyError(reply, kNotFloat);
+                return false;
+            }
+        }
+        break;
+    case CommandType::ZINCRBY:
+        scores.push_back(0);
+        if (!parseScore(args[0], scores.back())) {
+            replyError(reply, kNotFloat);
+            return false;
+        }
+        break;
+    case CommandType::ZRANGE:
+        if (!withScores(args, 2, scoresToo)) {
+            replyError(reply, kSyntaxError);
+            return false;
+        }
+        if (!parseInt64(args[0], start) || !parseInt64(args[1], stop)) {
+            replyError(reply, kNotInteger);
+            return false;
+        }
+        break;
+    case CommandType::ZRANGEBYSCORE:
+        if (!withScores(args, 2, scoresToo)) {
+            replyError(reply, kSyntaxError);
+            return false;
+        }
+        if (!parseBound(args[0], min, minExclusive) || !parseBound(args[1], max, maxExclusive)) {
+            replyError(reply, "ERR min or max is not a float");
+            return false;
+        }
+        break;
+    default:
+        break;
+    }
+    auto inRange = [&](double score) {
+        return (minExclusive ? score > min : score >= min) &&
+               (maxExclusive ? score < max : score <= max);
+    };
+    std::vector<std::pair<std::string_view, double>> range;
+
+    if (encoding == Encoding::Listpack) {
+        unpack();
+        size_t n = items.size() / 2;
+        auto find = [&](std::string_view member) {
+            for (size_t i = 0; i + 1 < items.size(); i += 2) {
+                if (items[i] == member)
+                    return i;
+            }
+            return kNone;
+        };
+        // Pairs stay sorted by (score, member)
+        std::vector<ScoreBytes> stored(scores.size());
+        auto place = [&](std::string_view member, std::string_view score) {
+            double s = scoreOf(score);
+            size_t at = 0;
+            while (at < items.size() && !zsetBefore(s, member, scoreOf(items[at + 1]), items[at]))
+                at += 2;
+            items.insert(items.begin() + static_cast<std::ptrdiff_t>(at), {member, score});
+        };
+        auto erasePair = [&](size_t at) {
+            items.erase(items.begin() + static_cast<std::ptrdiff_t>(at),
+                        items.begin() + static_cast<std::ptrdiff_t>(at) + 2);
+        };
+        switch (command) {
+        case CommandType::ZADD: {
+            size_t added = 0;
+            bool changed = false;
+            std::vector<std::string_view> members;
+            for (size_t i = 0; i + 1 < args.size(); i += 2) {
+                std::string_view member = args[i + 1];
+                members.push_back(member);
+                stored[i / 2] = scoreBytes(scores[i / 2]);
+                size_t at = find(member);
+                if (at != kNone) {
+                    if (scoreOf(items[at + 1]) == scores[i / 2])
+                        continue;
+                    erasePair(at);
+                } else {
+                    added++;
+                }
+                place(member, scoreView(stored[i / 2]));
+                changed = true;
+            }
+            replyInt(reply, static_cast<long long>(added));
+            if (!changed)
+                return false;
+            if (fitsPacked(items.size() / 2, members))
+                repack();
+            else
+                expand();
+            return true;
+        }
+        case CommandType::ZINCRBY: {
+            size_t at = find(args[1]);
+            double score = scores[0] + (at == kNone ? 0 : scoreOf(items[at + 1]));
+            if (std::isnan(score)) {
+                replyError(reply, "ERR resulting score is not a number (NaN)");
+                return false;
+            }
+            if (at != kNone)
+                erasePair(at);
+            stored[0] = scoreBytes(score);
+            place(args[1], scoreView(stored[0]));
+            replyBulk(reply, formatScore(score));
+            if (fitsPacked(items.size() / 2, {args[1]}))
+                repack();
+            else
+                expand();
+            return true;
+        }
+        case CommandType::ZREM: {
+            size_t removed = 0;
+            for (std::string_view member : args) {
+                size_t at = find(member);
+                if (at != kNone) {
+                    erasePair(at);
+                    removed++;
+                }
+            }
+            replyInt(reply, static_cast<long long>(removed));
+            if (removed)
+                repack();
+            return removed > 0;
+        }
+        case CommandType::ZSCORE: {
+            size_t at = find(args[0]);
+            if (at == kNone)
+                replyNil(reply);
+            else
+                replyBulk(reply, formatScore(scoreOf(items[at + 1])));
+            return false;
+        }
+        case CommandType::ZCARD:
+            replyInt(reply, static_cast<long long>(n));
+            return false;
+        case CommandType::ZRANK: {
+            size_t at = find(args[0]);
+            if (at == kNone)
+                replyNil(reply);
+            else
+                replyInt(reply, static_cast<long long>(at / 2));
+            return false;
+        }
+        case CommandType::ZRANGE: {
+            size_t first, last;
+            if (clampRange(start, stop, n, first, last)) {
+                for (size_t i = first; i <= last; i++)
+                    range.emplace_back(items[2 * i], scoreOf(items[2 * i + 1]));
+            }
+            replyRange(reply, range, scoresToo);
+            return false;
+        }
+        case CommandType::ZRANGEBYSCORE:
+            for (size_t i = 0; i < n; i++) {
+                double score = scoreOf(items[2 * i + 1]);
+                if (inRange(score))
+                    range.emplace_back(items[2 * i], score);
+            }
+            replyRange(reply, range, scoresToo);
+            return false;
+        default:
+            return false;
+        }
+    }
+
+    Collection& c = *expanded;
+    // Moves `member` to `score`, inserting it if new; true if it was new
+    auto update = [&](std::string_view member, double score) {
+        auto result = c.scores.try_emplace(std::string(member), score);
+        if (result.second) {
+            c.zset.insert(score, member);
+            c.bytes += 2 * (member.size() + kElementOverhead);
+            return true;
+        }
+        if (result.first->second != score) {
+            c.zset.erase(result.first->second, member);
+            c.zset.insert(score, member);
+            result.first->second = score;
+        }
+        return false;
+    };
+    switch (command) {
+    case CommandType::ZADD: {
+        size_t added = 0;
+        bool changed = false;
+        for (size_t i = 0; i + 1 < args.size(); i += 2) {
+            auto it = c.scores.find(std::string(args[i + 1]));
+            if (it != c.scores.end() && it->second == scores[i / 2])
+                continue;
+            added += update(args[i + 1], scores[i / 2]);
+            changed = true;
+        }
+        replyInt(reply, static_cast<long long>(added));
+        return changed;
+    }
+    case CommandType::ZINCRBY: {
+        auto it = c.scores.find(std::string(args[1]));
+        double score = scores[0] + (it == c.scores.end() ? 0 : it->second);
+        if (std::isnan(score)) {
+            replyError(reply, "ERR resulting score is not a number (NaN)");
+            return false;
+        }
+        update(args[1], score);
+        replyBulk(reply, formatScore(score));
+        return true;
+    }
+    case CommandType::ZREM: {
+        size_t removed = 0;
+        for (std::string_view member : args) {
+            auto it = c.scores.find(std::string(member));
+            if (it == c.scores.end())
+                continue;
+            c.zset.erase(it->second, member);
+            c.scores.erase(it);
+            c.bytes -= 2 * (member.size() + kElementOverhead);
+            removed++;
+        }
+        replyInt(reply, static_cast<long long>(removed));
+        return removed > 0;
+    }
+    case CommandType::ZSCORE: {
+        auto it = c.scores.find(std::string(args[0]));
+        if (it == c.scores.end())
+            replyNil(reply);
+        else
+            replyBulk(reply, formatScore(it->second));
+        return false;
+    }
+    case CommandType::ZCARD:
+        replyInt(reply, static_cast<long long>(c.zset.size()));
+        return false;
+    case CommandType::ZRANK: {
+        auto it = c.scores.find(std::string(args[0]));
+        if (it == c.scores.end())
+            replyNil(reply);
+        else
+            replyInt(reply, static_cast<long long>(c.zset.rank(it->second, args[0]) - 1));
+        return false;
+    }
+    case CommandType::ZRANGE: {
+        size_t first, last;
+        if (clampRange(start, stop, c.zset.size(), first, last)) {
+            const SkipList::Node* node = c.zset.byRank(first + 1);
+            for (size_t i = first; i <= last && node; i++, node = node->next())
+                range.emplace_back(node->member, node->score);
+        }
+        replyRange(reply, range, scoresToo);
+        return false;
+    }
+    case CommandType::ZRANGEBYSCORE:
+        for (const SkipList::Node* node = c.zset.lowerBound(min, minExclusive);
+             node && inRange(node->score); node = node->next())
+            range.emplace_back(node->member, node->score);
+        replyRange(reply, range, scoresToo);
+        return false;
+    default:
+        return false;
+    }
+}
+
+void serializeValue(ValueType type, Encoding encoding, std::string_view packed,
+                    const Collection* expanded, std::string& out) {
+    out.clear();
+    out += static_cast<char>(type);
+    if (encoding != Encoding::Expanded) {
+        out += static_cast<char>(encoding);
+        out.append(packed.data(), packed.size());
+        return;
+    }
+
+    std::vector<std::string_view> items;
+    std::vector<ScoreBytes> scores;
+    switch (type) {
+    case ValueType::Hash:
+        for (const auto& entry : expanded->hash) {
+            items.push_back(entry.first);
+            items.push_back(entry.second);
+        }
+        break;
+    case ValueType::List:
+        items.assign(expanded->list.begin(), expanded->list.end());
+        break;
+    case ValueType::Set:
+        items.assign(expanded->set.begin(), expanded->set.end());
+        break;
+    case ValueType::ZSet:
+        scores.reserve(expanded->zset.size());
+        for (const SkipList::Node* node = expanded->zset.first(); node; node = node->next()) {
+            scores.push_back(scoreBytes(node->score));
+            items.push_back(node->member);
+            items.push_back(scoreView(scores.back()));
+        }
+        break;
+    case ValueType::String:
+        break;
+    }
+    std::string body;
+    packListpack(items, body);
+    out += static_cast<char>(Encoding::Listpack);
+    out += body;
+}
+
+bool deserializeValue(std::string_view payload, const CollectionLimits& limits,
+                      ValueType& type, Encoding& encoding, std::string& packed,
+                      std::unique_ptr<Collection>& expanded) {
+    if (payload.size() < 2 || static_cast<uint8_t>(payload[0]) > uint8_t(ValueType::ZSet))
+        return false;
+    type = static_cast<ValueType>(payload[0]);
+    encoding = static_cast<Encoding>(payload[1]);
+    std::string_view body = payload.substr(2);
+    expanded.reset();
+
+    if (type == ValueType::String) {
+        packed.assign(body.data(), body.size());
+        if (encoding == Encoding::Compressed) {
+            std::string original;
+            return decompressValue(body, original);
+        }
+        return encoding == Encoding::Raw;
+    }
+
+    CollectionOp op(type, encoding, body, nullptr, limits);
+    bool fits;
+    if (encoding == Encoding::Intset) {
+        if (type != ValueType::Set || body.empty())
+            return false;
+        uint8_t width = static_cast<uint8_t>(body[0]);
+        if ((width != 2 && width != 4 && width != 8) || (body.size() - 1) % width != 0)
+            return false;
+        size_t n = intsetCount(body);
+        for (size_t i = 1; i < n; i++) {
+            if (intsetAt(body, i - 1) >= intsetAt(body, i))
+                return false;
+        }
+        if (n == 0)
+            return false;
+        fits = n <= limits.intsetMaxEntries;
+    } else if (encoding == Encoding::Listpack) {
+        if (!validListpack(body, op.items) || op.items.empty())
+            return false;
+        bool pairs = type == ValueType::Hash || type == ValueType::ZSet;
+        if (pairs && op.items.size() % 2 != 0)
+            return false;
+        if (type == ValueType::ZSet) {
+            for (size_t i = 1; i < op.items.size(); i += 2) {
+                if (op.items[i].size() != sizeof(double) || std::isnan(scoreOf(op.items[i])))
+                    return false;
+            }
+        }
+        fits = op.fitsPacked(pairs ? op.items.size() / 2 : op.items.size(), op.items);
+    } else {
+        return false;
+    }
+
+    if (fits) {
+        packed.assign(body.data(), body.size());
+        return true;
+    }
+    op.expand();
+    encoding = Encoding::Expanded;
+    expanded = std::move(op.converted);
+    packed.clear();
+    return true;
+}
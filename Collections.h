@@ -0,0 +1,122 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+#include "Command.h"
+#include "SkipList.h"
+
+// Hashes, lists, sets and sorted sets. A small collection lives packed in
+// its entry's CompactString, as Redis keeps small ones in a listpack or
+// intset: a few bytes per element and no allocation per element. Once it
+// outgrows CollectionLimits it is converted, one time, into a Collection
+// of real containers (hash table, deque, skiplist). Packed edits rewrite
+// the bytes, which is O(n), but n is at most listpackMaxEntries.
+enum class ValueType : uint8_t { String, Hash, List, Set, ZSet };
+
+enum class Encoding : uint8_t {
+    Raw,      // String
+    Listpack, // varint count | (varint length | bytes) per element
+    Intset,   // Set of integers: u8 width (2, 4 or 8) | sorted values
+    Expanded, // in a Collection
+    Int,      // String holding an int64 as 8 raw bytes, after INCRBY
+    Compressed // String as compressValue() left it (see Compression.h)
+};
+
+struct CollectionLimits {
+    size_t listpackMaxEntries = 128; // elements (hash / zset: pairs)
+    size_t listpackMaxValue = 64;    // bytes per element
+    size_t intsetMaxEntries = 512;
+};
+
+// Expanded form; only the container of the value's type is used. The
+// member -> score map lets ZSCORE and updates skip the skiplist walk.
+struct Collection {
+    std::unordered_map<std::string, std::string> hash;
+    std::unordered_set<std::string> set;
+    std::deque<std::string> list;
+    SkipList zset;
+    std::unordered_map<std::string, double> scores;
+    size_t bytes = 0; // estimated heap use, counted against maxMemory
+};
+
+// Names a collection command for the RESP front end and the AOF. `arity`
+// counts the name and the key (negative: at least that many), and the
+// arguments after the key come in groups of `step` (HSET field value).
+struct CollectionCommand {
+    const char* name;
+    CommandType type;
+    ValueType valueType;
+    int arity;
+    int step;
+    bool write;
+};
+
+// `name` upper-cased; null if it is not a collection command
+const CollectionCommand* findCollectionCommand(std::string_view name);
+const CollectionCommand* collectionCommand(CommandType type);
+bool arityMatches(const CollectionCommand& command, size_t argc);
+
+const char* typeName(ValueType type);
+const char* encodingName(ValueType type, Encoding encoding);
+
+// Runs one collection command against one value. `packed` / `expanded`
+// are the value as stored (empty and null for a missing key); a write
+// leaves it in `encoding` and either `repacked` or the Collection (in
+// place, or the new one in `converted`).
+class CollectionOp {
+public:
+    CollectionOp(ValueType type, Encoding encoding, std::string_view packed,
+                 Collection* expanded, const CollectionLimits& limits);
+
+    // Appends the RESP reply; returns true if the value changed
+    bool run(CommandType command, const std::vector<std::string_view>& args,
+             std::string& reply);
+
+    size_t size() const; // elements afterwards; 0 means the key goes away
+
+    Encoding encoding;
+    std::string repacked;
+    std::unique_ptr<Collection> converted;
+
+private:
+    ValueType type;
+    std::string_view packed;
+    Collection* expanded;
+    const CollectionLimits& limits;
+    std::vector<std::string_view> items; // unpacked elements
+
+    void unpack();
+    void repack();
+    void expand();
+    bool fitsPacked(size_t count, const std::vector<std::string_view>& added) const;
+
+    bool runHash(CommandType command, const std::vector<std::string_view>& args,
+                 std::string& reply);
+    bool runList(CommandType command, const std::vector<std::string_view>& args,
+                 std::string& reply);
+    bool runSet(CommandType command, const std::vector<std::string_view>& args,
+                std::string& reply);
+    bool runZSet(CommandType command, const std::vector<std::string_view>& args,
+                 std::string& reply);
+
+    friend bool deserializeValue(std::string_view payload, const CollectionLimits& limits,
+                                 ValueType& type, Encoding& encoding, std::string& packed,
+                                 std::unique_ptr<Collection>& expanded);
+};
+
+// The whole value in one string, for RESTORE / DUMP, snapshots and AOF
+// rewrites: u8 type | u8 encoding | packed bytes (an expanded value is
+// packed for the occasion)
+void serializeValue(ValueType type, Encoding encoding, std::string_view packed,
+                    const Collection* expanded, std::string& out);
+// Validates `payload` and rebuilds the value, expanded if it is over
+// `limits`; false if the payload is malformed
+bool deserializeValue(std::string_view payload, const CollectionLimits& limits,
+                      ValueType& type, Encoding& encoding, std::string& packed,
+                      std::unique_ptr<Collection>& expanded);
@@ -0,0 +1,174 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+#include <atomic>
+#include <functional>
+#include "CompletionSlot.h"
+#include "RecvBuffer.h"
+#include "ValueBuffer.h"
+
+class CompletionQueue;
+class SnapshotWriter;
+struct SnapshotLoad;
+struct ScanJob;
+
+// Identifies where a front end (e.g. RespServer) wants a result routed
+struct ReplyTag {
+    uint64_t connection = 0;
+    uint64_t sequence = 0;
+    uint32_t part = 0; // key index within a multi-key request
+};
+
+// Receives results of commands submitted with a sink. Called on the shard
+// worker; `status` is the value Shard::apply returned (1 = found /
+// removed / written) and `value` the GET payload.
+class ReplySink {
+public:
+    virtual void deliver(const ReplyTag& tag, int64_t status, std::string&& value) = 0;
+
+    // A GET of a shared (large) value: the bytes by reference instead of
+    // a copy. Sinks that do not override it get the copy after all.
+    virtual void deliverShared(const ReplyTag& tag, int64_t status, ValueRef&& value) {
+        deliver(tag, status, std::string(value.view()));
+    }
+
+protected:
+    ~ReplySink() = default;
+};
+
+enum class CommandType {
+    SET,
+    GET,
+    DEL,
+    SET_TTL,
+    BATCH,
+    AOF_REWRITE,  // control: start this shard's part of an AOF rewrite
+    SNAPSHOT,     // control: start streaming this shard into `snapshotWriter`
+    SNAPSHOT_LOAD, // control: bulk-load this shard's records of `snapshotLoad`
+    SYNC_MARK,    // control: flush the log, then log absolutely until SNAPSHOT
+    SLOT_KEYS,    // cluster: count (status) and up to `limit` keys of `hashSlot`
+    SCAN,         // keyspace: one bounded step of `scan` (see KeyScan.h)
+    SCAN_PREFIX,  // keyspace: this shard's part of a prefix query `scan`
+    DUMP,         // cluster: the key as an AOF SET / RESTORE record, "" if missing
+    DEL_IF_VALUE, // cluster: delete if the value still equals `value`
+    RESTORE,      // `value` is a whole value from serializeValue()
+    TYPE,
+    OBJECT_ENCODING,
+    // Atomic read-modify-writes on strings. INCRBY takes its delta in
+    // `value`; CAS compares with `value` and stores args[0] (fields[0]).
+    INCRBY,
+    APPEND,
+    GETSET,
+    CAS,
+    // Bytes args[0] through args[1] (inclusive, negative from the end) of
+    // a string, as Redis's GETRANGE
+    GETRANGE,
+    // Collections (see Collections.h); the arguments after the key are in
+    // Command::args / BatchOp::fields, and the reply is RESP in the value
+    HSET, HGET, HMGET, HDEL, HLEN, HEXISTS, HGETALL, HINCRBY,
+    LPUSH, RPUSH, LPOP, RPOP, LLEN, LINDEX, LRANGE, LSET,
+    SADD, SREM, SISMEMBER, SCARD, SMEMBERS,
+    ZADD, ZREM, ZSCORE, ZCARD, ZINCRBY, ZRANK, ZRANGE, ZRANGEBYSCORE
+};
+
+// Per-type tables are sized by this; keep ZRANGEBYSCORE (or whatever is
+// appended after it) last
+constexpr size_t kCommandTypes = static_cast<size_t>(CommandType::ZRANGEBYSCORE) + 1;
+
+// Status of a string command that found a collection under its key. A
+// status of 0 with a non-empty value means the value is an error message
+// (INCRBY on a non-integer, a write refused over maxmemory).
+constexpr int64_t kWrongType = -2;
+
+// Status of a GET delivered to a ReplySink with the value still as
+// compressValue() left it (RedisLiteConfig::compressMin); the sink
+// decompresses it off the worker
+constexpr int64_t kCompressedValue = 3;
+
+// One operation inside a BATCH command
+struct BatchOp {
+    CommandType type;
+    std::string key;
+    std::string value;
+    int ttlSeconds = 0;
+    size_t slot = 0; // index of this op's result in BatchResult::values
+    std::vector<std::string> fields; // collection command arguments
+};
+
+// Shared by the per-shard pieces of one pipeline; lives on the waiting
+// caller's stack. Each shard writes only its own slots and the last one
+// to finish completes `done`.
+struct BatchResult {
+    std::vector<std::string> values;
+    std::vector<int64_t> statuses; // per op when sized by the caller
+    std::atomic<size_t> pending{0};
+    CompletionSlot* done = nullptr;
+};
+
+struct Command {
+    CommandType type;
+    std::string key;
+    std::string value;
+    int ttlSeconds = 0;
+    CompletionSlot* completion = nullptr; // Blocking GET, and SYNC_MARK
+    // SET / SET_TTL value already wrapped by the client thread (large
+    // values); used in place of `value` and `valueView`, and the store
+    // keeps it as is
+    ValueRef sharedValue;
+    // The value was compressed by the client thread (compressValue())
+    bool compressed = false;
+
+    // Zero-copy payload from a front end: views into `buffer`, which the
+    // command keeps alive until the worker is done with it. Used in place
+    // of key/value whenever `buffer` is set.
+    RecvBuffer::Ref buffer;
+    std::string_view keyView;
+    std::string_view valueView;
+    std::vector<std::string_view> args; // collection command arguments
+
+    // Async GET: the value goes to `callback` instead, posted
+    // to `completions` if set, otherwise invoked on the worker thread
+    std::function<void(std::string)> callback;
+    CompletionQueue* completions = nullptr;
+
+    // Front-end delivery; takes precedence over the fields above
+    ReplySink* sink = nullptr;
+    ReplyTag tag;
+
+    // Only used for BATCH; `batch` is null when nobody waits for results
+    std::vector<BatchOp> ops;
+    BatchResult* batch = nullptr;
+
+    // A read for the shard's priority lane (used only if it has one)
+    bool priority = false;
+
+    // Replayed from the append-only file: applied, but not logged again
+    bool fromAof = false;
+
+    SnapshotWriter* snapshotWriter = nullptr;
+    SnapshotLoad* snapshotLoad = nullptr;
+
+    // SCAN / SCAN_PREFIX; routed by the job's cursor, or to every shard
+    ScanJob* scan = nullptr;
+
+    // SLOT_KEYS arguments; routed by slot rather than by key
+    uint16_t hashSlot = 0;
+    size_t limit = 0;
+    // SET / SET_TTL that leaves a missing key alone (status -1), used
+    // while the key's slot migrates away
+    bool onlyIfExists = false;
+    // RESTORE without REPLACE: refuses an existing key (status -1)
+    bool onlyIfMissing = false;
+
+    // Steady-clock ns at Shard::enqueue, for the queue wait metric (0
+    // when latency tracking is off)
+    uint64_t enqueuedNs = 0;
+
+    std::string_view keyData() const { return buffer ? keyView : std::string_view(key); }
+    std::string_view valueData() const {
+        return sharedValue ? sharedValue.view() : buffer ? valueView : std::string_view(value);
+    }
+};
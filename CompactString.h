@@ -0,0 +1,141 @@
+#pragma once
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include "SlabArena.h"
+#include "ValueBuffer.h"
+
+// 32-byte string for keys and values in the store. Up to 31 bytes live
+// inline in the object itself; longer strings go to a block from the
+// owning shard's SlabArena (or plain new when no arena is given). A large
+// value can instead hold a reference to a shared ValueBuffer (share()),
+// charged to the arena while held. Move only: the object is memcpy'd and
+// the source reset.
+class CompactString {
+private:
+    static constexpr size_t kInlineCapacity = 31;
+    static constexpr uint8_t kHeapFlag = 0x80;
+    static constexpr uint8_t kSharedFlag = 0x40;
+
+    struct Heap {
+        char* ptr;
+        SlabArena* arena;
+        uint32_t size;
+        uint32_t capacity;
+    };
+
+    struct Shared {
+        ValueBuffer* buffer;
+        SlabArena* arena;
+        uint32_t size;
+    };
+
+    // The last byte is the tag (inline length, kHeapFlag or kSharedFlag);
+    // the out-of-line headers only cover the first 24 bytes so they never
+    // overlap it
+    union {
+        char inlineBytes[kInlineCapacity + 1];
+        Heap heap;
+        Shared shared;
+    };
+
+    uint8_t tag() const { return static_cast<uint8_t>(inlineBytes[kInlineCapacity]); }
+    void setTag(uint8_t t) { inlineBytes[kInlineCapacity] = static_cast<char>(t); }
+    bool isHeap() const { return tag() & kHeapFlag; }
+
+    void freeHeap() {
+        if (isShared()) {
+            if (shared.arena)
+                shared.arena->refund(shared.size);
+            ValueRef::attach(shared.buffer); // drops the reference
+            setTag(0);
+            return;
+        }
+        if (!isHeap())
+            return;
+        if (heap.arena)
+            heap.arena->deallocate(heap.ptr, heap.capacity);
+        else
+            ::operator delete(heap.ptr);
+        setTag(0);
+    }
+
+public:
+    CompactString() { setTag(0); }
+
+    CompactString(std::string_view s, SlabArena* arena) : CompactString() {
+        assign(s, arena);
+    }
+
+    CompactString(CompactString&& other) noexcept {
+        std::memcpy(static_cast<void*>(this), &other, sizeof(CompactString));
+        other.setTag(0);
+    }
+
+    CompactString& operator=(CompactString&& other) noexcept {
+        if (this != &other) {
+            freeHeap();
+            std::memcpy(static_cast<void*>(this), &other, sizeof(CompactString));
+            other.setTag(0);
+        }
+        return *this;
+    }
+
+    CompactString(const CompactString&) = delete;
+    CompactString& operator=(const CompactString&) = delete;
+
+    ~CompactString() { freeHeap(); }
+
+    // Reuses the current heap block when it is big enough
+    void assign(std::string_view s, SlabArena* arena) {
+        if (s.size() <= kInlineCapacity) {
+            freeHeap();
+            std::memcpy(inlineBytes, s.data(), s.size());
+            setTag(static_cast<uint8_t>(s.size()));
+            return;
+        }
+
+        if (!isHeap() || heap.capacity < s.size() || heap.arena != arena) {
+            freeHeap();
+            size_t capacity = s.size();
+            char* p = arena ? arena->allocate(s.size(), &capacity)
+                            : static_cast<char*>(::operator new(s.size()));
+            heap.ptr = p;
+            heap.arena = arena;
+            heap.capacity = static_cast<uint32_t>(capacity);
+            setTag(kHeapFlag);
+        }
+        std::memcpy(heap.ptr, s.data(), s.size());
+        heap.size = static_cast<uint32_t>(s.size());
+    }
+
+    // Holds `value` by reference instead of copying it; its bytes count
+    // towards `arena` (if any) until this string lets go of it
+    void share(ValueRef value, SlabArena* arena) {
+        freeHeap();
+        shared.size = static_cast<uint32_t>(value.size());
+        shared.arena = arena;
+        shared.buffer = value.detach();
+        if (arena)
+            arena->charge(shared.size);
+        setTag(kSharedFlag);
+    }
+
+    bool isShared() const { return tag() & kSharedFlag; }
+
+    // Another reference to the shared buffer; empty unless isShared()
+    ValueRef sharedValue() const { return isShared() ? ValueRef::retain(shared.buffer) : ValueRef(); }
+
+    const char* data() const {
+        return isHeap() ? heap.ptr : isShared() ? ValueRef::bytesOf(shared.buffer).data() : inlineBytes;
+    }
+    size_t size() const { return isHeap() ? heap.size : isShared() ? shared.size : tag(); }
+
+    // Out-of-line bytes this string owns (0 when inline)
+    size_t heapBytes() const { return isHeap() ? heap.capacity : isShared() ? shared.size : 0; }
+
+    operator std::string_view() const { return std::string_view(data(), size()); }
+};
+
+static_assert(sizeof(CompactString) == 32, "CompactString should stay one half cache line");
@@ -0,0 +1,46 @@
+#pragma once
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <mutex>
+#include <vector>
+
+// Hands results back to the threads that want them. Workers post()
+// completions; any number of client threads drain them with poll() or
+// waitAndPoll(), so callbacks run there instead of on a shard worker.
+class CompletionQueue {
+private:
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<std::function<void()>> pending;
+
+public:
+    void post(std::function<void()> completion) {
+        // Notify under the lock so a consumer that has just run the last
+        // completion may destroy the queue as soon as it gets the mutex
+        std::lock_guard<std::mutex> lock(mutex);
+        pending.push_back(std::move(completion));
+        cv.notify_one();
+    }
+
+    // Runs every completion queued so far; returns how many ran
+    size_t poll() {
+        std::vector<std::function<void()>> ready;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            ready.swap(pending);
+        }
+        for (auto& completion : ready)
+            completion();
+        return ready.size();
+    }
+
+    // Blocks until at least one completion is queued, then runs them all
+    size_t waitAndPoll() {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return !pending.empty(); });
+        }
+        return poll();
+    }
+};
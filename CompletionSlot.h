@@ -0,0 +1,104 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+#include "MpscRing.h"
+#include "ValueBuffer.h"
+
+// Reusable rendezvous between one waiting client thread and a worker:
+// a ready flag plus a result buffer whose capacity survives across
+// requests. Each thread leases one slot from a process-wide pool, so a
+// blocking GET allocates nothing beyond the copy of the value it returns
+// (and not even that for a shared value, see RedisLite::getShared).
+class CompletionSlot {
+private:
+    static constexpr int kSpinIterations = 128;
+    static constexpr int kYieldIterations = 32;
+
+    std::atomic<bool> ready{false};
+    std::atomic<bool> waiting{false};
+    std::mutex parkMutex;
+    std::condition_variable cv;
+
+    // Slots are never freed: a worker may still be inside complete() when
+    // the owning thread exits, so slots go back to the pool instead
+    struct Pool {
+        std::mutex mutex;
+        std::vector<CompletionSlot*> free;
+    };
+
+    static Pool& pool() {
+        static Pool* instance = new Pool();
+        return *instance;
+    }
+
+    struct Lease {
+        CompletionSlot* slot;
+
+        Lease() {
+            Pool& p = pool();
+            std::lock_guard<std::mutex> lock(p.mutex);
+            if (p.free.empty()) {
+                slot = new CompletionSlot();
+            } else {
+                slot = p.free.back();
+                p.free.pop_back();
+            }
+        }
+
+        ~Lease() {
+            Pool& p = pool();
+            std::lock_guard<std::mutex> lock(p.mutex);
+            p.free.push_back(slot);
+        }
+    };
+
+public:
+    std::string value; // written by the worker before complete()
+    ValueRef shared;   // same, for a value stored in a shared buffer
+    bool compressed = false; // either one still needs decompressValue()
+
+    static CompletionSlot& forThisThread() {
+        thread_local Lease lease;
+        return *lease.slot;
+    }
+
+    // Owner, before handing the slot to a worker
+    void arm() {
+        ready.store(false, std::memory_order_relaxed);
+    }
+
+    // Worker. A late notify can reach the slot's next request, which only
+    // makes that waiter re-check `ready`.
+    void complete() {
+        ready.store(true, std::memory_order_release);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (waiting.load(std::memory_order_relaxed)) {
+            std::lock_guard<std::mutex> lock(parkMutex);
+            cv.notify_one();
+        }
+    }
+
+    // Owner: spins, then yields, then parks until complete()
+    void wait() {
+        for (int i = 0; i < kSpinIterations; i++) {
+            if (ready.load(std::memory_order_acquire))
+                return;
+            cpuRelax();
+        }
+        for (int i = 0; i < kYieldIterations; i++) {
+            if (ready.load(std::memory_order_acquire))
+                return;
+            std::this_thread::yield();
+        }
+
+        std::unique_lock<std::mutex> lock(parkMutex);
+        waiting.store(true, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        cv.wait(lock, [&]() { return ready.load(std::memory_order_acquire); });
+        waiting.store(false, std::memory_order_relaxed);
+    }
+};
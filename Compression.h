@@ -0,0 +1,184 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Compressed string values: a 4-byte little-endian length of the original
+// followed by one block in the LZ4 block format, so any LZ4 decoder can
+// read the body. The encoder is a plain greedy one with a small hash
+// table, about as fast as LZ4's default level, kept in-tree so the
+// project still has no dependencies.
+namespace lz4 {
+constexpr size_t kMinMatch = 4;
+constexpr size_t kLastLiterals = 5; // a block ends with this many literals
+constexpr size_t kMatchLimit = 12;  // no match starts closer to the end
+constexpr size_t kMaxOffset = 65535;
+constexpr int kHashBits = 12;       // 16 KiB of positions per thread
+constexpr size_t kHeader = 4;
+
+inline uint32_t read32(const char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint32_t hash(uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - kHashBits);
+}
+
+inline void putLength(std::string& out, size_t length) {
+    while (length >= 255) {
+        out += static_cast<char>(255);
+        length -= 255;
+    }
+    out += static_cast<char>(length);
+}
+
+inline void putSequence(std::string& out, const char* literals, size_t literalLength,
+                        size_t offset, size_t matchLength) {
+    size_t extra = matchLength - kMinMatch;
+    uint8_t token = static_cast<uint8_t>((literalLength < 15 ? literalLength : 15) << 4 |
+                                         (extra < 15 ? extra : 15));
+    out += static_cast<char>(token);
+    if (literalLength >= 15)
+        putLength(out, literalLength - 15);
+    out.append(literals, literalLength);
+    out += static_cast<char>(offset & 0xFF);
+    out += static_cast<char>(offset >> 8);
+    if (extra >= 15)
+        putLength(out, extra - 15);
+}
+
+inline void putLastLiterals(std::string& out, const char* literals, size_t length) {
+    out += static_cast<char>((length < 15 ? length : 15) << 4);
+    if (length >= 15)
+        putLength(out, length - 15);
+    out.append(literals, length);
+}
+
+// Appends the block for `in` to `out`
+inline void compressBlock(std::string_view in, std::string& out) {
+    thread_local std::vector<uint32_t> table;
+    table.assign(size_t(1) << kHashBits, 0); // position + 1; 0 = empty
+    const char* base = in.data();
+    size_t n = in.size();
+    size_t anchor = 0;
+
+    if (n > kMatchLimit) {
+        size_t limit = n - kMatchLimit;
+        size_t i = 0;
+        while (i < limit) {
+            uint32_t sequence = read32(base + i);
+            uint32_t& slot = table[hash(sequence)];
+            size_t candidate = slot;
+            slot = static_cast<uint32_t>(i + 1);
+            if (!candidate || i - (candidate - 1) > kMaxOffset ||
+                read32(base + candidate - 1) != sequence) {
+                i++;
+                continue;
+            }
+            size_t ref = candidate - 1;
+            while (i > anchor && ref > 0 && base[i - 1] == base[ref - 1]) {
+                i--;
+                ref--;
+            }
+            size_t end = i + kMinMatch;
+            size_t maxEnd = n - kLastLiterals;
+            while (end < maxEnd && base[end] == base[ref + (end - i)])
+                end++;
+            putSequence(out, base + anchor, i - anchor, i - ref, end - i);
+            i = end;
+            anchor = i;
+        }
+    }
+    putLastLiterals(out, base + anchor, n - anchor);
+}
+
+// Decodes a block into exactly `size` bytes at `dst`; false if it is
+// malformed or decodes to any other size
+inline bool decompressBlock(std::string_view in, char* dst, size_t size) {
+    const uint8_t* ip = reinterpret_cast<const uint8_t*>(in.data());
+    const uint8_t* end = ip + in.size();
+    size_t op = 0;
+    auto length = [&](size_t& value) {
+        uint8_t b;
+        do {
+            if (ip == end)
+                return false;
+            b = *ip++;
+            value += b;
+        } while (b == 255);
+        return true;
+    };
+
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t literals = token >> 4;
+        if (literals == 15 && !length(literals))
+            return false;
+        if (literals > static_cast<size_t>(end - ip) || literals > size - op)
+            return false;
+        std::memcpy(dst + op, ip, literals);
+        ip += literals;
+        op += literals;
+        if (ip == end)
+            return op == size; // the last sequence has no match
+
+        if (end - ip < 2)
+            return false;
+        size_t offset = size_t(ip[0]) | size_t(ip[1]) << 8;
+        ip += 2;
+        size_t match = token & 15;
+        if (match == 15 && !length(match))
+            return false;
+        match += kMinMatch;
+        if (offset == 0 || offset > op || match > size - op)
+            return false;
+        if (offset >= match) {
+            std::memcpy(dst + op, dst + op - offset, match);
+        } else {
+            for (size_t i = 0; i < match; i++) // overlapping: repeats a pattern
+                dst[op + i] = dst[op - offset + i];
+        }
+        op += match;
+    }
+    return false;
+}
+}
+
+// `value` with its length header, if that saves at least an eighth of it
+inline bool compressValue(std::string_view value, std::string& out) {
+    if (value.size() > UINT32_MAX)
+        return false;
+    out.clear();
+    out.reserve(lz4::kHeader + value.size());
+    uint32_t size = static_cast<uint32_t>(value.size());
+    for (size_t i = 0; i < lz4::kHeader; i++)
+        out += static_cast<char>(size >> (8 * i));
+    lz4::compressBlock(value, out);
+    return out.size() <= value.size() - value.size() / 8;
+}
+
+// Length of the value that `stored` (from compressValue) decompresses to
+inline size_t compressedValueSize(std::string_view stored) {
+    if (stored.size() < lz4::kHeader)
+        return 0;
+    uint32_t size = 0;
+    for (size_t i = 0; i < lz4::kHeader; i++)
+        size |= uint32_t(static_cast<uint8_t>(stored[i])) << (8 * i);
+    return size;
+}
+
+// Replaces `out` with the original value; false if `stored` is corrupt
+inline bool decompressValue(std::string_view stored, std::string& out) {
+    // A block cannot expand more than 255-fold; a bigger length is a
+    // corrupt header, not worth allocating for
+    size_t size = compressedValueSize(stored);
+    if (stored.size() <= lz4::kHeader || size / 255 > stored.size())
+        return false;
+    out.resize(size);
+    return lz4::decompressBlock(stored.substr(lz4::kHeader), &out[0], out.size());
+}
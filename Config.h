@@ -0,0 +1,120 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// What a shard does once it is over its share of maxMemory
+enum class EvictionPolicy {
+    NoEviction,  // reject writes (SET / SET_TTL) until memory is freed
+    AllKeysLru,  // evict the least recently used key of a sample
+    AllKeysLfu,  // evict the least frequently used key of a sample
+    VolatileTtl  // evict the TTL key closest to expiring of a sample
+};
+
+// What a client command does when its shard's queue is full
+enum class QueueOverflow {
+    Block,  // wait for room
+    Reject, // refuse it at once (RESP -OVERLOADED, RedisLite throws QueueFullError)
+    // Refuse what goes to the main queue, as Reject, but let reads bound
+    // for the priority lane wait for room there. Needs a lane
+    // (priorityQueueCapacity), or the constructor throws
+    // std::invalid_argument. Queued commands are never dropped.
+    Shed
+};
+
+// When the append-only file is fsynced, as in Redis's appendfsync
+enum class AofFsync {
+    Always,   // after every group commit
+    EverySec, // at most once a second
+    No        // left to the OS
+};
+
+struct RedisLiteConfig {
+    size_t shards = 1;            // one worker thread + store per shard
+    size_t queueCapacity = 16384; // per shard, rounded up to a power of two
+    QueueOverflow queueOverflow = QueueOverflow::Block;
+    // Capacity of a second, priority queue per shard for reads, drained
+    // ahead of the main one; 0 = none. RESP GET / MGET use it when the
+    // client has nothing else in flight, and the library only for
+    // RedisLite::getPriority(), since a read in it can overtake writes
+    // still queued in the main one.
+    size_t priorityQueueCapacity = 0;
+    size_t maxBatchSize = 256;    // commands drained per worker pass
+    size_t expireBudget = 256;    // TTL timers processed per worker pass
+
+    // CPU each shard's worker is pinned to: shard i runs on
+    // workerCpus[i % size()]; empty = wherever the scheduler puts it. A
+    // pinned worker allocates its store, arena and tables itself after
+    // pinning, so on a NUMA machine they sit on its own node. Linux only.
+    std::vector<int> workerCpus;
+    // Idle workers keep polling their queue instead of parking on a
+    // condition variable: dispatch without a wakeup, for one fully busy
+    // core per shard. Best combined with workerCpus.
+    bool busyPoll = false;
+
+    // GETs read a per-shard lock-free mirror of the string values instead
+    // of queueing (see ReadIndex). It costs a second copy of every value,
+    // and a get() may not yet see a set() still sitting in the queue.
+    bool lockFreeReads = false;
+    // Keys each client thread caches in front of get() (see NearCache);
+    // 0 = off. Other threads' writes reach it within one worker pass,
+    // and an expired key leaves it once the worker has removed it.
+    size_t nearCacheEntries = 0;
+    // Keep an ordered index of each shard's keys for prefix queries
+    // (RedisLite::scanPrefix, SCANPREFIX). Costs a second copy of every
+    // key and a tree insert / erase per key created or removed.
+    bool keyIndex = false;
+
+    // Time every command's queue wait and execution for INFO and the
+    // Prometheus metrics (RedisLite::latencyStats); costs a clock read
+    // per enqueue and per executed command
+    bool latencyTracking = true;
+    // Commands that run for at least this many microseconds are kept in
+    // the slow log (see SlowLog), the last slowlogMaxLen of them;
+    // negative = off. Shares the clock read per command with the above.
+    int64_t slowlogSlowerThanUs = 10000;
+    size_t slowlogMaxLen = 128;
+    // Worker stalls of at least this many microseconds go to the latency
+    // monitor by cause (see LatencyMonitor); 0 = off. Adds a clock read
+    // per housekeeping step of a worker pass.
+    uint64_t latencyMonitorThresholdUs = 0;
+
+    // Strings of at least this many bytes live in a refcounted buffer
+    // instead of the arena, so GETs share it rather than copy it on the
+    // worker (see RedisLite::getShared); 0 = never
+    size_t sharedValueMin = 64 * 1024;
+    // SET values of at least this many bytes are LZ4-compressed by the
+    // thread that sends them (see Compression.h) and decompressed when
+    // read, where possible by the reader; 0 = never. Kept only if that
+    // saves an eighth or more.
+    size_t compressMin = 0;
+
+    size_t maxMemory = 0;         // bytes across all shards; 0 = unlimited
+    EvictionPolicy evictionPolicy = EvictionPolicy::NoEviction;
+    size_t evictionSamples = 5;   // keys sampled per eviction
+
+    // Hashes, lists, sets and sorted sets stay packed (listpack / intset)
+    // up to these sizes, as Redis's *-max-listpack-* settings
+    size_t listpackMaxEntries = 128; // elements, or field-value pairs
+    size_t listpackMaxValue = 64;    // bytes per element
+    size_t intsetMaxEntries = 512;   // sets of integers only
+
+    // Append-only file; empty path = no persistence. An existing file is
+    // replayed at construction.
+    std::string aofPath;
+    AofFsync aofFsync = AofFsync::EverySec;
+    // Rewrite once the log has grown this much (percent) past its size
+    // after the last rewrite, but not before it reaches aofRewriteMinSize.
+    // 0 = only on RedisLite::rewriteAof().
+    size_t aofRewritePercentage = 100;
+    size_t aofRewriteMinSize = 64 * 1024 * 1024;
+
+    // Snapshot file written by save() / bgsave(). When there is no AOF, an
+    // existing snapshot is loaded at construction instead.
+    std::string snapshotPath;
+
+    // Bytes of recent mutations kept for replicas that reconnect and
+    // resume (partial resync); 0 = this instance cannot be a primary
+    size_t replBacklogSize = 1024 * 1024;
+};
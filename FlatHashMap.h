@@ -0,0 +1,458 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <new>
+#include <string_view>
+#include <utility>
+
+#if defined(__SSE2__) || defined(_M_X64)
+#include <emmintrin.h>
+#define FLATHASHMAP_SSE2 1
+#endif
+
+// Open-addressing hash table with Swiss-table style probing: one control
+// byte per slot (empty / deleted / 7 bits of the hash), scanned 16 at a
+// time with SSE2 where available. Each slot stores its full hash, so a
+// resize never rehashes keys, and growth is incremental: a resize
+// allocates the new table and moves old groups over a few at a time on
+// later writes (or via rehashStep() when the owner is idle), so no single
+// operation pays for the whole copy.
+//
+// Lookups take a std::string_view; Key must convert to one. Pointers and
+// references into the map are invalidated by any insert or erase.
+template <typename Key, typename Value>
+class FlatHashMap {
+private:
+    static constexpr size_t kGroupWidth = 16;
+    static constexpr int8_t kEmpty = -128;
+    static constexpr int8_t kDeleted = -2;
+    static constexpr size_t kMinGroups = 1;
+    // Old groups migrated per insert while a resize is in flight
+    static constexpr size_t kMigrateGroupsPerWrite = 2;
+
+    struct Slot {
+        size_t hash;
+        Key key;
+        Value value;
+    };
+
+    struct Table {
+        int8_t* ctrl = nullptr;
+        Slot* slots = nullptr;
+        size_t groupMask = 0;
+        size_t size = 0;
+        size_t tombstones = 0;
+
+        size_t groups() const { return ctrl ? groupMask + 1 : 0; }
+        size_t capacity() const { return groups() * kGroupWidth; }
+    };
+
+    Table cur;
+    Table old;              // non-empty only while a resize is in flight
+    size_t migrateNext = 0; // next group of `old` to move
+
+    // Bitmask helpers over one 16-byte control group
+    static uint32_t matchByte(const int8_t* group, int8_t value) {
+#ifdef FLATHASHMAP_SSE2
+        __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+        return static_cast<uint32_t>(
+            _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_set1_epi8(value), ctrl)));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < kGroupWidth; i++)
+            mask |= static_cast<uint32_t>(group[i] == value) << i;
+        return mask;
+#endif
+    }
+
+    static uint32_t matchEmptyOrDeleted(const int8_t* group) {
+#ifdef FLATHASHMAP_SSE2
+        __m128i ctrl = _mm_loadu_si128(reinterpret_cast<const __m128i*>(group));
+        // kEmpty and kDeleted are the only control values below -1
+        return static_cast<uint32_t>(
+            _mm_movemask_epi8(_mm_cmpgt_epi8(_mm_set1_epi8(-1), ctrl)));
+#else
+        uint32_t mask = 0;
+        for (size_t i = 0; i < kGroupWidth; i++)
+            mask |= static_cast<uint32_t>(group[i] < -1) << i;
+        return mask;
+#endif
+    }
+
+    static int lowestBit(uint32_t mask) {
+#if defined(__GNUC__) || defined(__clang__)
+        return __builtin_ctz(mask);
+#else
+        int i = 0;
+        while (!(mask & 1u)) {
+            mask >>= 1;
+            i++;
+        }
+        return i;
+#endif
+    }
+
+    static size_t hashOf(std::string_view key) {
+        return std::hash<std::string_view>{}(key);
+    }
+
+    static int8_t h2(size_t hash) {
+        return static_cast<int8_t>(hash >> (sizeof(size_t) * 8 - 7));
+    }
+
+    static size_t homeGroup(const Table& t, size_t hash) {
+        return hash & t.groupMask;
+    }
+
+    static bool isFull(int8_t c) { return c >= 0; }
+
+    static void allocate(Table& t, size_t groups) {
+        t.groupMask = groups - 1;
+        t.ctrl = static_cast<int8_t*>(::operator new(groups * kGroupWidth));
+        std::memset(t.ctrl, kEmpty, groups * kGroupWidth);
+        t.slots = static_cast<Slot*>(::operator new(groups * kGroupWidth * sizeof(Slot)));
+        t.size = 0;
+        t.tombstones = 0;
+    }
+
+    static void release(Table& t) {
+        if (!t.ctrl)
+            return;
+        size_t cap = t.capacity();
+        for (size_t i = 0; i < cap; i++) {
+            if (isFull(t.ctrl[i]))
+                t.slots[i].~Slot();
+        }
+        ::operator delete(t.ctrl);
+        ::operator delete(t.slots);
+        t = Table();
+    }
+
+    // Slot index of `key` in `t`, or -1
+    static std::ptrdiff_t findIn(const Table& t, std::string_view key, size_t hash) {
+        if (!t.ctrl)
+            return -1;
+        int8_t tag = h2(hash);
+        size_t g = homeGroup(t, hash);
+        for (size_t probes = 0; probes <= t.groupMask; probes++) {
+            const int8_t* group = t.ctrl + g * kGroupWidth;
+            for (uint32_t m = matchByte(group, tag); m; m &= m - 1) {
+                size_t i = g * kGroupWidth + lowestBit(m);
+                const Slot& slot = t.slots[i];
+                if (slot.hash == hash && std::string_view(slot.key) == key)
+                    return static_cast<std::ptrdiff_t>(i);
+            }
+            // A group with an empty slot ends every probe that reaches it
+            if (matchByte(group, kEmpty))
+                return -1;
+            g = (g + 1) & t.groupMask;
+        }
+        return -1;
+    }
+
+    // First free slot on `hash`'s probe sequence; caller guarantees room
+    static size_t freeSlotIn(const Table& t, size_t hash) {
+        size_t g = homeGroup(t, hash);
+        while (true) {
+            uint32_t m = matchEmptyOrDeleted(t.ctrl + g * kGroupWidth);
+            if (m)
+                return g * kGroupWidth + lowestBit(m);
+            g = (g + 1) & t.groupMask;
+        }
+    }
+
+    static Slot& placeIn(Table& t, size_t hash, Key&& key, Value&& value) {
+        size_t i = freeSlotIn(t, hash);
+        if (t.ctrl[i] == kDeleted)
+            t.tombstones--;
+        t.ctrl[i] = h2(hash);
+        Slot* slot = new (&t.slots[i]) Slot{hash, std::move(key), std::move(value)};
+        t.size++;
+        return *slot;
+    }
+
+    // Moving an element out while a resize is in flight has to leave a
+    // tombstone, so probes for later elements still run past it
+    static void eraseAt(Table& t, size_t i, bool keepProbeChain) {
+        t.slots[i].~Slot();
+        const int8_t* group = t.ctrl + (i / kGroupWidth) * kGroupWidth;
+        if (!keepProbeChain && matchByte(group, kEmpty)) {
+            // No probe ever continued past a group that still has an
+            // empty slot, so this one can go straight back to empty
+            t.ctrl[i] = kEmpty;
+        } else {
+            t.ctrl[i] = kDeleted;
+            t.tombstones++;
+        }
+        t.size--;
+    }
+
+    static size_t groupsFor(size_t entries) {
+        // Smallest power of two that leaves the table at most half full
+        size_t groups = kMinGroups;
+        while (groups * kGroupWidth / 2 < entries)
+            groups <<= 1;
+        return groups;
+    }
+
+    static size_t reverseBits(size_t v) {
+        size_t r = 0;
+        for (size_t i = 0; i < sizeof(size_t) * 8; i++) {
+            r = (r << 1) | (v & 1);
+            v >>= 1;
+        }
+        return r;
+    }
+
+    // Increments the high (unmasked) bits reversed, so the cursor order
+    // stays valid for any table size
+    static size_t nextCursor(size_t cursor, size_t mask) {
+        cursor |= ~mask;
+        cursor = reverseBits(cursor);
+        cursor++;
+        return reverseBits(cursor);
+    }
+
+    // Entries whose home group is `g`. They sit between g and the first
+    // group with an empty slot, which is where every probe from g stops.
+    template <typename Fn>
+    static void visitHome(const Table& t, size_t home, Fn& fn) {
+        if (!t.ctrl || t.size == 0)
+            return;
+        size_t g = home;
+        for (size_t probes = 0; probes <= t.groupMask; probes++) {
+            const int8_t* group = t.ctrl + g * kGroupWidth;
+            for (size_t j = 0; j < kGroupWidth; j++) {
+                size_t i = g * kGroupWidth + j;
+                if (isFull(t.ctrl[i]) && homeGroup(t, t.slots[i].hash) == home)
+                    fn(static_cast<const Key&>(t.slots[i].key), t.slots[i].value);
+            }
+            if (matchByte(group, kEmpty))
+                return;
+            g = (g + 1) & t.groupMask;
+        }
+    }
+
+    void migrateGroups(size_t count) {
+        size_t groups = old.groups();
+        while (count-- > 0 && migrateNext < groups) {
+            size_t base = migrateNext * kGroupWidth;
+            for (size_t i = base; i < base + kGroupWidth; i++) {
+                if (!isFull(old.ctrl[i]))
+                    continue;
+                Slot& slot = old.slots[i];
+                placeIn(cur, slot.hash, std::move(slot.key), std::move(slot.value));
+                eraseAt(old, i, true);
+            }
+            migrateNext++;
+        }
+        if (old.size == 0 || migrateNext >= groups) {
+            release(old);
+            migrateNext = 0;
+        }
+    }
+
+    void finishMigration() {
+        while (old.ctrl)
+            migrateGroups(old.groups());
+    }
+
+    // Called before every insert into `cur`
+    void reserveOne() {
+        if (!cur.ctrl) {
+            allocate(cur, kMinGroups);
+            return;
+        }
+        if (old.ctrl)
+            migrateGroups(kMigrateGroupsPerWrite);
+        if ((cur.size + cur.tombstones + 1) * 8 <= cur.capacity() * 7)
+            return;
+
+        // A resize still in flight has to land before the next one starts
+        finishMigration();
+        if ((cur.size + cur.tombstones + 1) * 8 <= cur.capacity() * 7)
+            return;
+
+        // Grow so the live entries fill at most half the new table (or
+        // just sweep tombstones when they are what filled this one), then
+        // migrate incrementally
+        size_t groups = groupsFor(cur.size + 1);
+        if (groups < cur.groups())
+            groups = cur.groups();
+        old = cur;
+        cur = Table();
+        allocate(cur, groups);
+        migrateNext = 0;
+        migrateGroups(kMigrateGroupsPerWrite);
+    }
+
+public:
+    FlatHashMap() = default;
+    FlatHashMap(const FlatHashMap&) = delete;
+    FlatHashMap& operator=(const FlatHashMap&) = delete;
+
+    ~FlatHashMap() {
+        release(cur);
+        release(old);
+    }
+
+    size_t size() const { return cur.size + old.size; }
+    bool empty() const { return size() == 0; }
+    bool isRehashing() const { return old.ctrl != nullptr; }
+
+    // Bytes held by control bytes and slots of both tables
+    size_t tableBytes() const {
+        return (cur.capacity() + old.capacity()) * (1 + sizeof(Slot));
+    }
+
+    Value* find(std::string_view key) {
+        size_t hash = hashOf(key);
+        std::ptrdiff_t i = findIn(cur, key, hash);
+        if (i >= 0)
+            return &cur.slots[i].value;
+        i = findIn(old, key, hash);
+        if (i >= 0)
+            return &old.slots[i].value;
+        return nullptr;
+    }
+
+    // Returns the value for `key`, inserting a default-constructed one (with
+    // the key built by makeKey()) if it is missing
+    template <typename MakeKey>
+    Value& findOrInsert(std::string_view key, MakeKey&& makeKey, bool* inserted = nullptr) {
+        size_t hash = hashOf(key);
+        std::ptrdiff_t i = findIn(cur, key, hash);
+        if (i >= 0) {
+            if (inserted)
+                *inserted = false;
+            return cur.slots[i].value;
+        }
+
+        i = findIn(old, key, hash);
+        if (i >= 0) {
+            // Pull it forward rather than updating it in the old table
+            Slot& slot = old.slots[i];
+            Key k = std::move(slot.key);
+            Value v = std::move(slot.value);
+            eraseAt(old, static_cast<size_t>(i), true);
+            reserveOne();
+            if (inserted)
+                *inserted = false;
+            return placeIn(cur, hash, std::move(k), std::move(v)).value;
+        }
+
+        reserveOne();
+        if (inserted)
+            *inserted = true;
+        return placeIn(cur, hash, makeKey(), Value()).value;
+    }
+
+    Value& findOrInsert(std::string_view key, bool* inserted = nullptr) {
+        return findOrInsert(key, [&]() { return Key(key); }, inserted);
+    }
+
+    bool erase(std::string_view key) {
+        size_t hash = hashOf(key);
+        std::ptrdiff_t i = findIn(cur, key, hash);
+        if (i >= 0) {
+            eraseAt(cur, static_cast<size_t>(i), false);
+            return true;
+        }
+        i = findIn(old, key, hash);
+        if (i >= 0) {
+            eraseAt(old, static_cast<size_t>(i), true);
+            return true;
+        }
+        return false;
+    }
+
+    // Moves up to `groups` old groups forward; returns true while a
+    // resize is still in flight
+    bool rehashStep(size_t groups) {
+        if (old.ctrl)
+            migrateGroups(groups);
+        return old.ctrl != nullptr;
+    }
+
+    // Presizes for `entries` without any incremental work left over
+    void reserve(size_t entries) {
+        finishMigration();
+        size_t groups = groupsFor(entries);
+        if (groups <= cur.groups())
+            return;
+        old = cur;
+        cur = Table();
+        allocate(cur, groups);
+        migrateNext = 0;
+        finishMigration();
+    }
+
+    void clear() {
+        release(cur);
+        release(old);
+        migrateNext = 0;
+    }
+
+    // fn(const Key&, Value&) for up to `count` entries found by walking
+    // from a random slot; used for approximate (sampled) eviction
+    template <typename Fn>
+    size_t sample(uint64_t random, size_t count, Fn&& fn) {
+        size_t visited = 0;
+        for (Table* t : {&cur, &old}) {
+            if (t->size == 0)
+                continue;
+            size_t cap = t->capacity();
+            size_t start = static_cast<size_t>(random) & (cap - 1);
+            for (size_t n = 0; n < cap && visited < count; n++) {
+                size_t i = (start + n) & (cap - 1);
+                if (isFull(t->ctrl[i])) {
+                    fn(static_cast<const Key&>(t->slots[i].key), t->slots[i].value);
+                    visited++;
+                }
+            }
+            if (visited >= count)
+                break;
+        }
+        return visited;
+    }
+
+    // Incremental iteration in the style of Redis's dictScan: pass 0 to
+    // start, then the returned cursor until it comes back as 0. Every entry
+    // present for the whole scan is visited at least once, even if the
+    // table grows or migrates in between calls; entries may be visited
+    // twice. Each call covers one home group (and its counterparts in the
+    // other table while a resize is in flight).
+    template <typename Fn>
+    size_t scan(size_t cursor, Fn&& fn) {
+        if (empty())
+            return 0;
+        if (!old.ctrl || old.size == 0) {
+            visitHome(cur, cursor & cur.groupMask, fn);
+            return nextCursor(cursor, cur.groupMask);
+        }
+
+        const Table& small = old.groupMask <= cur.groupMask ? old : cur;
+        const Table& large = &small == &old ? cur : old;
+        visitHome(small, cursor & small.groupMask, fn);
+        // Then every group of the larger table that expands this one
+        do {
+            visitHome(large, cursor & large.groupMask, fn);
+            cursor = nextCursor(cursor, large.groupMask);
+        } while (cursor & (small.groupMask ^ large.groupMask));
+        return cursor;
+    }
+
+    // fn(const Key&, Value&) for every entry
+    template <typename Fn>
+    void forEach(Fn&& fn) {
+        for (Table* t : {&cur, &old}) {
+            size_t cap = t->capacity();
+            for (size_t i = 0; i < cap; i++) {
+                if (isFull(t->ctrl[i]))
+                    fn(static_cast<const Key&>(t->slots[i].key), t->slots[i].value);
+            }
+        }
+    }
+};
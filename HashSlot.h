@@ -0,0 +1,54 @@
+#pragma once
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string_view>
+
+// Redis Cluster key hashing: CRC16 (XMODEM) of the key modulo 16384. When
+// the key holds a non-empty "{...}" hash tag only the tag is hashed, so
+// related keys can be forced into one slot. Shards own whole slots
+// (slot % shards), which keeps each slot's keys in one store.
+
+constexpr size_t kHashSlots = 16384;
+
+namespace hashslot {
+constexpr std::array<uint16_t, 256> makeTable() {
+    std::array<uint16_t, 256> table{};
+    for (uint32_t i = 0; i < 256; i++) {
+        uint16_t crc = static_cast<uint16_t>(i << 8);
+        for (int bit = 0; bit < 8; bit++)
+            crc = static_cast<uint16_t>(crc & 0x8000 ? (crc << 1) ^ 0x1021 : crc << 1);
+        table[i] = crc;
+    }
+    return table;
+}
+
+inline constexpr std::array<uint16_t, 256> kCrcTable = makeTable();
+}
+
+inline uint16_t crc16(const char* data, size_t size) {
+    uint16_t crc = 0;
+    for (size_t i = 0; i < size; i++) {
+        uint8_t index = static_cast<uint8_t>((crc >> 8) ^ static_cast<uint8_t>(data[i]));
+        crc = static_cast<uint16_t>((crc << 8) ^ hashslot::kCrcTable[index]);
+    }
+    return crc;
+}
+
+inline uint16_t keySlot(std::string_view key) {
+    size_t open = key.find('{');
+    if (open != std::string_view::npos) {
+        size_t close = key.find('}', open + 1);
+        if (close != std::string_view::npos && close > open + 1)
+            key = key.substr(open + 1, close - open - 1);
+    }
+    return static_cast<uint16_t>(crc16(key.data(), key.size()) & (kHashSlots - 1));
+}
+
+inline size_t shardOfSlot(uint16_t slot, size_t shards) {
+    return shards > 1 ? slot % shards : 0;
+}
+
+inline size_t shardOfKey(std::string_view key, size_t shards) {
+    return shards > 1 ? keySlot(key) % shards : 0;
+}
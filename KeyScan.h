@@ -0,0 +1,162 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+#include "CompletionSlot.h"
+
+// Glob-style matching as Redis's stringmatchlen, for SCAN's MATCH: `*`,
+// `?`, `[abc]`, `[^abc]`, `[a-z]` and `\` to escape the next character.
+// A `*` backtracks to the last star only, so the cost stays linear in
+// pattern times key length.
+namespace glob {
+// Does the element at `p` match `c`? Moves `p` past it either way
+inline bool matchOne(std::string_view pattern, size_t& p, char c) {
+    size_t n = pattern.size();
+    char pc = pattern[p++];
+    if (pc == '?')
+        return true;
+    if (pc == '\\' && p < n)
+        return pattern[p++] == c;
+    if (pc != '[')
+        return pc == c;
+
+    bool negate = p < n && pattern[p] == '^';
+    p += negate;
+    bool hit = false;
+    auto uc = [](char ch) { return static_cast<unsigned char>(ch); };
+    while (p < n && pattern[p] != ']') {
+        if (pattern[p] == '\\' && p + 1 < n) {
+            hit |= pattern[p + 1] == c;
+            p += 2;
+        } else if (p + 2 < n && pattern[p + 1] == '-' && pattern[p + 2] != ']') {
+            unsigned char lo = uc(pattern[p]), hi = uc(pattern[p + 2]);
+            if (lo > hi)
+                std::swap(lo, hi);
+            hit |= uc(c) >= lo && uc(c) <= hi;
+            p += 3;
+        } else {
+            hit |= pattern[p++] == c;
+        }
+    }
+    p += p < n; // the ']'; an unterminated class just ends the pattern
+    return hit != negate;
+}
+}
+
+inline bool globMatch(std::string_view pattern, std::string_view s) {
+    constexpr size_t kNone = std::string_view::npos;
+    size_t p = 0, i = 0;
+    size_t starP = kNone, starI = 0; // after the last '*', and where it resumes
+    while (i < s.size()) {
+        if (p < pattern.size() && pattern[p] == '*') {
+            while (p < pattern.size() && pattern[p] == '*')
+                p++;
+            if (p == pattern.size())
+                return true;
+            starP = p;
+            starI = i;
+            continue;
+        }
+        size_t next = p;
+        if (p < pattern.size() && glob::matchOne(pattern, next, s[i])) {
+            p = next;
+            i++;
+            continue;
+        }
+        if (starP == kNone)
+            return false;
+        p = starP;
+        i = ++starI; // let the star swallow one more character
+    }
+    while (p < pattern.size() && pattern[p] == '*')
+        p++;
+    return p == pattern.size();
+}
+
+// Ordered copy of one shard's keys (RedisLiteConfig::keyIndex), so a
+// prefix query walks only the keys under the prefix instead of the whole
+// table. Worker thread only, like the store it mirrors.
+class KeyIndex {
+private:
+    std::set<std::string, std::less<>> keys;
+    size_t keyBytes = 0;
+
+    // Red-black tree node overhead on top of the std::string
+    static constexpr size_t kNodeBytes = 4 * sizeof(void*);
+
+public:
+    void insert(std::string_view key) {
+        if (keys.emplace(key).second)
+            keyBytes += key.size();
+    }
+
+    void erase(std::string_view key) {
+        auto it = keys.find(key);
+        if (it == keys.end())
+            return;
+        keyBytes -= it->size();
+        keys.erase(it);
+    }
+
+    void clear() {
+        keys.clear();
+        keyBytes = 0;
+    }
+
+    size_t size() const { return keys.size(); }
+    size_t bytes() const { return keys.size() * (kNodeBytes + sizeof(std::string)) + keyBytes; }
+
+    // fn(const std::string&) for the keys starting with `prefix` that
+    // sort after `after` (all of them if it is empty), in order, until fn
+    // returns false
+    template <typename Fn>
+    void range(std::string_view prefix, std::string_view after, Fn&& fn) const {
+        auto it = after.empty() || after < prefix ? keys.lower_bound(prefix)
+                                                  : keys.upper_bound(after);
+        for (; it != keys.end() && std::string_view(*it).substr(0, prefix.size()) == prefix; ++it) {
+            if (!fn(*it))
+                return;
+        }
+    }
+};
+
+// A SCAN step, which runs on the one shard its cursor names, or a prefix
+// query (SCAN_PREFIX), which runs on every shard. The workers fill it in,
+// and the last one to finish merges the parts, then delivers the RESP
+// reply to the command's sink (and frees the job) or completes `done`.
+struct ScanJob {
+    // SCAN: 0 to start, then the previous `next`. The low part (modulo
+    // the shard count) picks the shard, the rest is that shard's table
+    // cursor (FlatHashMap::scan).
+    uint64_t cursor = 0;
+    // SCAN_PREFIX: keys starting with `prefix` that sort after `after`
+    std::string prefix;
+    std::string after;
+    std::string pattern; // MATCH; empty = any key
+    int type = -1;       // TYPE: a ValueType; -1 = any
+    // Keys to return (SCAN: about as many, since a step finishes the
+    // table group it is in), and to stop at 10x as many visited, so a
+    // sparse table or a selective MATCH cannot make one step long
+    size_t count = 10;
+
+    struct Part {
+        std::vector<std::string> keys;
+        bool more = false; // stopped early, at `last`
+        std::string last;
+    };
+    std::vector<Part> parts; // SCAN_PREFIX, per shard
+
+    // Results: the keys (SCAN_PREFIX: sorted), and where to resume, 0 /
+    // "" once the iteration is complete
+    std::vector<std::string> keys;
+    uint64_t next = 0;
+    std::string nextAfter;
+
+    std::atomic<size_t> pending{0};
+    CompletionSlot* done = nullptr;
+};
@@ -0,0 +1,99 @@
+#pragma once
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// HDR-style histogram of latencies in nanoseconds: each power of two is
+// split into 128 linear steps, so any recorded value comes back within
+// 1% at a fixed 4.5K counters, from 1 ns up to 2^40 ns (about 18 minutes;
+// longer ones count as that). Not thread-safe: keep one per thread and
+// merge them.
+class LatencyHistogram {
+private:
+    static constexpr int kSubBits = 7;
+    static constexpr int kMaxBits = 40;
+    static constexpr uint64_t kSubCount = uint64_t(1) << kSubBits;
+    static constexpr uint64_t kMaxValue = (uint64_t(1) << kMaxBits) - 1;
+
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t sum = 0;
+    uint64_t lowest = UINT64_MAX;
+    uint64_t highest = 0;
+
+    static int topBit(uint64_t v) {
+#if defined(__GNUC__) || defined(__clang__)
+        return 63 - __builtin_clzll(v);
+#else
+        int bit = 0;
+        while (v >>= 1)
+            bit++;
+        return bit;
+#endif
+    }
+
+    static size_t indexOf(uint64_t v) {
+        if (v < kSubCount)
+            return static_cast<size_t>(v);
+        int shift = topBit(v) - kSubBits;
+        return static_cast<size_t>((uint64_t(shift + 1) << kSubBits) + ((v >> shift) & (kSubCount - 1)));
+    }
+
+    // Highest value that lands in `index`
+    static uint64_t valueAt(size_t index) {
+        if (index < 2 * kSubCount)
+            return index;
+        int shift = static_cast<int>(index >> kSubBits) - 1;
+        uint64_t sub = index & (kSubCount - 1);
+        return ((kSubCount + sub + 1) << shift) - 1;
+    }
+
+public:
+    LatencyHistogram() : counts(indexOf(kMaxValue) + 1, 0) {}
+
+    void record(uint64_t ns) {
+        ns = std::min(ns, kMaxValue);
+        counts[indexOf(ns)]++;
+        total++;
+        sum += ns;
+        lowest = std::min(lowest, ns);
+        highest = std::max(highest, ns);
+    }
+
+    void merge(const LatencyHistogram& other) {
+        for (size_t i = 0; i < counts.size(); i++)
+            counts[i] += other.counts[i];
+        total += other.total;
+        sum += other.sum;
+        lowest = std::min(lowest, other.lowest);
+        highest = std::max(highest, other.highest);
+    }
+
+    void reset() {
+        std::fill(counts.begin(), counts.end(), 0);
+        total = sum = highest = 0;
+        lowest = UINT64_MAX;
+    }
+
+    // Smallest recorded value that at least `percent` of all values are
+    // at or below, to the histogram's precision; 0 when empty
+    uint64_t percentile(double percent) const {
+        if (!total)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(percent / 100.0 * static_cast<double>(total) + 0.5);
+        rank = std::max<uint64_t>(1, std::min(rank, total));
+        uint64_t seen = 0;
+        for (size_t i = 0; i < counts.size(); i++) {
+            seen += counts[i];
+            if (seen >= rank)
+                return std::min(valueAt(i), highest);
+        }
+        return highest;
+    }
+
+    uint64_t count() const { return total; }
+    uint64_t min() const { return total ? lowest : 0; }
+    uint64_t max() const { return highest; }
+    double mean() const { return total ? static_cast<double>(sum) / static_cast<double>(total) : 0; }
+};
@@ -0,0 +1,109 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include "Command.h"
+
+// Durations are counted in power-of-two buckets: bucket i holds those of
+// [2^(i-1), 2^i) ns, and the last one everything from about a second on
+constexpr size_t kLatencyBuckets = 32;
+
+// What a LatencyCounters held when it was read; mergeable across shards
+struct LatencySummary {
+    uint64_t calls = 0;
+    uint64_t totalNs = 0;
+    uint64_t buckets[kLatencyBuckets] = {};
+
+    void merge(const LatencySummary& other) {
+        calls += other.calls;
+        totalNs += other.totalNs;
+        for (size_t i = 0; i < kLatencyBuckets; i++)
+            buckets[i] += other.buckets[i];
+    }
+
+    // Exclusive upper bound of bucket `i`, in ns
+    static uint64_t bound(size_t i) { return uint64_t(1) << i; }
+
+    // Upper bound of the bucket that `percent` of the calls fall in, so
+    // within a factor of two; 0 when empty
+    uint64_t percentile(double percent) const {
+        if (!calls)
+            return 0;
+        uint64_t rank = static_cast<uint64_t>(percent / 100.0 * static_cast<double>(calls) + 0.5);
+        rank = rank ? rank : 1;
+        uint64_t seen = 0;
+        for (size_t i = 0; i < kLatencyBuckets; i++) {
+            seen += buckets[i];
+            if (seen >= rank)
+                return bound(i);
+        }
+        return bound(kLatencyBuckets - 1);
+    }
+
+    double meanNs() const {
+        return calls ? static_cast<double>(totalNs) / static_cast<double>(calls) : 0;
+    }
+};
+
+// Timings of one kind, recorded by a single thread (a shard worker) with
+// a relaxed load and store per counter, so recording takes no lock and
+// no read-modify-write. Any thread may read them.
+class LatencyCounters {
+private:
+    std::atomic<uint64_t> calls{0};
+    std::atomic<uint64_t> totalNs{0};
+    std::atomic<uint64_t> buckets[kLatencyBuckets];
+
+    static void add(std::atomic<uint64_t>& counter, uint64_t by) {
+        counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+    }
+
+    static size_t bucketOf(uint64_t ns) {
+        if (!ns)
+            return 0;
+#if defined(__GNUC__) || defined(__clang__)
+        size_t width = static_cast<size_t>(64 - __builtin_clzll(ns));
+#else
+        size_t width = 0;
+        while (ns >> width)
+            width++;
+#endif
+        return width < kLatencyBuckets ? width : kLatencyBuckets - 1;
+    }
+
+public:
+    LatencyCounters() {
+        for (auto& b : buckets)
+            b.store(0, std::memory_order_relaxed);
+    }
+
+    LatencyCounters(const LatencyCounters&) = delete;
+    LatencyCounters& operator=(const LatencyCounters&) = delete;
+
+    void record(uint64_t ns) {
+        add(calls, 1);
+        add(totalNs, ns);
+        add(buckets[bucketOf(ns)], 1);
+    }
+
+    LatencySummary summary() const {
+        LatencySummary s;
+        s.calls = calls.load(std::memory_order_relaxed);
+        s.totalNs = totalNs.load(std::memory_order_relaxed);
+        for (size_t i = 0; i < kLatencyBuckets; i++)
+            s.buckets[i] = buckets[i].load(std::memory_order_relaxed);
+        return s;
+    }
+};
+
+// Where the workers' time goes (RedisLiteConfig::latencyTracking)
+struct LatencyStats {
+    LatencySummary queueWait;               // from enqueue to execution
+    LatencySummary commands[kCommandTypes]; // execution, by CommandType
+
+    void merge(const LatencyStats& other) {
+        queueWait.merge(other.queueWait);
+        for (size_t i = 0; i < kCommandTypes; i++)
+            commands[i].merge(other.commands[i]);
+    }
+};
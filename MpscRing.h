@@ -0,0 +1,99 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <memory>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+inline void cpuRelax() {
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__)
+    _mm_pause();
+#elif defined(__aarch64__)
+    asm volatile("yield");
+#endif
+}
+
+// Bounded multi-producer / single-consumer ring of preallocated slots.
+// Each slot carries a sequence number (Vyukov style): producers claim a
+// position with one CAS on `tail` and publish it with a release store on
+// the slot, so an enqueue costs a couple of atomics and never takes a lock.
+template <typename T>
+class MpscRing {
+private:
+    struct Slot {
+        std::atomic<size_t> seq;
+        T value;
+    };
+
+    std::unique_ptr<Slot[]> slots;
+    size_t mask;
+
+    alignas(64) std::atomic<size_t> tail{0}; // shared by producers
+    alignas(64) size_t head = 0;             // consumer thread only
+
+    static size_t roundUp(size_t n) {
+        size_t cap = 2;
+        while (cap < n)
+            cap <<= 1;
+        return cap;
+    }
+
+public:
+    explicit MpscRing(size_t capacity)
+        : slots(new Slot[roundUp(capacity)]), mask(roundUp(capacity) - 1) {
+        for (size_t i = 0; i <= mask; i++)
+            slots[i].seq.store(i, std::memory_order_relaxed);
+    }
+
+    MpscRing(const MpscRing&) = delete;
+    MpscRing& operator=(const MpscRing&) = delete;
+
+    size_t capacity() const { return mask + 1; }
+
+    // Any thread. `value` is only moved from when the push succeeds;
+    // returns false if the ring is full.
+    bool tryPush(T&& value) {
+        size_t pos = tail.load(std::memory_order_relaxed);
+        while (true) {
+            Slot& slot = slots[pos & mask];
+            size_t seq = slot.seq.load(std::memory_order_acquire);
+            auto diff = static_cast<std::ptrdiff_t>(seq - pos);
+
+            if (diff == 0) {
+                if (tail.compare_exchange_weak(pos, pos + 1,
+                                               std::memory_order_relaxed)) {
+                    slot.value = std::move(value);
+                    slot.seq.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false; // full
+            } else {
+                pos = tail.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Consumer thread only.
+    bool tryPop(T& out) {
+        Slot& slot = slots[head & mask];
+        if (slot.seq.load(std::memory_order_acquire) != head + 1)
+            return false;
+
+        out = std::move(slot.value);
+        slot.seq.store(head + mask + 1, std::memory_order_release);
+        head++;
+        return true;
+    }
+
+    // Consumer thread only. Counts slots claimed by producers that are
+    // still being filled.
+    size_t size() const { return tail.load(std::memory_order_relaxed) - head; }
+
+    // Consumer thread only.
+    bool empty() const {
+        return slots[head & mask].seq.load(std::memory_order_acquire) != head + 1;
+    }
+};
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// Per-thread cache in front of RedisLite::get (RedisLiteConfig::
+// nearCacheEntries), in the spirit of Redis client-side caching. Each
+// shard keeps a version per bucket of key hashes and bumps it whenever a
+// key in the bucket is written, deleted or expires. An entry remembers
+// the version it read before fetching its value and is served only while
+// that version is unchanged; the worker never has to know who cached
+// what. Direct-mapped: a key has one slot and a newer key takes it over.
+class NearCache {
+private:
+    struct Entry {
+        std::string key;
+        std::string value;
+        uint64_t version = 0;
+        bool used = false;
+    };
+
+    std::vector<Entry> entries;
+
+    Entry& slotFor(size_t hash) { return entries[hash % entries.size()]; }
+
+public:
+    explicit NearCache(size_t capacity) : entries(capacity ? capacity : 1) {}
+
+    // `hash` is std::hash<std::string_view> of the key, as for
+    // Shard::version(); null unless cached at `version`
+    const std::string* find(std::string_view key, size_t hash, uint64_t version) {
+        Entry& e = slotFor(hash);
+        if (!e.used || e.version != version || e.key != key)
+            return nullptr;
+        return &e.value;
+    }
+
+    // `version` must have been read before `value` was fetched, so a
+    // write in between leaves the entry stale rather than wrong
+    void store(std::string_view key, size_t hash, std::string_view value, uint64_t version) {
+        Entry& e = slotFor(hash);
+        e.key.assign(key.data(), key.size());
+        e.value.assign(value.data(), value.size());
+        e.version = version;
+        e.used = true;
+    }
+
+    // Own writes: the worker may not have run them yet, and until it
+    // does their version bump is not there to go by
+    void invalidate(std::string_view key, size_t hash) {
+        Entry& e = slotFor(hash);
+        if (e.used && e.key == key)
+            e.used = false;
+    }
+};
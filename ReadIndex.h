@@ -0,0 +1,372 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <new>
+#include <string>
+#include <string_view>
+#include <vector>
+
+// What a lock-free read found. Queue means only the worker can answer:
+// the key holds a collection, or the reader got no epoch slot.
+enum class ReadResult { Found, Missing, Queue };
+
+// Epoch-based reclamation shared by every ReadIndex. A reader announces
+// the global epoch it started in; memory a worker unlinks is tagged with
+// the epoch current at unlink time and freed once every reader is either
+// outside or in a later epoch. Each reader thread leases one of a fixed
+// set of slots for as long as it lives.
+class ReadEpochs {
+private:
+    struct alignas(64) Slot {
+        std::atomic<bool> leased{false};
+        std::atomic<uint64_t> epoch{0}; // 0 = not reading
+    };
+
+    static constexpr size_t kSlots = 256;
+
+    Slot slots[kSlots];
+    std::atomic<uint64_t> global{1};
+
+    Slot* lease() {
+        struct Lease {
+            Slot* slot = nullptr;
+            ~Lease() {
+                if (slot)
+                    slot->leased.store(false, std::memory_order_release);
+            }
+        };
+        static thread_local Lease mine;
+        if (mine.slot)
+            return mine.slot;
+        size_t start = std::hash<const void*>{}(&mine) % kSlots;
+        for (size_t i = 0; i < kSlots; i++) {
+            Slot& s = slots[(start + i) % kSlots];
+            bool expected = false;
+            if (!s.leased.load(std::memory_order_relaxed) &&
+                s.leased.compare_exchange_strong(expected, true, std::memory_order_acquire))
+                return mine.slot = &s;
+        }
+        return nullptr;
+    }
+
+public:
+    // Never destroyed: reader threads may outlive static destruction
+    static ReadEpochs& instance() {
+        static ReadEpochs* epochs = new ReadEpochs();
+        return *epochs;
+    }
+
+    // Read-side critical section; false if every slot is leased
+    class Guard {
+    private:
+        Slot* slot;
+
+    public:
+        Guard() : slot(instance().lease()) {
+            if (!slot)
+                return;
+            slot->epoch.store(instance().global.load(), std::memory_order_release);
+            // Pairs with the fence in advance(): either the worker sees
+            // this slot busy, or this reader sees what it unlinked.
+            std::atomic_thread_fence(std::memory_order_seq_cst);
+        }
+        ~Guard() {
+            if (slot)
+                slot->epoch.store(0, std::memory_order_release);
+        }
+        Guard(const Guard&) = delete;
+        Guard& operator=(const Guard&) = delete;
+
+        explicit operator bool() const { return slot != nullptr; }
+    };
+
+    // Worker side, after unlinking: what it unlinked belongs to the
+    // returned epoch
+    uint64_t advance() {
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        return global.fetch_add(1);
+    }
+
+    // Memory retired in an epoch below this is no longer visible
+    uint64_t oldestActive() const {
+        uint64_t oldest = UINT64_MAX;
+        for (const Slot& s : slots) {
+            uint64_t e = s.epoch.load(std::memory_order_acquire);
+            if (e && e < oldest)
+                oldest = e;
+        }
+        return oldest;
+    }
+};
+
+// Mirror of one shard's keys that GETs read without going through the
+// queue (RedisLiteConfig::lockFreeReads), like an RCU-protected table.
+// The shard worker is the only writer and publishes every change before
+// it replies. Nodes are immutable once linked: a write links a new node
+// in place of the old one, which readers still inside it can keep
+// following, and the old one is freed through ReadEpochs. Growing builds
+// a copy of the table and publishes it in one store.
+class ReadIndex {
+private:
+    struct Node {
+        std::atomic<Node*> next{nullptr};
+        size_t hash;
+        int64_t deadline; // shard clock ms, 0 = no TTL
+        uint32_t keySize;
+        uint32_t valueSize;
+        bool string;
+
+        const char* data() const { return reinterpret_cast<const char*>(this + 1); }
+        std::string_view key() const { return std::string_view(data(), keySize); }
+        std::string_view value() const { return std::string_view(data() + keySize, valueSize); }
+        size_t bytes() const { return sizeof(Node) + keySize + valueSize; }
+    };
+
+    struct Table {
+        size_t mask;
+        std::unique_ptr<std::atomic<Node*>[]> buckets;
+
+        explicit Table(size_t size) : mask(size - 1), buckets(new std::atomic<Node*>[size]) {
+            for (size_t i = 0; i < size; i++)
+                buckets[i].store(nullptr, std::memory_order_relaxed);
+        }
+    };
+
+    // Unlinked during one worker pass, freed together
+    struct Retired {
+        uint64_t epoch;
+        std::vector<Node*> nodes;
+        std::vector<Table*> tables; // with every node still linked in them
+    };
+
+    static constexpr size_t kMinBuckets = 16;
+
+    std::atomic<Table*> table;
+
+    // Worker thread only
+    size_t count = 0;
+    size_t liveBytes = 0; // nodes linked in `table`
+    size_t retiredBytes = 0;
+    Retired pending{0, {}, {}};
+    std::vector<Retired> retired;
+
+    static size_t hashOf(std::string_view key) { return std::hash<std::string_view>{}(key); }
+
+    static Node* makeNode(size_t hash, std::string_view key, std::string_view value,
+                          int64_t deadline, bool string) {
+        void* mem = ::operator new(sizeof(Node) + key.size() + value.size());
+        Node* n = new (mem) Node();
+        n->hash = hash;
+        n->deadline = deadline;
+        n->keySize = static_cast<uint32_t>(key.size());
+        n->valueSize = static_cast<uint32_t>(value.size());
+        n->string = string;
+        char* data = reinterpret_cast<char*>(n + 1);
+        std::memcpy(data, key.data(), key.size());
+        if (!value.empty())
+            std::memcpy(data + key.size(), value.data(), value.size());
+        return n;
+    }
+
+    static void freeNode(Node* n) {
+        n->~Node();
+        ::operator delete(n);
+    }
+
+    static void freeTable(Table* t) {
+        for (size_t i = 0; i <= t->mask; i++) {
+            Node* n = t->buckets[i].load(std::memory_order_relaxed);
+            while (n) {
+                Node* next = n->next.load(std::memory_order_relaxed);
+                freeNode(n);
+                n = next;
+            }
+        }
+        delete t;
+    }
+
+    static size_t tableBytes(const Table* t) {
+        return sizeof(Table) + (t->mask + 1) * sizeof(std::atomic<Node*>);
+    }
+
+    // The link that points at `key`'s node, or the chain's null tail
+    std::atomic<Node*>* find(Table* t, size_t hash, std::string_view key) {
+        std::atomic<Node*>* link = &t->buckets[hash & t->mask];
+        Node* n;
+        while ((n = link->load(std::memory_order_relaxed)) &&
+               !(n->hash == hash && n->key() == key))
+            link = &n->next;
+        return link;
+    }
+
+    void retire(Node* n) {
+        size_t b = n->bytes();
+        liveBytes -= b;
+        retiredBytes += b;
+        pending.nodes.push_back(n);
+    }
+
+    // `t` holds the liveBytes worth of nodes
+    void retireTable(Table* t) {
+        retiredBytes += liveBytes + tableBytes(t);
+        pending.tables.push_back(t);
+    }
+
+    void grow() {
+        Table* old = table.load(std::memory_order_relaxed);
+        Table* t = new Table((old->mask + 1) * 2);
+        for (size_t i = 0; i <= old->mask; i++) {
+            for (Node* n = old->buckets[i].load(std::memory_order_relaxed); n;
+                 n = n->next.load(std::memory_order_relaxed)) {
+                Node* copy = makeNode(n->hash, n->key(), n->value(), n->deadline, n->string);
+                std::atomic<Node*>& head = t->buckets[n->hash & t->mask];
+                copy->next.store(head.load(std::memory_order_relaxed), std::memory_order_relaxed);
+                head.store(copy, std::memory_order_relaxed);
+            }
+        }
+        retireTable(old);
+        table.store(t, std::memory_order_release);
+    }
+
+    void link(std::string_view key, std::string_view value, int64_t deadline, bool string) {
+        size_t hash = hashOf(key);
+        Table* t = table.load(std::memory_order_relaxed);
+        std::atomic<Node*>* at = find(t, hash, key);
+        Node* old = at->load(std::memory_order_relaxed);
+        // A collection's marker only changes with its TTL
+        if (old && !string && !old->string && old->deadline == deadline)
+            return;
+        if (!old && count + 1 > t->mask + 1) {
+            grow();
+            t = table.load(std::memory_order_relaxed);
+            at = find(t, hash, key);
+        }
+        Node* n = makeNode(hash, key, value, deadline, string);
+        liveBytes += n->bytes();
+        if (old)
+            n->next.store(old->next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+        at->store(n, std::memory_order_release);
+        if (old)
+            retire(old);
+        else
+            count++;
+    }
+
+public:
+    ReadIndex() : table(new Table(kMinBuckets)) {}
+
+    // No reader may be inside any more
+    ~ReadIndex() {
+        for (Retired& r : retired) {
+            for (Node* n : r.nodes)
+                freeNode(n);
+            for (Table* t : r.tables)
+                freeTable(t);
+        }
+        for (Node* n : pending.nodes)
+            freeNode(n);
+        for (Table* t : pending.tables)
+            freeTable(t);
+        freeTable(table.load(std::memory_order_relaxed));
+    }
+
+    ReadIndex(const ReadIndex&) = delete;
+    ReadIndex& operator=(const ReadIndex&) = delete;
+
+    // Any thread. `now` is on the shard clock, for the TTL check; an
+    // expired key reads as missing before the worker removes it.
+    ReadResult get(std::string_view key, int64_t now, std::string& out) const {
+        ReadEpochs::Guard guard;
+        if (!guard)
+            return ReadResult::Queue;
+        size_t hash = hashOf(key);
+        const Table* t = table.load(std::memory_order_acquire);
+        for (const Node* n = t->buckets[hash & t->mask].load(std::memory_order_acquire); n;
+             n = n->next.load(std::memory_order_acquire)) {
+            if (n->hash != hash || n->key() != key)
+                continue;
+            if (n->deadline && now >= n->deadline)
+                return ReadResult::Missing;
+            if (!n->string)
+                return ReadResult::Queue;
+            std::string_view value = n->value();
+            out.assign(value.data(), value.size());
+            return ReadResult::Found;
+        }
+        return ReadResult::Missing;
+    }
+
+    // Worker thread only from here on
+    void put(std::string_view key, std::string_view value, int64_t deadline) {
+        link(key, value, deadline, true);
+    }
+
+    // A key whose value is not a string
+    void putOther(std::string_view key, int64_t deadline) {
+        link(key, std::string_view(), deadline, false);
+    }
+
+    void erase(std::string_view key) {
+        Table* t = table.load(std::memory_order_relaxed);
+        std::atomic<Node*>* at = find(t, hashOf(key), key);
+        Node* old = at->load(std::memory_order_relaxed);
+        if (!old)
+            return;
+        at->store(old->next.load(std::memory_order_relaxed), std::memory_order_release);
+        retire(old);
+        count--;
+    }
+
+    void clear() {
+        retireTable(table.load(std::memory_order_relaxed));
+        liveBytes = 0;
+        count = 0;
+        table.store(new Table(kMinBuckets), std::memory_order_release);
+    }
+
+    // Once per worker pass: tags what the pass unlinked with an epoch and
+    // frees whatever no reader can still be looking at
+    void reclaim() {
+        if (!pending.nodes.empty() || !pending.tables.empty()) {
+            pending.epoch = ReadEpochs::instance().advance();
+            retired.push_back(std::move(pending));
+            pending = Retired{0, {}, {}};
+        }
+        if (retired.empty())
+            return;
+        uint64_t oldest = ReadEpochs::instance().oldestActive();
+        size_t kept = 0;
+        for (Retired& r : retired) {
+            if (r.epoch >= oldest) {
+                if (&retired[kept] != &r)
+                    retired[kept] = std::move(r);
+                kept++;
+                continue;
+            }
+            for (Node* n : r.nodes) {
+                retiredBytes -= n->bytes();
+                freeNode(n);
+            }
+            for (Table* t : r.tables) {
+                for (size_t i = 0; i <= t->mask; i++) {
+                    for (Node* n = t->buckets[i].load(std::memory_order_relaxed); n;
+                         n = n->next.load(std::memory_order_relaxed))
+                        retiredBytes -= n->bytes();
+                }
+                retiredBytes -= tableBytes(t);
+                freeTable(t);
+            }
+        }
+        retired.resize(kept);
+    }
+
+    // Nodes, buckets, and what is waiting to be freed
+    size_t bytes() const {
+        return liveBytes + tableBytes(table.load(std::memory_order_relaxed)) + retiredBytes;
+    }
+    size_t size() const { return count; }
+};
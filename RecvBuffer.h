@@ -0,0 +1,66 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdlib>
+#include <new>
+#include <utility>
+
+// Refcounted block of bytes read off a socket. Commands parsed out of it
+// carry string_views into the block plus a Ref, so a request reaches the
+// shard worker without copying its key or value; the bytes are copied once,
+// into the store. Bytes are only ever appended, so a region handed to a
+// command is never written again.
+class RecvBuffer {
+private:
+    std::atomic<size_t> refs{1};
+    size_t cap;
+
+    explicit RecvBuffer(size_t capacity) : cap(capacity) {}
+
+    char* bytes() { return reinterpret_cast<char*>(this + 1); }
+
+    static void release(RecvBuffer* b) {
+        if (b && b->refs.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+            b->~RecvBuffer();
+            std::free(b);
+        }
+    }
+
+public:
+    class Ref {
+    private:
+        RecvBuffer* buf = nullptr;
+
+    public:
+        Ref() = default;
+        explicit Ref(RecvBuffer* b) : buf(b) {}
+        Ref(const Ref& other) : buf(other.buf) {
+            if (buf)
+                buf->refs.fetch_add(1, std::memory_order_relaxed);
+        }
+        Ref(Ref&& other) noexcept : buf(std::exchange(other.buf, nullptr)) {}
+        Ref& operator=(Ref other) noexcept {
+            std::swap(buf, other.buf);
+            return *this;
+        }
+        ~Ref() { release(buf); }
+
+        RecvBuffer* get() const { return buf; }
+        RecvBuffer* operator->() const { return buf; }
+        explicit operator bool() const { return buf != nullptr; }
+    };
+
+    static Ref create(size_t capacity) {
+        void* mem = std::malloc(sizeof(RecvBuffer) + capacity);
+        if (!mem)
+            throw std::bad_alloc();
+        return Ref(new (mem) RecvBuffer(capacity));
+    }
+
+    char* data() { return bytes(); }
+    size_t capacity() const { return cap; }
+
+    // True if no command holds a view into this block any more. The
+    // acquire pairs with the workers' releasing decrements.
+    bool unique() const { return refs.load(std::memory_order_acquire) == 1; }
+};
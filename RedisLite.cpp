@@ -1,133 +1,1206 @@
 #include "RedisLite.h"
+#include "Compression.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cctype>
+#include <stdexcept>
+#include <unistd.h>
+#include <functional>
+#include <iterator>
+#include <unordered_map>
 
-RedisLite::RedisLite() {
-    worker = std::thread(&RedisLite::workerLoop, this);
+namespace {
+// Replayed ops per BATCH command
+constexpr size_t kReplayBatchSize = 1024;
+
+std::atomic<uint64_t> nextInstanceId{1};
+
+// Shortest span instantaneous_ops_per_sec is measured over
+constexpr auto kRateInterval = std::chrono::milliseconds(100);
+// Smallest histogram bucket bound metricsText() exposes (2^10 ns, about
+// 1 us); faster calls all count towards it
+constexpr size_t kFirstExposedBucket = 10;
+
+int64_t unixNowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+}
+
+std::string commandName(CommandType type) {
+    switch (type) {
+    case CommandType::SET:
+        return "set";
+    case CommandType::GET:
+        return "get";
+    case CommandType::DEL:
+        return "del";
+    case CommandType::SET_TTL:
+        return "setex";
+    case CommandType::BATCH:
+        return "batch";
+    case CommandType::AOF_REWRITE:
+        return "aof_rewrite";
+    case CommandType::SNAPSHOT:
+        return "snapshot";
+    case CommandType::SNAPSHOT_LOAD:
+        return "snapshot_load";
+    case CommandType::SYNC_MARK:
+        return "sync_mark";
+    case CommandType::SLOT_KEYS:
+        return "slot_keys";
+    case CommandType::SCAN:
+        return "scan";
+    case CommandType::SCAN_PREFIX:
+        return "scanprefix";
+    case CommandType::DUMP:
+        return "dump";
+    case CommandType::DEL_IF_VALUE:
+        return "del_if_value";
+    case CommandType::RESTORE:
+        return "restore";
+    case CommandType::TYPE:
+        return "type";
+    case CommandType::OBJECT_ENCODING:
+        return "object_encoding";
+    case CommandType::INCRBY:
+        return "incrby";
+    case CommandType::APPEND:
+        return "append";
+    case CommandType::GETSET:
+        return "getset";
+    case CommandType::CAS:
+        return "cas";
+    case CommandType::GETRANGE:
+        return "getrange";
+    default:
+        break;
+    }
+    const CollectionCommand* command = collectionCommand(type);
+    std::string name = command ? command->name : "unknown";
+    for (char& c : name)
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return name;
 }
 
+namespace {
+const char* policyName(EvictionPolicy policy) {
+    switch (policy) {
+    case EvictionPolicy::AllKeysLru:
+        return "allkeys-lru";
+    case EvictionPolicy::AllKeysLfu:
+        return "allkeys-lfu";
+    case EvictionPolicy::VolatileTtl:
+        return "volatile-ttl";
+    case EvictionPolicy::NoEviction:
+        break;
+    }
+    return "noeviction";
+}
+
+// As Redis's used_memory_human: 1.50K, 2.25M, ...
+std::string humanBytes(uint64_t bytes) {
+    const char* units = "BKMGTP";
+    double value = static_cast<double>(bytes);
+    size_t unit = 0;
+    while (value >= 1024 && unit < 5) {
+        value /= 1024;
+        unit++;
+    }
+    char buf[32];
+    if (unit == 0)
+        std::snprintf(buf, sizeof(buf), "%lluB", static_cast<unsigned long long>(bytes));
+    else
+        std::snprintf(buf, sizeof(buf), "%.2f%c", value, units[unit]);
+    return buf;
+}
+
+std::string micros(double ns) {
+    char buf[32];
+    std::snprintf(buf, sizeof(buf), "%.3f", ns / 1000.0);
+    return buf;
+}
+
+// A logged record as the op that reproduces it; an expiry already in the
+// past becomes a DEL
+BatchOp opFor(const AppendOnlyFile::Record& rec, int64_t unixNow) {
+    BatchOp op;
+    op.key.assign(rec.key.data(), rec.key.size());
+    if (rec.del || (rec.expireAtMs && rec.expireAtMs <= unixNow)) {
+        op.type = CommandType::DEL;
+    } else if (rec.type != CommandType::SET) {
+        op.type = rec.type;
+        op.value.assign(rec.value.data(), rec.value.size());
+        op.fields.assign(rec.args.begin(), rec.args.end());
+        if (rec.expireAtMs)
+            op.ttlSeconds = static_cast<int>((rec.expireAtMs - unixNow + 999) / 1000);
+    } else if (rec.expireAtMs) {
+        op.type = CommandType::SET_TTL;
+        op.value.assign(rec.value.data(), rec.value.size());
+        // Whole seconds, rounded up as SET PX does
+        op.ttlSeconds = static_cast<int>((rec.expireAtMs - unixNow + 999) / 1000);
+    } else {
+        op.type = CommandType::SET;
+        op.value.assign(rec.value.data(), rec.value.size());
+    }
+    return op;
+}
+}
+
+RedisLite::RedisLite(const RedisLiteConfig& config)
+    : snapshotPath(config.snapshotPath), sharedValueMin(config.sharedValueMin),
+      compressMin(config.compressMin), keyIndex(config.keyIndex),
+      nearCacheEntries(config.nearCacheEntries),
+      instanceId(nextInstanceId.fetch_add(1, std::memory_order_relaxed)),
+      maxMemory(config.maxMemory), evictionPolicy(config.evictionPolicy),
+      startTime(std::chrono::steady_clock::now()), rateAt(startTime) {
+    size_t n = config.shards ? config.shards : 1;
+    // Without a lane there is nothing to keep, and Shed is just Reject
+    if (config.queueOverflow == QueueOverflow::Shed && !config.priorityQueueCapacity)
+        throw std::invalid_argument("queueOverflow Shed needs a priorityQueueCapacity");
+    if (config.slowlogSlowerThanUs >= 0)
+        slowLog = std::make_unique<SlowLog>(static_cast<uint64_t>(config.slowlogSlowerThanUs),
+                                            config.slowlogMaxLen);
+    if (config.latencyMonitorThresholdUs)
+        latencyMonitor = std::make_unique<LatencyMonitor>(config.latencyMonitorThresholdUs);
+    if (!config.aofPath.empty())
+        aof = std::make_unique<AppendOnlyFile>(config, n, [this]() { startAofScans(); });
+    if (config.replBacklogSize)
+        backlog = std::make_unique<ReplicationBacklog>(config.replBacklogSize);
+
+    shards.reserve(n);
+    for (size_t i = 0; i < n; i++)
+        shards.push_back(std::make_unique<Shard>(config, i, aof.get(), backlog.get(),
+                                                 slowLog.get(), latencyMonitor.get()));
+
+    // The AOF, when enabled, is the complete history and wins
+    if (aof)
+        replayAof();
+    else if (!snapshotPath.empty() && access(snapshotPath.c_str(), F_OK) == 0)
+        loadSnapshot(snapshotPath, false);
+}
+
+// Each shard drains its queue, flushes its last AOF records and finishes
+// a running snapshot, then joins its worker; the writers go last
 RedisLite::~RedisLite() {
-    {
-        std::lock_guard<std::mutex> lock(queueMutex);
-        stop = true;
+    if (aof)
+        aof->stopRewrites();
+    shards.clear();
+    snapshotWriter.reset();
+}
+
+// Feeds the existing log through the shard queues in batches. Commands
+// are marked fromAof so they are not logged a second time.
+void RedisLite::replayAof() {
+    std::vector<std::vector<BatchOp>> perShard(shards.size());
+    auto flush = [&](size_t s) {
+        Command cmd;
+        cmd.type = CommandType::BATCH;
+        cmd.ops = std::move(perShard[s]);
+        cmd.fromAof = true;
+        shards[s]->enqueue(std::move(cmd));
+        perShard[s].clear();
+    };
+
+    int64_t unixNow = unixNowMs();
+    aof->replay([&](const AppendOnlyFile::Record& rec) {
+        BatchOp op = opFor(rec, unixNow);
+        size_t s = shardIndex(op.key);
+        perShard[s].push_back(std::move(op));
+        if (perShard[s].size() >= kReplayBatchSize)
+            flush(s);
+    });
+
+    for (size_t s = 0; s < shards.size(); s++) {
+        if (!perShard[s].empty())
+            flush(s);
     }
-    cv.notify_one();
-    worker.join();
 }
 
-void RedisLite::workerLoop() {
-    while (true) {
+// Every shard reads its part of the mapped file in parallel; waits for
+// all of them and throws if any found a damaged block
+void RedisLite::loadSnapshot(const std::string& path, bool replace) {
+    SnapshotReader reader(path);
+    SnapshotLoad load;
+    load.reader = &reader;
+    load.replace = replace;
+    load.pending.store(shards.size(), std::memory_order_relaxed);
+    load.done = &CompletionSlot::forThisThread();
+    load.done->arm();
+
+    for (auto& shard : shards) {
         Command cmd;
+        cmd.type = CommandType::SNAPSHOT_LOAD;
+        cmd.snapshotLoad = &load;
+        shard->enqueue(std::move(cmd));
+    }
+    load.done->wait();
+    if (load.failed.load(std::memory_order_relaxed))
+        throw std::runtime_error("corrupt snapshot: " + path);
+}
 
-        {
-            std::unique_lock<std::mutex> lock(queueMutex);
-            cv.wait(lock, [&]() {
-                return stop || !commandQueue.empty();
-            });
+// Folds a finished writer into the counters (snapshotMutex held)
+void RedisLite::reapSnapshot() {
+    if (!snapshotWriter || !snapshotWriter->done())
+        return;
+    if (snapshotWriter->wait()) {
+        snapshotCounters.saves++;
+        snapshotCounters.lastSaveRecords = snapshotWriter->recordCount();
+        snapshotCounters.lastSaveBytes = snapshotWriter->byteCount();
+    } else {
+        snapshotCounters.failedSaves++;
+    }
+    snapshotWriter.reset();
+}
+
+// snapshotMutex held
+bool RedisLite::startSnapshot(const std::string& path) {
+    reapSnapshot();
+    if (path.empty() || snapshotWriter)
+        return false;
+    try {
+        snapshotWriter = std::make_unique<SnapshotWriter>(path, shards.size());
+    } catch (const std::runtime_error&) {
+        snapshotCounters.failedSaves++;
+        return false;
+    }
+    for (auto& shard : shards) {
+        Command cmd;
+        cmd.type = CommandType::SNAPSHOT;
+        cmd.snapshotWriter = snapshotWriter.get();
+        shard->enqueue(std::move(cmd));
+    }
+    return true;
+}
 
-            if (stop && commandQueue.empty())
-                break;
+bool RedisLite::bgsave() {
+    std::lock_guard<std::mutex> lock(snapshotMutex);
+    return startSnapshot(snapshotPath);
+}
 
-            cmd = std::move(commandQueue.front());
-            commandQueue.pop();
-        }
+bool RedisLite::save() {
+    std::lock_guard<std::mutex> lock(snapshotMutex);
+    if (!startSnapshot(snapshotPath))
+        return false;
+    bool ok = snapshotWriter->wait();
+    reapSnapshot();
+    return ok;
+}
 
-        auto now = std::chrono::steady_clock::now();
+// The offset is taken before any shard starts its part, so a write a
+// shard runs in between is both in the snapshot and after the offset, and
+// the replica applies it twice. SET / DEL with absolute expiry tolerate
+// that, but LPUSH or HINCRBY would not: so first every shard flushes what
+// it has logged so far and logs each write as the key's resulting value
+// (SET / RESTORE / DEL) until its snapshot starts.
+bool RedisLite::saveForSync(const std::string& path, uint64_t& offset) {
+    if (!backlog)
+        return false;
+    std::lock_guard<std::mutex> lock(snapshotMutex);
+    if (snapshotWriter) {
+        snapshotWriter->wait(); // a BGSAVE in progress finishes first
+        reapSnapshot();
+    }
+    CompletionSlot& marked = CompletionSlot::forThisThread();
+    for (auto& shard : shards) {
+        Command cmd;
+        cmd.type = CommandType::SYNC_MARK;
+        marked.arm();
+        cmd.completion = &marked;
+        shard->enqueue(std::move(cmd));
+        marked.wait();
+    }
+    offset = backlog->activate();
+    if (!startSnapshot(path))
+        return false;
+    bool ok = snapshotWriter->wait();
+    reapSnapshot();
+    return ok;
+}
 
-        switch (cmd.type) {
+ReplicationBacklog* RedisLite::replicationBacklog() {
+    return backlog.get();
+}
 
-        case CommandType::SET: {
-            ValueEntry entry;
-            entry.value = cmd.value;
-            entry.hasTTL = false;
-            store[cmd.key] = entry;
-            break;
-        }
+// Not waited for: the shard queues keep the primary's per-key order
+void RedisLite::applyReplicated(const std::vector<AppendOnlyFile::Record>& records) {
+    int64_t unixNow = unixNowMs();
+    std::vector<std::vector<BatchOp>> perShard(shards.size());
+    for (const auto& rec : records) {
+        BatchOp op = opFor(rec, unixNow);
+        perShard[shardIndex(op.key)].push_back(std::move(op));
+    }
+    for (size_t s = 0; s < shards.size(); s++) {
+        if (perShard[s].empty())
+            continue;
+        Command cmd;
+        cmd.type = CommandType::BATCH;
+        cmd.ops = std::move(perShard[s]);
+        shards[s]->enqueue(std::move(cmd));
+    }
+}
 
-        case CommandType::SET_TTL: {
-            ValueEntry entry;
-            entry.value = cmd.value;
-            entry.hasTTL = true;
-            entry.expireAt = now + std::chrono::seconds(cmd.ttlSeconds);
-            store[cmd.key] = entry;
-            break;
-        }
+void RedisLite::loadReplicaSnapshot(const std::string& path) {
+    loadSnapshot(path, true);
+}
 
-        case CommandType::GET: {
-            if (!store.count(cmd.key)) {
-                cmd.result.set_value("");
-                break;
-            }
+SnapshotStats RedisLite::snapshotStats() {
+    std::lock_guard<std::mutex> lock(snapshotMutex);
+    reapSnapshot();
+    SnapshotStats s = snapshotCounters;
+    s.inProgress = snapshotWriter != nullptr;
+    return s;
+}
 
-            auto &entry = store[cmd.key];
+void RedisLite::startAofScans() {
+    for (auto& shard : shards) {
+        Command cmd;
+        cmd.type = CommandType::AOF_REWRITE;
+        shard->enqueue(std::move(cmd));
+    }
+}
 
-            if (entry.hasTTL && now >= entry.expireAt) {
-                store.erase(cmd.key); // expire
-                cmd.result.set_value("");
-            } else {
-                cmd.result.set_value(entry.value);
-            }
-            break;
-        }
+bool RedisLite::rewriteAof() {
+    if (!aof || !aof->tryBeginRewrite())
+        return false;
+    startAofScans();
+    return true;
+}
 
-        case CommandType::DEL:
-            store.erase(cmd.key);
-            break;
-        }
+AofStats RedisLite::aofStats() const {
+    return aof ? aof->stats() : AofStats();
+}
+
+size_t RedisLite::shardIndex(std::string_view key) const {
+    return shardOfKey(key, shards.size());
+}
+
+Shard& RedisLite::shardFor(std::string_view key) {
+    return *shards[shardIndex(key)];
+}
+
+// Splits ops by shard (keeping their relative order) and enqueues one
+// BATCH per shard touched. `statuses`, if given, receives what each op
+// returned. Throws QueueFullError if a shard refused its part, once the
+// others have run theirs.
+std::vector<std::string> RedisLite::submitBatch(std::vector<BatchOp>&& ops,
+                                                bool waitForResults,
+                                                std::vector<int64_t>* statuses) {
+    if (ops.empty())
+        return {};
+
+    size_t total = ops.size();
+    std::vector<std::vector<BatchOp>> perShard(shards.size());
+    for (size_t i = 0; i < total; i++) {
+        if (ops[i].type != CommandType::GET && ops[i].type != CommandType::DUMP)
+            forget(ops[i].key);
+        ops[i].slot = i;
+        size_t s = shardIndex(ops[i].key);
+        perShard[s].push_back(std::move(ops[i]));
+    }
+
+    BatchResult result;
+    if (waitForResults) {
+        result.values.resize(total);
+        if (statuses)
+            result.statuses.resize(total);
+        size_t touched = 0;
+        for (const auto& part : perShard)
+            touched += !part.empty();
+        result.pending.store(touched, std::memory_order_relaxed);
+        result.done = &CompletionSlot::forThisThread();
+        result.done->arm();
+    }
+
+    bool refused = false;
+    for (size_t s = 0; s < perShard.size(); s++) {
+        if (perShard[s].empty())
+            continue;
+        Command cmd;
+        cmd.type = CommandType::BATCH;
+        cmd.ops = std::move(perShard[s]);
+        cmd.batch = waitForResults ? &result : nullptr;
+        if (shards[s]->offer(cmd))
+            continue;
+        refused = true;
+        if (waitForResults && result.pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            result.done->complete();
     }
+
+    if (waitForResults)
+        result.done->wait();
+    if (refused)
+        throw QueueFullError();
+    if (!waitForResults)
+        return {};
+
+    if (statuses)
+        *statuses = std::move(result.statuses);
+    return std::move(result.values);
+}
+
+// One op through the batch path, which carries a status back
+int64_t RedisLite::runOne(BatchOp&& op, std::string* value) {
+    std::vector<BatchOp> ops;
+    ops.push_back(std::move(op));
+    std::vector<int64_t> statuses;
+    std::vector<std::string> values = submitBatch(std::move(ops), true, &statuses);
+    if (value)
+        *value = std::move(values[0]);
+    return statuses[0];
 }
 
-void RedisLite::set(const std::string& key, const std::string& value) {
+bool RedisLite::incrBy(std::string key, int64_t delta, int64_t* result) {
+    BatchOp op;
+    op.type = CommandType::INCRBY;
+    op.key = std::move(key);
+    op.value = std::to_string(delta);
+    std::string value;
+    if (runOne(std::move(op), &value) != 1)
+        return false;
+    if (result)
+        *result = std::stoll(value);
+    return true;
+}
+
+bool RedisLite::decrBy(std::string key, int64_t delta, int64_t* result) {
+    if (delta == INT64_MIN)
+        return false; // its negation does not fit
+    return incrBy(std::move(key), -delta, result);
+}
+
+size_t RedisLite::append(std::string key, std::string suffix) {
+    BatchOp op;
+    op.type = CommandType::APPEND;
+    op.key = std::move(key);
+    op.value = std::move(suffix);
+    std::string length;
+    if (runOne(std::move(op), &length) != 1)
+        return 0;
+    return static_cast<size_t>(std::stoull(length));
+}
+
+std::string RedisLite::getSet(std::string key, std::string value) {
+    BatchOp op;
+    op.type = CommandType::GETSET;
+    op.key = std::move(key);
+    op.value = std::move(value);
+    std::string old;
+    return runOne(std::move(op), &old) == 1 ? old : std::string();
+}
+
+bool RedisLite::compareAndSet(std::string key, std::string expected, std::string desired) {
+    BatchOp op;
+    op.type = CommandType::CAS;
+    op.key = std::move(key);
+    op.value = std::move(expected);
+    op.fields.push_back(std::move(desired));
+    return runOne(std::move(op), nullptr) == 1;
+}
+
+std::vector<std::string> RedisLite::dumpKeys(const std::vector<std::string>& keys) {
+    std::vector<BatchOp> ops(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        ops[i].type = CommandType::DUMP;
+        ops[i].key = keys[i];
+    }
+    return submitBatch(std::move(ops), true);
+}
+
+std::vector<int64_t> RedisLite::deleteIfValue(
+    std::vector<std::pair<std::string, std::string>> pairs) {
+    std::vector<BatchOp> ops(pairs.size());
+    for (size_t i = 0; i < pairs.size(); i++) {
+        ops[i].type = CommandType::DEL_IF_VALUE;
+        ops[i].key = std::move(pairs[i].first);
+        ops[i].value = std::move(pairs[i].second);
+    }
+    std::vector<int64_t> statuses;
+    submitBatch(std::move(ops), true, &statuses);
+    return statuses;
+}
+
+// This thread's near cache for this instance, made on first use. A
+// thread keeps the caches of instances it used until it exits.
+NearCache* RedisLite::nearCache() {
+    if (!nearCacheEntries)
+        return nullptr;
+    thread_local std::unordered_map<uint64_t, std::unique_ptr<NearCache>> caches;
+    thread_local uint64_t lastId = 0;
+    thread_local NearCache* last = nullptr;
+    if (lastId != instanceId) {
+        std::unique_ptr<NearCache>& cache = caches[instanceId];
+        if (!cache)
+            cache = std::make_unique<NearCache>(nearCacheEntries);
+        lastId = instanceId;
+        last = cache.get();
+    }
+    return last;
+}
+
+void RedisLite::forget(std::string_view key) {
+    if (NearCache* cache = nearCache())
+        cache->invalidate(key, std::hash<std::string_view>{}(key));
+}
+
+void RedisLite::set(std::string key, std::string value) {
+    forget(key);
+    Shard& shard = shardFor(key);
     Command cmd;
     cmd.type = CommandType::SET;
-    cmd.key = key;
-    cmd.value = value;
+    cmd.key = std::move(key);
+    cmd.value = std::move(value);
+    prepareValue(cmd);
 
-    {
-        std::lock_guard<std::mutex> lock(queueMutex);
-        commandQueue.push(std::move(cmd));
-    }
-    cv.notify_one();
+    if (!shard.offer(cmd))
+        throw QueueFullError();
 }
 
-void RedisLite::setWithTTL(const std::string& key,
-                           const std::string& value,
-                           int ttlSeconds) {
+void RedisLite::setWithTTL(std::string key, std::string value, int ttlSeconds) {
+    forget(key);
+    Shard& shard = shardFor(key);
     Command cmd;
     cmd.type = CommandType::SET_TTL;
-    cmd.key = key;
-    cmd.value = value;
+    cmd.key = std::move(key);
+    cmd.value = std::move(value);
+    prepareValue(cmd);
     cmd.ttlSeconds = ttlSeconds;
 
-    {
-        std::lock_guard<std::mutex> lock(queueMutex);
-        commandQueue.push(std::move(cmd));
+    if (!shard.offer(cmd))
+        throw QueueFullError();
+}
+
+std::string RedisLite::get(std::string key) {
+    return fetch(std::move(key), false);
+}
+
+std::string RedisLite::getPriority(std::string key) {
+    return fetch(std::move(key), true);
+}
+
+// Near cache, then the read index, then the queue
+std::string RedisLite::fetch(std::string key, bool priority) {
+    Shard& shard = shardFor(key);
+    NearCache* cache = nearCache();
+    size_t hash = 0;
+    uint64_t version = 0;
+    if (cache) {
+        hash = std::hash<std::string_view>{}(key);
+        version = shard.version(hash);
+        if (const std::string* cached = cache->find(key, hash, version))
+            return *cached;
     }
-    cv.notify_one();
+
+    std::string value;
+    if (shard.read(key, value) != ReadResult::Queue) {
+        if (cache)
+            cache->store(key, hash, value, version);
+        return value;
+    }
+
+    Command cmd;
+    cmd.type = CommandType::GET;
+    cmd.priority = priority;
+    if (cache)
+        cmd.key = key;
+    else
+        cmd.key = std::move(key);
+
+    CompletionSlot& slot = CompletionSlot::forThisThread();
+    slot.arm();
+    cmd.completion = &slot;
+
+    if (!shard.offer(cmd))
+        throw QueueFullError();
+
+    slot.wait();
+    if (slot.compressed) {
+        std::string_view stored = slot.shared ? slot.shared.view() : std::string_view(slot.value);
+        std::string original;
+        decompressValue(stored, original);
+        slot.value = std::move(original);
+        slot.shared = ValueRef();
+    } else if (slot.shared) {
+        slot.value.assign(slot.shared.data(), slot.shared.size());
+        slot.shared = ValueRef();
+    }
+    if (cache)
+        cache->store(key, hash, slot.value, version);
+    return slot.value;
 }
 
-std::string RedisLite::get(const std::string& key) {
+// Always queued: the read index and near caches hold copies
+ValueRef RedisLite::getShared(std::string key) {
+    Shard& shard = shardFor(key);
     Command cmd;
     cmd.type = CommandType::GET;
-    cmd.key = key;
+    cmd.key = std::move(key);
 
-    auto future = cmd.result.get_future();
+    CompletionSlot& slot = CompletionSlot::forThisThread();
+    slot.arm();
+    cmd.completion = &slot;
 
-    {
-        std::lock_guard<std::mutex> lock(queueMutex);
-        commandQueue.push(std::move(cmd));
+    if (!shard.offer(cmd))
+        throw QueueFullError();
+
+    slot.wait();
+    if (slot.compressed) {
+        std::string original;
+        decompressValue(slot.shared ? slot.shared.view() : std::string_view(slot.value),
+                        original);
+        slot.shared = ValueRef();
+        slot.value.clear();
+        return ValueRef::adopt(std::move(original));
     }
-    cv.notify_one();
+    if (slot.shared)
+        return std::move(slot.shared);
+    if (slot.value.empty())
+        return ValueRef();
+    return ValueRef::adopt(std::move(slot.value));
+}
 
-    return future.get();
+std::string RedisLite::getRange(std::string key, int64_t start, int64_t end) {
+    BatchOp op;
+    op.type = CommandType::GETRANGE;
+    op.key = std::move(key);
+    op.fields = {std::to_string(start), std::to_string(end)};
+    std::string value;
+    runOne(std::move(op), &value);
+    return value;
 }
 
-void RedisLite::del(const std::string& key) {
+bool RedisLite::stream(std::string key, size_t chunkSize,
+                       const std::function<bool(std::string_view)>& chunk) {
+    ValueRef value = getShared(std::move(key));
+    if (!value)
+        return false;
+    chunkSize = chunkSize ? chunkSize : 1;
+    for (size_t offset = 0; offset < value.size(); offset += chunkSize) {
+        if (!chunk(value.slice(offset, chunkSize)))
+            break;
+    }
+    return true;
+}
+
+ReadResult RedisLite::readLockFree(std::string_view key, std::string& value) {
+    return shardFor(key).read(key, value);
+}
+
+void RedisLite::getAsync(std::string key, GetCallback callback,
+                         CompletionQueue* completions) {
+    Shard& shard = shardFor(key);
+    Command cmd;
+    cmd.type = CommandType::GET;
+    cmd.key = std::move(key);
+    cmd.callback = std::move(callback);
+    cmd.completions = completions;
+
+    if (!shard.offer(cmd))
+        throw QueueFullError();
+}
+
+#ifdef REDISLITE_HAS_COROUTINES
+GetAwaitable RedisLite::getAsync(std::string key, CompletionQueue* completions) {
+    return GetAwaitable(*this, std::move(key), completions);
+}
+
+void GetAwaitable::await_suspend(std::coroutine_handle<> handle) {
+    // The frame (and so this awaitable) stays alive until the resume
+    redis.getAsync(key, [this, handle](std::string result) {
+        value = std::move(result);
+        handle.resume();
+    }, completions);
+}
+#endif
+
+void RedisLite::del(std::string key) {
+    forget(key);
+    Shard& shard = shardFor(key);
     Command cmd;
     cmd.type = CommandType::DEL;
-    cmd.key = key;
+    cmd.key = std::move(key);
+
+    if (!shard.offer(cmd))
+        throw QueueFullError();
+}
 
-    {
-        std::lock_guard<std::mutex> lock(queueMutex);
-        commandQueue.push(std::move(cmd));
+void RedisLite::mset(std::vector<std::pair<std::string, std::string>> pairs) {
+    std::vector<BatchOp> ops(pairs.size());
+    for (size_t i = 0; i < pairs.size(); i++) {
+        ops[i].type = CommandType::SET;
+        ops[i].key = std::move(pairs[i].first);
+        ops[i].value = std::move(pairs[i].second);
     }
-    cv.notify_one();
+    submitBatch(std::move(ops), false);
+}
+
+std::vector<std::string> RedisLite::mget(const std::vector<std::string>& keys) {
+    std::vector<BatchOp> ops(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+        ops[i].type = CommandType::GET;
+        ops[i].key = keys[i];
+    }
+    return submitBatch(std::move(ops), true);
+}
+
+uint64_t RedisLite::scan(uint64_t cursor, std::vector<std::string>& keys,
+                         std::string_view pattern, size_t count) {
+    ScanJob job;
+    job.cursor = cursor;
+    job.pattern = pattern;
+    job.count = count ? count : 1;
+    job.done = &CompletionSlot::forThisThread();
+    job.done->arm();
+    Command cmd;
+    cmd.type = CommandType::SCAN;
+    cmd.scan = &job;
+    if (!dispatch(std::move(cmd)))
+        throw QueueFullError();
+    job.done->wait();
+    keys.insert(keys.end(), std::make_move_iterator(job.keys.begin()),
+                std::make_move_iterator(job.keys.end()));
+    return job.next;
+}
+
+std::string RedisLite::scanPrefix(std::string_view prefix, std::string_view after,
+                                  std::vector<std::string>& keys, size_t count) {
+    ScanJob job;
+    job.prefix = prefix;
+    job.after = after;
+    job.count = count ? count : 1;
+    job.done = &CompletionSlot::forThisThread();
+    job.done->arm();
+    Command cmd;
+    cmd.type = CommandType::SCAN_PREFIX;
+    cmd.scan = &job;
+    dispatch(std::move(cmd));
+    job.done->wait();
+    keys.insert(keys.end(), std::make_move_iterator(job.keys.begin()),
+                std::make_move_iterator(job.keys.end()));
+    return std::move(job.nextAfter);
+}
+
+bool RedisLite::hasKeyIndex() const {
+    return keyIndex;
+}
+
+Pipeline RedisLite::pipeline() {
+    return Pipeline(*this);
+}
+
+bool RedisLite::dispatch(Command&& cmd) {
+    if (cmd.type == CommandType::SLOT_KEYS) {
+        shards[shardOfSlot(cmd.hashSlot, shards.size())]->enqueue(std::move(cmd));
+        return true;
+    }
+    if (cmd.type == CommandType::SCAN)
+        return shards[cmd.scan->cursor % shards.size()]->offer(cmd);
+    if (cmd.type == CommandType::SCAN_PREFIX) {
+        // Each shard fills in its part; the last one to finish merges
+        cmd.scan->parts.resize(shards.size());
+        cmd.scan->pending.store(shards.size(), std::memory_order_relaxed);
+        for (size_t s = 1; s < shards.size(); s++) {
+            Command part;
+            part.type = cmd.type;
+            part.scan = cmd.scan;
+            part.sink = cmd.sink;
+            part.tag = cmd.tag;
+            shards[s]->enqueue(std::move(part));
+        }
+        shards[0]->enqueue(std::move(cmd));
+        return true;
+    }
+    if (cmd.type == CommandType::SET || cmd.type == CommandType::SET_TTL)
+        prepareValue(cmd);
+    return shardFor(cmd.keyData()).offer(cmd);
+}
+
+// On the producer thread, so the worker only has to store the result:
+// compresses a large SET value, or else puts a very large one in a shared
+// buffer (taking over an owned value, copying one viewed in a front
+// end's receive buffer)
+void RedisLite::prepareValue(Command& cmd) const {
+    std::string_view value = cmd.valueData();
+    if (compressMin && value.size() >= compressMin) {
+        std::string packed;
+        if (compressValue(value, packed)) {
+            cmd.sharedValue = ValueRef::adopt(std::move(packed));
+            cmd.value = std::string();
+            cmd.compressed = true;
+            return;
+        }
+    }
+    if (sharedValueMin && value.size() >= sharedValueMin)
+        cmd.sharedValue = cmd.buffer ? ValueRef::copy(value) : ValueRef::adopt(std::move(cmd.value));
+}
+
+size_t RedisLite::shardCount() const {
+    return shards.size();
+}
+
+WorkerStats RedisLite::stats() const {
+    WorkerStats total;
+    for (const auto& shard : shards) {
+        WorkerStats s = shard->stats();
+        total.batches += s.batches;
+        total.commands += s.commands;
+        total.maxBatchSize = std::max(total.maxBatchSize, s.maxBatchSize);
+        total.lastBatchSize += s.lastBatchSize;
+        total.expiredActive += s.expiredActive;
+        total.expiredLazy += s.expiredLazy;
+        total.ttlTimers += s.ttlTimers;
+        total.usedMemory += s.usedMemory;
+        total.evictedKeys += s.evictedKeys;
+        total.rejectedWrites += s.rejectedWrites;
+        total.keys += s.keys;
+        total.expiringKeys += s.expiringKeys;
+        total.keyspaceHits += s.keyspaceHits;
+        total.keyspaceMisses += s.keyspaceMisses;
+        total.queueDepth += s.queueDepth;
+        total.queueFullWaits += s.queueFullWaits;
+        total.queueRefused += s.queueRefused;
+    }
+    return total;
+}
+
+WorkerStats RedisLite::shardStats(size_t shard) const {
+    return shards.at(shard)->stats();
+}
+
+LatencyStats RedisLite::latencyStats() const {
+    LatencyStats total;
+    for (const auto& shard : shards)
+        total.merge(shard->latencyStats());
+    return total;
+}
+
+std::vector<SlowLogEntry> RedisLite::slowlog(size_t max) const {
+    return slowLog ? slowLog->get(max) : std::vector<SlowLogEntry>();
+}
+
+size_t RedisLite::slowlogLen() const {
+    return slowLog ? slowLog->size() : 0;
+}
+
+void RedisLite::slowlogReset() {
+    if (slowLog)
+        slowLog->reset();
+}
+
+std::vector<LatencySpike> RedisLite::latencyLatest() const {
+    return latencyMonitor ? latencyMonitor->latest() : std::vector<LatencySpike>();
+}
+
+std::vector<LatencySample> RedisLite::latencyHistory(LatencyEvent event) const {
+    return latencyMonitor ? latencyMonitor->history(event) : std::vector<LatencySample>();
+}
+
+void RedisLite::latencyReset(LatencyEvent event) {
+    if (latencyMonitor)
+        latencyMonitor->reset(event);
+}
+
+void RedisLite::latencyReset() {
+    if (latencyMonitor)
+        latencyMonitor->reset();
+}
+
+double RedisLite::sampleOpsPerSec(uint64_t commands) {
+    std::lock_guard<std::mutex> lock(rateMutex);
+    auto now = std::chrono::steady_clock::now();
+    if (now - rateAt >= kRateInterval) {
+        double seconds = std::chrono::duration<double>(now - rateAt).count();
+        opsPerSec = static_cast<double>(commands - rateCommands) / seconds;
+        rateCommands = commands;
+        rateAt = now;
+    }
+    return opsPerSec;
+}
+
+std::string RedisLite::info(std::string_view section) {
+    std::string wanted;
+    for (char c : section)
+        wanted += static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    bool all = wanted == "all" || wanted == "everything";
+    bool byDefault = all || wanted.empty() || wanted == "default";
+    auto want = [&](const char* name, bool inDefault) {
+        return wanted == name || (inDefault ? byDefault : all);
+    };
+
+    WorkerStats total = stats();
+    std::string out;
+    auto field = [&](const char* name, const std::string& value) {
+        out += name;
+        out += ':';
+        out += value;
+        out += "\r\n";
+    };
+    auto number = [&](const char* name, uint64_t value) { field(name, std::to_string(value)); };
+
+    if (want("server", true)) {
+        out += "# Server\r\n";
+        number("uptime_in_seconds", static_cast<uint64_t>(
+                                        std::chrono::duration_cast<std::chrono::seconds>(
+                                            std::chrono::steady_clock::now() - startTime)
+                                            .count()));
+        number("shards", shards.size());
+        out += "\r\n";
+    }
+    if (want("memory", true)) {
+        out += "# Memory\r\n";
+        number("used_memory", total.usedMemory);
+        field("used_memory_human", humanBytes(total.usedMemory));
+        number("maxmemory", maxMemory);
+        field("maxmemory_human", humanBytes(maxMemory));
+        field("maxmemory_policy", policyName(evictionPolicy));
+        out += "\r\n";
+    }
+    if (want("persistence", true)) {
+        AofStats a = aofStats();
+        SnapshotStats snap = snapshotStats();
+        out += "# Persistence\r\n";
+        number("aof_enabled", aof ? 1 : 0);
+        number("aof_rewrite_in_progress", a.rewriting ? 1 : 0);
+        number("aof_current_size", a.currentSize);
+        number("aof_base_size", a.baseSize);
+        number("aof_rewrites", a.rewrites);
+        number("aof_group_commits", a.groupCommits);
+        number("aof_fsyncs", a.fsyncs);
+        number("aof_write_errors", a.writeErrors);
+        number("rdb_bgsave_in_progress", snap.inProgress ? 1 : 0);
+        number("rdb_saves", snap.saves);
+        number("rdb_failed_saves", snap.failedSaves);
+        number("rdb_last_save_keys", snap.lastSaveRecords);
+        number("rdb_last_save_bytes", snap.lastSaveBytes);
+        out += "\r\n";
+    }
+    if (want("stats", true)) {
+        LatencySummary wait = latencyStats().queueWait;
+        char rate[32];
+        std::snprintf(rate, sizeof(rate), "%.0f", sampleOpsPerSec(total.commands));
+        out += "# Stats\r\n";
+        number("total_commands_processed", total.commands);
+        field("instantaneous_ops_per_sec", rate);
+        number("total_batches", total.batches);
+        number("max_batch_size", total.maxBatchSize);
+        number("expired_keys", total.expiredActive + total.expiredLazy);
+        number("expired_keys_lazy", total.expiredLazy);
+        number("ttl_timers", total.ttlTimers);
+        number("evicted_keys", total.evictedKeys);
+        number("rejected_writes", total.rejectedWrites);
+        number("keyspace_hits", total.keyspaceHits);
+        number("keyspace_misses", total.keyspaceMisses);
+        number("queue_depth", total.queueDepth);
+        number("queue_full_waits", total.queueFullWaits);
+        number("queue_refused", total.queueRefused);
+        field("queue_wait_usec_per_command", micros(wait.meanNs()));
+        field("queue_wait_usec_p99", micros(static_cast<double>(wait.percentile(99))));
+        out += "\r\n";
+    }
+    if (want("replication", true)) {
+        out += "# Replication\r\n";
+        number("repl_backlog_active", backlog ? 1 : 0);
+        number("master_repl_offset", backlog ? backlog->offset() : 0);
+        out += "\r\n";
+    }
+    if (want("commandstats", false) || want("latencystats", false)) {
+        LatencyStats latency = latencyStats();
+        if (want("commandstats", false)) {
+            out += "# Commandstats\r\n";
+            for (size_t i = 0; i < kCommandTypes; i++) {
+                const LatencySummary& c = latency.commands[i];
+                if (!c.calls)
+                    continue;
+                out += "cmdstat_" + commandName(static_cast<CommandType>(i)) +
+                       ":calls=" + std::to_string(c.calls) +
+                       ",usec=" + std::to_string(c.totalNs / 1000) +
+                       ",usec_per_call=" + micros(c.meanNs()) + "\r\n";
+            }
+            out += "\r\n";
+        }
+        if (want("latencystats", false)) {
+            out += "# Latencystats\r\n";
+            for (size_t i = 0; i < kCommandTypes; i++) {
+                const LatencySummary& c = latency.commands[i];
+                if (!c.calls)
+                    continue;
+                out += "latency_percentiles_usec_" + commandName(static_cast<CommandType>(i)) +
+                       ":p50=" + micros(static_cast<double>(c.percentile(50))) +
+                       ",p99=" + micros(static_cast<double>(c.percentile(99))) +
+                       ",p99.9=" + micros(static_cast<double>(c.percentile(99.9))) + "\r\n";
+            }
+            out += "\r\n";
+        }
+    }
+    if (want("keyspace", true)) {
+        out += "# Keyspace\r\n";
+        if (total.keys)
+            out += "db0:keys=" + std::to_string(total.keys) +
+                   ",expires=" + std::to_string(total.expiringKeys) + "\r\n";
+        out += "\r\n";
+    }
+    if (want("shards", true)) {
+        out += "# Shards\r\n";
+        for (size_t i = 0; i < shards.size(); i++) {
+            WorkerStats s = shards[i]->stats();
+            out += "shard" + std::to_string(i) + ":keys=" + std::to_string(s.keys) +
+                   ",expires=" + std::to_string(s.expiringKeys) +
+                   ",commands=" + std::to_string(s.commands) +
+                   ",queue_depth=" + std::to_string(s.queueDepth) +
+                   ",used_memory=" + std::to_string(s.usedMemory) + "\r\n";
+        }
+        out += "\r\n";
+    }
+    // No trailing blank line, as Redis
+    if (out.size() >= 2)
+        out.resize(out.size() - 2);
+    return out;
+}
+
+std::string RedisLite::metricsText() {
+    WorkerStats total = stats();
+    AofStats a = aofStats();
+    SnapshotStats snap = snapshotStats();
+    LatencyStats latency = latencyStats();
+    std::string out;
+
+    auto header = [&](const char* name, const char* type, const char* help) {
+        out += std::string("# HELP ") + name + " " + help + "\n# TYPE " + name + " " + type + "\n";
+    };
+    auto sample = [&](const char* name, const std::string& labels, uint64_t value) {
+        out += name;
+        if (!labels.empty())
+            out += "{" + labels + "}";
+        out += " " + std::to_string(value) + "\n";
+    };
+    auto metric = [&](const char* name, const char* type, const char* help, uint64_t value) {
+        header(name, type, help);
+        sample(name, "", value);
+    };
+    auto perShard = [&](const char* name, const char* help, uint64_t WorkerStats::*field) {
+        header(name, "gauge", help);
+        for (size_t i = 0; i < shards.size(); i++)
+            sample(name, "shard=\"" + std::to_string(i) + "\"", shards[i]->stats().*field);
+    };
+    // Cumulative buckets up to each bound, in seconds
+    auto histogram = [&](const char* name, const std::string& labels, const LatencySummary& h) {
+        std::string prefix = labels.empty() ? "" : labels + ",";
+        uint64_t seen = 0;
+        for (size_t i = 0; i + 1 < kLatencyBuckets; i++) {
+            seen += h.buckets[i];
+            if (i < kFirstExposedBucket)
+                continue;
+            char le[32];
+            std::snprintf(le, sizeof(le), "%.10g", static_cast<double>(LatencySummary::bound(i)) / 1e9);
+            out += std::string(name) + "_bucket{" + prefix + "le=\"" + le + "\"} " +
+                   std::to_string(seen) + "\n";
+        }
+        out += std::string(name) + "_bucket{" + prefix + "le=\"+Inf\"} " +
+               std::to_string(h.calls) + "\n";
+        char sum[32];
+        std::snprintf(sum, sizeof(sum), "%.9g", static_cast<double>(h.totalNs) / 1e9);
+        std::string braces = labels.empty() ? "" : "{" + labels + "}";
+        out += std::string(name) + "_sum" + braces + " " + sum + "\n";
+        out += std::string(name) + "_count" + braces + " " + std::to_string(h.calls) + "\n";
+    };
+
+    metric("redislite_uptime_seconds", "gauge", "Seconds since the instance started.",
+           static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::seconds>(
+                                     std::chrono::steady_clock::now() - startTime)
+                                     .count()));
+    metric("redislite_commands_processed_total", "counter", "Commands executed by the shard workers.",
+           total.commands);
+    metric("redislite_batches_total", "counter", "Worker passes over the command queues.",
+           total.batches);
+    metric("redislite_keyspace_hits_total", "counter", "Reads that found their key.",
+           total.keyspaceHits);
+    metric("redislite_keyspace_misses_total", "counter", "Reads that did not find their key.",
+           total.keyspaceMisses);
+    header("redislite_expired_keys_total", "counter", "Keys removed because their TTL passed.");
+    sample("redislite_expired_keys_total", "mode=\"active\"", total.expiredActive);
+    sample("redislite_expired_keys_total", "mode=\"lazy\"", total.expiredLazy);
+    metric("redislite_evicted_keys_total", "counter", "Keys evicted over maxmemory.",
+           total.evictedKeys);
+    metric("redislite_rejected_writes_total", "counter", "Writes refused over maxmemory.",
+           total.rejectedWrites);
+    metric("redislite_queue_full_waits_total", "counter", "Enqueues that found a shard queue full.",
+           total.queueFullWaits);
+    metric("redislite_queue_refused_total", "counter", "Client commands refused by a full shard queue.",
+           total.queueRefused);
+    perShard("redislite_keys", "Keys in the shard.", &WorkerStats::keys);
+    perShard("redislite_expiring_keys", "Keys with a TTL in the shard.", &WorkerStats::expiringKeys);
+    perShard("redislite_queue_depth", "Commands waiting in the shard queue.", &WorkerStats::queueDepth);
+    perShard("redislite_memory_used_bytes", "Memory used by the shard's data.",
+             &WorkerStats::usedMemory);
+    metric("redislite_memory_max_bytes", "gauge", "maxmemory across all shards, 0 if unlimited.",
+           maxMemory);
+
+    metric("redislite_aof_enabled", "gauge", "Whether the append-only file is on.", aof ? 1 : 0);
+    metric("redislite_aof_size_bytes", "gauge", "Size of the append-only file.", a.currentSize);
+    metric("redislite_aof_rewrites_total", "counter", "Completed AOF rewrites.", a.rewrites);
+    metric("redislite_aof_fsyncs_total", "counter", "fsync calls on the append-only file.", a.fsyncs);
+    metric("redislite_aof_write_errors_total", "counter", "Failed writes to the append-only file.",
+           a.writeErrors);
+    header("redislite_snapshots_total", "counter", "Snapshots finished, by result.");
+    sample("redislite_snapshots_total", "result=\"ok\"", snap.saves);
+    sample("redislite_snapshots_total", "result=\"failed\"", snap.failedSaves);
+    metric("redislite_repl_offset_bytes", "gauge", "Replication stream offset.",
+           backlog ? backlog->offset() : 0);
+
+    header("redislite_queue_wait_seconds", "histogram",
+           "Time commands spent queued before a worker ran them.");
+    histogram("redislite_queue_wait_seconds", "", latency.queueWait);
+    header("redislite_command_duration_seconds", "histogram",
+           "Time the shard workers spent executing commands, by command.");
+    for (size_t i = 0; i < kCommandTypes; i++) {
+        if (latency.commands[i].calls)
+            histogram("redislite_command_duration_seconds",
+                      "cmd=\"" + commandName(static_cast<CommandType>(i)) + "\"",
+                      latency.commands[i]);
+    }
+    return out;
+}
+
+Pipeline::Pipeline(RedisLite& redis) : redis(redis) {}
+
+Pipeline& Pipeline::add(CommandType type, std::string key, std::string value,
+                        int ttlSeconds) {
+    BatchOp op;
+    op.type = type;
+    op.key = std::move(key);
+    op.value = std::move(value);
+    op.ttlSeconds = ttlSeconds;
+    ops.push_back(std::move(op));
+    return *this;
+}
+
+Pipeline& Pipeline::set(std::string key, std::string value) {
+    return add(CommandType::SET, std::move(key), std::move(value), 0);
+}
+
+Pipeline& Pipeline::get(std::string key) {
+    return add(CommandType::GET, std::move(key), "", 0);
+}
+
+Pipeline& Pipeline::del(std::string key) {
+    return add(CommandType::DEL, std::move(key), "", 0);
+}
+
+Pipeline& Pipeline::setWithTTL(std::string key, std::string value, int ttlSeconds) {
+    return add(CommandType::SET_TTL, std::move(key), std::move(value), ttlSeconds);
+}
+
+size_t Pipeline::size() const {
+    return ops.size();
+}
+
+std::vector<std::string> Pipeline::exec() {
+    size_t n = ops.size();
+    std::vector<std::string> results = redis.submitBatch(std::move(ops), true);
+    ops.clear();
+    results.resize(n);
+    return results;
 }
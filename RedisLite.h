@@ -1,56 +1,290 @@
 #pragma once
-#include <unordered_map>
-#include <queue>
+#include <memory>
 #include <string>
-#include <thread>
+#include <vector>
+#include <utility>
+#include <functional>
 #include <mutex>
-#include <condition_variable>
-#include <future>
-#include<chrono>
-
-enum class CommandType {
-    SET,
-    GET,
-    DEL,
-    SET_TTL
-};
+#include <chrono>
+#include <string_view>
+#include <stdexcept>
+#include "Config.h"
+#include "Shard.h"
+#include "CompletionQueue.h"
+#include "AppendOnlyFile.h"
+#include "Replication.h"
+#include "NearCache.h"
+#include "Metrics.h"
+#include "SlowLog.h"
+
+#if defined(__cpp_impl_coroutine) && __has_include(<coroutine>)
+#include <coroutine>
+#define REDISLITE_HAS_COROUTINES 1
+#endif
 
-struct ValueEntry{
-   std::string value;
-   bool hasTTL = false;
-   std::chrono::steady_clock::time_point expireAt;
+class RedisLite;
 
+// Thrown by a client call whose shard queue is full, under
+// QueueOverflow::Reject or Shed; the command did not run
+class QueueFullError : public std::runtime_error {
+public:
+    QueueFullError() : std::runtime_error("shard queue is full") {}
 };
 
-struct Command {
-    CommandType type;
+using GetCallback = std::function<void(std::string)>;
+
+// Lower-case name of a command type, as INFO commandstats, the metrics
+// labels and SLOWLOG GET show it
+std::string commandName(CommandType type);
+
+#ifdef REDISLITE_HAS_COROUTINES
+// `co_await redis.getAsync(key, &cq)` suspends until the worker has the
+// value. The coroutine resumes on whichever thread polls `cq`, or on the
+// shard worker when no queue is given (keep that continuation short).
+class GetAwaitable {
+private:
+    RedisLite& redis;
     std::string key;
+    CompletionQueue* completions;
     std::string value;
-    int ttlSeconds = 0;
-    std::promise<std::string> result; // Only used for GET
+
+public:
+    GetAwaitable(RedisLite& redis, std::string key, CompletionQueue* completions)
+        : redis(redis), key(std::move(key)), completions(completions) {}
+
+    bool await_ready() const noexcept { return false; }
+    void await_suspend(std::coroutine_handle<> handle);
+    std::string await_resume() { return std::move(value); }
+};
+#endif
+
+// Queues operations client-side and sends them as a single BATCH command
+// per shard, with one completion for the whole pipeline.
+class Pipeline {
+private:
+    RedisLite& redis;
+    std::vector<BatchOp> ops;
+
+    Pipeline& add(CommandType type, std::string key, std::string value, int ttlSeconds);
+
+public:
+    explicit Pipeline(RedisLite& redis);
+
+    Pipeline& set(std::string key, std::string value);
+    Pipeline& get(std::string key);
+    Pipeline& del(std::string key);
+    Pipeline& setWithTTL(std::string key, std::string value, int ttlSeconds);
+
+    size_t size() const;
+
+    // Sends every queued op and blocks until all have run. Returns one
+    // entry per op in queue order: the value for GET, "" otherwise.
+    std::vector<std::string> exec();
 };
 
 class RedisLite {
 private:
-    // Single-thread owned state (worker thread only)
-    std::unordered_map<std::string, ValueEntry>store;
+    // Declared first so it outlives the shards, which log into it until
+    // their queues are drained
+    std::unique_ptr<AppendOnlyFile> aof;
+    std::unique_ptr<ReplicationBacklog> backlog;
+
+    // Current or last snapshot; its destructor waits for the shards,
+    // which finish a running snapshot before they exit
+    std::string snapshotPath;
+    std::mutex snapshotMutex;
+    std::unique_ptr<SnapshotWriter> snapshotWriter;
+    SnapshotStats snapshotCounters;
+
+    // Written by every shard worker, so also declared before the shards;
+    // null when off
+    std::unique_ptr<SlowLog> slowLog;
+    std::unique_ptr<LatencyMonitor> latencyMonitor;
 
-    // Producer-consumer queue
-    std::queue<Command> commandQueue;
-    std::mutex queueMutex;
-    std::condition_variable cv;
+    // Keys are hashed onto shards; each shard runs its own worker
+    std::vector<std::unique_ptr<Shard>> shards;
 
-    std::thread worker;
-    bool stop = false;
+    // Config::sharedValueMin / compressMin: the producer thread wraps or
+    // compresses SET values this large itself (see prepareValue)
+    size_t sharedValueMin;
+    size_t compressMin;
+    bool keyIndex; // Config::keyIndex
 
-    void workerLoop();
+    // Per-thread near caches are found by this id, not by address, so a
+    // new instance never inherits a dead one's entries
+    size_t nearCacheEntries;
+    uint64_t instanceId;
+
+    // Reported by info()
+    size_t maxMemory;
+    EvictionPolicy evictionPolicy;
+    std::chrono::steady_clock::time_point startTime;
+    // instantaneous_ops_per_sec: commands per second between two info()
+    // calls at least kRateInterval apart
+    std::mutex rateMutex;
+    std::chrono::steady_clock::time_point rateAt;
+    uint64_t rateCommands = 0;
+    double opsPerSec = 0;
+
+    void prepareValue(Command& cmd) const;
+    std::string fetch(std::string key, bool priority);
+    size_t shardIndex(std::string_view key) const;
+    Shard& shardFor(std::string_view key);
+    std::vector<std::string> submitBatch(std::vector<BatchOp>&& ops, bool waitForResults,
+                                         std::vector<int64_t>* statuses = nullptr);
+    int64_t runOne(BatchOp&& op, std::string* value);
+    NearCache* nearCache();
+    void forget(std::string_view key);
+    void replayAof();
+    void startAofScans();
+    void loadSnapshot(const std::string& path, bool replace);
+    bool startSnapshot(const std::string& path);
+    void reapSnapshot();
+    double sampleOpsPerSec(uint64_t commands);
+
+    friend class Pipeline;
 
 public:
-    RedisLite();
+    explicit RedisLite(const RedisLiteConfig& config = RedisLiteConfig());
     ~RedisLite();
 
-    void set(const std::string& key, const std::string& value);
-    std::string get(const std::string& key);
-    void del(const std::string& key);
-    void setWithTTL(const std::string& key, const std::string& value, int ttlSeconds);
+    // Keys and values are taken by value and moved through to the worker,
+    // so callers can std::move() them in to skip the copy. Under
+    // QueueOverflow::Reject or Shed, calls that queue throw QueueFullError
+    // instead of waiting for room.
+    void set(std::string key, std::string value);
+    std::string get(std::string key);
+    void del(std::string key);
+    void setWithTTL(std::string key, std::string value, int ttlSeconds);
+    // get() through the shard's priority lane (priorityQueueCapacity), so
+    // it does not wait behind queued writes. It may overtake writes still
+    // queued, this thread's own included, so it can miss a set() just
+    // made. The same as get() without a lane.
+    std::string getPriority(std::string key);
+
+    // Atomic read-modify-writes, run on the key's worker in one queue trip
+    // (each waits for its result). incrBy / decrBy return false, leaving
+    // `result` alone, if the value is not an integer or would overflow;
+    // a missing key counts as 0. compareAndSet stores `desired` only if
+    // the key exists and holds `expected`.
+    bool incrBy(std::string key, int64_t delta, int64_t* result = nullptr);
+    bool decrBy(std::string key, int64_t delta, int64_t* result = nullptr);
+    size_t append(std::string key, std::string suffix); // length afterwards
+    std::string getSet(std::string key, std::string value); // old value, "" if none
+    bool compareAndSet(std::string key, std::string expected, std::string desired);
+
+    // Batched variants: one queue entry per shard instead of one per key
+    void mset(std::vector<std::pair<std::string, std::string>> pairs);
+    std::vector<std::string> mget(const std::vector<std::string>& keys);
+    Pipeline pipeline();
+
+    // Large values without copies. getShared() hands back a reference to
+    // the stored bytes if the value is at least sharedValueMin (a private
+    // copy otherwise); it stays valid after the key changes, and is empty
+    // if the key is missing or holds "". getRange() copies only bytes
+    // `start` through `end` (inclusive, negative counts from the end),
+    // as GETRANGE. stream() feeds a value to `chunk` in pieces of at most
+    // `chunkSize` bytes on the calling thread until it returns false;
+    // false if there was nothing to read.
+    ValueRef getShared(std::string key);
+    std::string getRange(std::string key, int64_t start, int64_t end);
+    bool stream(std::string key, size_t chunkSize,
+                const std::function<bool(std::string_view)>& chunk);
+
+    // Incremental keyspace iteration, as SCAN: start with cursor 0 and
+    // pass the returned cursor back until it is 0 again. Each call is one
+    // bounded step on one shard that appends about `count` keys matching
+    // the glob `pattern` ("" = all) to `keys`. A key present for
+    // the whole iteration is returned at least once, possibly twice.
+    uint64_t scan(uint64_t cursor, std::vector<std::string>& keys,
+                  std::string_view pattern = "", size_t count = 10);
+    // With RedisLiteConfig::keyIndex: at most `count` keys that start with
+    // `prefix` and sort after `after` ("" = from the first), in order
+    // across all shards. Returns the `after` for the next call, "" once
+    // there are no more. Finds nothing without the index.
+    std::string scanPrefix(std::string_view prefix, std::string_view after,
+                           std::vector<std::string>& keys, size_t count = 10);
+    bool hasKeyIndex() const;
+
+    // Non-blocking GET. The callback runs on a thread polling
+    // `completions`, or on the shard worker if it is null.
+    void getAsync(std::string key, GetCallback callback,
+                  CompletionQueue* completions = nullptr);
+#ifdef REDISLITE_HAS_COROUTINES
+    GetAwaitable getAsync(std::string key, CompletionQueue* completions = nullptr);
+#endif
+
+    // With RedisLiteConfig::lockFreeReads, a GET answered from the key's
+    // read index on the calling thread; ReadResult::Queue if it has to be
+    // queued instead (always, when the option is off). get() tries this
+    // first by itself.
+    ReadResult readLockFree(std::string_view key, std::string& value);
+
+    // Routes a prebuilt command to its key's shard (a SCAN by its cursor,
+    // a SCAN_PREFIX to every shard); used by front ends
+    // such as RespServer that deliver results through a ReplySink. False,
+    // leaving `cmd` as it was, if the shard's queueOverflow policy
+    // refused it.
+    bool dispatch(Command&& cmd);
+
+    // Starts a background AOF rewrite; false if persistence is off or a
+    // rewrite is already running
+    bool rewriteAof();
+    AofStats aofStats() const;
+
+    // Point-in-time snapshot to RedisLiteConfig::snapshotPath, taken while
+    // the shards keep serving. bgsave() returns false if no path is set,
+    // a snapshot is already running, or the file cannot be created; save()
+    // also waits and reports whether the file was written.
+    bool bgsave();
+    bool save();
+    SnapshotStats snapshotStats();
+
+    // Primary side of replication (null when replBacklogSize is 0).
+    // saveForSync() writes a snapshot to `path` for a full resync, after
+    // a BGSAVE in progress if there is one, and sets `offset` to where
+    // the backlog stream continues from it.
+    ReplicationBacklog* replicationBacklog();
+    bool saveForSync(const std::string& path, uint64_t& offset);
+
+    // Replica side: applies records of the primary's stream (queued, not
+    // waited for), or replaces the whole keyspace with a snapshot file.
+    // loadReplicaSnapshot() throws std::runtime_error on a corrupt file.
+    void applyReplicated(const std::vector<AppendOnlyFile::Record>& records);
+    void loadReplicaSnapshot(const std::string& path);
+
+    // Moving keys between cluster nodes: each key as an AOF SET record
+    // with its absolute expiry ("" if missing), and a delete that only
+    // happens if the value is still the one copied (1 deleted, 0 missing,
+    // 2 changed in the meantime). Both block.
+    std::vector<std::string> dumpKeys(const std::vector<std::string>& keys);
+    std::vector<int64_t> deleteIfValue(std::vector<std::pair<std::string, std::string>> pairs);
+
+    size_t shardCount() const;
+    WorkerStats stats() const; // summed over all shards
+    WorkerStats shardStats(size_t shard) const;
+    LatencyStats latencyStats() const; // merged over all shards
+
+    // Redis-style INFO text ("# Section" headers, field:value lines with
+    // CRLF). `section` picks one section, case-insensitively; "" or
+    // "default" gives all but commandstats and latencystats, "all" or
+    // "everything" gives those too.
+    std::string info(std::string_view section = "");
+    // The same counters in the Prometheus text exposition format, with
+    // queue wait and per-command times as histograms
+    std::string metricsText();
+
+    // Slow log (RedisLiteConfig::slowlogSlowerThanUs): up to `max`
+    // entries, newest first. Empty, 0 and a no-op when it is off.
+    std::vector<SlowLogEntry> slowlog(size_t max = 10) const;
+    size_t slowlogLen() const;
+    void slowlogReset();
+
+    // Latency monitor (RedisLiteConfig::latencyMonitorThresholdUs): the
+    // latest and worst stall of every event that had one, one event's
+    // history (oldest first), and a reset of one or all events
+    std::vector<LatencySpike> latencyLatest() const;
+    std::vector<LatencySample> latencyHistory(LatencyEvent event) const;
+    void latencyReset(LatencyEvent event);
+    void latencyReset();
 };
@@ -0,0 +1,326 @@
+#include "Replication.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <charconv>
+#include <chrono>
+#include <cstring>
+#include <random>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "AppendOnlyFile.h"
+#include "RedisLite.h"
+#include "RespParser.h"
+
+namespace {
+constexpr size_t kRecvChunk = 64 * 1024;
+constexpr auto kReconnectDelay = std::chrono::milliseconds(100);
+constexpr int kReconnectSlices = 10; // stop() is checked this many times per delay
+
+bool sendAll(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t n = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data.remove_prefix(static_cast<size_t>(n));
+    }
+    return true;
+}
+
+std::string bulk(std::string_view s) {
+    return "$" + std::to_string(s.size()) + "\r\n" + std::string(s) + "\r\n";
+}
+
+template <typename T>
+bool parseNumber(std::string_view s, T& out) {
+    auto r = std::from_chars(s.data(), s.data() + s.size(), out);
+    return r.ec == std::errc() && r.ptr == s.data() + s.size();
+}
+}
+
+ReplicationBacklog::ReplicationBacklog(size_t capacity) : ring(capacity ? capacity : 1) {
+    std::random_device rd;
+    std::mt19937_64 rng((uint64_t(rd()) << 32) ^ rd());
+    static const char kHex[] = "0123456789abcdef";
+    for (int i = 0; i < 40; i++)
+        replId += kHex[rng() & 15];
+}
+
+uint64_t ReplicationBacklog::activate() {
+    std::lock_guard<std::mutex> lock(mutex);
+    enabled.store(true, std::memory_order_relaxed);
+    return end;
+}
+
+void ReplicationBacklog::append(std::string_view records) {
+    std::lock_guard<std::mutex> lock(mutex);
+    size_t capacity = ring.size();
+    // Only the newest `capacity` bytes can survive anyway
+    if (records.size() > capacity) {
+        end += records.size() - capacity;
+        records.remove_prefix(records.size() - capacity);
+    }
+    size_t at = static_cast<size_t>(end % capacity);
+    size_t first = std::min(records.size(), capacity - at);
+    std::memcpy(ring.data() + at, records.data(), first);
+    std::memcpy(ring.data(), records.data() + first, records.size() - first);
+    end += records.size();
+    // Under the lock, so setListener(nullptr) returning means it is done
+    if (listener)
+        listener();
+}
+
+uint64_t ReplicationBacklog::offset() const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return end;
+}
+
+bool ReplicationBacklog::covers(uint64_t from) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    return from <= end && end - from <= ring.size();
+}
+
+bool ReplicationBacklog::read(uint64_t from, size_t max, std::string& out) const {
+    std::lock_guard<std::mutex> lock(mutex);
+    if (from > end || end - from > ring.size())
+        return false;
+    size_t capacity = ring.size();
+    size_t count = static_cast<size_t>(std::min<uint64_t>(end - from, max));
+    size_t at = static_cast<size_t>(from % capacity);
+    size_t first = std::min(count, capacity - at);
+    out.append(ring.data() + at, first);
+    out.append(ring.data(), count - first);
+    return true;
+}
+
+void ReplicationBacklog::setListener(std::function<void()> fn) {
+    std::lock_guard<std::mutex> lock(mutex);
+    listener = std::move(fn);
+}
+
+ReplicaLink::ReplicaLink(RedisLite& redis, std::string host, uint16_t port,
+                         std::string syncPath)
+    : redis(redis), host(std::move(host)), port(port), syncPath(std::move(syncPath)) {}
+
+ReplicaLink::~ReplicaLink() {
+    stop();
+}
+
+void ReplicaLink::start() {
+    if (running.exchange(true))
+        return;
+    thread = std::thread(&ReplicaLink::run, this);
+}
+
+void ReplicaLink::stop() {
+    if (!running.exchange(false))
+        return;
+    {
+        std::lock_guard<std::mutex> lock(fdMutex);
+        if (fd >= 0)
+            shutdown(fd, SHUT_RDWR); // unblocks a recv() in run()
+    }
+    thread.join();
+}
+
+ReplicaStats ReplicaLink::stats() const {
+    ReplicaStats s;
+    s.linkUp = statLinkUp.load(std::memory_order_relaxed);
+    s.offset = statOffset.load(std::memory_order_relaxed);
+    s.fullSyncs = statFullSyncs.load(std::memory_order_relaxed);
+    s.partialSyncs = statPartialSyncs.load(std::memory_order_relaxed);
+    return s;
+}
+
+void ReplicaLink::run() {
+    while (running.load()) {
+        if (connectToPrimary() && handshake()) {
+            statLinkUp.store(true, std::memory_order_relaxed);
+            stream();
+            statLinkUp.store(false, std::memory_order_relaxed);
+        }
+        disconnect();
+        for (int i = 0; i < kReconnectSlices && running.load(); i++)
+            std::this_thread::sleep_for(kReconnectDelay / kReconnectSlices);
+    }
+}
+
+bool ReplicaLink::connectToPrimary() {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addrs = nullptr;
+    if (getaddrinfo(host.c_str(), std::to_string(port).c_str(), &hints, &addrs) != 0)
+        return false;
+
+    int s = -1;
+    for (addrinfo* a = addrs; a; a = a->ai_next) {
+        s = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (s < 0)
+            continue;
+        if (connect(s, a->ai_addr, a->ai_addrlen) == 0)
+            break;
+        close(s);
+        s = -1;
+    }
+    freeaddrinfo(addrs);
+    if (s < 0)
+        return false;
+
+    int one = 1;
+    setsockopt(s, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    std::lock_guard<std::mutex> lock(fdMutex);
+    fd = s;
+    if (!running.load())
+        shutdown(fd, SHUT_RDWR);
+    return true;
+}
+
+void ReplicaLink::disconnect() {
+    std::lock_guard<std::mutex> lock(fdMutex);
+    if (fd >= 0)
+        close(fd);
+    fd = -1;
+    in.clear();
+    inUsed = 0;
+}
+
+// Appends whatever the socket has next to `in`; false on EOF or error
+bool ReplicaLink::fill() {
+    size_t used = in.size();
+    in.resize(used + kRecvChunk);
+    ssize_t n;
+    do {
+        n = recv(fd, &in[used], kRecvChunk, 0);
+    } while (n < 0 && errno == EINTR);
+    in.resize(used + (n > 0 ? static_cast<size_t>(n) : 0));
+    return n > 0;
+}
+
+bool ReplicaLink::readLine(std::string& line) {
+    while (true) {
+        size_t crlf = in.find("\r\n", inUsed);
+        if (crlf != std::string::npos) {
+            line.assign(in, inUsed, crlf - inUsed);
+            inUsed = crlf + 2;
+            return true;
+        }
+        if (!fill())
+            return false;
+    }
+}
+
+// PSYNC <id> <offset>, or PSYNC ? -1 before the first sync
+bool ReplicaLink::handshake() {
+    std::string request = "*3\r\n$5\r\nPSYNC\r\n";
+    request += synced ? bulk(replId) + bulk(std::to_string(nextOffset)) : bulk("?") + bulk("-1");
+    std::string line;
+    if (!sendAll(fd, request) || !readLine(line))
+        return false;
+
+    if (line == "+CONTINUE") {
+        statPartialSyncs.fetch_add(1, std::memory_order_relaxed);
+        return true;
+    }
+    // +FULLRESYNC <id> <offset>
+    const std::string_view prefix = "+FULLRESYNC ";
+    if (line.compare(0, prefix.size(), prefix) != 0)
+        return false;
+    std::string_view rest = std::string_view(line).substr(prefix.size());
+    size_t space = rest.find(' ');
+    uint64_t offset;
+    if (space == std::string_view::npos || !parseNumber(rest.substr(space + 1), offset))
+        return false;
+    if (!receiveSnapshot())
+        return false;
+    replId.assign(rest.data(), space);
+    nextOffset = offset;
+    synced = true;
+    statOffset.store(nextOffset, std::memory_order_relaxed);
+    statFullSyncs.fetch_add(1, std::memory_order_relaxed);
+    return true;
+}
+
+// "$<length>\r\n" followed by the snapshot file, staged on disk and then
+// loaded in place of everything this replica held
+bool ReplicaLink::receiveSnapshot() {
+    std::string line;
+    uint64_t length;
+    if (!readLine(line) || line.empty() || line[0] != '$' ||
+        !parseNumber(std::string_view(line).substr(1), length))
+        return false;
+
+    int out = open(syncPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0)
+        return false;
+    bool ok = true;
+    while (ok && length > 0) {
+        if (inUsed == in.size()) {
+            in.clear();
+            inUsed = 0;
+            if (!fill()) {
+                ok = false;
+                break;
+            }
+        }
+        size_t take = static_cast<size_t>(std::min<uint64_t>(length, in.size() - inUsed));
+        ok = write(out, in.data() + inUsed, take) == static_cast<ssize_t>(take);
+        inUsed += take;
+        length -= take;
+    }
+    close(out);
+
+    if (ok) {
+        try {
+            redis.loadReplicaSnapshot(syncPath);
+        } catch (const std::exception&) {
+            ok = false;
+        }
+    }
+    unlink(syncPath.c_str());
+    return ok;
+}
+
+// Applies complete records as they arrive; the offset only moves past a
+// record once it has been handed to the shards, so a reconnect asks for
+// the first one not applied
+bool ReplicaLink::stream() {
+    in.erase(0, inUsed);
+    inUsed = 0;
+
+    RespParser parser;
+    std::vector<std::string_view> args;
+    std::vector<AppendOnlyFile::Record> records;
+    while (running.load()) {
+        RespParser::Result r;
+        AppendOnlyFile::Record rec;
+        while ((r = parser.next(in.data(), in.size(), args)) == RespParser::Result::Command) {
+            // Anything but SET / DEL (a future keepalive, say) is skipped
+            if (AppendOnlyFile::decode(args, rec))
+                records.push_back(rec);
+        }
+        if (r == RespParser::Result::Error)
+            return false;
+        if (!records.empty()) {
+            redis.applyReplicated(records);
+            records.clear();
+        }
+
+        nextOffset += parser.pendingStart();
+        statOffset.store(nextOffset, std::memory_order_relaxed);
+        in.erase(0, parser.pendingStart());
+        parser.rebase();
+        if (!fill())
+            return false;
+    }
+    return true;
+}
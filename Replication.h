@@ -0,0 +1,113 @@
+#pragma once
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+class RedisLite;
+
+// Primary side of replication: the newest `capacity` bytes of the mutation
+// stream the shard workers execute, in the same RESP records the AOF gets
+// (SET key value [PXAT unix-ms], DEL key). Bytes are addressed by a
+// replication offset that only grows, as in Redis's repl_backlog, so a
+// replica that reconnects with the id and offset it stopped at can
+// continue from the ring instead of doing a full resync.
+//
+// Shards only feed it once active() (the first replica asked to sync), so
+// a primary without replicas pays nothing for it.
+class ReplicationBacklog {
+private:
+    mutable std::mutex mutex;
+    std::vector<char> ring;
+    uint64_t end = 0; // offset one past the newest byte
+    std::string replId;
+    std::function<void()> listener;
+    std::atomic<bool> enabled{false};
+
+public:
+    explicit ReplicationBacklog(size_t capacity);
+
+    ReplicationBacklog(const ReplicationBacklog&) = delete;
+    ReplicationBacklog& operator=(const ReplicationBacklog&) = delete;
+
+    // 40 hex characters, new for every process
+    const std::string& id() const { return replId; }
+
+    bool active() const { return enabled.load(std::memory_order_relaxed); }
+    // Starts recording; returns the offset the stream continues from
+    uint64_t activate();
+
+    // Shard workers; the listener (if any) runs afterwards on the caller
+    void append(std::string_view records);
+
+    uint64_t offset() const;
+    // True if every byte from `from` up to offset() is still in the ring
+    bool covers(uint64_t from) const;
+    // Copies up to `max` bytes starting at `from` into `out`; false if
+    // covers(from) does not hold
+    bool read(uint64_t from, size_t max, std::string& out) const;
+
+    // Called after every append, e.g. to wake the connections of replicas
+    void setListener(std::function<void()> fn);
+};
+
+struct ReplicaStats {
+    bool linkUp = false;
+    uint64_t offset = 0;       // primary offset applied up to
+    uint64_t fullSyncs = 0;
+    uint64_t partialSyncs = 0;
+};
+
+// Replica side: a thread that keeps one connection to the primary, sends
+// PSYNC with the id and offset it has, loads the snapshot of a full
+// resync (+FULLRESYNC) or just carries on (+CONTINUE), then applies the
+// stream to `redis` as it arrives. Reconnects after any error.
+class ReplicaLink {
+private:
+    RedisLite& redis;
+    std::string host;
+    uint16_t port;
+    std::string syncPath; // where a full resync's snapshot is staged
+
+    std::atomic<bool> running{false};
+    std::mutex fdMutex; // lets stop() shut the socket down under run()
+    int fd = -1;
+    std::thread thread;
+
+    // Link thread only
+    std::string replId = "?";
+    uint64_t nextOffset = 0;
+    bool synced = false;
+    std::string in;
+    size_t inUsed = 0; // bytes of `in` already consumed
+
+    std::atomic<bool> statLinkUp{false};
+    std::atomic<uint64_t> statOffset{0};
+    std::atomic<uint64_t> statFullSyncs{0};
+    std::atomic<uint64_t> statPartialSyncs{0};
+
+    void run();
+    bool connectToPrimary();
+    void disconnect();
+    bool fill();
+    bool readLine(std::string& line);
+    bool handshake();
+    bool receiveSnapshot();
+    bool stream();
+
+public:
+    ReplicaLink(RedisLite& redis, std::string host, uint16_t port, std::string syncPath);
+    ~ReplicaLink();
+
+    ReplicaLink(const ReplicaLink&) = delete;
+    ReplicaLink& operator=(const ReplicaLink&) = delete;
+
+    void start();
+    void stop();
+
+    ReplicaStats stats() const;
+};
@@ -0,0 +1,155 @@
+#pragma once
+#include <cstddef>
+#include <cstring>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+// Incremental RESP request parser. It works on a caller-owned byte range
+// and remembers where it stopped, so a request split across reads is never
+// re-scanned from the start. Parsed arguments are string_views into that
+// range; nothing is copied. Handles RESP arrays of bulk strings as well as
+// inline (space separated) commands.
+class RespParser {
+public:
+    enum class Result { Incomplete, Command, Error };
+
+private:
+    static constexpr long long kMaxBulkLength = 512LL * 1024 * 1024;
+    static constexpr long long kMaxArgs = 1024 * 1024;
+    static constexpr size_t kMaxLengthLine = 32;
+    static constexpr size_t kMaxInlineLength = 64 * 1024;
+
+    size_t start = 0;        // first byte of the request being parsed
+    size_t scan = 0;         // first byte not looked at yet
+    long long argsWanted = -1; // -1 until the array header is read
+    long long bulkLength = -1; // -1 until the next "$<n>" header is read
+    std::vector<std::pair<size_t, size_t>> spans; // offset, length per arg
+
+    // Reads "<digits>\r\n" at `scan`. Returns 0 if incomplete, -1 if
+    // malformed, 1 on success.
+    int readLength(const char* buf, size_t end, long long& out) {
+        const void* crlf = std::memchr(buf + scan, '\r', end - scan);
+        if (!crlf) {
+            return end - scan > kMaxLengthLine ? -1 : 0;
+        }
+        size_t cr = static_cast<const char*>(crlf) - buf;
+        if (cr + 1 >= end)
+            return 0;
+        if (buf[cr + 1] != '\n' || cr == scan)
+            return -1;
+
+        bool negative = buf[scan] == '-';
+        long long value = 0;
+        for (size_t i = scan + negative; i < cr; i++) {
+            char c = buf[i];
+            if (c < '0' || c > '9' || value > kMaxBulkLength)
+                return -1;
+            value = value * 10 + (c - '0');
+        }
+        out = negative ? -value : value;
+        scan = cr + 2;
+        return 1;
+    }
+
+    Result parseInline(const char* buf, size_t end, std::vector<std::string_view>& args) {
+        const void* nl = std::memchr(buf + scan, '\n', end - scan);
+        if (!nl) {
+            scan = end;
+            return end - start > kMaxInlineLength ? Result::Error : Result::Incomplete;
+        }
+        size_t lineEnd = static_cast<const char*>(nl) - buf;
+        size_t next = lineEnd + 1;
+        if (lineEnd > start && buf[lineEnd - 1] == '\r')
+            lineEnd--;
+
+        size_t i = start;
+        while (i < lineEnd) {
+            while (i < lineEnd && buf[i] == ' ')
+                i++;
+            size_t from = i;
+            while (i < lineEnd && buf[i] != ' ')
+                i++;
+            if (i > from)
+                args.emplace_back(buf + from, i - from);
+        }
+        start = scan = next;
+        return Result::Command;
+    }
+
+public:
+    // Parses the next request out of buf[0, end). On Command, `args`
+    // holds views into `buf`; on Incomplete, call again once more bytes
+    // were appended. Error means the stream cannot be resynchronised.
+    Result next(const char* buf, size_t end, std::vector<std::string_view>& args) {
+        args.clear();
+        if (argsWanted < 0) {
+            if (start >= end)
+                return Result::Incomplete;
+            if (buf[start] != '*')
+                return parseInline(buf, end, args);
+
+            scan = start + 1;
+            long long count;
+            int r = readLength(buf, end, count);
+            if (r <= 0) {
+                scan = start;
+                return r < 0 ? Result::Error : Result::Incomplete;
+            }
+            if (count > kMaxArgs)
+                return Result::Error;
+            argsWanted = count < 0 ? 0 : count;
+            spans.clear();
+        }
+
+        while (static_cast<long long>(spans.size()) < argsWanted) {
+            if (bulkLength < 0) {
+                if (scan >= end)
+                    return Result::Incomplete;
+                if (buf[scan] != '$')
+                    return Result::Error;
+                size_t header = scan++;
+                int r = readLength(buf, end, bulkLength);
+                if (r <= 0) {
+                    scan = header;
+                    bulkLength = -1;
+                    return r < 0 ? Result::Error : Result::Incomplete;
+                }
+                if (bulkLength < 0)
+                    return Result::Error;
+            }
+            size_t len = static_cast<size_t>(bulkLength);
+            if (end - scan < len + 2)
+                return Result::Incomplete;
+            spans.emplace_back(scan, len);
+            scan += len + 2;
+            bulkLength = -1;
+        }
+
+        for (const auto& span : spans)
+            args.emplace_back(buf + span.first, span.second);
+        start = scan;
+        argsWanted = -1;
+        return Result::Command;
+    }
+
+    // Offset of the first byte still needed (the unfinished request)
+    size_t pendingStart() const { return start; }
+
+    // Bytes the unfinished request is known to need in total, counted
+    // from pendingStart(); lets the caller size a new block once
+    size_t pendingSize() const {
+        if (argsWanted >= 0 && bulkLength >= 0)
+            return scan - start + static_cast<size_t>(bulkLength) + 2;
+        return scan - start;
+    }
+
+    // The caller moved buf[pendingStart(), end) to the front of a new block
+    void rebase() {
+        size_t delta = start;
+        for (auto& span : spans)
+            span.first -= delta;
+        scan -= delta;
+        start = 0;
+    }
+};
@@ -0,0 +1,1838 @@
+#include "RespServer.h"
+#include "Compression.h"
+
+#include <algorithm>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cerrno>
+#include <climits>
+#include <cstring>
+#include <stdexcept>
+
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "AppendOnlyFile.h"
+#include "RespParser.h"
+
+namespace {
+constexpr uint64_t kListenerId = 0;
+constexpr uint64_t kWakeId = UINT64_MAX;
+constexpr int kMaxEvents = 256;
+constexpr size_t kRecvBlock = 16 * 1024;
+constexpr int kMaxIovecs = 512;
+// Backlog bytes queued per write to a replica
+constexpr size_t kReplicaChunk = 256 * 1024;
+// Metrics endpoint: how often its thread checks for stop(), how long a
+// scraper gets to send its request, and how much of it is read
+constexpr int kMetricsPollMs = 200;
+constexpr long kMetricsTimeoutMs = 2000;
+constexpr size_t kMaxMetricsRequest = 8 * 1024;
+// Upper-cases a command or option name into `out`; longer names cannot
+// match anything and come back unchanged
+std::string_view upper(std::string_view s, char (&out)[16]) {
+    if (s.size() > sizeof(out))
+        return s;
+    for (size_t i = 0; i < s.size(); i++)
+        out[i] = static_cast<char>(std::toupper(static_cast<unsigned char>(s[i])));
+    return std::string_view(out, s.size());
+}
+
+std::string bulk(std::string_view s) {
+    std::string out = "$" + std::to_string(s.size()) + "\r\n";
+    out.append(s.data(), s.size());
+    out += "\r\n";
+    return out;
+}
+
+std::string error(const std::string& message) {
+    return "-" + message + "\r\n";
+}
+
+std::string arityError(std::string_view name) {
+    std::string lower(name);
+    for (char& c : lower)
+        c = static_cast<char>(std::tolower(static_cast<unsigned char>(c)));
+    return error("ERR wrong number of arguments for '" + lower + "' command");
+}
+
+const char* kOomError =
+    "-OOM command not allowed when used memory > 'maxmemory'.\r\n";
+const char* kWrongTypeError =
+    "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n";
+const char* kOverloadedError =
+    "-OVERLOADED command queue is full, try again later\r\n";
+
+bool parseInt(std::string_view s, long long& out) {
+    auto r = std::from_chars(s.data(), s.data() + s.size(), out);
+    return r.ec == std::errc() && r.ptr == s.data() + s.size();
+}
+
+void setNonBlocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+int64_t unixNowMs() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool sendAll(int fd, std::string_view data) {
+    while (!data.empty()) {
+        ssize_t n = send(fd, data.data(), data.size(), MSG_NOSIGNAL);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        data.remove_prefix(static_cast<size_t>(n));
+    }
+    return true;
+}
+
+// Blocking connection whose connect, sends and receives each give up
+// after `timeoutMs`; -1 on failure
+int connectTo(const std::string& host, const std::string& port, long long timeoutMs) {
+    addrinfo hints{};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* addrs = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &addrs) != 0)
+        return -1;
+    timeval tv{};
+    tv.tv_sec = static_cast<time_t>(timeoutMs / 1000);
+    tv.tv_usec = static_cast<suseconds_t>(timeoutMs % 1000 * 1000);
+    int s = -1;
+    for (addrinfo* a = addrs; a; a = a->ai_next) {
+        s = socket(a->ai_family, a->ai_socktype | SOCK_CLOEXEC, a->ai_protocol);
+        if (s < 0)
+            continue;
+        setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+        setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+        if (connect(s, a->ai_addr, a->ai_addrlen) == 0)
+            break;
+        close(s);
+        s = -1;
+    }
+    freeaddrinfo(addrs);
+    return s;
+}
+
+// Reads `count` single-line replies; false on timeout, EOF or any reply
+// that is an error
+bool expectReplies(int fd, size_t count, std::string& firstError) {
+    std::string in;
+    size_t used = 0;
+    char buf[4096];
+    bool ok = true;
+    while (count > 0) {
+        size_t crlf = in.find("\r\n", used);
+        if (crlf == std::string::npos) {
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0) {
+                if (firstError.empty())
+                    firstError = "IOERR error or timeout reading from target instance";
+                return false;
+            }
+            in.append(buf, static_cast<size_t>(n));
+            continue;
+        }
+        if (in[used] == '-' && ok) {
+            firstError = "IOERR target instance replied: " + in.substr(used + 1, crlf - used - 1);
+            ok = false;
+        }
+        used = crlf + 2;
+        count--;
+    }
+    return ok;
+}
+
+std::runtime_error systemError(const std::string& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+
+bool readFile(const std::string& path, std::string& out) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return false;
+    char chunk[64 * 1024];
+    ssize_t n;
+    while ((n = read(fd, chunk, sizeof(chunk))) > 0)
+        out.append(chunk, static_cast<size_t>(n));
+    close(fd);
+    return n == 0;
+}
+}
+
+RespServer::RespServer(RedisLite& redis, const RespServerConfig& config)
+    : redis(redis), config(config) {}
+
+RespServer::~RespServer() {
+    stop();
+}
+
+void RespServer::start() {
+    if (running.load())
+        return;
+
+    listenFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (listenFd < 0)
+        throw systemError("socket");
+
+    int one = 1;
+    setsockopt(listenFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(config.port);
+    if (inet_pton(AF_INET, config.bindAddress.c_str(), &addr.sin_addr) != 1) {
+        close(listenFd);
+        listenFd = -1;
+        throw std::runtime_error("invalid bind address: " + config.bindAddress);
+    }
+    if (bind(listenFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+        listen(listenFd, config.backlog) < 0) {
+        auto err = systemError("bind/listen");
+        close(listenFd);
+        listenFd = -1;
+        throw err;
+    }
+
+    socklen_t len = sizeof(addr);
+    getsockname(listenFd, reinterpret_cast<sockaddr*>(&addr), &len);
+    boundPort = ntohs(addr.sin_port);
+
+    size_t n = config.ioThreads ? config.ioThreads : 1;
+    for (size_t i = 0; i < n; i++) {
+        auto io = std::make_unique<IoThread>();
+        io->index = i;
+        io->nextConnectionId = n + i; // low ids are taken by kListenerId
+        io->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        io->wakeFd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (io->epollFd < 0 || io->wakeFd < 0)
+            throw systemError("epoll/eventfd");
+
+        epoll_event ev{};
+        ev.events = EPOLLIN | EPOLLET;
+        ev.data.u64 = kWakeId;
+        epoll_ctl(io->epollFd, EPOLL_CTL_ADD, io->wakeFd, &ev);
+        if (i == 0) {
+            ev.data.u64 = kListenerId;
+            epoll_ctl(io->epollFd, EPOLL_CTL_ADD, listenFd, &ev);
+        }
+        ioThreads.push_back(std::move(io));
+    }
+
+    running = true;
+    for (auto& io : ioThreads)
+        io->thread = std::thread(&RespServer::run, this, std::ref(*io));
+
+    if (!config.clusterAddress.empty())
+        cluster = std::make_unique<ClusterState>(config.clusterAddress);
+    backgroundStopping = false;
+    backgroundThread = std::thread(&RespServer::runBackground, this);
+
+    syncPath = config.syncPath.empty() ? "replsync-" + std::to_string(boundPort) + ".rls"
+                                       : config.syncPath;
+    if (ReplicationBacklog* backlog = redis.replicationBacklog())
+        backlog->setListener([this]() { onBacklogAppend(); });
+    if (!config.replicaOfHost.empty()) {
+        replicaLink = std::make_unique<ReplicaLink>(redis, config.replicaOfHost,
+                                                    config.replicaOfPort, syncPath + ".incoming");
+        replicaLink->start();
+    }
+
+    if (config.metricsPort) {
+        metricsFd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        addr.sin_port = htons(config.metricsPort);
+        if (metricsFd < 0 ||
+            setsockopt(metricsFd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+            bind(metricsFd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0 ||
+            listen(metricsFd, config.backlog) < 0) {
+            auto err = systemError("metrics bind/listen");
+            stop();
+            throw err;
+        }
+        metricsThread = std::thread(&RespServer::runMetrics, this);
+    }
+}
+
+void RespServer::stop() {
+    if (!running.exchange(false))
+        return;
+
+    replicaLink.reset();
+    {
+        std::lock_guard<std::mutex> lock(backgroundMutex);
+        backgroundStopping = true;
+    }
+    backgroundCv.notify_all();
+    backgroundThread.join();
+    if (metricsThread.joinable())
+        metricsThread.join();
+    if (metricsFd >= 0) {
+        close(metricsFd);
+        metricsFd = -1;
+    }
+    backgroundJobs.clear();
+    syncWaiting.clear();
+    if (ReplicationBacklog* backlog = redis.replicationBacklog())
+        backlog->setListener(nullptr);
+
+    for (auto& io : ioThreads) {
+        wake(*io);
+        io->thread.join();
+    }
+
+    // Workers may still hold commands that point back at us
+    while (inFlight.load(std::memory_order_acquire) > 0)
+        std::this_thread::yield();
+
+    for (auto& io : ioThreads) {
+        for (auto& entry : io->connections)
+            close(entry.second->fd);
+        for (int fd : io->accepted)
+            close(fd);
+        close(io->epollFd);
+        close(io->wakeFd);
+    }
+    ioThreads.clear();
+    close(listenFd);
+    listenFd = -1;
+    connectedClients.store(0, std::memory_order_relaxed);
+}
+
+void RespServer::wake(IoThread& io) {
+    uint64_t one = 1;
+    ssize_t ignored = write(io.wakeFd, &one, sizeof(one));
+    (void)ignored;
+}
+
+void RespServer::run(IoThread& io) {
+    epoll_event events[kMaxEvents];
+
+    while (running.load(std::memory_order_relaxed)) {
+        int n = epoll_wait(io.epollFd, events, kMaxEvents, -1);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            break;
+        }
+
+        for (int i = 0; i < n; i++) {
+            uint64_t id = events[i].data.u64;
+            if (id == kListenerId) {
+                acceptAll();
+                continue;
+            }
+            if (id == kWakeId) {
+                uint64_t count;
+                while (read(io.wakeFd, &count, sizeof(count)) > 0) {
+                }
+                drainInbox(io);
+                continue;
+            }
+
+            auto it = io.connections.find(id);
+            if (it == io.connections.end())
+                continue;
+            Connection& conn = *it->second;
+            if (events[i].events & (EPOLLERR | EPOLLHUP)) {
+                closeConnection(conn);
+                continue;
+            }
+            if (events[i].events & EPOLLIN)
+                handleRead(conn);
+            if (events[i].events & EPOLLOUT)
+                io.dirty.push_back(id);
+        }
+
+        // Flush once per loop turn so pipelined replies share a writev
+        std::vector<uint64_t> toFlush;
+        toFlush.swap(io.dirty);
+        std::sort(toFlush.begin(), toFlush.end());
+        toFlush.erase(std::unique(toFlush.begin(), toFlush.end()), toFlush.end());
+        for (uint64_t id : toFlush) {
+            auto it = io.connections.find(id);
+            if (it != io.connections.end())
+                flush(*it->second);
+        }
+    }
+}
+
+// Runs on ioThreads[0]; deals the new sockets out round-robin
+void RespServer::acceptAll() {
+    while (true) {
+        int fd = accept4(listenFd, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0)
+            return; // EAGAIN, or a transient error the next event retries
+
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        setNonBlocking(fd);
+
+        IoThread& target = *ioThreads[nextIoThread++ % ioThreads.size()];
+        if (target.index == 0) {
+            adopt(target, fd);
+            continue;
+        }
+        bool wasEmpty;
+        {
+            std::lock_guard<std::mutex> lock(target.inboxMutex);
+            wasEmpty = target.accepted.empty() && target.completions.empty();
+            target.accepted.push_back(fd);
+        }
+        if (wasEmpty)
+            wake(target);
+    }
+}
+
+void RespServer::adopt(IoThread& io, int fd) {
+    auto conn = std::make_unique<Connection>();
+    conn->id = io.nextConnectionId;
+    io.nextConnectionId += ioThreads.size();
+    conn->fd = fd;
+    conn->io = &io;
+
+    epoll_event ev{};
+    ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    ev.data.u64 = conn->id;
+    io.connections.emplace(conn->id, std::move(conn));
+    epoll_ctl(io.epollFd, EPOLL_CTL_ADD, fd, &ev);
+    connectedClients.fetch_add(1, std::memory_order_relaxed);
+    totalConnections.fetch_add(1, std::memory_order_relaxed);
+}
+
+// Makes room at the end of the receive block. A block still referenced by
+// in-flight commands is never written below `inUsed`; the unfinished
+// request at its tail, if any, moves to a fresh block instead.
+void RespServer::reserveInput(Connection& conn) {
+    if (!conn.in) {
+        conn.in = RecvBuffer::create(kRecvBlock);
+        conn.inUsed = 0;
+        return;
+    }
+
+    size_t from = conn.parser.pendingStart();
+    size_t tail = conn.inUsed - from;
+    if (from == conn.inUsed && conn.in->unique()) {
+        // Nothing pending and nobody else reading: reuse in place
+        conn.inUsed = 0;
+        conn.parser.rebase();
+        return;
+    }
+    if (conn.inUsed < conn.in->capacity())
+        return;
+
+    size_t need = std::max(conn.parser.pendingSize(), tail) + kRecvBlock;
+    RecvBuffer::Ref next = RecvBuffer::create(std::max(need, kRecvBlock));
+    std::memcpy(next->data(), conn.in->data() + from, tail);
+    conn.in = std::move(next);
+    conn.inUsed = tail;
+    conn.parser.rebase();
+}
+
+void RespServer::handleRead(Connection& conn) {
+    // Edge-triggered: read until the socket is drained
+    bool eof = false;
+    while (!conn.closeAfterFlush) {
+        reserveInput(conn);
+        ssize_t n = read(conn.fd, conn.in->data() + conn.inUsed,
+                         conn.in->capacity() - conn.inUsed);
+        if (n > 0) {
+            conn.inUsed += static_cast<size_t>(n);
+            parseInput(conn);
+            continue;
+        }
+        if (n == 0)
+            eof = true;
+        else if (errno == EINTR)
+            continue;
+        else if (errno != EAGAIN && errno != EWOULDBLOCK)
+            eof = true;
+        break;
+    }
+
+    conn.io->dirty.push_back(conn.id);
+    if (eof)
+        conn.closeAfterFlush = true;
+}
+
+void RespServer::parseInput(Connection& conn) {
+    std::vector<std::string_view> args;
+    while (!conn.closeAfterFlush) {
+        RespParser::Result r = conn.parser.next(conn.in->data(), conn.inUsed, args);
+        if (r == RespParser::Result::Incomplete)
+            break;
+        if (r == RespParser::Result::Error) {
+            Reply reply;
+            reply.head = error("ERR Protocol error");
+            reply.ready = true;
+            conn.replies.push_back(std::move(reply));
+            conn.nextSeq++;
+            conn.closeAfterFlush = true;
+            break;
+        }
+        // A replica only listens once it has sent PSYNC
+        if (!args.empty() && !conn.replica) {
+            handleCommand(conn, args);
+            if (conn.replies.back().waiting)
+                conn.unfinished++;
+        }
+    }
+}
+
+void RespServer::submit(Connection& conn, uint64_t seq, uint32_t part, CommandType type,
+                        std::string_view key, std::string_view value, int ttlSeconds,
+                        bool onlyIfExists, bool onlyIfMissing,
+                        std::vector<std::string_view> args) {
+    Command cmd;
+    cmd.type = type;
+    cmd.buffer = conn.in;
+    cmd.keyView = key;
+    cmd.valueView = value;
+    cmd.args = std::move(args);
+    cmd.ttlSeconds = ttlSeconds;
+    cmd.onlyIfExists = onlyIfExists;
+    cmd.onlyIfMissing = onlyIfMissing;
+    cmd.sink = this;
+    cmd.tag.connection = conn.id;
+    cmd.tag.sequence = seq;
+    cmd.tag.part = part;
+    // A GET may only overtake queued writes when none of them is this
+    // client's
+    cmd.priority = type == CommandType::GET && conn.unfinished == 0;
+
+    inFlight.fetch_add(1, std::memory_order_relaxed);
+    if (!redis.dispatch(std::move(cmd)))
+        refuse(conn, seq, cmd);
+}
+
+// For a key or value that is not a view into the receive buffer
+void RespServer::submitOwned(Connection& conn, uint64_t seq, Command&& cmd) {
+    cmd.sink = this;
+    cmd.tag.connection = conn.id;
+    cmd.tag.sequence = seq;
+
+    inFlight.fetch_add(1, std::memory_order_relaxed);
+    if (!redis.dispatch(std::move(cmd)))
+        refuse(conn, seq, cmd);
+}
+
+// A part the shard's queue turned away (queueOverflow): the whole reply
+// becomes -OVERLOADED once any parts that did get in have finished
+void RespServer::refuse(Connection& conn, uint64_t seq, Command& cmd) {
+    inFlight.fetch_sub(1, std::memory_order_relaxed);
+    delete cmd.scan; // a SCAN step, freed by the shard otherwise
+    Reply& reply = conn.replies[seq - conn.baseSeq];
+    reply.overloaded = true;
+    // Still inside handleCommand, so not yet counted in `unfinished`
+    if (--reply.waiting == 0)
+        finish(reply);
+}
+
+void RespServer::handleCommand(Connection& conn, const std::vector<std::string_view>& args) {
+    char nameBuf[16];
+    std::string_view name = upper(args[0], nameBuf);
+    uint64_t seq = conn.nextSeq++;
+    conn.replies.emplace_back();
+    Reply& reply = conn.replies.back();
+    size_t argc = args.size();
+
+    auto ready = [&](std::string encoded) {
+        reply.head = std::move(encoded);
+        reply.ready = true;
+    };
+
+    if (replicaLink && (name == "SET" || name == "SETEX" || name == "DEL" || name == "MSET" ||
+                        name == "MIGRATE" || name == "RESTORE" || name == "INCR" ||
+                        name == "DECR" || name == "INCRBY" || name == "DECRBY" ||
+                        name == "APPEND" || name == "GETSET" || name == "CAS")) {
+        ready(error("READONLY You can't write against a read only replica."));
+        return;
+    }
+    bool asking = conn.asking;
+    conn.asking = false;
+
+    if (name == "PING") {
+        if (argc > 2)
+            ready(arityError(name));
+        else
+            ready(argc == 2 ? bulk(args[1]) : "+PONG\r\n");
+    } else if (name == "ECHO") {
+        ready(argc == 2 ? bulk(args[1]) : arityError(name));
+    } else if (name == "QUIT") {
+        ready("+OK\r\n");
+        conn.closeAfterFlush = true;
+    } else if (name == "SELECT") {
+        if (argc != 2)
+            ready(arityError(name));
+        else
+            ready(args[1] == "0" ? "+OK\r\n" : error("ERR DB index is out of range"));
+    } else if (name == "BGREWRITEAOF") {
+        if (redis.rewriteAof())
+            ready("+Background append only file rewriting started\r\n");
+        else if (redis.aofStats().rewriting)
+            ready(error("ERR Background append only file rewriting already in progress"));
+        else
+            ready(error("ERR append only file is disabled"));
+    } else if (name == "BGSAVE" || name == "SAVE") {
+        // SAVE blocks only this I/O loop; the shards keep serving meanwhile
+        if (name == "BGSAVE" ? redis.bgsave() : redis.save())
+            ready(name == "BGSAVE" ? "+Background saving started\r\n" : "+OK\r\n");
+        else if (redis.snapshotStats().inProgress)
+            ready(error("ERR Background save already in progress"));
+        else
+            ready(error("ERR snapshot failed or no snapshot path is configured"));
+    } else if (name == "PSYNC") {
+        if (argc != 3)
+            ready(arityError(name));
+        else
+            handlePsync(conn, seq, args);
+    } else if (name == "ROLE") {
+        if (replicaLink) {
+            ReplicaStats link = replicaLink->stats();
+            ready("*5\r\n$5\r\nslave\r\n" + bulk(config.replicaOfHost) + ":" +
+                  std::to_string(config.replicaOfPort) + "\r\n" +
+                  bulk(link.linkUp ? "connected" : "connect") + ":" +
+                  std::to_string(link.offset) + "\r\n");
+        } else {
+            ReplicationBacklog* backlog = redis.replicationBacklog();
+            ready("*3\r\n$6\r\nmaster\r\n:" + std::to_string(backlog ? backlog->offset() : 0) +
+                  "\r\n*0\r\n");
+        }
+    } else if (name == "CLUSTER") {
+        handleCluster(conn, seq, args);
+    } else if (name == "ASKING") {
+        if (!cluster) {
+            ready(error("ERR This instance has cluster support disabled"));
+            return;
+        }
+        conn.asking = true;
+        ready("+OK\r\n");
+    } else if (name == "MIGRATE") {
+        handleMigrate(conn, seq, args);
+    } else if (name == "INFO") {
+        if (argc > 2) {
+            ready(arityError(name));
+            return;
+        }
+        char sectionBuf[16];
+        std::string_view section = argc == 2 ? upper(args[1], sectionBuf) : std::string_view();
+        std::string text = redis.info(argc == 2 ? args[1] : std::string_view());
+        if (section.empty() || section == "DEFAULT" || section == "ALL" ||
+            section == "EVERYTHING" || section == "CLIENTS") {
+            if (!text.empty())
+                text += "\r\n";
+            text += clientsInfo();
+        }
+        ready(bulk(text));
+    } else if (name == "SLOWLOG") {
+        handleSlowlog(conn, args);
+    } else if (name == "SCAN" || name == "SCANPREFIX") {
+        handleScan(conn, seq, args);
+    } else if (name == "LATENCY") {
+        handleLatency(conn, args);
+    } else if (name == "COMMAND" || name == "CONFIG") {
+        // Probed by clients and redis-benchmark on connect
+        ready("*0\r\n");
+    } else if (name == "GET") {
+        if (argc != 2) {
+            ready(arityError(name));
+            return;
+        }
+        if (!routeKeys(conn, args, 1, 1, asking, reply))
+            return;
+        std::string value;
+        if (conn.unfinished == 0 && reply.redirect.empty()) {
+            ReadResult read = redis.readLockFree(args[1], value);
+            if (read != ReadResult::Queue) {
+                ready(read == ReadResult::Found ? bulk(value) : "$-1\r\n");
+                return;
+            }
+        }
+        reply.kind = ReplyKind::Bulk;
+        reply.waiting = 1;
+        submit(conn, seq, 0, CommandType::GET, args[1], {}, 0);
+    } else if (name == "SET" || name == "SETEX") {
+        long long ttl = 0;
+        std::string_view key, value;
+        if (name == "SETEX") {
+            if (argc != 4) {
+                ready(arityError(name));
+                return;
+            }
+            if (!parseInt(args[2], ttl) || ttl <= 0 || ttl > INT_MAX) {
+                ready(error("ERR invalid expire time in 'setex' command"));
+                return;
+            }
+            key = args[1];
+            value = args[3];
+        } else {
+            if (argc != 3 && argc != 5) {
+                ready(argc < 3 ? arityError(name) : error("ERR syntax error"));
+                return;
+            }
+            if (argc == 5) {
+                char optionBuf[16];
+                std::string_view option = upper(args[3], optionBuf);
+                long long amount;
+                if ((option != "EX" && option != "PX" && option != "PXAT") ||
+                    !parseInt(args[4], amount)) {
+                    ready(error("ERR syntax error"));
+                    return;
+                }
+                // TTLs are kept in whole seconds; round PX up. PXAT is how
+                // MIGRATE hands over a deadline; one already past keeps
+                // the key for its last second rather than failing the move.
+                if (option == "PXAT" && amount > 0)
+                    amount = std::max(amount - unixNowMs(), 1LL);
+                ttl = option == "EX" ? amount : (amount + 999) / 1000;
+                if (amount <= 0 || ttl > INT_MAX) {
+                    ready(error("ERR invalid expire time in 'set' command"));
+                    return;
+                }
+            }
+            key = args[1];
+            value = args[2];
+        }
+        if (!routeKeys(conn, args, 1, argc, asking, reply))
+            return;
+        reply.kind = ReplyKind::Ok;
+        reply.waiting = 1;
+        // A slot migrating away only takes writes to keys still here
+        submit(conn, seq, 0, ttl ? CommandType::SET_TTL : CommandType::SET,
+               key, value, static_cast<int>(ttl), !reply.redirect.empty());
+    } else if (name == "DEL") {
+        if (argc < 2) {
+            ready(arityError(name));
+            return;
+        }
+        if (!routeKeys(conn, args, 1, 1, asking, reply))
+            return;
+        reply.kind = ReplyKind::Integer;
+        reply.waiting = argc - 1;
+        for (size_t i = 1; i < argc; i++)
+            submit(conn, seq, static_cast<uint32_t>(i - 1), CommandType::DEL, args[i], {}, 0);
+    } else if (name == "MGET") {
+        if (argc < 2) {
+            ready(arityError(name));
+            return;
+        }
+        if (!routeKeys(conn, args, 1, 1, asking, reply))
+            return;
+        reply.kind = ReplyKind::Array;
+        reply.waiting = argc - 1;
+        reply.parts.resize(argc - 1);
+        for (size_t i = 1; i < argc; i++)
+            submit(conn, seq, static_cast<uint32_t>(i - 1), CommandType::GET, args[i], {}, 0);
+    } else if (name == "INCR" || name == "DECR" || name == "INCRBY" || name == "DECRBY") {
+        bool by = name == "INCRBY" || name == "DECRBY";
+        if (argc != (by ? 3u : 2u)) {
+            ready(arityError(name));
+            return;
+        }
+        // DECRBY is INCRBY of the negated amount, checked here so the
+        // shard only sees a valid delta
+        std::string delta = by ? std::string(args[2]) : "1";
+        if (name[0] == 'D') {
+            long long amount;
+            if (!parseInt(delta, amount) || amount == LLONG_MIN) {
+                ready(error("ERR value is not an integer or out of range"));
+                return;
+            }
+            delta = std::to_string(-amount);
+        }
+        if (!routeKeys(conn, args, 1, argc, asking, reply))
+            return;
+        reply.kind = ReplyKind::Number;
+        reply.waiting = 1;
+        // The delta may be a temporary: send it as the owned value
+        Command cmd;
+        cmd.type = CommandType::INCRBY;
+        cmd.key = std::string(args[1]);
+        cmd.value = std::move(delta);
+        cmd.onlyIfExists = !reply.redirect.empty();
+        submitOwned(conn, seq, std::move(cmd));
+    } else if (name == "APPEND" || name == "GETSET") {
+        if (argc != 3) {
+            ready(arityError(name));
+            return;
+        }
+        if (!routeKeys(conn, args, 1, argc, asking, reply))
+            return;
+        reply.kind = name == "APPEND" ? ReplyKind::Number : ReplyKind::Bulk;
+        reply.waiting = 1;
+        submit(conn, seq, 0, name == "APPEND" ? CommandType::APPEND : CommandType::GETSET,
+               args[1], args[2], 0, !reply.redirect.empty());
+    } else if (name == "GETRANGE") {
+        if (argc != 4) {
+            ready(arityError(name));
+            return;
+        }
+        long long start, end;
+        if (!parseInt(args[2], start) || !parseInt(args[3], end)) {
+            ready(error("ERR value is not an integer or out of range"));
+            return;
+        }
+        if (!routeKeys(conn, args, 1, argc, asking, reply))
+            return;
+        reply.kind = ReplyKind::Bulk;
+        reply.waiting = 1;
+        submit(conn, seq, 0, CommandType::GETRANGE, args[1], {}, 0, !reply.redirect.empty(),
+               false, {args[2], args[3]});
+    } else if (name == "CAS") {
+        // CAS key expected desired: not in Redis, which needs WATCH /
+        // MULTI or a script for this
+        if (argc != 4) {
+            ready(arityError(name));
+            return;
+        }
+        if (!routeKeys(conn, args, 1, argc, asking, reply))
+            return;
+        reply.kind = ReplyKind::Number;
+        reply.waiting = 1;
+        submit(conn, seq, 0, CommandType::CAS, args[1], args[2], 0, !reply.redirect.empty(),
+               false, {args[3]});
+    } else if (name == "TYPE") {
+        if (argc != 2) {
+            ready(arityError(name));
+            return;
+        }
+        if (!routeKeys(conn, args, 1, 1, asking, reply))
+            return;
+        reply.kind = ReplyKind::Raw;
+        reply.waiting = 1;
+        submit(conn, seq, 0, CommandType::TYPE, args[1], {}, 0, !reply.redirect.empty());
+    } else if (name == "OBJECT") {
+        char subBuf[16];
+        if (argc != 3 || upper(args[1], subBuf) != "ENCODING") {
+            ready(error("ERR unknown subcommand or wrong number of arguments for 'OBJECT'"));
+            return;
+        }
+        if (!routeKeys(conn, args, 2, 1, asking, reply))
+            return;
+        reply.kind = ReplyKind::Raw;
+        reply.waiting = 1;
+        submit(conn, seq, 0, CommandType::OBJECT_ENCODING, args[2], {}, 0,
+               !reply.redirect.empty());
+    } else if (name == "RESTORE") {
+        handleRestore(conn, seq, args, asking);
+    } else if (name == "MSET") {
+        if (argc < 3 || argc % 2 == 0) {
+            ready(arityError(name));
+            return;
+        }
+        if (!routeKeys(conn, args, 1, 2, asking, reply))
+            return;
+        reply.kind = ReplyKind::Ok;
+        reply.waiting = (argc - 1) / 2;
+        for (size_t i = 1; i + 1 < argc; i += 2)
+            submit(conn, seq, static_cast<uint32_t>(i / 2), CommandType::SET,
+                   args[i], args[i + 1], 0);
+    } else if (const CollectionCommand* command = findCollectionCommand(name)) {
+        handleTyped(conn, seq, args, *command, asking);
+    } else {
+        ready(error("ERR unknown command '" + std::string(args[0]) + "'"));
+    }
+}
+
+// Hash, list, set and sorted set commands: the shard runs them and
+// replies in RESP itself
+void RespServer::handleTyped(Connection& conn, uint64_t seq,
+                             const std::vector<std::string_view>& args,
+                             const CollectionCommand& command, bool asking) {
+    Reply& reply = conn.replies.back();
+    auto ready = [&](std::string encoded) {
+        reply.head = std::move(encoded);
+        reply.ready = true;
+    };
+    if (!arityMatches(command, args.size())) {
+        ready(arityError(command.name));
+        return;
+    }
+    if (replicaLink && command.write) {
+        ready(error("READONLY You can't write against a read only replica."));
+        return;
+    }
+    if (!routeKeys(conn, args, 1, args.size(), asking, reply))
+        return;
+    reply.kind = ReplyKind::Raw;
+    reply.waiting = 1;
+    // A slot migrating away only serves the keys still here
+    submit(conn, seq, 0, command.type, args[1], {}, 0, !reply.redirect.empty(), false,
+           std::vector<std::string_view>(args.begin() + 2, args.end()));
+}
+
+// SCAN cursor [MATCH pattern] [COUNT count] [TYPE type], and the prefix
+// query SCANPREFIX prefix [AFTER key] [MATCH ...] [COUNT ...] [TYPE ...],
+// whose cursor is the last key returned. Both run as one bounded step on
+// the workers, and the shard that finishes the job sends the reply.
+void RespServer::handleScan(Connection& conn, uint64_t seq,
+                            const std::vector<std::string_view>& args) {
+    Reply& reply = conn.replies.back();
+    auto ready = [&](std::string encoded) {
+        reply.head = std::move(encoded);
+        reply.ready = true;
+    };
+    char nameBuf[16];
+    bool prefix = upper(args[0], nameBuf) == "SCANPREFIX";
+    if (args.size() < 2 || args.size() % 2 != 0) {
+        ready(args.size() < 2 ? arityError(prefix ? "SCANPREFIX" : "SCAN")
+                              : error("ERR syntax error"));
+        return;
+    }
+    if (prefix && !redis.hasKeyIndex()) {
+        ready(error("ERR SCANPREFIX needs the key index (--key-index yes)"));
+        return;
+    }
+
+    auto job = std::make_unique<ScanJob>();
+    if (prefix) {
+        job->prefix = args[1];
+    } else {
+        auto r = std::from_chars(args[1].data(), args[1].data() + args[1].size(), job->cursor);
+        if (r.ec != std::errc() || r.ptr != args[1].data() + args[1].size()) {
+            ready(error("ERR invalid cursor"));
+            return;
+        }
+    }
+    for (size_t i = 2; i < args.size(); i += 2) {
+        char optionBuf[16];
+        std::string_view option = upper(args[i], optionBuf);
+        long long count;
+        if (option == "MATCH") {
+            job->pattern = args[i + 1];
+            if (job->pattern == "*")
+                job->pattern.clear();
+        } else if (option == "COUNT") {
+            if (!parseInt(args[i + 1], count) || count < 1) {
+                ready(error("ERR syntax error"));
+                return;
+            }
+            job->count = static_cast<size_t>(count);
+        } else if (option == "TYPE") {
+            // An unknown type matches nothing, as in Redis
+            job->type = int(ValueType::ZSet) + 1;
+            for (int t = 0; t <= int(ValueType::ZSet); t++) {
+                if (args[i + 1] == typeName(static_cast<ValueType>(t)))
+                    job->type = t;
+            }
+        } else if (option == "AFTER" && prefix) {
+            job->after = args[i + 1];
+        } else {
+            ready(error("ERR syntax error"));
+            return;
+        }
+    }
+
+    reply.kind = ReplyKind::Raw;
+    reply.waiting = 1;
+    Command cmd;
+    cmd.type = prefix ? CommandType::SCAN_PREFIX : CommandType::SCAN;
+    cmd.scan = job.release(); // freed by the shard that replies
+    submitOwned(conn, seq, std::move(cmd));
+}
+
+// RESTORE key ttl payload [REPLACE] [ABSTTL]: how MIGRATE hands over a
+// collection. The payload is serializeValue()'s, not Redis's RDB format.
+void RespServer::handleRestore(Connection& conn, uint64_t seq,
+                               const std::vector<std::string_view>& args, bool asking) {
+    Reply& reply = conn.replies.back();
+    auto ready = [&](std::string encoded) {
+        reply.head = std::move(encoded);
+        reply.ready = true;
+    };
+    if (args.size() < 4) {
+        ready(arityError("RESTORE"));
+        return;
+    }
+    bool replace = false, absolute = false;
+    for (size_t i = 4; i < args.size(); i++) {
+        char optionBuf[16];
+        std::string_view option = upper(args[i], optionBuf);
+        if (option == "REPLACE") {
+            replace = true;
+        } else if (option == "ABSTTL") {
+            absolute = true;
+        } else {
+            ready(error("ERR syntax error"));
+            return;
+        }
+    }
+    long long ttl;
+    if (!parseInt(args[2], ttl) || ttl < 0) {
+        ready(error("ERR Invalid TTL value, must be >= 0"));
+        return;
+    }
+    // Whole seconds, rounded up; a deadline already past keeps the key for
+    // its last second, as SET PXAT does
+    if (absolute && ttl > 0)
+        ttl = std::max(ttl - unixNowMs(), 1LL);
+    ttl = (ttl + 999) / 1000;
+    if (ttl > INT_MAX) {
+        ready(error("ERR Invalid TTL value, must be >= 0"));
+        return;
+    }
+    if (!routeKeys(conn, args, 1, args.size(), asking, reply))
+        return;
+    reply.kind = ReplyKind::Raw;
+    reply.waiting = 1;
+    submit(conn, seq, 0, CommandType::RESTORE, args[1], args[3], static_cast<int>(ttl),
+           false, !replace);
+}
+
+// Shard worker thread
+void RespServer::deliver(const ReplyTag& tag, int64_t status, std::string&& value) {
+    IoThread& io = *ioThreads[tag.connection % ioThreads.size()];
+    bool wasEmpty;
+    {
+        std::lock_guard<std::mutex> lock(io.inboxMutex);
+        wasEmpty = io.completions.empty() && io.accepted.empty();
+        io.completions.push_back(Completion{tag, status, std::move(value), ValueRef()});
+    }
+    // Only the first message of a round needs to wake the loop
+    if (wasEmpty)
+        wake(io);
+    inFlight.fetch_sub(1, std::memory_order_release);
+}
+
+void RespServer::deliverShared(const ReplyTag& tag, int64_t status, ValueRef&& value) {
+    IoThread& io = *ioThreads[tag.connection % ioThreads.size()];
+    bool wasEmpty;
+    {
+        std::lock_guard<std::mutex> lock(io.inboxMutex);
+        wasEmpty = io.completions.empty() && io.accepted.empty();
+        io.completions.push_back(Completion{tag, status, std::string(), std::move(value)});
+    }
+    if (wasEmpty)
+        wake(io);
+    inFlight.fetch_sub(1, std::memory_order_release);
+}
+
+// Background thread: a reply that was left waiting, already encoded
+void RespServer::post(const ReplyTag& tag, std::string encoded) {
+    IoThread& io = *ioThreads[tag.connection % ioThreads.size()];
+    {
+        std::lock_guard<std::mutex> lock(io.inboxMutex);
+        io.completions.push_back(Completion{tag, 0, std::move(encoded), ValueRef()});
+    }
+    wake(io);
+}
+
+void RespServer::drainInbox(IoThread& io) {
+    std::vector<Completion> ready;
+    std::vector<int> fds;
+    std::vector<FullSync> syncs;
+    {
+        std::lock_guard<std::mutex> lock(io.inboxMutex);
+        ready.swap(io.completions);
+        fds.swap(io.accepted);
+        syncs.swap(io.syncs);
+    }
+    for (int fd : fds)
+        adopt(io, fd);
+    for (auto& c : ready)
+        applyCompletion(io, c);
+    for (auto& sync : syncs)
+        applyFullSync(io, sync);
+    if (io.streamPending.exchange(false, std::memory_order_acq_rel))
+        io.dirty.insert(io.dirty.end(), io.replicas.begin(), io.replicas.end());
+}
+
+// PSYNC <replid> <offset>: continues from the backlog if it still holds
+// that offset, otherwise queues a full resync whose reply (carrying the
+// snapshot) the background thread fills in
+void RespServer::handlePsync(Connection& conn, uint64_t seq,
+                             const std::vector<std::string_view>& args) {
+    Reply& reply = conn.replies.back();
+    ReplicationBacklog* backlog = redis.replicationBacklog();
+    if (!backlog) {
+        reply.head = error("ERR replication is disabled on this instance");
+        reply.ready = true;
+        return;
+    }
+    conn.replica = true;
+
+    long long offset;
+    if (args[1] == backlog->id() && parseInt(args[2], offset) && offset >= 0 &&
+        backlog->covers(static_cast<uint64_t>(offset))) {
+        reply.head = "+CONTINUE\r\n";
+        reply.ready = true;
+        attachReplica(conn, static_cast<uint64_t>(offset));
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(backgroundMutex);
+        syncWaiting.push_back(ReplyTag{conn.id, seq, 0});
+        if (syncWaiting.size() > 1)
+            return; // a snapshot is already queued
+        backgroundJobs.push_back([this]() { runFullSync(); });
+    }
+    backgroundCv.notify_one();
+}
+
+void RespServer::runBackground() {
+    while (true) {
+        std::function<void()> job;
+        {
+            std::unique_lock<std::mutex> lock(backgroundMutex);
+            backgroundCv.wait(lock, [&]() { return backgroundStopping || !backgroundJobs.empty(); });
+            if (backgroundStopping)
+                return;
+            job = std::move(backgroundJobs.front());
+            backgroundJobs.pop_front();
+        }
+        job();
+    }
+}
+
+// One snapshot serves every replica that asked meanwhile
+void RespServer::runFullSync() {
+    std::vector<ReplyTag> waiting;
+    {
+        std::lock_guard<std::mutex> lock(backgroundMutex);
+        waiting.swap(syncWaiting);
+    }
+
+    FullSync sync{};
+    std::string payload;
+    sync.ok = redis.saveForSync(syncPath, sync.offset) && readFile(syncPath, payload);
+    unlink(syncPath.c_str());
+    sync.payload = ValueRef::adopt(std::move(payload));
+    for (const ReplyTag& tag : waiting) {
+        IoThread& io = *ioThreads[tag.connection % ioThreads.size()];
+        sync.tag = tag;
+        {
+            std::lock_guard<std::mutex> lock(io.inboxMutex);
+            io.syncs.push_back(sync);
+        }
+        wake(io);
+    }
+}
+
+const ClusterState::View& RespServer::clusterView(IoThread& io) {
+    uint64_t version = cluster->version();
+    if (!io.cluster || io.clusterVersion != version) {
+        io.cluster = cluster->view();
+        io.clusterVersion = version;
+    }
+    return *io.cluster;
+}
+
+// In cluster mode the keys args[first], args[first + step], ... must all
+// hash to one slot that this node serves. If not, `reply` is made ready
+// with the redirect or error and false comes back. On a slot migrating
+// away, reply.redirect is set to the -ASK that replaces a miss.
+bool RespServer::routeKeys(Connection& conn, const std::vector<std::string_view>& args,
+                           size_t first, size_t step, bool asking, Reply& reply) {
+    if (!cluster)
+        return true;
+    auto fail = [&](std::string encoded) {
+        reply.head = std::move(encoded);
+        reply.ready = true;
+        return false;
+    };
+    uint16_t slot = keySlot(args[first]);
+    size_t keys = 0;
+    for (size_t i = first; i < args.size(); i += step, keys++) {
+        if (keySlot(args[i]) != slot)
+            return fail(error("CROSSSLOT Keys in request don't hash to the same slot"));
+    }
+
+    const ClusterState::View& view = clusterView(*conn.io);
+    const ClusterState::Slot& s = view.slots[slot];
+    if (s.owner == 0) {
+        if (s.state != ClusterState::SlotState::Migrating)
+            return true;
+        // Some keys may have moved already; Redis asks for a retry too
+        if (keys > 1)
+            return fail(error("TRYAGAIN Multiple keys request during rehashing of slot"));
+        reply.redirect = "-ASK " + std::to_string(slot) + " " + view.nodes[s.peer] + "\r\n";
+        return true;
+    }
+    if (s.state == ClusterState::SlotState::Importing && asking)
+        return true;
+    // Without SETSLOT NODE here yet, the import source is the owner we know
+    int32_t owner = s.owner >= 0 ? s.owner : s.peer;
+    if (owner < 0)
+        return fail(error("CLUSTERDOWN Hash slot not served"));
+    return fail("-MOVED " + std::to_string(slot) + " " + view.nodes[owner] + "\r\n");
+}
+
+void RespServer::handleCluster(Connection& conn, uint64_t seq,
+                               const std::vector<std::string_view>& args) {
+    Reply& reply = conn.replies.back();
+    auto ready = [&](std::string encoded) {
+        reply.head = std::move(encoded);
+        reply.ready = true;
+    };
+    if (!cluster) {
+        ready(error("ERR This instance has cluster support disabled"));
+        return;
+    }
+    if (args.size() < 2) {
+        ready(arityError("CLUSTER"));
+        return;
+    }
+    char subBuf[16];
+    std::string_view sub = upper(args[1], subBuf);
+    size_t argc = args.size();
+    auto parseSlot = [&](std::string_view s, uint32_t& slot) {
+        long long n;
+        if (!parseInt(s, n) || n < 0 || n >= static_cast<long long>(kHashSlots))
+            return false;
+        slot = static_cast<uint32_t>(n);
+        return true;
+    };
+    uint32_t slot, last;
+
+    if (sub == "KEYSLOT" && argc == 3) {
+        ready(":" + std::to_string(keySlot(args[2])) + "\r\n");
+    } else if (sub == "MYID" && argc == 2) {
+        ready(bulk(cluster->self()));
+    } else if (sub == "ADDSLOTS" && argc >= 3) {
+        std::vector<uint32_t> slots(argc - 2);
+        for (size_t i = 2; i < argc; i++) {
+            if (!parseSlot(args[i], slots[i - 2])) {
+                ready(error("ERR Invalid or out of range slot"));
+                return;
+            }
+        }
+        ready(cluster->addSlots(slots) ? "+OK\r\n" : error("ERR Slot is already busy"));
+    } else if (sub == "ADDSLOTSRANGE" && argc >= 4 && argc % 2 == 0) {
+        // Every range is checked before any slot is assigned
+        std::vector<uint32_t> slots;
+        for (size_t i = 2; i < argc; i += 2) {
+            if (!parseSlot(args[i], slot) || !parseSlot(args[i + 1], last)) {
+                ready(error("ERR Invalid or out of range slot"));
+                return;
+            }
+            if (slot > last) {
+                ready(error("ERR start slot number " + std::to_string(slot) +
+                            " is greater than end slot number " + std::to_string(last)));
+                return;
+            }
+            for (uint32_t s = slot; s <= last; s++)
+                slots.push_back(s);
+        }
+        ready(cluster->addSlots(slots) ? "+OK\r\n" : error("ERR Slot is already busy"));
+    } else if (sub == "SETSLOT" && argc >= 4) {
+        if (!parseSlot(args[2], slot)) {
+            ready(error("ERR Invalid or out of range slot"));
+            return;
+        }
+        char actionBuf[16];
+        std::string_view action = upper(args[3], actionBuf);
+        std::string node = argc == 5 ? std::string(args[4]) : std::string();
+        bool ok;
+        if (action == "STABLE" && argc == 4)
+            ok = cluster->setSlotStable(slot);
+        else if (action == "NODE" && argc == 5)
+            ok = cluster->setSlotNode(slot, node);
+        else if (action == "MIGRATING" && argc == 5)
+            ok = cluster->setSlotMigrating(slot, node);
+        else if (action == "IMPORTING" && argc == 5)
+            ok = cluster->setSlotImporting(slot, node);
+        else {
+            ready(error("ERR syntax error"));
+            return;
+        }
+        ready(ok ? "+OK\r\n" : error("ERR Slot is not in a state that allows " +
+                                     std::string(action)));
+    } else if (sub == "SLOTS" && argc == 2) {
+        // Runs of consecutive slots with one owner: [first, last, [host, port]]
+        const ClusterState::View& view = clusterView(*conn.io);
+        std::string body;
+        size_t ranges = 0;
+        for (uint32_t s = 0; s < kHashSlots;) {
+            int32_t owner = view.slots[s].owner;
+            uint32_t e = s;
+            while (e + 1 < kHashSlots && view.slots[e + 1].owner == owner)
+                e++;
+            if (owner >= 0) {
+                const std::string& node = view.nodes[owner];
+                size_t colon = node.rfind(':');
+                long long port = 0;
+                parseInt(std::string_view(node).substr(colon + 1), port);
+                body += "*3\r\n:" + std::to_string(s) + "\r\n:" + std::to_string(e) +
+                        "\r\n*2\r\n" + bulk(std::string_view(node).substr(0, colon)) + ":" +
+                        std::to_string(port) + "\r\n";
+                ranges++;
+            }
+            s = e + 1;
+        }
+        ready("*" + std::to_string(ranges) + "\r\n" + body);
+    } else if (sub == "INFO" && argc == 2) {
+        const ClusterState::View& view = clusterView(*conn.io);
+        size_t assigned = 0;
+        for (const auto& s : view.slots)
+            assigned += s.owner >= 0;
+        ready(bulk("cluster_enabled:1\r\ncluster_state:" +
+                   std::string(assigned == kHashSlots ? "ok" : "fail") +
+                   "\r\ncluster_slots_assigned:" + std::to_string(assigned) +
+                   "\r\ncluster_known_nodes:" + std::to_string(view.nodes.size()) + "\r\n"));
+    } else if ((sub == "COUNTKEYSINSLOT" && argc == 3) ||
+               (sub == "GETKEYSINSLOT" && argc == 4)) {
+        long long limit = 0;
+        if (!parseSlot(args[2], slot) || (argc == 4 && (!parseInt(args[3], limit) || limit < 0))) {
+            ready(error("ERR Invalid slot or number of keys"));
+            return;
+        }
+        // The shard owning the slot counts it and walks its keys
+        reply.kind = argc == 3 ? ReplyKind::Integer : ReplyKind::Raw;
+        reply.waiting = 1;
+        Command cmd;
+        cmd.type = CommandType::SLOT_KEYS;
+        cmd.hashSlot = static_cast<uint16_t>(slot);
+        cmd.limit = static_cast<size_t>(limit);
+        cmd.sink = this;
+        cmd.tag.connection = conn.id;
+        cmd.tag.sequence = seq;
+        inFlight.fetch_add(1, std::memory_order_relaxed);
+        redis.dispatch(std::move(cmd));
+    } else {
+        ready(error("ERR unknown subcommand or wrong number of arguments for 'CLUSTER " +
+                    std::string(args[1]) + "'"));
+    }
+}
+
+// SLOWLOG GET [count] | LEN | RESET. Each entry is id, unix time,
+// microseconds and the command as [name, key, size], then the shard in
+// place of Redis's client address, and an empty client name.
+void RespServer::handleSlowlog(Connection& conn, const std::vector<std::string_view>& args) {
+    Reply& reply = conn.replies.back();
+    auto ready = [&](std::string encoded) {
+        reply.head = std::move(encoded);
+        reply.ready = true;
+    };
+    size_t argc = args.size();
+    if (argc < 2) {
+        ready(arityError("SLOWLOG"));
+        return;
+    }
+    char subBuf[16];
+    std::string_view sub = upper(args[1], subBuf);
+
+    if (sub == "GET" && argc <= 3) {
+        long long count = 10;
+        if (argc == 3 && (!parseInt(args[2], count) || count < -1)) {
+            ready(error("ERR count should be greater than or equal to -1"));
+            return;
+        }
+        std::vector<SlowLogEntry> entries =
+            redis.slowlog(count < 0 ? SIZE_MAX : static_cast<size_t>(count));
+        std::string out = "*" + std::to_string(entries.size()) + "\r\n";
+        for (const SlowLogEntry& e : entries) {
+            out += "*6\r\n:" + std::to_string(e.id) + "\r\n:" + std::to_string(e.unixTime) +
+                   "\r\n:" + std::to_string(e.durationUs) + "\r\n*3\r\n" +
+                   bulk(commandName(e.type)) + bulk(e.key) + bulk(std::to_string(e.size)) +
+                   bulk("shard" + std::to_string(e.shard)) + bulk("");
+        }
+        ready(std::move(out));
+    } else if (sub == "LEN" && argc == 2) {
+        ready(":" + std::to_string(redis.slowlogLen()) + "\r\n");
+    } else if (sub == "RESET" && argc == 2) {
+        redis.slowlogReset();
+        ready("+OK\r\n");
+    } else {
+        ready(error("ERR unknown subcommand or wrong number of arguments for 'SLOWLOG'"));
+    }
+}
+
+// LATENCY LATEST | HISTORY event | RESET [event ...]. Times are in
+// microseconds, where Redis reports milliseconds.
+void RespServer::handleLatency(Connection& conn, const std::vector<std::string_view>& args) {
+    Reply& reply = conn.replies.back();
+    auto ready = [&](std::string encoded) {
+        reply.head = std::move(encoded);
+        reply.ready = true;
+    };
+    size_t argc = args.size();
+    if (argc < 2) {
+        ready(arityError("LATENCY"));
+        return;
+    }
+    char subBuf[16];
+    std::string_view sub = upper(args[1], subBuf);
+    LatencyEvent event;
+
+    if (sub == "LATEST" && argc == 2) {
+        std::vector<LatencySpike> spikes = redis.latencyLatest();
+        std::string out = "*" + std::to_string(spikes.size()) + "\r\n";
+        for (const LatencySpike& spike : spikes) {
+            out += "*4\r\n" + bulk(latencyEventName(spike.event)) + ":" +
+                   std::to_string(spike.latest.unixTime) + "\r\n:" +
+                   std::to_string(spike.latest.us) + "\r\n:" + std::to_string(spike.maxUs) +
+                   "\r\n";
+        }
+        ready(std::move(out));
+    } else if (sub == "HISTORY" && argc == 3) {
+        if (!parseLatencyEvent(args[2], event)) {
+            ready("*0\r\n");
+            return;
+        }
+        std::vector<LatencySample> samples = redis.latencyHistory(event);
+        std::string out = "*" + std::to_string(samples.size()) + "\r\n";
+        for (const LatencySample& sample : samples) {
+            out += "*2\r\n:" + std::to_string(sample.unixTime) + "\r\n:" +
+                   std::to_string(sample.us) + "\r\n";
+        }
+        ready(std::move(out));
+    } else if (sub == "RESET") {
+        if (argc == 2) {
+            size_t events = redis.latencyLatest().size();
+            redis.latencyReset();
+            ready(":" + std::to_string(events) + "\r\n");
+            return;
+        }
+        size_t reset = 0;
+        for (size_t i = 2; i < argc; i++) {
+            if (parseLatencyEvent(args[i], event)) {
+                redis.latencyReset(event);
+                reset++;
+            }
+        }
+        ready(":" + std::to_string(reset) + "\r\n");
+    } else {
+        ready(error("ERR unknown subcommand or wrong number of arguments for 'LATENCY'"));
+    }
+}
+
+// MIGRATE host port key|"" destination-db timeout [COPY] [REPLACE] [KEYS key...]
+// The keys go out as the same SET records the AOF holds (absolute PXAT
+// deadline), each behind ASKING so an importing target takes them; the
+// reply waits on the background thread.
+void RespServer::handleMigrate(Connection& conn, uint64_t seq,
+                               const std::vector<std::string_view>& args) {
+    Reply& reply = conn.replies.back();
+    auto ready = [&](std::string encoded) {
+        reply.head = std::move(encoded);
+        reply.ready = true;
+    };
+    size_t argc = args.size();
+    long long db, timeout;
+    if (argc < 6) {
+        ready(arityError("MIGRATE"));
+        return;
+    }
+    if (!parseInt(args[4], db) || !parseInt(args[5], timeout) || timeout < 0) {
+        ready(error("ERR value is not an integer or out of range"));
+        return;
+    }
+    if (db != 0) {
+        ready(error("ERR DB index is out of range"));
+        return;
+    }
+    bool copy = false;
+    std::vector<std::string> keys;
+    for (size_t i = 6; i < argc; i++) {
+        char optionBuf[16];
+        std::string_view option = upper(args[i], optionBuf);
+        if (option == "COPY") {
+            copy = true;
+        } else if (option == "REPLACE") {
+            // SET always replaces
+        } else if (option == "KEYS" && args[3].empty()) {
+            keys.assign(args.begin() + static_cast<std::ptrdiff_t>(i) + 1, args.end());
+            break;
+        } else {
+            ready(error("ERR syntax error"));
+            return;
+        }
+    }
+    if (!args[3].empty())
+        keys.emplace_back(args[3]);
+    if (keys.empty()) {
+        ready("+NOKEY\r\n");
+        return;
+    }
+
+    reply.kind = ReplyKind::Raw;
+    reply.waiting = 1;
+    ReplyTag tag{conn.id, seq, 0};
+    std::string host(args[1]), port(args[2]);
+    {
+        std::lock_guard<std::mutex> lock(backgroundMutex);
+        backgroundJobs.push_back([this, tag, host, port, keys, timeout, copy]() {
+            migrate(tag, host, port, keys, timeout ? timeout : 1000, copy);
+        });
+    }
+    backgroundCv.notify_one();
+}
+
+// Background thread. A key is only deleted here if its value is still
+// the one the target acknowledged; one written meanwhile stays, and one
+// deleted meanwhile is deleted on the target as well.
+void RespServer::migrate(ReplyTag tag, std::string host, std::string port,
+                         std::vector<std::string> keys, long long timeoutMs, bool copy) {
+    static const std::string kAsking = "*1\r\n$6\r\nASKING\r\n";
+    std::vector<std::string> records = redis.dumpKeys(keys);
+    std::string request;
+    std::vector<std::pair<std::string, std::string>> sent;
+    std::vector<std::string_view> recordArgs;
+    for (size_t i = 0; i < records.size(); i++) {
+        RespParser parser;
+        AppendOnlyFile::Record rec;
+        if (records[i].empty() ||
+            parser.next(records[i].data(), records[i].size(), recordArgs) !=
+                RespParser::Result::Command ||
+            !AppendOnlyFile::decode(recordArgs, rec))
+            continue;
+        request += kAsking;
+        request += records[i];
+        sent.emplace_back(keys[i], std::string(rec.value));
+    }
+    if (sent.empty()) {
+        post(tag, "+NOKEY\r\n");
+        return;
+    }
+
+    int fd = connectTo(host, port, timeoutMs);
+    if (fd < 0) {
+        post(tag, error("IOERR error or timeout connecting to the client"));
+        return;
+    }
+    std::string failure;
+    bool ok = sendAll(fd, request) && expectReplies(fd, 2 * sent.size(), failure);
+    if (ok && !copy) {
+        std::string deletes;
+        size_t count = 0;
+        std::vector<int64_t> statuses = redis.deleteIfValue(sent);
+        for (size_t i = 0; i < sent.size(); i++) {
+            if (statuses[i] != 0)
+                continue;
+            deletes += kAsking;
+            AppendOnlyFile::encodeDel(deletes, sent[i].first);
+            count++;
+        }
+        if (count)
+            ok = sendAll(fd, deletes) && expectReplies(fd, 2 * count, failure);
+    }
+    close(fd);
+    if (ok)
+        post(tag, "+OK\r\n");
+    else
+        post(tag, error(failure.empty() ? "IOERR error writing to target instance" : failure));
+}
+
+void RespServer::applyFullSync(IoThread& io, FullSync& sync) {
+    auto it = io.connections.find(sync.tag.connection);
+    if (it == io.connections.end())
+        return; // replica went away
+    Connection& conn = *it->second;
+    Reply& reply = conn.replies[sync.tag.sequence - conn.baseSeq];
+    if (sync.ok) {
+        reply.head = "+FULLRESYNC " + redis.replicationBacklog()->id() + " " +
+                     std::to_string(sync.offset) + "\r\n$" +
+                     std::to_string(sync.payload.size()) + "\r\n";
+        reply.sharedBody = sync.payload;
+        attachReplica(conn, sync.offset);
+    } else {
+        reply.head = error("ERR full resync failed");
+        conn.closeAfterFlush = true;
+    }
+    reply.ready = true;
+    io.dirty.push_back(conn.id);
+}
+
+void RespServer::attachReplica(Connection& conn, uint64_t offset) {
+    conn.replOffset = offset;
+    conn.io->replicas.push_back(conn.id);
+    conn.io->hasReplicas.store(true, std::memory_order_relaxed);
+    conn.io->dirty.push_back(conn.id);
+}
+
+// Queues the next piece of the stream once everything before it went
+// out, so a replica never holds more than one chunk of output. False if
+// there is nothing new, or if the replica fell out of the backlog: then
+// it is dropped and comes back for a full resync.
+bool RespServer::feedReplica(Connection& conn) {
+    Reply reply;
+    if (!redis.replicationBacklog()->read(conn.replOffset, kReplicaChunk, reply.head)) {
+        conn.closeAfterFlush = true;
+        return false;
+    }
+    if (reply.head.empty())
+        return false;
+    conn.replOffset += reply.head.size();
+    reply.ready = true;
+    conn.replies.push_back(std::move(reply));
+    conn.nextSeq++;
+    return true;
+}
+
+// Shard worker, under the backlog's lock
+void RespServer::onBacklogAppend() {
+    for (auto& io : ioThreads) {
+        if (io->hasReplicas.load(std::memory_order_relaxed) &&
+            !io->streamPending.exchange(true, std::memory_order_acq_rel))
+            wake(*io);
+    }
+}
+
+void RespServer::applyCompletion(IoThread& io, Completion& c) {
+    auto it = io.connections.find(c.tag.connection);
+    if (it == io.connections.end())
+        return; // client went away
+    Connection& conn = *it->second;
+    Reply& reply = conn.replies[c.tag.sequence - conn.baseSeq];
+
+    switch (reply.kind) {
+    case ReplyKind::Bulk:
+        if (c.status == kWrongType) {
+            reply.head = kWrongTypeError;
+        } else if (c.status == 0 && !c.value.empty()) {
+            reply.head = error(c.value);
+        } else if (c.status == -1 && !reply.redirect.empty()) {
+            reply.redirected = true;
+        } else if (c.status == kCompressedValue) {
+            std::string original;
+            decompressValue(c.shared ? c.shared.view() : std::string_view(c.value), original);
+            reply.head = "$" + std::to_string(original.size()) + "\r\n";
+            reply.body = std::move(original);
+            reply.bodyCrlf = true;
+        } else if (c.shared) {
+            reply.head = "$" + std::to_string(c.shared.size()) + "\r\n";
+            reply.sharedBody = std::move(c.shared);
+            reply.bodyCrlf = true;
+        } else if (c.status) {
+            reply.head = "$" + std::to_string(c.value.size()) + "\r\n";
+            reply.body = std::move(c.value);
+            reply.bodyCrlf = true;
+        } else if (!reply.redirect.empty()) {
+            reply.redirected = true;
+        } else {
+            reply.head = "$-1\r\n";
+        }
+        break;
+    case ReplyKind::Ok:
+        reply.failed |= c.status == 0;
+        reply.redirected |= c.status < 0;
+        break;
+    case ReplyKind::Integer:
+        reply.total += c.status;
+        reply.redirected |= c.status == 0 && !reply.redirect.empty();
+        break;
+    case ReplyKind::Number:
+        if (c.status == kWrongType)
+            reply.head = kWrongTypeError;
+        else if (c.status == 0 && !c.value.empty())
+            reply.head = error(c.value);
+        else
+            reply.head = ":" + (c.value.empty() ? std::to_string(c.status) : c.value) + "\r\n";
+        reply.redirected |= c.status == -1 && !reply.redirect.empty();
+        break;
+    case ReplyKind::Raw:
+        reply.head = std::move(c.value);
+        reply.redirected |= c.status == -1 && !reply.redirect.empty();
+        break;
+    case ReplyKind::Array:
+        // An MGET part is spliced into the head, so a shared value is
+        // copied here after all
+        if (c.status == kCompressedValue) {
+            std::string original;
+            decompressValue(c.shared ? c.shared.view() : std::string_view(c.value), original);
+            c.value = std::move(original);
+        } else if (c.shared) {
+            c.value.assign(c.shared.data(), c.shared.size());
+        }
+        reply.parts[c.tag.part] = {c.status > 0, std::move(c.value)};
+        break;
+    case ReplyKind::Ready:
+        break;
+    }
+
+    if (--reply.waiting == 0) {
+        conn.unfinished--;
+        finish(reply);
+        io.dirty.push_back(conn.id);
+    }
+}
+
+void RespServer::finish(Reply& reply) {
+    if (reply.overloaded) {
+        reply.head = kOverloadedError;
+        reply.body.clear();
+        reply.sharedBody = ValueRef();
+        reply.bodyCrlf = false;
+        reply.parts.clear();
+        reply.ready = true;
+        return;
+    }
+    if (reply.redirected) {
+        reply.head = std::move(reply.redirect);
+        reply.ready = true;
+        return;
+    }
+    switch (reply.kind) {
+    case ReplyKind::Ok:
+        reply.head = reply.failed ? kOomError : "+OK\r\n";
+        break;
+    case ReplyKind::Integer:
+        reply.head = ":" + std::to_string(reply.total) + "\r\n";
+        break;
+    case ReplyKind::Array:
+        reply.head = "*" + std::to_string(reply.parts.size()) + "\r\n";
+        for (auto& part : reply.parts)
+            reply.head += part.first ? bulk(part.second) : "$-1\r\n";
+        reply.parts.clear();
+        break;
+    default:
+        break;
+    }
+    reply.ready = true;
+}
+
+void RespServer::flush(Connection& conn) {
+    static const char kCrlf[] = "\r\n";
+
+    while (true) {
+        if (conn.replies.empty() || !conn.replies.front().ready) {
+            if (!conn.replica || !conn.replies.empty() || !feedReplica(conn))
+                break;
+        }
+        iovec iov[kMaxIovecs];
+        int count = 0;
+        size_t skip = conn.writeOffset;
+
+        for (auto& reply : conn.replies) {
+            if (!reply.ready || count + 3 > kMaxIovecs)
+                break;
+            std::string_view body = reply.bodyView();
+            const std::pair<const char*, size_t> segments[3] = {
+                {reply.head.data(), reply.head.size()},
+                {body.data(), body.size()},
+                {kCrlf, reply.bodyCrlf ? size_t(2) : size_t(0)}};
+            for (const auto& seg : segments) {
+                if (seg.second <= skip) {
+                    skip -= seg.second;
+                    continue;
+                }
+                iov[count].iov_base = const_cast<char*>(seg.first + skip);
+                iov[count].iov_len = seg.second - skip;
+                skip = 0;
+                count++;
+            }
+        }
+
+        ssize_t n = writev(conn.fd, iov, count);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return; // EPOLLOUT will bring us back
+            closeConnection(conn);
+            return;
+        }
+
+        // Retire fully written replies
+        size_t written = conn.writeOffset + static_cast<size_t>(n);
+        while (!conn.replies.empty() && conn.replies.front().ready) {
+            const Reply& front = conn.replies.front();
+            size_t size = front.head.size() + front.bodyView().size() + (front.bodyCrlf ? 2 : 0);
+            if (written < size)
+                break;
+            written -= size;
+            conn.replies.pop_front();
+            conn.baseSeq++;
+        }
+        conn.writeOffset = written;
+    }
+
+    if (conn.closeAfterFlush && conn.replies.empty())
+        closeConnection(conn);
+}
+
+void RespServer::closeConnection(Connection& conn) {
+    IoThread& io = *conn.io;
+    if (conn.replica) {
+        io.replicas.erase(std::remove(io.replicas.begin(), io.replicas.end(), conn.id),
+                          io.replicas.end());
+        io.hasReplicas.store(!io.replicas.empty(), std::memory_order_relaxed);
+    }
+    epoll_ctl(io.epollFd, EPOLL_CTL_DEL, conn.fd, nullptr);
+    close(conn.fd);
+    io.connections.erase(conn.id);
+    connectedClients.fetch_sub(1, std::memory_order_relaxed);
+}
+
+std::string RespServer::clientsInfo() const {
+    return "# Clients\r\nconnected_clients:" +
+           std::to_string(connectedClients.load(std::memory_order_relaxed)) +
+           "\r\ntotal_connections_received:" +
+           std::to_string(totalConnections.load(std::memory_order_relaxed)) + "\r\n";
+}
+
+void RespServer::runMetrics() {
+    pollfd pfd{};
+    pfd.fd = metricsFd;
+    pfd.events = POLLIN;
+    while (running.load(std::memory_order_relaxed)) {
+        int n = poll(&pfd, 1, kMetricsPollMs);
+        if (n <= 0)
+            continue;
+        int fd = accept4(metricsFd, nullptr, nullptr, SOCK_CLOEXEC);
+        if (fd < 0)
+            continue;
+        serveMetrics(fd);
+        close(fd);
+    }
+}
+
+// One HTTP/1.x request per connection: GET /metrics, or a 404
+void RespServer::serveMetrics(int fd) {
+    timeval tv{};
+    tv.tv_sec = kMetricsTimeoutMs / 1000;
+    tv.tv_usec = kMetricsTimeoutMs % 1000 * 1000;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+
+    std::string request;
+    char buf[1024];
+    while (request.find("\r\n\r\n") == std::string::npos && request.size() < kMaxMetricsRequest) {
+        ssize_t n = recv(fd, buf, sizeof(buf), 0);
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return;
+        request.append(buf, static_cast<size_t>(n));
+    }
+    std::string_view line(request);
+    line = line.substr(0, line.find("\r\n"));
+    bool found = line.rfind("GET /metrics ", 0) == 0 || line.rfind("GET /metrics?", 0) == 0;
+
+    std::string body;
+    if (found) {
+        body = redis.metricsText();
+        body += "# HELP redislite_connected_clients Open client connections.\n"
+                "# TYPE redislite_connected_clients gauge\n"
+                "redislite_connected_clients " +
+                std::to_string(connectedClients.load(std::memory_order_relaxed)) +
+                "\n# HELP redislite_connections_received_total Client connections accepted.\n"
+                "# TYPE redislite_connections_received_total counter\n"
+                "redislite_connections_received_total " +
+                std::to_string(totalConnections.load(std::memory_order_relaxed)) + "\n";
+    } else {
+        body = "not found\n";
+    }
+    std::string head = std::string(found ? "HTTP/1.1 200 OK" : "HTTP/1.1 404 Not Found") +
+                       "\r\nContent-Type: text/plain; version=0.0.4; charset=utf-8"
+                       "\r\nContent-Length: " + std::to_string(body.size()) +
+                       "\r\nConnection: close\r\n\r\n";
+    if (sendAll(fd, head))
+        sendAll(fd, body);
+}
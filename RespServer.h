@@ -0,0 +1,267 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+#include "RedisLite.h"
+#include "RecvBuffer.h"
+#include "RespParser.h"
+#include "Replication.h"
+#include "Cluster.h"
+#include "Collections.h"
+
+// Network front end speaking RESP (the Redis wire protocol), so stock
+// Redis clients and redis-benchmark can talk to a RedisLite instance.
+// Each I/O thread runs an edge-triggered epoll loop over the connections
+// it owns: it parses commands out of their receive buffers, dispatches
+// them to the shard queues with the server as the ReplySink, and writes
+// replies back in request order with writev. Commands still execute only
+// on the shard workers; the I/O threads just spread socket and protocol
+// work across cores, like Redis 6 io-threads. Linux only.
+//
+// Replication: a client sending PSYNC becomes a replica connection. It
+// gets +CONTINUE and the backlog from its offset if that is still held,
+// or +FULLRESYNC with a snapshot (taken on a sync thread) otherwise, and
+// is then fed from the backlog by its I/O thread whenever shards append.
+// With replicaOfHost set the server is a read-only replica itself.
+//
+// Cluster mode (clusterAddress set): every key command first checks that
+// its keys share a hash slot this node serves, and answers -MOVED (slot
+// owned elsewhere), -ASK (slot migrating and key not here) or -CROSSSLOT
+// instead of running it. MIGRATE runs on the background thread, so slots
+// can move between live nodes.
+
+struct RespServerConfig {
+    std::string bindAddress = "0.0.0.0";
+    uint16_t port = 6379; // 0 picks a free port, see RespServer::port()
+    int backlog = 511;
+    size_t ioThreads = 1; // event loops; connections are spread round-robin
+
+    // Primary to replicate from; empty = this server is a primary
+    std::string replicaOfHost;
+    uint16_t replicaOfPort = 6379;
+    // Staging file for full resyncs; empty = replsync-<port>.rls in the
+    // working directory. A replica receives into `<path>.incoming`.
+    std::string syncPath;
+
+    // "host:port" clients and other nodes reach this node at; non-empty
+    // turns cluster mode on, with no slots assigned yet
+    std::string clusterAddress;
+    // Plain HTTP port answering GET /metrics with RedisLite::metricsText()
+    // for Prometheus to scrape; 0 = no metrics endpoint
+    uint16_t metricsPort = 0;
+};
+
+class RespServer : public ReplySink {
+private:
+    enum class ReplyKind {
+        Ready,   // encoded when the request was parsed
+        Bulk,    // GET
+        Ok,      // SET / MSET: +OK once every part is written
+        Integer, // DEL: sum of the parts' statuses
+        Array,   // MGET
+        Number,  // INCRBY / APPEND / CAS: the value (or status) as an integer
+        Raw      // the value delivered is the encoded reply
+    };
+
+    // One per request, flushed strictly in request order. Bulk payloads
+    // stay in `body` as moved out of the worker and go out as their own
+    // iovec, so a value is never copied into a framing buffer. A shared
+    // value is sent straight from its buffer, in as many writes as the
+    // socket needs.
+    struct Reply {
+        ReplyKind kind = ReplyKind::Ready;
+        bool ready = false;
+        std::string head;
+        std::string body;
+        ValueRef sharedBody; // in place of `body` when set
+        bool bodyCrlf = false;
+
+        std::string_view bodyView() const { return sharedBody ? sharedBody.view() : body; }
+
+        size_t waiting = 0;
+        int64_t total = 0;
+        bool failed = false;
+        bool overloaded = false; // a part was refused by a full queue
+        // Cluster: -ASK to send instead if the key is not here
+        std::string redirect;
+        bool redirected = false;
+        std::vector<std::pair<bool, std::string>> parts;
+    };
+
+    struct IoThread;
+
+    struct Connection {
+        uint64_t id;
+        int fd;
+        IoThread* io;
+        // Current receive block and how much of it holds data. Requests
+        // are dispatched as views into it; see RecvBuffer.
+        RecvBuffer::Ref in;
+        size_t inUsed = 0;
+        RespParser parser;
+        std::deque<Reply> replies;
+        uint64_t baseSeq = 0;     // sequence number of replies.front()
+        uint64_t nextSeq = 0;
+        size_t writeOffset = 0;   // bytes of replies.front() already sent
+        bool closeAfterFlush = false;
+        bool asking = false; // ASKING applies to the next command only
+        // Replies still waiting for a shard; a lock-free GET is only
+        // taken when there are none, so it sees this client's writes
+        size_t unfinished = 0;
+        // After PSYNC: the stream position the next write starts at
+        bool replica = false;
+        uint64_t replOffset = 0;
+    };
+
+    struct Completion {
+        ReplyTag tag;
+        int64_t status;
+        std::string value;
+        ValueRef shared; // a GET of a shared value, instead of `value`
+        // status kCompressedValue: either one is compressed, and this I/O
+        // thread decompresses it
+    };
+
+    // A finished full-resync snapshot for the PSYNC reply at `tag`
+    struct FullSync {
+        ReplyTag tag;
+        bool ok;
+        uint64_t offset;
+        ValueRef payload; // shared by every replica's reply, sent uncopied
+    };
+
+    // One event loop. Connection ids are chosen so that
+    // id % ioThreads.size() is the index of the owning thread, which is
+    // how a ReplyTag finds its way back.
+    struct IoThread {
+        size_t index = 0;
+        int epollFd = -1;
+        int wakeFd = -1; // eventfd poked when the inbox fills
+        std::thread thread;
+
+        // This thread only
+        std::unordered_map<uint64_t, std::unique_ptr<Connection>> connections;
+        std::vector<uint64_t> dirty; // connections with replies to flush
+        uint64_t nextConnectionId = 0;
+        std::vector<uint64_t> replicas;
+        std::shared_ptr<const ClusterState::View> cluster;
+        uint64_t clusterVersion = 0;
+
+        // Set by shard workers when the backlog grew and this thread has
+        // replicas to feed; the flag coalesces the wake-ups
+        std::atomic<bool> hasReplicas{false};
+        std::atomic<bool> streamPending{false};
+
+        // Inbox: completions from shard workers and sockets handed over
+        // by the accepting thread
+        std::mutex inboxMutex;
+        std::vector<Completion> completions;
+        std::vector<int> accepted;
+        std::vector<FullSync> syncs;
+    };
+
+    RedisLite& redis;
+    RespServerConfig config;
+
+    int listenFd = -1; // polled by ioThreads[0], which does all accepts
+    uint16_t boundPort = 0;
+    std::vector<std::unique_ptr<IoThread>> ioThreads;
+    size_t nextIoThread = 0; // round-robin cursor (accepting thread only)
+
+    std::atomic<bool> running{false};
+    std::atomic<size_t> inFlight{0};
+
+    // Work that would stall an event loop: full resyncs and MIGRATE.
+    // PSYNC requests that arrive while a snapshot is pending share it.
+    std::mutex backgroundMutex;
+    std::condition_variable backgroundCv;
+    std::deque<std::function<void()>> backgroundJobs;
+    std::vector<ReplyTag> syncWaiting;
+    bool backgroundStopping = false;
+    std::thread backgroundThread;
+    std::string syncPath;
+
+    std::unique_ptr<ReplicaLink> replicaLink;
+    std::unique_ptr<ClusterState> cluster;
+
+    // Reported by INFO and the metrics endpoint
+    std::atomic<uint64_t> connectedClients{0};
+    std::atomic<uint64_t> totalConnections{0};
+    // metricsPort: scrapes are rare and small, so one blocking thread
+    // serves them one at a time
+    int metricsFd = -1;
+    std::thread metricsThread;
+
+    void run(IoThread& io);
+    void acceptAll();
+    void adopt(IoThread& io, int fd);
+    void wake(IoThread& io);
+    void drainInbox(IoThread& io);
+    void handleRead(Connection& conn);
+    void reserveInput(Connection& conn);
+    void parseInput(Connection& conn);
+    void handleCommand(Connection& conn, const std::vector<std::string_view>& args);
+    void submit(Connection& conn, uint64_t seq, uint32_t part, CommandType type,
+                std::string_view key, std::string_view value, int ttlSeconds,
+                bool onlyIfExists = false, bool onlyIfMissing = false,
+                std::vector<std::string_view> args = {});
+    void submitOwned(Connection& conn, uint64_t seq, Command&& cmd);
+    void refuse(Connection& conn, uint64_t seq, Command& cmd);
+    void handleTyped(Connection& conn, uint64_t seq, const std::vector<std::string_view>& args,
+                     const CollectionCommand& command, bool asking);
+    void handleRestore(Connection& conn, uint64_t seq, const std::vector<std::string_view>& args,
+                       bool asking);
+    void applyCompletion(IoThread& io, Completion& c);
+    void handlePsync(Connection& conn, uint64_t seq, const std::vector<std::string_view>& args);
+    void runBackground();
+    void runFullSync();
+    void post(const ReplyTag& tag, std::string encoded);
+    void applyFullSync(IoThread& io, FullSync& sync);
+    void attachReplica(Connection& conn, uint64_t offset);
+    bool feedReplica(Connection& conn);
+    void onBacklogAppend();
+    const ClusterState::View& clusterView(IoThread& io);
+    bool routeKeys(Connection& conn, const std::vector<std::string_view>& args, size_t first,
+                   size_t step, bool asking, Reply& reply);
+    void handleCluster(Connection& conn, uint64_t seq, const std::vector<std::string_view>& args);
+    void handleMigrate(Connection& conn, uint64_t seq, const std::vector<std::string_view>& args);
+    void handleSlowlog(Connection& conn, const std::vector<std::string_view>& args);
+    void handleScan(Connection& conn, uint64_t seq, const std::vector<std::string_view>& args);
+    void handleLatency(Connection& conn, const std::vector<std::string_view>& args);
+    void migrate(ReplyTag tag, std::string host, std::string port, std::vector<std::string> keys,
+                 long long timeoutMs, bool copy);
+    void finish(Reply& reply);
+    void flush(Connection& conn);
+    void closeConnection(Connection& conn);
+    std::string clientsInfo() const;
+    void runMetrics();
+    void serveMetrics(int fd);
+
+public:
+    RespServer(RedisLite& redis, const RespServerConfig& config = RespServerConfig());
+    ~RespServer();
+
+    RespServer(const RespServer&) = delete;
+    RespServer& operator=(const RespServer&) = delete;
+
+    // Binds, listens and starts the I/O threads. Throws
+    // std::runtime_error if the socket cannot be set up.
+    void start();
+
+    // Stops the loops, closes every connection and waits until no command
+    // the server dispatched is still queued in a shard
+    void stop();
+
+    uint16_t port() const { return boundPort; }
+
+    void deliver(const ReplyTag& tag, int64_t status, std::string&& value) override;
+    void deliverShared(const ReplyTag& tag, int64_t status, ValueRef&& value) override;
+};
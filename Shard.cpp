@@ -0,0 +1,1650 @@
+#include "Shard.h"
+#include <algorithm>
+#include <charconv>
+#include <cstring>
+#include <stdexcept>
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+#include "CompletionQueue.h"
+#include "Compression.h"
+
+namespace {
+// Empty polls before the worker yields, and yields before it parks.
+constexpr int kSpinIterations = 256;
+constexpr int kYieldIterations = 16;
+// Table groups migrated per pass while a resize is in flight
+constexpr size_t kRehashGroupsPerBatch = 4;
+constexpr size_t kRehashGroupsPerIdleStep = 64;
+// Home groups of the store scanned per pass while an AOF rewrite runs
+constexpr size_t kAofScanGroupsPerBatch = 16;
+constexpr size_t kAofScanGroupsPerIdleStep = 256;
+// Same for a snapshot, plus the size at which its buffer becomes a block
+constexpr size_t kSnapshotGroupsPerBatch = 16;
+constexpr size_t kSnapshotGroupsPerIdleStep = 256;
+constexpr size_t kSnapshotBlockBytes = 64 * 1024;
+// Timing wheel resolution, and how long a parked worker with pending
+// timers sleeps before it runs another expiry pass
+constexpr int64_t kExpireTickMs = 10;
+constexpr auto kIdleExpireInterval = std::chrono::milliseconds(100);
+
+// Near-cache version buckets per shard
+constexpr size_t kVersionBuckets = 1 << 16;
+
+// Evictions attempted per write before letting it through over budget
+constexpr int kMaxEvictionsPerWrite = 32;
+
+const char* const kOomReply = "-OOM command not allowed when used memory > 'maxmemory'.\r\n";
+const char* const kOomError = "OOM command not allowed when used memory > 'maxmemory'.";
+const char* const kNotInteger = "ERR value is not an integer or out of range";
+const char* const kWrongTypeReply =
+    "-WRONGTYPE Operation against a key holding the wrong kind of value\r\n";
+
+void bump(std::atomic<uint64_t>& counter, uint64_t by = 1) {
+    counter.store(counter.load(std::memory_order_relaxed) + by, std::memory_order_relaxed);
+}
+
+// For Command::enqueuedNs; steady_clock is the same on every thread
+uint64_t clockNs() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     std::chrono::steady_clock::now().time_since_epoch())
+                                     .count());
+}
+
+// A string whose stored bytes are its value, as opposed to a collection
+// or a compressed string, which records carry as RESTORE payloads
+bool plainString(const ValueEntry& entry) {
+    return entry.type() == ValueType::String && entry.encoding() != Encoding::Compressed;
+}
+
+// What INCRBY accepts: a whole decimal int64, nothing around it
+bool parseInt64(std::string_view s, int64_t& out) {
+    auto r = std::from_chars(s.data(), s.data() + s.size(), out);
+    return !s.empty() && r.ec == std::errc() && r.ptr == s.data() + s.size();
+}
+
+// Access metadata, packed into ValueEntry::access the way Redis packs
+// its 24-bit robj->lru field
+constexpr uint32_t kLruClockMask = (1u << 24) - 1;
+constexpr uint32_t kTypeBits = ~kLruClockMask; // see ValueEntry::type()
+constexpr uint32_t kLfuInitCounter = 5;
+constexpr double kLfuLogFactor = 10.0;
+constexpr int64_t kLfuDecayMinutes = 1;
+
+uint32_t lruClock(int64_t nowMs) {
+    return static_cast<uint32_t>(nowMs / 1000) & kLruClockMask;
+}
+
+uint32_t lruIdle(uint32_t access, uint32_t clock) {
+    return (clock - access) & kLruClockMask;
+}
+
+uint32_t lfuMinutes(int64_t nowMs) {
+    return static_cast<uint32_t>(nowMs / 60000) & 0xFFFF;
+}
+
+// Counter after decay: one step down per idle period since last access
+uint32_t lfuDecayed(uint32_t access, int64_t nowMs) {
+    uint32_t counter = access & 0xFF;
+    uint32_t elapsed = (lfuMinutes(nowMs) - (access >> 8)) & 0xFFFF;
+    uint32_t periods = static_cast<uint32_t>(elapsed / kLfuDecayMinutes);
+    return counter > periods ? counter - periods : 0;
+}
+
+// Logarithmic increment: the higher the counter, the less likely a hit
+// moves it, so 8 bits cover millions of accesses
+uint32_t lfuIncrement(uint32_t counter, uint64_t random) {
+    if (counter >= 255)
+        return 255;
+    double base = counter > kLfuInitCounter ? counter - kLfuInitCounter : 0;
+    double p = 1.0 / (base * kLfuLogFactor + 1.0);
+    double r = static_cast<double>(random >> 11) / static_cast<double>(uint64_t(1) << 53);
+    return r < p ? counter + 1 : counter;
+}
+}
+
+Shard::Shard(const RedisLiteConfig& config, size_t index, AppendOnlyFile* aof,
+             ReplicationBacklog* backlog, SlowLog* slowLog, LatencyMonitor* latencyMonitor)
+    : index(index),
+      aof(aof),
+      backlog(backlog),
+      slotKeyCounts(kHashSlots, 0),
+      commandQueue(config.queueCapacity),
+      queueOverflow(config.queueOverflow),
+      batch(config.maxBatchSize ? config.maxBatchSize : 1),
+      slowLog(slowLog),
+      latencyMonitor(latencyMonitor) {
+    epoch = std::chrono::steady_clock::now();
+    expireBudget = config.expireBudget ? config.expireBudget : 1;
+    shardCount = config.shards ? config.shards : 1;
+    memoryBudget = config.maxMemory / shardCount;
+    evictionPolicy = config.evictionPolicy;
+    evictionSamples = config.evictionSamples ? config.evictionSamples : 1;
+    limits.listpackMaxEntries = config.listpackMaxEntries;
+    limits.listpackMaxValue = config.listpackMaxValue;
+    limits.intsetMaxEntries = config.intsetMaxEntries;
+    sharedValueMin = config.sharedValueMin;
+    rngState = reinterpret_cast<uintptr_t>(this) | 1;
+    latencyTracking = config.latencyTracking;
+    busyPoll = config.busyPoll;
+    if (!config.workerCpus.empty()) {
+        cpu = config.workerCpus[index % config.workerCpus.size()];
+#ifdef __linux__
+        cpu_set_t allowed;
+        if (cpu < 0 || cpu >= CPU_SETSIZE || sched_getaffinity(0, sizeof(allowed), &allowed) != 0 ||
+            !CPU_ISSET(cpu, &allowed))
+            throw std::invalid_argument("workerCpus: CPU " + std::to_string(cpu) +
+                                        " is not available to this process");
+#endif
+    }
+    if (config.lockFreeReads)
+        readIndex = std::make_unique<ReadIndex>();
+    if (config.keyIndex)
+        keyIndex = std::make_unique<KeyIndex>();
+    if (config.priorityQueueCapacity)
+        priorityQueue = std::make_unique<MpscRing<Command>>(config.priorityQueueCapacity);
+    if (config.nearCacheEntries) {
+        versions.reset(new std::atomic<uint64_t>[kVersionBuckets]);
+        for (size_t i = 0; i < kVersionBuckets; i++)
+            versions[i].store(0, std::memory_order_relaxed);
+        versionMask = kVersionBuckets - 1;
+    }
+    worker = std::thread(&Shard::workerLoop, this);
+}
+
+Shard::~Shard() {
+    {
+        std::lock_guard<std::mutex> lock(parkMutex);
+        stop = true;
+    }
+    cv.notify_one();
+    worker.join();
+}
+
+bool Shard::waitForCommand(Command& cmd) {
+    bool spin = true;
+    while (true) {
+        if (spin) {
+            for (int i = 0; i < kSpinIterations; i++) {
+                if (tryPop(cmd))
+                    return true;
+                cpuRelax();
+            }
+            // Spend idle time finishing an in-flight resize before parking
+            while (store.isRehashing() || expires.isRehashing() || timerTicks.isRehashing() ||
+                   collections.isRehashing()) {
+                if (tryPop(cmd))
+                    return true;
+                store.rehashStep(kRehashGroupsPerIdleStep);
+                expires.rehashStep(kRehashGroupsPerIdleStep);
+                timerTicks.rehashStep(kRehashGroupsPerIdleStep);
+                collections.rehashStep(kRehashGroupsPerIdleStep);
+            }
+            for (int i = 0; i < kYieldIterations && !busyPoll; i++) {
+                if (tryPop(cmd))
+                    return true;
+                std::this_thread::yield();
+            }
+        }
+        // Idle: keep expiring in budget-sized steps while timers are due,
+        // and push a running AOF rewrite scan along
+        while (expireStep() || aofScanStep(kAofScanGroupsPerIdleStep) ||
+               snapshotStep(kSnapshotGroupsPerIdleStep)) {
+            if (tryPop(cmd))
+                return true;
+        }
+        flushLog();
+        if (readIndex)
+            readIndex->reclaim();
+
+        statQueueDepth.store(0, std::memory_order_relaxed);
+        if (busyPoll) {
+            // Never parks, so producers never have to notify; the idle
+            // work above runs between rounds of polling
+            if (tryPop(cmd))
+                return true;
+            if (stop.load(std::memory_order_relaxed))
+                return false;
+            continue;
+        }
+        std::unique_lock<std::mutex> lock(parkMutex);
+        sleeping.store(true, std::memory_order_relaxed);
+        // Pairs with the fence in enqueue(): either the producer sees
+        // `sleeping` and notifies, or we see its slot and skip the wait.
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        auto ready = [&]() {
+            return stop.load(std::memory_order_relaxed) || queued();
+        };
+        // With timers pending, wake up periodically to expire them
+        bool woken = true;
+        if (expiryWheel.empty())
+            cv.wait(lock, ready);
+        else
+            woken = cv.wait_for(lock, kIdleExpireInterval, ready);
+        sleeping.store(false, std::memory_order_relaxed);
+
+        if (tryPop(cmd))
+            return true;
+        if (stop.load(std::memory_order_relaxed))
+            return false;
+        // A timeout means we are still idle: expire, then park again
+        spin = woken;
+    }
+}
+
+// Blocks for the first command, then takes whatever else is already
+// queued (up to the batch cap) without going back to the wait path.
+size_t Shard::drainBatch() {
+    if (!waitForCommand(batch[0]))
+        return 0;
+
+    // The priority lane gets at most three quarters of a batch ahead of
+    // the main queue, so a flood of reads cannot starve the writes
+    size_t n = 1;
+    size_t priorityShare = batch.size() - batch.size() / 4;
+    while (priorityQueue && n < priorityShare && priorityQueue->tryPop(batch[n]))
+        n++;
+    while (n < batch.size() && commandQueue.tryPop(batch[n]))
+        n++;
+    while (priorityQueue && n < batch.size() && priorityQueue->tryPop(batch[n]))
+        n++;
+    return n;
+}
+
+void Shard::recordBatch(size_t size) {
+    bump(statBatches);
+    bump(statCommands, size);
+    statLastBatch.store(size, std::memory_order_relaxed);
+    if (size > statMaxBatch.load(std::memory_order_relaxed))
+        statMaxBatch.store(size, std::memory_order_relaxed);
+}
+
+// A command that took at least the slow log threshold; `cmd` has run but
+// still holds its key and arguments
+void Shard::logSlow(const Command& cmd, uint64_t ns) {
+    SlowLogEntry entry;
+    entry.durationUs = ns / 1000;
+    entry.type = cmd.type;
+    entry.shard = index;
+    if (cmd.type == CommandType::BATCH) {
+        entry.size = cmd.ops.size();
+        if (!cmd.ops.empty())
+            entry.key = cmd.ops[0].key.substr(0, SlowLog::kMaxKey);
+    } else {
+        entry.key = std::string(cmd.keyData().substr(0, SlowLog::kMaxKey));
+        entry.size = cmd.valueData().empty() ? cmd.args.size() : cmd.valueData().size();
+    }
+    slowLog->add(std::move(entry));
+}
+
+// Reports the time since `since` as `event` and returns the clock, for
+// the next step to start from; without a monitor it reads nothing
+uint64_t Shard::monitorStep(LatencyEvent event, uint64_t since) {
+    if (!latencyMonitor)
+        return 0;
+    uint64_t now = clockNs();
+    latencyMonitor->record(event, now - since);
+    return now;
+}
+
+// First thing on the worker: pins it to `cpu` and sets its memory policy
+// to node-local, so that whatever it allocates from now on (the store,
+// expires and collection tables, the arena's slabs, every table resize)
+// is first touched on the pinned CPU's node. The worker-only tables the
+// constructor already made are made again here for the same reason.
+void Shard::pinWorker() {
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    // Overrides an interleave or bind policy inherited from the process
+    // (e.g. numactl); harmless where the kernel has no NUMA support
+    syscall(SYS_set_mempolicy, MPOL_LOCAL, nullptr, 0);
+    std::vector<Command>(batch.size()).swap(batch);
+    std::vector<uint32_t>(kHashSlots, 0).swap(slotKeyCounts);
+#endif
+}
+
+void Shard::workerLoop() {
+    if (cpu >= 0)
+        pinWorker();
+    bool timed = latencyTracking || slowLog || latencyMonitor;
+    size_t n;
+    while ((n = drainBatch()) > 0) {
+        statQueueDepth.store(commandQueue.size() + (priorityQueue ? priorityQueue->size() : 0),
+                             std::memory_order_relaxed);
+        // Executed in dequeue order, so per-key ordering is unchanged.
+        // One clock read per command: where one ends the next one starts.
+        uint64_t mark = timed ? clockNs() : 0;
+        for (size_t i = 0; i < n; i++) {
+            uint64_t enqueued = batch[i].enqueuedNs;
+            execute(batch[i]);
+            if (timed) {
+                uint64_t end = clockNs();
+                uint64_t ns = end - mark;
+                if (latencyTracking) {
+                    if (enqueued)
+                        queueWait.record(mark > enqueued ? mark - enqueued : 0);
+                    commandTimes[static_cast<size_t>(batch[i].type)].record(ns);
+                }
+                if (slowLog && slowLog->slow(ns))
+                    logSlow(batch[i], ns);
+                if (latencyMonitor)
+                    latencyMonitor->record(LatencyEvent::Command, ns);
+                mark = end;
+            }
+            batch[i] = Command();
+        }
+        recordBatch(n);
+        statUsedMemory.store(usedMemory(), std::memory_order_relaxed);
+        statKeys.store(store.size(), std::memory_order_relaxed);
+        statExpiring.store(expires.size(), std::memory_order_relaxed);
+        // Housekeeping, each step timed for the latency monitor
+        uint64_t step = latencyMonitor ? clockNs() : 0;
+        store.rehashStep(kRehashGroupsPerBatch);
+        expires.rehashStep(kRehashGroupsPerBatch);
+        timerTicks.rehashStep(kRehashGroupsPerBatch);
+        collections.rehashStep(kRehashGroupsPerBatch);
+        step = monitorStep(LatencyEvent::Rehash, step);
+        expireStep();
+        step = monitorStep(LatencyEvent::ExpireCycle, step);
+        aofScanStep(kAofScanGroupsPerBatch);
+        step = monitorStep(LatencyEvent::AofRewriteScan, step);
+        snapshotStep(kSnapshotGroupsPerBatch);
+        step = monitorStep(LatencyEvent::Snapshot, step);
+        flushLog();
+        step = monitorStep(LatencyEvent::AofFlush, step);
+        if (readIndex) {
+            readIndex->reclaim();
+            monitorStep(LatencyEvent::Reclaim, step);
+        }
+    }
+    // A snapshot still running at shutdown is finished, not dropped
+    while (snapshotStep(kSnapshotGroupsPerIdleStep)) {
+    }
+    flushLog();
+}
+
+int64_t Shard::nowMs() const {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::steady_clock::now() - epoch).count();
+}
+
+// Rounds up, so a timer never fires before its entry's deadline
+uint64_t Shard::tickFor(int64_t deadlineMs) const {
+    if (deadlineMs <= 0)
+        return 0;
+    return static_cast<uint64_t>((deadlineMs + kExpireTickMs - 1) / kExpireTickMs);
+}
+
+void Shard::scheduleExpiry(std::string_view key, int64_t deadline) {
+    uint64_t tick = tickFor(deadline);
+    bool inserted = false;
+    uint64_t& live = timerTicks.findOrInsert(
+        key, [&]() { return CompactString(key, &arena); }, &inserted);
+    if (!inserted && live <= tick)
+        return; // fires early and re-arms for the later deadline
+    live = tick;
+    expiryWheel.schedule(std::string(key), tick);
+}
+
+bool Shard::isExpired(std::string_view key, int64_t now) {
+    if (expires.empty())
+        return false;
+    const int64_t* deadline = expires.find(key);
+    return deadline && now >= *deadline;
+}
+
+bool Shard::removeKey(std::string_view key) {
+    preserveForSnapshot(key);
+    if (!collections.empty()) {
+        ValueEntry* entry = store.find(key);
+        if (entry)
+            dropCollection(key, *entry);
+    }
+    bool removed = store.erase(key);
+    if (!expires.empty())
+        expires.erase(key);
+    if (removed) {
+        if (versions)
+            bumpVersion(key);
+        if (readIndex)
+            readIndex->erase(key);
+        slotKeyCounts[keySlot(key)]--;
+        if (keyIndex)
+            keyIndex->erase(key);
+    }
+    return removed;
+}
+
+// The live entry for `key`; one that has expired is removed first
+ValueEntry* Shard::lookup(std::string_view key, int64_t now) {
+    ValueEntry* entry = store.find(key);
+    if (!entry || !isExpired(key, now))
+        return entry;
+    removeKey(key);
+    logDel(key);
+    bump(statExpiredLazy);
+    return nullptr;
+}
+
+// Turns the entry back into an (empty) string, freeing an expanded
+// collection
+void Shard::dropCollection(std::string_view key, ValueEntry& entry) {
+    if (entry.encoding() == Encoding::Expanded) {
+        std::unique_ptr<Collection>* c = collections.find(key);
+        if (c) {
+            collectionBytes -= (*c)->bytes;
+            collections.erase(key);
+        }
+    }
+    entry.setType(ValueType::String, Encoding::Raw);
+}
+
+// Deadline of `key` as unix ms for a log record, 0 if it has no TTL
+int64_t Shard::unixExpireAt(std::string_view key) {
+    const int64_t* deadline = expires.empty() ? nullptr : expires.find(key);
+    return deadline ? unixMsFor(*deadline) : 0;
+}
+
+// The entry as one absolute record: SET for a string, RESTORE for a
+// collection
+void Shard::encodeEntry(std::string& out, std::string_view key, const ValueEntry& entry,
+                        int64_t expireAtMs) {
+    if (plainString(entry)) {
+        char buf[24];
+        AppendOnlyFile::encodeSet(out, key, stringOf(entry, buf), expireAtMs);
+    } else {
+        serializeEntry(key, entry, dumpScratch);
+        AppendOnlyFile::encodeRestore(out, key, dumpScratch, expireAtMs);
+    }
+}
+
+// Logs `key` as it is now (a DEL if it is gone)
+void Shard::logCurrent(std::string_view key) {
+    ValueEntry* entry = store.find(key);
+    if (entry)
+        encodeEntry(logBuffer, key, *entry, unixExpireAt(key));
+    else
+        AppendOnlyFile::encodeDel(logBuffer, key);
+}
+
+// Tells readers outside the worker that `key` changed: near caches
+// through its version, the read index by mirroring its current state
+void Shard::publish(std::string_view key) {
+    if (versions)
+        bumpVersion(key);
+    if (!readIndex)
+        return;
+    ValueEntry* entry = store.find(key);
+    if (!entry) {
+        readIndex->erase(key);
+        return;
+    }
+    const int64_t* deadline = expires.empty() ? nullptr : expires.find(key);
+    if (entry->type() != ValueType::String) {
+        readIndex->putOther(key, deadline ? *deadline : 0);
+        return;
+    }
+    char buf[24];
+    readIndex->put(key, stringOf(*entry, buf), deadline ? *deadline : 0);
+}
+
+ReadResult Shard::read(std::string_view key, std::string& value) const {
+    return readIndex ? readIndex->get(key, nowMs(), value) : ReadResult::Queue;
+}
+
+// Release: a client that sees the new version also sees the write
+void Shard::bumpVersion(std::string_view key) {
+    std::atomic<uint64_t>& v = versions[std::hash<std::string_view>{}(key) & versionMask];
+    v.store(v.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+}
+
+uint64_t Shard::version(size_t hash) const {
+    return versions ? versions[hash & versionMask].load(std::memory_order_acquire) : 0;
+}
+
+// A collection's payload for RESTORE records and snapshots
+void Shard::serializeEntry(std::string_view key, const ValueEntry& entry, std::string& out) {
+    std::unique_ptr<Collection>* c =
+        entry.encoding() == Encoding::Expanded ? collections.find(key) : nullptr;
+    serializeValue(entry.type(), entry.encoding(), entry.value, c ? c->get() : nullptr, out);
+}
+
+size_t Shard::usedMemory() const {
+    return arena.bytesInUse() + store.tableBytes() + expires.tableBytes() +
+           timerTicks.tableBytes() + expiryWheel.bytes() +
+           collections.tableBytes() + collectionBytes + (readIndex ? readIndex->bytes() : 0) +
+           (keyIndex ? keyIndex->bytes() : 0);
+}
+
+uint64_t Shard::nextRandom() {
+    // xorshift64*
+    rngState ^= rngState >> 12;
+    rngState ^= rngState << 25;
+    rngState ^= rngState >> 27;
+    return rngState * 0x2545F4914F6CDD1DULL;
+}
+
+void Shard::touch(ValueEntry& entry, int64_t now, bool created) {
+    switch (evictionPolicy) {
+    case EvictionPolicy::AllKeysLru:
+        entry.access = (entry.access & kTypeBits) | lruClock(now);
+        break;
+    case EvictionPolicy::AllKeysLfu: {
+        uint32_t counter = created ? kLfuInitCounter
+                                   : lfuIncrement(lfuDecayed(entry.access, now), nextRandom());
+        entry.access = (entry.access & kTypeBits) | (lfuMinutes(now) << 8) | counter;
+        break;
+    }
+    default:
+        break;
+    }
+}
+
+// Called before every write. Over budget, evicts a bounded number of keys;
+// returns false if the write has to be refused instead.
+bool Shard::admitWrite() {
+    if (!memoryBudget || usedMemory() <= memoryBudget)
+        return true;
+
+    if (evictionPolicy != EvictionPolicy::NoEviction) {
+        uint64_t start = latencyMonitor ? clockNs() : 0;
+        bool admitted = true;
+        for (int i = 0; i < kMaxEvictionsPerWrite && usedMemory() > memoryBudget; i++) {
+            if (!evictOne()) {
+                admitted = i > 0;
+                break;
+            }
+        }
+        monitorStep(LatencyEvent::Eviction, start);
+        return admitted;
+    }
+
+    bump(statRejected);
+    return false;
+}
+
+// Approximate eviction: picks the worst of `evictionSamples` sampled keys
+bool Shard::evictOne() {
+    int64_t now = nowMs();
+    std::string victim;
+    bool found = false;
+
+    if (evictionPolicy == EvictionPolicy::VolatileTtl) {
+        int64_t soonest = 0;
+        expires.sample(nextRandom(), evictionSamples,
+                       [&](const CompactString& key, int64_t& deadline) {
+            if (!found || deadline < soonest) {
+                soonest = deadline;
+                victim.assign(key.data(), key.size());
+                found = true;
+            }
+        });
+    } else {
+        uint32_t clock = lruClock(now);
+        uint64_t worst = 0;
+        store.sample(nextRandom(), evictionSamples,
+                     [&](const CompactString& key, ValueEntry& entry) {
+            uint64_t score = evictionPolicy == EvictionPolicy::AllKeysLru
+                                 ? lruIdle(entry.access, clock)
+                                 : 255 - lfuDecayed(entry.access, now);
+            if (!found || score > worst) {
+                worst = score;
+                victim.assign(key.data(), key.size());
+                found = true;
+            }
+        });
+    }
+
+    if (!found)
+        return false;
+    removeKey(victim);
+    logDel(victim);
+    bump(statEvicted);
+    return true;
+}
+
+// Processes at most `expireBudget` due timers; returns true if it used
+// the whole budget, i.e. more may be due
+bool Shard::expireStep() {
+    if (expiryWheel.empty())
+        return false;
+
+    int64_t now = nowMs();
+    uint64_t tick = static_cast<uint64_t>(now / kExpireTickMs);
+    uint64_t expired = 0;
+
+    size_t handled = expiryWheel.advance(tick, expireBudget, [&](const std::string& key,
+                                                                 uint64_t fired) {
+        uint64_t* live = timerTicks.find(key);
+        if (!live || *live != fired)
+            return; // stale: the TTL was shortened and another timer took over
+        const int64_t* deadline = expires.empty() ? nullptr : expires.find(key);
+        if (!deadline) {
+            timerTicks.erase(key); // the TTL is gone
+        } else if (now >= *deadline) {
+            timerTicks.erase(key);
+            removeKey(key);
+            logDel(key);
+            expired++;
+        } else {
+            // Extended since this timer was set
+            *live = tickFor(*deadline);
+            expiryWheel.schedule(key, *live);
+        }
+    });
+
+    if (expired)
+        bump(statExpiredActive, expired);
+    statTtlTimers.store(expiryWheel.size(), std::memory_order_relaxed);
+    return handled == expireBudget;
+}
+
+WorkerStats Shard::stats() const {
+    WorkerStats s;
+    s.batches = statBatches.load(std::memory_order_relaxed);
+    s.commands = statCommands.load(std::memory_order_relaxed);
+    s.maxBatchSize = statMaxBatch.load(std::memory_order_relaxed);
+    s.lastBatchSize = statLastBatch.load(std::memory_order_relaxed);
+    s.expiredActive = statExpiredActive.load(std::memory_order_relaxed);
+    s.expiredLazy = statExpiredLazy.load(std::memory_order_relaxed);
+    s.ttlTimers = statTtlTimers.load(std::memory_order_relaxed);
+    s.usedMemory = statUsedMemory.load(std::memory_order_relaxed);
+    s.evictedKeys = statEvicted.load(std::memory_order_relaxed);
+    s.rejectedWrites = statRejected.load(std::memory_order_relaxed);
+    s.keys = statKeys.load(std::memory_order_relaxed);
+    s.expiringKeys = statExpiring.load(std::memory_order_relaxed);
+    s.keyspaceHits = statHits.load(std::memory_order_relaxed);
+    s.keyspaceMisses = statMisses.load(std::memory_order_relaxed);
+    s.queueDepth = statQueueDepth.load(std::memory_order_relaxed);
+    s.queueFullWaits = statQueueFull.load(std::memory_order_relaxed);
+    s.queueRefused = statQueueRefused.load(std::memory_order_relaxed);
+    return s;
+}
+
+LatencyStats Shard::latencyStats() const {
+    LatencyStats s;
+    s.queueWait = queueWait.summary();
+    for (size_t i = 0; i < kCommandTypes; i++)
+        s.commands[i] = commandTimes[i].summary();
+    return s;
+}
+
+void Shard::execute(Command& cmd) {
+    int64_t now = nowMs();
+    logWrites = !cmd.fromAof && logging();
+    incoming = cmd.sharedValue ? &cmd.sharedValue : nullptr;
+    valueCompressed = cmd.compressed;
+
+    if (cmd.type == CommandType::AOF_REWRITE) {
+        startAofScan();
+        return;
+    }
+    if (cmd.type == CommandType::SNAPSHOT) {
+        startSnapshot(cmd.snapshotWriter);
+        return;
+    }
+    if (cmd.type == CommandType::SNAPSHOT_LOAD) {
+        loadSnapshot(*cmd.snapshotLoad);
+        return;
+    }
+    if (cmd.type == CommandType::SYNC_MARK) {
+        flushLog();
+        syncLogging = true;
+        cmd.completion->complete();
+        return;
+    }
+    if (cmd.type == CommandType::SLOT_KEYS) {
+        slotKeys(cmd);
+        return;
+    }
+    if (cmd.type == CommandType::SCAN) {
+        scanKeys(cmd);
+        return;
+    }
+    if (cmd.type == CommandType::SCAN_PREFIX) {
+        scanPrefix(cmd);
+        return;
+    }
+
+    if (cmd.type == CommandType::BATCH) {
+        for (auto& op : cmd.ops) {
+            std::string* out = cmd.batch ? &cmd.batch->values[op.slot] : nullptr;
+            fieldViews.assign(op.fields.begin(), op.fields.end());
+            int64_t status = apply(op.type, op.key, op.value, op.ttlSeconds, now, out, &fieldViews);
+            if (cmd.batch && !cmd.batch->statuses.empty())
+                cmd.batch->statuses[op.slot] = status;
+        }
+        // Last shard to finish its part completes the whole pipeline
+        if (cmd.batch && cmd.batch->pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            cmd.batch->done->complete();
+        return;
+    }
+
+    if (cmd.sink) {
+        std::string_view key = cmd.keyData();
+        if (cmd.onlyIfExists && (!store.find(key) || isExpired(key, now))) {
+            cmd.sink->deliver(cmd.tag, -1, std::string());
+            return;
+        }
+        if (cmd.onlyIfMissing && lookup(key, now)) {
+            cmd.sink->deliver(cmd.tag, -1, "-BUSYKEY Target key name already exists.\r\n");
+            return;
+        }
+        std::string value;
+        if (cmd.type == CommandType::GET) {
+            // A shared value goes out by reference, without a copy here,
+            // and a compressed one as it is, for the sink to decompress
+            int64_t status;
+            ValueEntry* entry = readString(key, now, status);
+            if (entry && entry->encoding() == Encoding::Compressed)
+                status = kCompressedValue;
+            if (entry && entry->value.isShared()) {
+                cmd.sink->deliverShared(cmd.tag, status, entry->value.sharedValue());
+                return;
+            }
+            char buf[24];
+            if (status == kCompressedValue)
+                value = std::string_view(entry->value);
+            else if (entry)
+                value = stringOf(*entry, buf);
+            cmd.sink->deliver(cmd.tag, status, std::move(value));
+            return;
+        }
+        int64_t status = apply(cmd.type, cmd.keyData(), cmd.valueData(), cmd.ttlSeconds, now,
+                               &value, &cmd.args);
+        cmd.sink->deliver(cmd.tag, status, std::move(value));
+        return;
+    }
+
+    if (cmd.type != CommandType::GET) {
+        apply(cmd.type, cmd.keyData(), cmd.valueData(), cmd.ttlSeconds, now, nullptr);
+        return;
+    }
+
+    // The waiting thread copies a shared value and decompresses a
+    // compressed one itself, off this worker
+    if (cmd.completion) {
+        int64_t status;
+        ValueEntry* entry = readString(cmd.keyData(), now, status);
+        cmd.completion->value.clear();
+        cmd.completion->compressed = entry && entry->encoding() == Encoding::Compressed;
+        if (entry && entry->value.isShared()) {
+            cmd.completion->shared = entry->value.sharedValue();
+        } else if (cmd.completion->compressed) {
+            cmd.completion->value = std::string_view(entry->value);
+        } else if (entry) {
+            char buf[24];
+            std::string_view current = stringOf(*entry, buf);
+            cmd.completion->value.assign(current.data(), current.size());
+        }
+        cmd.completion->complete();
+        return;
+    }
+
+    std::string value;
+    apply(cmd.type, cmd.keyData(), cmd.valueData(), cmd.ttlSeconds, now, &value);
+    if (cmd.completions) {
+        cmd.completions->post(
+            [callback = std::move(cmd.callback), value = std::move(value)]() mutable {
+                callback(std::move(value));
+            });
+    } else {
+        cmd.callback(std::move(value));
+    }
+}
+
+// A string value: copied into the arena, or for a large one held in a
+// shared buffer (the client's own, when it sent one)
+void Shard::storeString(ValueEntry& entry, std::string_view value) {
+    if (!sharedValueMin || value.size() < sharedValueMin) {
+        entry.value.assign(value, &arena);
+        return;
+    }
+    if (incoming && value.data() == incoming->data())
+        entry.value.share(*incoming, &arena);
+    else
+        entry.value.share(ValueRef::copy(value), &arena);
+}
+
+// A string entry's bytes; an Int one is formatted into `buf` first, and a
+// compressed one decompressed into `inflated` (valid until the next call)
+std::string_view Shard::stringOf(const ValueEntry& entry, char (&buf)[24]) {
+    if (entry.encoding() == Encoding::Compressed) {
+        if (!decompressValue(entry.value, inflated))
+            inflated.clear();
+        return inflated;
+    }
+    if (entry.encoding() != Encoding::Int)
+        return entry.value;
+    int64_t n;
+    std::memcpy(&n, entry.value.data(), sizeof(n));
+    auto r = std::to_chars(buf, buf + sizeof(buf), n);
+    return std::string_view(buf, static_cast<size_t>(r.ptr - buf));
+}
+
+// The live string under `key` (counting a hit), or null with `status` 0
+// if it is missing or kWrongType if it holds a collection
+ValueEntry* Shard::readString(std::string_view key, int64_t now, int64_t& status) {
+    ValueEntry* entry = lookup(key, now);
+    bump(entry ? statHits : statMisses);
+    status = entry ? 1 : 0;
+    if (!entry)
+        return nullptr;
+    if (entry->type() != ValueType::String) {
+        status = kWrongType;
+        return nullptr;
+    }
+    touch(*entry, now, false);
+    return entry;
+}
+
+ValueEntry& Shard::upsert(std::string_view key, int64_t now) {
+    bool created = false;
+    ValueEntry& entry =
+        store.findOrInsert(key, [&]() { return CompactString(key, &arena); }, &created);
+    if (created) {
+        slotKeyCounts[keySlot(key)]++;
+        if (keyIndex)
+            keyIndex->insert(key);
+    }
+    if (snapshotWriter) {
+        // A key born after the snapshot point is not part of it
+        if (created)
+            entry.snapshotEpoch = snapshotEpoch;
+        else if (entry.snapshotEpoch != snapshotEpoch)
+            saveForSnapshot(key, entry, now);
+    }
+    touch(entry, now, created);
+    return entry;
+}
+
+// Converts a deadline on the shard clock to the wall-clock time the AOF
+// stores, so a replay after restart keeps the original expiry
+int64_t Shard::unixMsFor(int64_t deadlineMs) const {
+    int64_t unixNow = std::chrono::duration_cast<std::chrono::milliseconds>(
+                          std::chrono::system_clock::now().time_since_epoch()).count();
+    return unixNow + (deadlineMs - nowMs());
+}
+
+bool Shard::logging() const {
+    return aof || (backlog && backlog->active());
+}
+
+// Expiry and eviction are logged as DELs whatever triggered them
+void Shard::logDel(std::string_view key) {
+    if (logging())
+        AppendOnlyFile::encodeDel(logBuffer, key);
+}
+
+void Shard::flushLog() {
+    if (logBuffer.empty())
+        return;
+    if (backlog && backlog->active())
+        backlog->append(logBuffer);
+    if (aof) {
+        aof->append(index, std::move(logBuffer));
+        logBuffer = std::string();
+    } else {
+        logBuffer.clear();
+    }
+}
+
+// Records logged before this point are in the old file and covered by the
+// scan; those after it also go to the rewrite's diff
+void Shard::startAofScan() {
+    if (!aof || aofScanning)
+        return;
+    flushLog();
+    aof->beginBase(index);
+    aofScanning = true;
+    aofCursor = 0;
+}
+
+// Returns true while the scan has more of the store to cover
+bool Shard::aofScanStep(size_t groups) {
+    if (!aofScanning)
+        return false;
+
+    int64_t now = nowMs();
+    int64_t unixOffset = unixMsFor(now) - now;
+    std::string base;
+    for (size_t i = 0; i < groups; i++) {
+        aofCursor = store.scan(aofCursor, [&](const CompactString& key, ValueEntry& entry) {
+            int64_t expireAt = 0;
+            if (!expires.empty()) {
+                const int64_t* deadline = expires.find(key);
+                if (deadline) {
+                    if (now >= *deadline)
+                        return; // already expired, just not collected yet
+                    expireAt = *deadline + unixOffset;
+                }
+            }
+            encodeEntry(base, key, entry, expireAt);
+        });
+        if (aofCursor == 0)
+            break;
+    }
+
+    if (!base.empty())
+        aof->appendBase(index, std::move(base));
+    if (aofCursor == 0) {
+        aof->endBase(index);
+        aofScanning = false;
+    }
+    return aofScanning;
+}
+
+void Shard::startSnapshot(SnapshotWriter* writer) {
+    if (snapshotWriter) {
+        writer->shardDone(index); // one at a time; RedisLite never overlaps them
+        return;
+    }
+    snapshotWriter = writer;
+    syncLogging = false;
+    if (++snapshotEpoch == 0)
+        snapshotEpoch = 1; // 0 is what fresh entries carry
+    snapshotCursor = 0;
+}
+
+void Shard::saveForSnapshot(std::string_view key, ValueEntry& entry, int64_t now) {
+    int64_t expireAt = 0;
+    if (!expires.empty()) {
+        const int64_t* deadline = expires.find(key);
+        if (deadline)
+            expireAt = *deadline + (unixMsFor(now) - now);
+    }
+    if (plainString(entry)) {
+        char buf[24];
+        snapshot::encodeRecord(snapshotBuffer, key, stringOf(entry, buf), expireAt);
+    } else {
+        serializeEntry(key, entry, dumpScratch);
+        snapshot::encodeRecord(snapshotBuffer, key, dumpScratch, expireAt, true);
+    }
+    snapshotBufferRecords++;
+    entry.snapshotEpoch = snapshotEpoch;
+    if (snapshotBuffer.size() >= kSnapshotBlockBytes)
+        flushSnapshot();
+}
+
+// Called before `key` is overwritten or removed
+void Shard::preserveForSnapshot(std::string_view key) {
+    if (!snapshotWriter)
+        return;
+    ValueEntry* entry = store.find(key);
+    if (entry && entry->snapshotEpoch != snapshotEpoch)
+        saveForSnapshot(key, *entry, nowMs());
+}
+
+void Shard::flushSnapshot() {
+    if (snapshotBufferRecords == 0)
+        return;
+    snapshotWriter->write(index, std::move(snapshotBuffer), snapshotBufferRecords);
+    snapshotBuffer = std::string();
+    snapshotBufferRecords = 0;
+}
+
+// Returns true while the snapshot has more of the store to cover
+bool Shard::snapshotStep(size_t groups) {
+    if (!snapshotWriter)
+        return false;
+
+    int64_t now = nowMs();
+    for (size_t i = 0; i < groups; i++) {
+        snapshotCursor = store.scan(snapshotCursor, [&](const CompactString& key, ValueEntry& entry) {
+            if (entry.snapshotEpoch != snapshotEpoch)
+                saveForSnapshot(key, entry, now);
+        });
+        if (snapshotCursor == 0)
+            break;
+    }
+    if (snapshotCursor != 0)
+        return true;
+
+    flushSnapshot();
+    snapshotWriter->shardDone(index);
+    snapshotWriter = nullptr;
+    return false;
+}
+
+// Runs before the shard serves anything, or on a replica's full resync
+// (`replace`). With the same shard count as the writer this shard reads
+// only its own blocks; otherwise it reads all of them and keeps the keys
+// that hash here. A replacing load is logged like any other write (a DEL
+// per old key, a SET per new one), so an AOF stays a complete history
+// even if a rewrite is running.
+void Shard::loadSnapshot(SnapshotLoad& load) {
+    const SnapshotReader& reader = *load.reader;
+    bool log = load.replace && logWrites;
+    if (load.replace) {
+        // A snapshot being taken keeps its point in time: finish it first
+        while (snapshotStep(kSnapshotGroupsPerIdleStep)) {
+        }
+        if (log) {
+            store.forEach([&](const CompactString& key, ValueEntry&) {
+                AppendOnlyFile::encodeDel(logBuffer, key);
+                if (logBuffer.size() >= kSnapshotBlockBytes)
+                    flushLog();
+            });
+        }
+        store.clear();
+        expires.clear();
+        collections.clear();
+        collectionBytes = 0;
+        std::fill(slotKeyCounts.begin(), slotKeyCounts.end(), 0);
+        if (keyIndex)
+            keyIndex->clear();
+        if (readIndex)
+            readIndex->clear();
+        for (size_t i = 0; versions && i <= versionMask; i++)
+            versions[i].store(versions[i].load(std::memory_order_relaxed) + 1,
+                              std::memory_order_release);
+    }
+    bool any = reader.shardCount() != shardCount;
+    uint64_t expected = any ? reader.recordCount() / shardCount : reader.countFor(false, index);
+    store.reserve(store.size() + expected + expected / 8);
+
+    int64_t now = nowMs();
+    int64_t unixNow = unixMsFor(now);
+    ValueType type = ValueType::String;
+    Encoding encoding = Encoding::Raw;
+    std::string packed;
+    std::unique_ptr<Collection> expanded;
+    bool malformed = false;
+    bool ok = reader.forEach(any, static_cast<uint32_t>(index),
+                             [&](const SnapshotReader::Record& rec) {
+        if (any && shardOfKey(rec.key, shardCount) != index)
+            return;
+        if (rec.expireAtMs && rec.expireAtMs <= unixNow)
+            return;
+        if (rec.typed && !deserializeValue(rec.value, limits, type, encoding, packed, expanded)) {
+            malformed = true;
+            return;
+        }
+        bool created = false;
+        ValueEntry& entry = store.findOrInsert(
+            rec.key, [&]() { return CompactString(rec.key, &arena); }, &created);
+        if (created) {
+            slotKeyCounts[keySlot(rec.key)]++;
+            if (keyIndex)
+                keyIndex->insert(rec.key);
+        } else
+            dropCollection(rec.key, entry);
+        touch(entry, now, true);
+        if (rec.typed) {
+            entry.value.assign(packed, &arena);
+            entry.setType(type, encoding);
+            if (expanded) {
+                collectionBytes += expanded->bytes;
+                collections.findOrInsert(
+                    rec.key, [&]() { return CompactString(rec.key, &arena); }) = std::move(expanded);
+            }
+        } else {
+            storeString(entry, rec.value);
+        }
+        if (rec.expireAtMs) {
+            int64_t deadline = now + (rec.expireAtMs - unixNow);
+            expires.findOrInsert(rec.key, [&]() { return CompactString(rec.key, &arena); }) =
+                deadline;
+            scheduleExpiry(rec.key, deadline);
+        }
+        publish(rec.key);
+        if (log) {
+            if (rec.typed)
+                AppendOnlyFile::encodeRestore(logBuffer, rec.key, rec.value, rec.expireAtMs);
+            else
+                AppendOnlyFile::encodeSet(logBuffer, rec.key, rec.value, rec.expireAtMs);
+            if (logBuffer.size() >= kSnapshotBlockBytes)
+                flushLog();
+        }
+    });
+
+    if (!ok || malformed)
+        load.failed.store(true, std::memory_order_relaxed);
+    if (load.pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        load.done->complete();
+}
+
+// Keys are not indexed by slot, so this walks the store, but stops as
+// soon as it has every key the slot holds (or `limit` of them). Delivers
+// the count as the status and the keys as a RESP array.
+void Shard::slotKeys(Command& cmd) {
+    uint32_t count = slotKeyCounts[cmd.hashSlot];
+    size_t wanted = std::min<size_t>(cmd.limit, count);
+    std::string keys;
+    size_t found = 0;
+    size_t cursor = 0;
+    if (wanted) {
+        do {
+            cursor = store.scan(cursor, [&](const CompactString& key, ValueEntry&) {
+                if (found < wanted && keySlot(key) == cmd.hashSlot) {
+                    std::string_view k = key;
+                    keys += "$" + std::to_string(k.size()) + "\r\n";
+                    keys.append(k.data(), k.size());
+                    keys += "\r\n";
+                    found++;
+                }
+            });
+        } while (cursor != 0 && found < wanted);
+    }
+    cmd.sink->deliver(cmd.tag, count, "*" + std::to_string(found) + "\r\n" + keys);
+}
+
+// One SCAN step over this shard's table, resumed from the job's cursor.
+// Like Redis's SCAN it stops once it has `count` keys or has visited ten
+// times `count` groups, so each step is short however sparse the matches;
+// the cursor survives resizes in between (FlatHashMap::scan).
+void Shard::scanKeys(Command& cmd) {
+    ScanJob& job = *cmd.scan;
+    int64_t now = nowMs();
+    size_t cursor = static_cast<size_t>(job.cursor / shardCount);
+    size_t groups = 0;
+    do {
+        cursor = store.scan(cursor, [&](const CompactString& key, ValueEntry& entry) {
+            if ((job.type < 0 || int(entry.type()) == job.type) && !isExpired(key, now) &&
+                (job.pattern.empty() || globMatch(job.pattern, key)))
+                job.keys.emplace_back(std::string_view(key));
+        });
+    } while (cursor != 0 && job.keys.size() < job.count && ++groups < job.count * 10);
+    // Once this table is done, the next call starts on the next shard
+    if (cursor != 0)
+        job.next = uint64_t(cursor) * shardCount + index;
+    else
+        job.next = index + 1 < shardCount ? index + 1 : 0;
+    finishScan(cmd);
+}
+
+// This shard's keys under the job's prefix, in order, from the key index;
+// bounded like a SCAN step. Without the index the part is empty.
+void Shard::scanPrefix(Command& cmd) {
+    ScanJob& job = *cmd.scan;
+    ScanJob::Part& part = job.parts[index];
+    int64_t now = nowMs();
+    size_t visited = 0;
+    if (keyIndex) {
+        keyIndex->range(job.prefix, job.after, [&](const std::string& key) {
+            const ValueEntry* entry = store.find(key);
+            if (entry && (job.type < 0 || int(entry->type()) == job.type) &&
+                !isExpired(key, now) && (job.pattern.empty() || globMatch(job.pattern, key)))
+                part.keys.push_back(key);
+            if (part.keys.size() < job.count && ++visited < job.count * 10)
+                return true;
+            part.more = true;
+            part.last = key;
+            return false;
+        });
+    }
+    if (job.pending.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        finishScan(cmd);
+}
+
+// On the worker that completed the job: merges a prefix query's parts,
+// then replies as Redis's SCAN does, [cursor, [key ...]]
+void Shard::finishScan(Command& cmd) {
+    ScanJob& job = *cmd.scan;
+    std::string cursor;
+    if (cmd.type == CommandType::SCAN_PREFIX) {
+        // Every shard has seen all of its keys up to the smallest key
+        // one of them stopped at, so only keys up to that one are final
+        const std::string* bound = nullptr;
+        for (const ScanJob::Part& part : job.parts) {
+            if (part.more && (!bound || part.last < *bound))
+                bound = &part.last;
+        }
+        for (ScanJob::Part& part : job.parts) {
+            for (std::string& key : part.keys) {
+                if (!bound || key <= *bound)
+                    job.keys.push_back(std::move(key));
+            }
+        }
+        std::sort(job.keys.begin(), job.keys.end());
+        if (job.keys.size() > job.count) {
+            job.keys.resize(job.count);
+            job.nextAfter = job.keys.back();
+        } else if (bound) {
+            job.nextAfter = *bound;
+        }
+        cursor = job.nextAfter;
+    } else {
+        cursor = std::to_string(job.next);
+    }
+
+    if (!cmd.sink) {
+        job.done->complete();
+        return;
+    }
+    std::string reply = "*2\r\n$" + std::to_string(cursor.size()) + "\r\n" + cursor + "\r\n*" +
+                        std::to_string(job.keys.size()) + "\r\n";
+    for (const std::string& key : job.keys) {
+        reply += "$" + std::to_string(key.size()) + "\r\n";
+        reply += key;
+        reply += "\r\n";
+    }
+    cmd.sink->deliver(cmd.tag, 1, std::move(reply));
+    delete &job;
+}
+
+// Runs one operation against the store. GET writes the value (or "")
+// into `out`, reusing its capacity. Returns 1 if the key was found (GET),
+// removed (DEL) or written (SET), 0 otherwise.
+int64_t Shard::apply(CommandType type, std::string_view key,
+                     std::string_view value, int ttlSeconds,
+                     int64_t now, std::string* out,
+                     const std::vector<std::string_view>* args) {
+    switch (type) {
+
+    case CommandType::SET: {
+        if (!admitWrite())
+            return 0;
+        ValueEntry& entry = upsert(key, now);
+        if (entry.encoding() != Encoding::Raw)
+            dropCollection(key, entry);
+        storeString(entry, value);
+        if (valueCompressed)
+            entry.setType(ValueType::String, Encoding::Compressed);
+        if (!expires.empty())
+            expires.erase(key); // a plain SET clears any TTL
+        publish(key);
+        if (logWrites && valueCompressed)
+            logCurrent(key);
+        else if (logWrites)
+            AppendOnlyFile::encodeSet(logBuffer, key, value, 0);
+        return 1;
+    }
+
+    case CommandType::SET_TTL: {
+        if (!admitWrite())
+            return 0;
+        ValueEntry& entry = upsert(key, now);
+        if (entry.encoding() != Encoding::Raw)
+            dropCollection(key, entry);
+        storeString(entry, value);
+        if (valueCompressed)
+            entry.setType(ValueType::String, Encoding::Compressed);
+        int64_t deadline = now + int64_t(ttlSeconds) * 1000;
+        expires.findOrInsert(key, [&]() { return CompactString(key, &arena); }) = deadline;
+        scheduleExpiry(key, deadline);
+        publish(key);
+        if (logWrites && valueCompressed)
+            logCurrent(key);
+        else if (logWrites)
+            AppendOnlyFile::encodeSet(logBuffer, key, value, unixMsFor(deadline));
+        return 1;
+    }
+
+    case CommandType::GET: {
+        out->clear();
+        int64_t status;
+        ValueEntry* entry = readString(key, now, status);
+        if (entry) {
+            char buf[24];
+            std::string_view current = stringOf(*entry, buf);
+            out->assign(current.data(), current.size());
+        }
+        return status;
+    }
+
+    // Only the range is copied, so a slice of a large value is cheap. A
+    // missing key reads as "", as in Redis.
+    case CommandType::GETRANGE: {
+        out->clear();
+        int64_t start, end;
+        if (!args || args->size() != 2 || !parseInt64((*args)[0], start) ||
+            !parseInt64((*args)[1], end)) {
+            *out = kNotInteger;
+            return 0;
+        }
+        int64_t status;
+        ValueEntry* entry = readString(key, now, status);
+        if (status == kWrongType)
+            return status;
+        char buf[24];
+        std::string_view current = entry ? stringOf(*entry, buf) : std::string_view();
+        int64_t size = static_cast<int64_t>(current.size());
+        if (start < 0)
+            start = std::max<int64_t>(size + start, 0);
+        if (end < 0)
+            end = size + end;
+        end = std::min(end, size - 1);
+        if (start <= end)
+            out->assign(current.data() + start, static_cast<size_t>(end - start + 1));
+        return 1;
+    }
+
+    case CommandType::DEL:
+        if (!removeKey(key))
+            return 0;
+        if (logWrites)
+            AppendOnlyFile::encodeDel(logBuffer, key);
+        return 1;
+
+    // Migration out of a slot: copy with DUMP, then delete only what did
+    // not change meanwhile (2 = changed, left for the next pass)
+    case CommandType::DUMP: {
+        out->clear();
+        ValueEntry* entry = store.find(key);
+        if (!entry || isExpired(key, now))
+            break;
+        encodeEntry(*out, key, *entry, unixExpireAt(key));
+        return 1;
+    }
+
+    case CommandType::DEL_IF_VALUE: {
+        ValueEntry* entry = store.find(key);
+        if (!entry || isExpired(key, now))
+            return 0;
+        if (!plainString(*entry)) {
+            serializeEntry(key, *entry, dumpScratch);
+            if (dumpScratch != value)
+                return 2;
+        } else {
+            char buf[24];
+            if (stringOf(*entry, buf) != value)
+                return 2;
+        }
+        removeKey(key);
+        if (logWrites)
+            AppendOnlyFile::encodeDel(logBuffer, key);
+        return 1;
+    }
+
+    case CommandType::RESTORE: {
+        int64_t status = restore(key, value, ttlSeconds, now, out);
+        publish(key);
+        return status;
+    }
+
+    case CommandType::INCRBY:
+    case CommandType::APPEND:
+    case CommandType::GETSET:
+    case CommandType::CAS: {
+        int64_t status = readModifyWrite(type, key, value, args, now, out);
+        publish(key);
+        return status;
+    }
+
+    case CommandType::TYPE:
+    case CommandType::OBJECT_ENCODING: {
+        ValueEntry* entry = lookup(key, now);
+        if (type == CommandType::TYPE) {
+            *out = "+";
+            *out += entry ? typeName(entry->type()) : "none";
+            *out += "\r\n";
+        } else if (entry) {
+            std::string_view name = encodingName(entry->type(), entry->encoding());
+            *out = "$" + std::to_string(name.size()) + "\r\n";
+            out->append(name.data(), name.size());
+            *out += "\r\n";
+        } else {
+            *out = "$-1\r\n";
+        }
+        return entry ? 1 : 0;
+    }
+
+    case CommandType::BATCH:
+    case CommandType::AOF_REWRITE:
+    case CommandType::SNAPSHOT:
+    case CommandType::SNAPSHOT_LOAD:
+    case CommandType::SYNC_MARK:
+    case CommandType::SLOT_KEYS:
+    case CommandType::SCAN:
+    case CommandType::SCAN_PREFIX:
+        break;
+
+    default: {
+        // The collection commands
+        const CollectionCommand* command = collectionCommand(type);
+        if (command && args)
+            return applyCollection(*command, key, *args, now, out);
+        break;
+    }
+    }
+    return 0;
+}
+
+// Replies in RESP through `out`. Returns 1 if a write changed the value
+// or a read found the key, 0 otherwise. A write that changed something
+// is logged as the command itself, which replays to the same value.
+int64_t Shard::applyCollection(const CollectionCommand& command, std::string_view key,
+                               const std::vector<std::string_view>& args, int64_t now,
+                               std::string* out) {
+    std::string discarded;
+    std::string& reply = out ? *out : discarded;
+    reply.clear();
+    if (command.write && !admitWrite()) {
+        reply = kOomReply;
+        return 0;
+    }
+
+    ValueEntry* entry = lookup(key, now);
+    if (!command.write)
+        bump(entry ? statHits : statMisses);
+    if (entry && entry->type() != command.valueType) {
+        reply = kWrongTypeReply;
+        return kWrongType;
+    }
+    // A missing set starts out as an intset, anything else as a listpack
+    Encoding encoding = entry ? entry->encoding()
+                              : command.valueType == ValueType::Set ? Encoding::Intset
+                                                                    : Encoding::Listpack;
+    Collection* expanded = nullptr;
+    if (encoding == Encoding::Expanded)
+        expanded = collections.find(key)->get();
+    if (command.write && entry)
+        preserveForSnapshot(key);
+
+    size_t bytesBefore = expanded ? expanded->bytes : 0;
+    CollectionOp op(command.valueType, encoding,
+                    entry ? std::string_view(entry->value) : std::string_view(), expanded, limits);
+    if (!op.run(command.type, args, reply)) {
+        if (entry)
+            touch(*entry, now, false);
+        return entry && !command.write ? 1 : 0;
+    }
+    if (expanded)
+        collectionBytes = collectionBytes - bytesBefore + expanded->bytes;
+
+    if (op.size() == 0) {
+        removeKey(key); // the last element went, and the key with it
+    } else {
+        // Views into the old value are not used past run(), so the entry
+        // may move here
+        ValueEntry& stored = upsert(key, now);
+        if (op.converted) {
+            collectionBytes += op.converted->bytes;
+            collections.findOrInsert(key, [&]() { return CompactString(key, &arena); }) =
+                std::move(op.converted);
+            stored.value.assign(std::string_view(), &arena);
+        } else if (op.encoding != Encoding::Expanded) {
+            stored.value.assign(op.repacked, &arena);
+        }
+        stored.setType(command.valueType, op.encoding);
+        publish(key);
+    }
+    // During a rewrite scan the base may already hold this change, and
+    // the diff replays on top of it; likewise a snapshot for a replica
+    // (syncLogging). Only an absolute record is safe then.
+    if (logWrites && (aofScanning || syncLogging))
+        logCurrent(key);
+    else if (logWrites)
+        AppendOnlyFile::encodeCommand(logBuffer, command.name, key, args);
+    return 1;
+}
+
+// INCRBY / APPEND / GETSET / CAS. Each is logged as the SET it amounts
+// to, so a replay (or a replica) never redoes the arithmetic. INCRBY and
+// APPEND keep the key's TTL; GETSET and CAS replace the value like SET.
+int64_t Shard::readModifyWrite(CommandType type, std::string_view key, std::string_view value,
+                               const std::vector<std::string_view>* args, int64_t now,
+                               std::string* out) {
+    std::string discarded;
+    std::string& result = out ? *out : discarded;
+    result.clear();
+    int64_t delta = 0;
+    if (type == CommandType::INCRBY && !parseInt64(value, delta)) {
+        result = kNotInteger;
+        return 0;
+    }
+    if (type == CommandType::CAS && (!args || args->empty()))
+        return 0;
+    if (!admitWrite()) {
+        result = kOomError;
+        return 0;
+    }
+
+    ValueEntry* entry = lookup(key, now);
+    if (entry && entry->type() != ValueType::String)
+        return kWrongType;
+    char buf[24];
+    std::string_view current = entry ? stringOf(*entry, buf) : std::string_view();
+    int64_t status = 1;
+
+    switch (type) {
+    case CommandType::INCRBY: {
+        // Parsed once; from then on the value stays a native integer
+        int64_t n = 0;
+        if (entry) {
+            if (entry->encoding() == Encoding::Int)
+                std::memcpy(&n, entry->value.data(), sizeof(n));
+            else if (current.size() > 20 || !parseInt64(current, n)) {
+                result = kNotInteger;
+                return 0;
+            }
+        }
+        if (__builtin_add_overflow(n, delta, &n)) {
+            result = "ERR increment or decrement would overflow";
+            return 0;
+        }
+        ValueEntry& stored = upsert(key, now);
+        stored.value.assign(std::string_view(reinterpret_cast<const char*>(&n), sizeof(n)),
+                            &arena);
+        stored.setType(ValueType::String, Encoding::Int);
+        result = std::to_string(n);
+        break;
+    }
+    case CommandType::APPEND: {
+        dumpScratch.assign(current.data(), current.size());
+        dumpScratch.append(value.data(), value.size());
+        ValueEntry& stored = upsert(key, now);
+        storeString(stored, dumpScratch);
+        stored.setType(ValueType::String, Encoding::Raw);
+        result = std::to_string(dumpScratch.size());
+        break;
+    }
+    case CommandType::GETSET:
+    case CommandType::CAS: {
+        if (type == CommandType::CAS && (!entry || current != value))
+            return 0; // nothing to compare with, or someone got there first
+        status = type == CommandType::CAS || entry ? 1 : 0;
+        if (type == CommandType::GETSET)
+            result.assign(current.data(), current.size());
+        std::string_view next = type == CommandType::CAS ? (*args)[0] : value;
+        ValueEntry& stored = upsert(key, now);
+        storeString(stored, next);
+        stored.setType(ValueType::String, Encoding::Raw);
+        if (!expires.empty())
+            expires.erase(key);
+        break;
+    }
+    default:
+        return 0;
+    }
+    if (logWrites)
+        logCurrent(key);
+    return status;
+}
+
+// Replaces the whole value (RESTORE ... REPLACE) with a serializeValue()
+// payload, as MIGRATE, rewritten AOFs and replicas send it
+int64_t Shard::restore(std::string_view key, std::string_view payload, int ttlSeconds,
+                       int64_t now, std::string* out) {
+    ValueType type;
+    Encoding encoding;
+    std::string packed;
+    std::unique_ptr<Collection> expanded;
+    if (!deserializeValue(payload, limits, type, encoding, packed, expanded)) {
+        if (out)
+            *out = "-ERR DUMP payload version or checksum are wrong\r\n";
+        return 0;
+    }
+    if (!admitWrite()) {
+        if (out)
+            *out = kOomReply;
+        return 0;
+    }
+
+    ValueEntry& entry = upsert(key, now);
+    dropCollection(key, entry);
+    entry.value.assign(packed, &arena);
+    entry.setType(type, encoding);
+    if (expanded) {
+        collectionBytes += expanded->bytes;
+        collections.findOrInsert(key, [&]() { return CompactString(key, &arena); }) =
+            std::move(expanded);
+    }
+    int64_t expireAt = 0;
+    if (ttlSeconds > 0) {
+        int64_t deadline = now + int64_t(ttlSeconds) * 1000;
+        expires.findOrInsert(key, [&]() { return CompactString(key, &arena); }) = deadline;
+        scheduleExpiry(key, deadline);
+        expireAt = unixMsFor(deadline);
+    } else if (!expires.empty()) {
+        expires.erase(key);
+    }
+    if (logWrites)
+        AppendOnlyFile::encodeRestore(logBuffer, key, payload, expireAt);
+    if (out)
+        *out = "+OK\r\n";
+    return 1;
+}
+
+void Shard::enqueue(Command&& cmd) {
+    push(cmd, false);
+}
+
+// Block waits for room. Reject refuses anything; Shed refuses what would
+// go to the main queue, and lets priority reads wait.
+bool Shard::offer(Command& cmd) {
+    bool priority = cmd.priority && priorityQueue;
+    return push(cmd, queueOverflow == QueueOverflow::Reject ||
+                         (queueOverflow == QueueOverflow::Shed && !priority));
+}
+
+// The priority lane first
+bool Shard::tryPop(Command& cmd) {
+    return (priorityQueue && priorityQueue->tryPop(cmd)) || commandQueue.tryPop(cmd);
+}
+
+bool Shard::queued() const {
+    return !commandQueue.empty() || (priorityQueue && !priorityQueue->empty());
+}
+
+bool Shard::push(Command& cmd, bool mayRefuse) {
+    if (latencyTracking)
+        cmd.enqueuedNs = clockNs();
+    MpscRing<Command>& ring = cmd.priority && priorityQueue ? *priorityQueue : commandQueue;
+    // Bounded queue: a full ring pushes back on the producer, or turns
+    // the command away
+    if (!ring.tryPush(std::move(cmd))) {
+        if (mayRefuse) {
+            statQueueRefused.fetch_add(1, std::memory_order_relaxed);
+            return false;
+        }
+        statQueueFull.fetch_add(1, std::memory_order_relaxed);
+        while (!ring.tryPush(std::move(cmd)))
+            std::this_thread::yield();
+    }
+
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (sleeping.load(std::memory_order_relaxed)) {
+        std::lock_guard<std::mutex> lock(parkMutex);
+        cv.notify_one();
+    }
+    return true;
+}
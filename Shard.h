@@ -0,0 +1,299 @@
+#pragma once
+#include <string>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include<chrono>
+#include "Command.h"
+#include "Config.h"
+#include "CompactString.h"
+#include "FlatHashMap.h"
+#include "SlabArena.h"
+#include "TimingWheel.h"
+#include "MpscRing.h"
+#include "AppendOnlyFile.h"
+#include "Snapshot.h"
+#include "Replication.h"
+#include "HashSlot.h"
+#include "Collections.h"
+#include "ReadIndex.h"
+#include "Metrics.h"
+#include "SlowLog.h"
+#include "KeyScan.h"
+
+// TTLs are kept out of the entry (see Shard::expires), so keys that
+// never expire carry no expiry metadata
+struct ValueEntry{
+   // A string, or a packed collection (an expanded one is empty here and
+   // lives in Shard::collections)
+   CompactString value;
+   // LRU: 24-bit clock in seconds. LFU: 16-bit minutes of the last decay
+   // followed by an 8-bit logarithmic counter, as in Redis. The top 8
+   // bits hold the value's type and encoding, where Redis's robj keeps
+   // them next to its lru field.
+   uint32_t access = 0;
+   // Last snapshot this entry was written to; sits in what was padding
+   uint32_t snapshotEpoch = 0;
+
+   ValueType type() const { return static_cast<ValueType>(access >> 28); }
+   Encoding encoding() const { return static_cast<Encoding>((access >> 24) & 0xF); }
+   void setType(ValueType type, Encoding encoding) {
+       access = (access & 0xFFFFFF) | uint32_t(type) << 28 | uint32_t(encoding) << 24;
+   }
+};
+
+// Snapshot of a worker's counters
+struct WorkerStats {
+    uint64_t batches = 0;
+    uint64_t commands = 0;
+    uint64_t maxBatchSize = 0;
+    uint64_t lastBatchSize = 0;
+
+    uint64_t expiredActive = 0; // removed by the timing wheel
+    uint64_t expiredLazy = 0;   // removed when a GET hit them
+    uint64_t ttlTimers = 0;     // timers still pending (including stale ones)
+
+    uint64_t usedMemory = 0;     // arena bytes in use plus table storage
+    uint64_t evictedKeys = 0;
+    uint64_t rejectedWrites = 0; // writes dropped under NoEviction
+
+    uint64_t keys = 0;           // as of the end of the last pass
+    uint64_t expiringKeys = 0;   // keys with a TTL
+    uint64_t keyspaceHits = 0;   // reads (GET, collection reads) that found the key
+    uint64_t keyspaceMisses = 0;
+    uint64_t queueDepth = 0;     // commands left queued after the last drain
+    uint64_t queueFullWaits = 0; // enqueues that found the ring full and waited
+    uint64_t queueRefused = 0;   // client commands refused by a full ring (queueOverflow)
+};
+
+// One partition of the keyspace: its own queue, worker thread and store.
+// Every key maps to exactly one shard, so each store still has a single
+// writer and needs no locking.
+class Shard {
+private:
+    // Single-thread owned state (worker thread only). The arena must
+    // outlive the store, whose strings hand their blocks back to it.
+    SlabArena arena;
+    FlatHashMap<CompactString, ValueEntry> store;
+
+    // Deadlines (ms since `epoch`) of keys that have a TTL, as in Redis's
+    // expires dict. Only TTL keys have an entry here.
+    FlatHashMap<CompactString, int64_t> expires;
+
+    // Collections that outgrew their packed encoding, and their estimated
+    // heap use
+    FlatHashMap<CompactString, std::unique_ptr<Collection>> collections;
+    size_t collectionBytes = 0;
+    CollectionLimits limits;
+    std::vector<std::string_view> fieldViews; // BatchOp::fields as views
+
+    // Strings of at least this many bytes are kept in a shared ValueBuffer
+    // (0 = never). `incoming` is the executing command's value if its
+    // client already wrapped it in one.
+    size_t sharedValueMin;
+    const ValueRef* incoming = nullptr;
+    // The executing command's value came compressed (Command::compressed),
+    // and the scratch a compressed value is read back into
+    bool valueCompressed = false;
+    std::string inflated;
+    std::string dumpScratch;
+
+    // lockFreeReads: what readers see in place of the store (null when
+    // off). Every write republishes its key before the reply goes out.
+    std::unique_ptr<ReadIndex> readIndex;
+    // nearCacheEntries: a version per bucket of key hashes, bumped after
+    // every change to a key in it (null when off)
+    std::unique_ptr<std::atomic<uint64_t>[]> versions;
+    size_t versionMask = 0;
+
+    // Active expiry, checked against `expires` when a timer fires. A key
+    // has one live timer, whose tick is in `timerTicks`; it stays put when
+    // the TTL is extended and re-arms itself if it fires early. Only a
+    // shortened TTL schedules another, leaving the old one stale. The
+    // entry outlives a removed TTL until its timer fires, so a key whose
+    // TTL is dropped and set again reuses the timer.
+    TimingWheel expiryWheel;
+    FlatHashMap<CompactString, uint64_t> timerTicks;
+    std::chrono::steady_clock::time_point epoch;
+    size_t expireBudget;
+
+    // This shard's slice of maxMemory (0 = unlimited)
+    size_t memoryBudget;
+    EvictionPolicy evictionPolicy;
+    size_t evictionSamples;
+    uint64_t rngState;
+
+    // Mutations executed in the current pass, in AOF format, handed to
+    // the AOF writer thread and the replication backlog once per pass.
+    // `logWrites` is off while a command replayed from the file runs.
+    size_t index;
+    AppendOnlyFile* aof;
+    ReplicationBacklog* backlog;
+    std::string logBuffer;
+    bool logWrites = false;
+    // Incremental store scan feeding an AOF rewrite
+    bool aofScanning = false;
+    size_t aofCursor = 0;
+
+    // Point-in-time snapshot in progress (null when none). The scan skips
+    // entries already stamped with `snapshotEpoch`; a write to an entry
+    // the scan has not reached yet saves its old value first.
+    SnapshotWriter* snapshotWriter = nullptr;
+    uint32_t snapshotEpoch = 0;
+    // Between SYNC_MARK and the snapshot a replica syncs from: the
+    // snapshot may still take in a write logged now, so collection writes
+    // are logged as their result rather than replayed
+    bool syncLogging = false;
+    size_t snapshotCursor = 0;
+    std::string snapshotBuffer;
+    uint32_t snapshotBufferRecords = 0;
+    size_t shardCount;
+
+    // Keys per hash slot, for CLUSTER COUNTKEYSINSLOT and to end a
+    // GETKEYSINSLOT walk early
+    std::vector<uint32_t> slotKeyCounts;
+    // keyIndex: every key of the store, in order (null when off)
+    std::unique_ptr<KeyIndex> keyIndex;
+
+    // Lock-free producer-consumer queue. The mutex/cv pair is only
+    // touched to park the worker once it has spun on an empty queue.
+    MpscRing<Command> commandQueue;
+    // Config::priorityQueueCapacity: reads marked Command::priority,
+    // drained ahead of commandQueue (null when off)
+    std::unique_ptr<MpscRing<Command>> priorityQueue;
+    QueueOverflow queueOverflow;
+    std::mutex parkMutex;
+    std::condition_variable cv;
+    std::atomic<bool> sleeping{false};
+    // Config::workerCpus / busyPoll; `cpu` is -1 when not pinned
+    int cpu = -1;
+    bool busyPoll;
+
+    // Commands drained per pass, reused across passes (worker thread only)
+    std::vector<Command> batch;
+
+    // Written by the worker only, readable from any thread
+    std::atomic<uint64_t> statBatches{0};
+    std::atomic<uint64_t> statCommands{0};
+    std::atomic<uint64_t> statMaxBatch{0};
+    std::atomic<uint64_t> statLastBatch{0};
+    std::atomic<uint64_t> statExpiredActive{0};
+    std::atomic<uint64_t> statExpiredLazy{0};
+    std::atomic<uint64_t> statTtlTimers{0};
+    std::atomic<uint64_t> statUsedMemory{0};
+    std::atomic<uint64_t> statEvicted{0};
+    std::atomic<uint64_t> statRejected{0};
+    std::atomic<uint64_t> statKeys{0};
+    std::atomic<uint64_t> statExpiring{0};
+    std::atomic<uint64_t> statHits{0};
+    std::atomic<uint64_t> statMisses{0};
+    std::atomic<uint64_t> statQueueDepth{0};
+    // Bumped by producers, but only on the slow path of a full ring
+    std::atomic<uint64_t> statQueueFull{0};
+    std::atomic<uint64_t> statQueueRefused{0};
+
+    // Set once at construction; the counters are the worker's alone, like
+    // the stats above
+    bool latencyTracking;
+    LatencyCounters queueWait;
+    LatencyCounters commandTimes[kCommandTypes];
+    // Shared by all shards and owned by RedisLite; null when off
+    SlowLog* slowLog;
+    LatencyMonitor* latencyMonitor;
+
+    std::thread worker;
+    std::atomic<bool> stop{false};
+
+    void workerLoop();
+    void pinWorker();
+    bool tryPop(Command& cmd);
+    bool queued() const;
+    bool push(Command& cmd, bool mayRefuse);
+    bool waitForCommand(Command& cmd);
+    size_t drainBatch();
+    void recordBatch(size_t size);
+    void logSlow(const Command& cmd, uint64_t ns);
+    uint64_t monitorStep(LatencyEvent event, uint64_t since);
+    int64_t nowMs() const;
+    uint64_t tickFor(int64_t deadlineMs) const;
+    void scheduleExpiry(std::string_view key, int64_t deadline);
+    bool isExpired(std::string_view key, int64_t now);
+    bool removeKey(std::string_view key);
+    ValueEntry* lookup(std::string_view key, int64_t now);
+    void dropCollection(std::string_view key, ValueEntry& entry);
+    void serializeEntry(std::string_view key, const ValueEntry& entry, std::string& out);
+    int64_t unixExpireAt(std::string_view key);
+    void encodeEntry(std::string& out, std::string_view key, const ValueEntry& entry,
+                     int64_t expireAtMs);
+    void logCurrent(std::string_view key);
+    void publish(std::string_view key);
+    void bumpVersion(std::string_view key);
+
+    size_t usedMemory() const;
+    bool admitWrite();
+    bool evictOne();
+    uint64_t nextRandom();
+    void touch(ValueEntry& entry, int64_t now, bool created);
+    bool expireStep();
+    int64_t unixMsFor(int64_t deadlineMs) const;
+    bool logging() const;
+    void logDel(std::string_view key);
+    void flushLog();
+    void startAofScan();
+    bool aofScanStep(size_t groups);
+    void startSnapshot(SnapshotWriter* writer);
+    void saveForSnapshot(std::string_view key, ValueEntry& entry, int64_t now);
+    void preserveForSnapshot(std::string_view key);
+    void flushSnapshot();
+    bool snapshotStep(size_t groups);
+    void loadSnapshot(SnapshotLoad& load);
+    void slotKeys(Command& cmd);
+    void scanKeys(Command& cmd);
+    void scanPrefix(Command& cmd);
+    void finishScan(Command& cmd);
+    void execute(Command& cmd);
+    ValueEntry& upsert(std::string_view key, int64_t now);
+    void storeString(ValueEntry& entry, std::string_view value);
+    ValueEntry* readString(std::string_view key, int64_t now, int64_t& status);
+    std::string_view stringOf(const ValueEntry& entry, char (&buf)[24]);
+    int64_t apply(CommandType type, std::string_view key,
+                  std::string_view value, int ttlSeconds,
+                  int64_t now, std::string* out,
+                  const std::vector<std::string_view>* args = nullptr);
+    int64_t applyCollection(const CollectionCommand& command, std::string_view key,
+                            const std::vector<std::string_view>& args, int64_t now,
+                            std::string* out);
+    int64_t readModifyWrite(CommandType type, std::string_view key, std::string_view value,
+                            const std::vector<std::string_view>* args, int64_t now,
+                            std::string* out);
+    int64_t restore(std::string_view key, std::string_view payload, int ttlSeconds,
+                    int64_t now, std::string* out);
+
+public:
+    // `aof`, `backlog`, `slowLog` and `latencyMonitor` (all optional)
+    // must outlive the shard; `index` tags its records
+    explicit Shard(const RedisLiteConfig& config, size_t index = 0,
+                   AppendOnlyFile* aof = nullptr, ReplicationBacklog* backlog = nullptr,
+                   SlowLog* slowLog = nullptr, LatencyMonitor* latencyMonitor = nullptr);
+    ~Shard();
+
+    Shard(const Shard&) = delete;
+    Shard& operator=(const Shard&) = delete;
+
+    // Waits for room if the queue is full; for internal commands, and
+    // for anything that must not be lost (replication, AOF replay)
+    void enqueue(Command&& cmd);
+    // A client command: as enqueue(), except that under queueOverflow a
+    // full queue refuses it. Then it returns false and `cmd` is intact.
+    bool offer(Command& cmd);
+    // Any thread, with lockFreeReads: GET without queueing
+    ReadResult read(std::string_view key, std::string& value) const;
+    // Any thread, with nearCacheEntries: the version of the bucket holding
+    // the key whose std::hash<std::string_view> is `hash` (0 when off)
+    uint64_t version(size_t hash) const;
+    WorkerStats stats() const;
+    LatencyStats latencyStats() const;
+};
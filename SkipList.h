@@ -0,0 +1,207 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <string>
+#include <string_view>
+
+// Sorted set order, as in Redis's zskiplist: (score, member) ascending,
+// with every forward link carrying its span so a rank is found in
+// O(log n) on the way down. Nodes are one allocation each: the header
+// followed by its levels.
+class SkipList {
+public:
+    struct Node;
+
+private:
+    static constexpr int kMaxLevel = 32;
+    static constexpr uint32_t kBranching = 4; // p = 1/4
+
+    struct Level {
+        Node* forward;
+        size_t span;
+    };
+
+public:
+    struct Node {
+        double score;
+        std::string member;
+        Node* backward;
+        int height;
+
+        Level* levels() { return reinterpret_cast<Level*>(this + 1); }
+        const Level* levels() const { return reinterpret_cast<const Level*>(this + 1); }
+        const Node* next() const { return levels()[0].forward; }
+    };
+
+private:
+    Node* head;
+    Node* tail = nullptr;
+    size_t length = 0;
+    int level = 1;
+    uint64_t rngState;
+
+    static Node* makeNode(int height, double score, std::string_view member) {
+        void* p = ::operator new(sizeof(Node) + height * sizeof(Level));
+        Node* node = new (p) Node{score, std::string(member), nullptr, height};
+        for (int i = 0; i < height; i++)
+            node->levels()[i] = Level{nullptr, 0};
+        return node;
+    }
+
+    static void freeNode(Node* node) {
+        node->~Node();
+        ::operator delete(node);
+    }
+
+    static bool before(const Node* node, double score, std::string_view member) {
+        return node->score < score ||
+               (node->score == score && std::string_view(node->member) < member);
+    }
+
+    int randomHeight() {
+        int height = 1;
+        while (height < kMaxLevel) {
+            rngState ^= rngState >> 12;
+            rngState ^= rngState << 25;
+            rngState ^= rngState >> 27;
+            if ((rngState * 0x2545F4914F6CDD1DULL >> 32) % kBranching != 0)
+                break;
+            height++;
+        }
+        return height;
+    }
+
+public:
+    SkipList() : head(makeNode(kMaxLevel, 0, {})), rngState(reinterpret_cast<uintptr_t>(this) | 1) {}
+
+    ~SkipList() {
+        Node* node = head;
+        while (node) {
+            Node* next = node->levels()[0].forward;
+            freeNode(node);
+            node = next;
+        }
+    }
+
+    SkipList(const SkipList&) = delete;
+    SkipList& operator=(const SkipList&) = delete;
+
+    size_t size() const { return length; }
+
+    // The caller guarantees `member` is not in the list
+    void insert(double score, std::string_view member) {
+        Node* update[kMaxLevel];
+        size_t rank[kMaxLevel];
+        Node* x = head;
+        for (int i = level - 1; i >= 0; i--) {
+            rank[i] = i == level - 1 ? 0 : rank[i + 1];
+            while (x->levels()[i].forward && before(x->levels()[i].forward, score, member)) {
+                rank[i] += x->levels()[i].span;
+                x = x->levels()[i].forward;
+            }
+            update[i] = x;
+        }
+        int height = randomHeight();
+        if (height > level) {
+            for (int i = level; i < height; i++) {
+                rank[i] = 0;
+                update[i] = head;
+                update[i]->levels()[i].span = length;
+            }
+            level = height;
+        }
+        x = makeNode(height, score, member);
+        for (int i = 0; i < height; i++) {
+            x->levels()[i].forward = update[i]->levels()[i].forward;
+            update[i]->levels()[i].forward = x;
+            x->levels()[i].span = update[i]->levels()[i].span - (rank[0] - rank[i]);
+            update[i]->levels()[i].span = rank[0] - rank[i] + 1;
+        }
+        for (int i = height; i < level; i++)
+            update[i]->levels()[i].span++;
+        x->backward = update[0] == head ? nullptr : update[0];
+        if (x->levels()[0].forward)
+            x->levels()[0].forward->backward = x;
+        else
+            tail = x;
+        length++;
+    }
+
+    bool erase(double score, std::string_view member) {
+        Node* update[kMaxLevel];
+        Node* x = head;
+        for (int i = level - 1; i >= 0; i--) {
+            while (x->levels()[i].forward && before(x->levels()[i].forward, score, member))
+                x = x->levels()[i].forward;
+            update[i] = x;
+        }
+        x = x->levels()[0].forward;
+        if (!x || x->score != score || x->member != member)
+            return false;
+        for (int i = 0; i < level; i++) {
+            if (update[i]->levels()[i].forward == x) {
+                update[i]->levels()[i].span += x->levels()[i].span - 1;
+                update[i]->levels()[i].forward = x->levels()[i].forward;
+            } else {
+                update[i]->levels()[i].span--;
+            }
+        }
+        if (x->levels()[0].forward)
+            x->levels()[0].forward->backward = x->backward;
+        else
+            tail = x->backward;
+        while (level > 1 && !head->levels()[level - 1].forward)
+            level--;
+        length--;
+        freeNode(x);
+        return true;
+    }
+
+    // 1-based rank of an element, 0 if it is not in the list
+    size_t rank(double score, std::string_view member) const {
+        size_t r = 0;
+        const Node* x = head;
+        for (int i = level - 1; i >= 0; i--) {
+            while (x->levels()[i].forward &&
+                   (before(x->levels()[i].forward, score, member) ||
+                    (x->levels()[i].forward->score == score &&
+                     x->levels()[i].forward->member == member))) {
+                r += x->levels()[i].span;
+                x = x->levels()[i].forward;
+            }
+            if (x != head && x->score == score && x->member == member)
+                return r;
+        }
+        return 0;
+    }
+
+    // Element at 1-based `rank`, or null
+    const Node* byRank(size_t rank) const {
+        size_t traversed = 0;
+        const Node* x = head;
+        for (int i = level - 1; i >= 0; i--) {
+            while (x->levels()[i].forward && traversed + x->levels()[i].span <= rank) {
+                traversed += x->levels()[i].span;
+                x = x->levels()[i].forward;
+            }
+            if (traversed == rank)
+                return x == head ? nullptr : x;
+        }
+        return nullptr;
+    }
+
+    // First element with a score >= `min` (> `min` if `exclusive`)
+    const Node* lowerBound(double min, bool exclusive) const {
+        const Node* x = head;
+        for (int i = level - 1; i >= 0; i--) {
+            while (x->levels()[i].forward &&
+                   (exclusive ? x->levels()[i].forward->score <= min
+                              : x->levels()[i].forward->score < min))
+                x = x->levels()[i].forward;
+        }
+        return x->levels()[0].forward;
+    }
+
+    const Node* first() const { return head->levels()[0].forward; }
+};
@@ -0,0 +1,112 @@
+#pragma once
+#include <cstddef>
+#include <new>
+#include <vector>
+
+// Size-class slab allocator for one shard's keys and values. Blocks from
+// 32 bytes to 4 KiB are carved out of 64 KiB slabs and recycled through
+// per-class free lists; anything larger goes to operator new. Not thread
+// safe: only the owning shard's worker allocates and frees.
+class SlabArena {
+private:
+    static constexpr size_t kMinClass = 32;
+    static constexpr size_t kMaxClass = 4096;
+    static constexpr int kClasses = 8; // 32, 64, ..., 4096
+    static constexpr size_t kSlabBytes = 64 * 1024;
+
+    struct FreeBlock {
+        FreeBlock* next;
+    };
+
+    FreeBlock* freeLists[kClasses] = {};
+    std::vector<char*> slabs;
+    char* bump = nullptr;
+    size_t bumpLeft = 0;
+
+    size_t inUse = 0;    // bytes handed out (by class size)
+    size_t reserved = 0; // bytes obtained from the system
+
+    static int classOf(size_t n) {
+        int c = 0;
+        size_t size = kMinClass;
+        while (size < n) {
+            size <<= 1;
+            c++;
+        }
+        return c;
+    }
+
+    static size_t classSize(int c) {
+        return kMinClass << c;
+    }
+
+public:
+    SlabArena() = default;
+    SlabArena(const SlabArena&) = delete;
+    SlabArena& operator=(const SlabArena&) = delete;
+
+    ~SlabArena() {
+        for (char* slab : slabs)
+            ::operator delete(slab);
+    }
+
+    // Returns a block of at least `n` bytes; `*capacity` receives its
+    // real size, which must be passed back to deallocate()
+    char* allocate(size_t n, size_t* capacity) {
+        if (n > kMaxClass) {
+            *capacity = n;
+            inUse += n;
+            reserved += n;
+            return static_cast<char*>(::operator new(n));
+        }
+
+        int c = classOf(n);
+        size_t size = classSize(c);
+        *capacity = size;
+        inUse += size;
+
+        if (FreeBlock* block = freeLists[c]) {
+            freeLists[c] = block->next;
+            return reinterpret_cast<char*>(block);
+        }
+
+        if (bumpLeft < size) {
+            bump = static_cast<char*>(::operator new(kSlabBytes));
+            bumpLeft = kSlabBytes;
+            slabs.push_back(bump);
+            reserved += kSlabBytes;
+        }
+        char* p = bump;
+        bump += size;
+        bumpLeft -= size;
+        return p;
+    }
+
+    void deallocate(char* p, size_t capacity) {
+        inUse -= capacity;
+        if (capacity > kMaxClass) {
+            reserved -= capacity;
+            ::operator delete(p);
+            return;
+        }
+        int c = classOf(capacity);
+        auto* block = reinterpret_cast<FreeBlock*>(p);
+        block->next = freeLists[c];
+        freeLists[c] = block;
+    }
+
+    // Bytes allocated elsewhere but held on this arena's behalf (shared
+    // values), so they count towards its use
+    void charge(size_t n) {
+        inUse += n;
+        reserved += n;
+    }
+
+    void refund(size_t n) {
+        inUse -= n;
+        reserved -= n;
+    }
+
+    size_t bytesInUse() const { return inUse; }
+    size_t bytesReserved() const { return reserved; }
+};
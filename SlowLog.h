@@ -0,0 +1,241 @@
+#pragma once
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+#include "Command.h"
+
+namespace slowlog_detail {
+inline int64_t unixNowSeconds() {
+    return std::chrono::duration_cast<std::chrono::seconds>(
+               std::chrono::system_clock::now().time_since_epoch()).count();
+}
+}
+
+// One command that ran for at least the slow log threshold
+struct SlowLogEntry {
+    uint64_t id = 0;
+    int64_t unixTime = 0; // seconds, when it finished
+    uint64_t durationUs = 0;
+    CommandType type = CommandType::GET;
+    std::string key;      // cut to SlowLog::kMaxKey bytes
+    size_t size = 0;      // value bytes, arguments after the key, or ops of a BATCH
+    size_t shard = 0;
+};
+
+// Ring of the most recent slow commands, as Redis's SLOWLOG
+// (RedisLiteConfig::slowlogSlowerThanUs). Workers compare each command's
+// time with the threshold and only take the lock to add an entry, so
+// nothing is paid while commands are fast.
+class SlowLog {
+private:
+    mutable std::mutex mutex;
+    std::vector<SlowLogEntry> ring;
+    size_t next = 0;  // slot the next entry goes to
+    size_t count = 0;
+    uint64_t nextId = 0;
+    uint64_t thresholdNs;
+
+public:
+    static constexpr size_t kMaxKey = 128;
+
+    SlowLog(uint64_t thresholdUs, size_t maxLen)
+        : ring(maxLen ? maxLen : 1), thresholdNs(thresholdUs * 1000) {}
+
+    SlowLog(const SlowLog&) = delete;
+    SlowLog& operator=(const SlowLog&) = delete;
+
+    bool slow(uint64_t ns) const { return ns >= thresholdNs; }
+
+    // `entry` comes without id and time
+    void add(SlowLogEntry&& entry) {
+        if (entry.key.size() > kMaxKey)
+            entry.key.resize(kMaxKey);
+        entry.unixTime = slowlog_detail::unixNowSeconds();
+        std::lock_guard<std::mutex> lock(mutex);
+        entry.id = nextId++;
+        ring[next] = std::move(entry);
+        next = (next + 1) % ring.size();
+        if (count < ring.size())
+            count++;
+    }
+
+    // Up to `max` entries, newest first
+    std::vector<SlowLogEntry> get(size_t max) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<SlowLogEntry> out;
+        size_t n = max < count ? max : count;
+        out.reserve(n);
+        for (size_t i = 1; i <= n; i++)
+            out.push_back(ring[(next + ring.size() - i) % ring.size()]);
+        return out;
+    }
+
+    size_t size() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return count;
+    }
+
+    // Entries ever added, including those since pushed out or reset
+    uint64_t total() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return nextId;
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (SlowLogEntry& e : ring)
+            e = SlowLogEntry();
+        next = 0;
+        count = 0;
+    }
+};
+
+// What stalled a shard worker, for the latency monitor
+enum class LatencyEvent {
+    Command,        // a single command, as in the slow log
+    Rehash,         // incremental resize steps of the tables
+    ExpireCycle,    // a pass of active expiry
+    Eviction,       // evicting keys to make room for a write
+    AofRewriteScan, // a step of the store scan feeding an AOF rewrite
+    Snapshot,       // a step of a snapshot's store scan
+    AofFlush,       // handing the pass's records to the AOF and backlog
+    Reclaim         // freeing what lock-free readers no longer see
+};
+
+constexpr size_t kLatencyEvents = static_cast<size_t>(LatencyEvent::Reclaim) + 1;
+
+inline const char* latencyEventName(LatencyEvent event) {
+    switch (event) {
+    case LatencyEvent::Command:
+        return "command";
+    case LatencyEvent::Rehash:
+        return "rehash";
+    case LatencyEvent::ExpireCycle:
+        return "expire-cycle";
+    case LatencyEvent::Eviction:
+        return "eviction";
+    case LatencyEvent::AofRewriteScan:
+        return "aof-rewrite-scan";
+    case LatencyEvent::Snapshot:
+        return "snapshot";
+    case LatencyEvent::AofFlush:
+        return "aof-flush";
+    case LatencyEvent::Reclaim:
+        return "reclaim";
+    }
+    return "unknown";
+}
+
+// The event whose latencyEventName() is `name` (lower case); false if none
+inline bool parseLatencyEvent(std::string_view name, LatencyEvent& out) {
+    for (size_t i = 0; i < kLatencyEvents; i++) {
+        if (name == latencyEventName(static_cast<LatencyEvent>(i))) {
+            out = static_cast<LatencyEvent>(i);
+            return true;
+        }
+    }
+    return false;
+}
+
+struct LatencySample {
+    int64_t unixTime = 0; // seconds
+    uint64_t us = 0;
+};
+
+// Latest and worst spike of one event
+struct LatencySpike {
+    LatencyEvent event;
+    LatencySample latest;
+    uint64_t maxUs;
+};
+
+// Worker stalls at or over a threshold, by cause, as Redis's LATENCY
+// monitor (RedisLiteConfig::latencyMonitorThresholdUs). Each event keeps
+// the worst stall per second for its last kHistory seconds with one. As
+// with SlowLog, the lock is only taken once something was slow.
+class LatencyMonitor {
+private:
+    struct Series {
+        std::vector<LatencySample> history; // ring, kHistory once full
+        size_t next = 0;
+        uint64_t maxUs = 0;
+    };
+
+    mutable std::mutex mutex;
+    Series series[kLatencyEvents];
+    uint64_t thresholdNs;
+
+public:
+    static constexpr size_t kHistory = 160;
+
+    explicit LatencyMonitor(uint64_t thresholdUs) : thresholdNs(thresholdUs * 1000) {}
+
+    LatencyMonitor(const LatencyMonitor&) = delete;
+    LatencyMonitor& operator=(const LatencyMonitor&) = delete;
+
+    void record(LatencyEvent event, uint64_t ns) {
+        if (ns < thresholdNs)
+            return;
+        LatencySample sample{slowlog_detail::unixNowSeconds(), ns / 1000};
+        std::lock_guard<std::mutex> lock(mutex);
+        Series& s = series[static_cast<size_t>(event)];
+        if (sample.us > s.maxUs)
+            s.maxUs = sample.us;
+        if (!s.history.empty()) {
+            LatencySample& last = s.history[(s.next + s.history.size() - 1) % s.history.size()];
+            if (last.unixTime == sample.unixTime) {
+                if (sample.us > last.us)
+                    last.us = sample.us;
+                return;
+            }
+        }
+        if (s.history.size() < kHistory) {
+            s.history.push_back(sample);
+            s.next = s.history.size() % kHistory;
+        } else {
+            s.history[s.next] = sample;
+            s.next = (s.next + 1) % kHistory;
+        }
+    }
+
+    // Every event that has had a spike since the last reset
+    std::vector<LatencySpike> latest() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        std::vector<LatencySpike> out;
+        for (size_t i = 0; i < kLatencyEvents; i++) {
+            const Series& s = series[i];
+            if (s.history.empty())
+                continue;
+            const LatencySample& last = s.history[(s.next + s.history.size() - 1) % s.history.size()];
+            out.push_back(LatencySpike{static_cast<LatencyEvent>(i), last, s.maxUs});
+        }
+        return out;
+    }
+
+    // Oldest first
+    std::vector<LatencySample> history(LatencyEvent event) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        const Series& s = series[static_cast<size_t>(event)];
+        std::vector<LatencySample> out;
+        out.reserve(s.history.size());
+        size_t start = s.history.size() < kHistory ? 0 : s.next;
+        for (size_t i = 0; i < s.history.size(); i++)
+            out.push_back(s.history[(start + i) % s.history.size()]);
+        return out;
+    }
+
+    void reset(LatencyEvent event) {
+        std::lock_guard<std::mutex> lock(mutex);
+        series[static_cast<size_t>(event)] = Series();
+    }
+
+    void reset() {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (Series& s : series)
+            s = Series();
+    }
+};
@@ -0,0 +1,215 @@
+#include "Snapshot.h"
+
+#include <cerrno>
+#include <stdexcept>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+void putU32(std::string& out, uint32_t v) {
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void putU64(std::string& out, uint64_t v) {
+    out.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+void putVarint(std::string& out, uint64_t v) {
+    while (v >= 0x80) {
+        out += static_cast<char>((v & 0x7F) | 0x80);
+        v >>= 7;
+    }
+    out += static_cast<char>(v);
+}
+
+std::runtime_error systemError(const std::string& what) {
+    return std::runtime_error(what + ": " + std::strerror(errno));
+}
+}
+
+// FNV-1a over 8-byte words, then the tail bytes
+uint64_t snapshot::checksum(const char* data, size_t size) {
+    constexpr uint64_t kPrime = 0x100000001B3ULL;
+    uint64_t h = 0xCBF29CE484222325ULL;
+    size_t i = 0;
+    for (; i + 8 <= size; i += 8)
+        h = (h ^ readU64(data + i)) * kPrime;
+    for (; i < size; i++)
+        h = (h ^ static_cast<uint8_t>(data[i])) * kPrime;
+    return h;
+}
+
+void snapshot::encodeRecord(std::string& out, std::string_view key, std::string_view value,
+                            int64_t expireAtMs, bool typed) {
+    out += static_cast<char>((expireAtMs ? 1 : 0) | (typed ? 2 : 0));
+    putVarint(out, key.size());
+    out.append(key.data(), key.size());
+    putVarint(out, value.size());
+    out.append(value.data(), value.size());
+    if (expireAtMs)
+        putU64(out, static_cast<uint64_t>(expireAtMs));
+}
+
+SnapshotWriter::SnapshotWriter(std::string path, size_t shards)
+    : path(std::move(path)), shardCount(shards) {
+    tmpPath = this->path + ".tmp";
+    fd = open(tmpPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+        throw systemError("open " + tmpPath);
+
+    std::string header(snapshot::kMagic, sizeof(snapshot::kMagic));
+    putU32(header, static_cast<uint32_t>(shards));
+    putU32(header, 0);
+    writeAll(header.data(), header.size());
+    writer = std::thread(&SnapshotWriter::run, this);
+}
+
+SnapshotWriter::~SnapshotWriter() {
+    wait();
+    writer.join();
+}
+
+// Notifies under the lock: once the last shard is done the writer may be
+// destroyed as soon as the mutex is released
+void SnapshotWriter::write(size_t shard, std::string&& data, uint32_t count) {
+    std::lock_guard<std::mutex> lock(mutex);
+    bool wasEmpty = pending.empty();
+    pending.push_back(Block{shard, count, std::move(data)});
+    if (wasEmpty)
+        cv.notify_all();
+}
+
+void SnapshotWriter::shardDone(size_t) {
+    std::lock_guard<std::mutex> lock(mutex);
+    shardsDone++;
+    cv.notify_all();
+}
+
+bool SnapshotWriter::wait() {
+    std::unique_lock<std::mutex> lock(mutex);
+    cv.wait(lock, [&]() { return finished; });
+    return ok;
+}
+
+bool SnapshotWriter::done() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return finished;
+}
+
+uint64_t SnapshotWriter::recordCount() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return finished ? records : 0;
+}
+
+uint64_t SnapshotWriter::byteCount() {
+    std::lock_guard<std::mutex> lock(mutex);
+    return finished ? bytes : 0;
+}
+
+void SnapshotWriter::writeAll(const char* data, size_t size) {
+    while (size > 0 && !failed) {
+        ssize_t n = ::write(fd, data, size);
+        if (n < 0) {
+            if (errno != EINTR)
+                failed = true;
+            continue;
+        }
+        data += n;
+        size -= static_cast<size_t>(n);
+        bytes += static_cast<uint64_t>(n);
+    }
+}
+
+void SnapshotWriter::run() {
+    std::vector<Block> blocksIn;
+    bool allDone = false;
+    while (!allDone) {
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [&]() { return !pending.empty() || shardsDone == shardCount; });
+            blocksIn.swap(pending);
+            allDone = pending.empty() && blocksIn.empty() && shardsDone == shardCount;
+        }
+        for (auto& block : blocksIn) {
+            std::string header;
+            putU32(header, static_cast<uint32_t>(block.data.size()));
+            putU32(header, block.records);
+            putU32(header, static_cast<uint32_t>(block.shard));
+            putU32(header, 0);
+            putU64(header, snapshot::checksum(block.data.data(), block.data.size()));
+            writeAll(header.data(), header.size());
+            writeAll(block.data.data(), block.data.size());
+            records += block.records;
+            blocks++;
+        }
+        blocksIn.clear();
+    }
+
+    std::string trailer(snapshot::kTrailerMagic, sizeof(snapshot::kTrailerMagic));
+    putU64(trailer, records);
+    putU64(trailer, blocks);
+    writeAll(trailer.data(), trailer.size());
+
+    bool success = !failed && fsync(fd) == 0;
+    close(fd);
+    success = success && rename(tmpPath.c_str(), path.c_str()) == 0;
+    if (!success)
+        unlink(tmpPath.c_str());
+
+    std::lock_guard<std::mutex> lock(mutex);
+    ok = success;
+    finished = true;
+    cv.notify_all();
+}
+
+SnapshotReader::SnapshotReader(const std::string& path) : path(path) {
+    int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        throw systemError("open " + path);
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        throw systemError("stat " + path);
+    }
+    size = static_cast<size_t>(st.st_size);
+    if (size < snapshot::kHeaderSize + snapshot::kTrailerSize) {
+        close(fd);
+        throw std::runtime_error("truncated snapshot: " + path);
+    }
+
+    void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED)
+        throw systemError("mmap " + path);
+    base = static_cast<const char*>(mapped);
+    // Shards read it front to back, so let the kernel read ahead. Advice
+    // values are not flags, so one call each; both are only hints, and a
+    // refusal (EINVAL on an old kernel) leaves the load as it was.
+    madvise(mapped, size, MADV_SEQUENTIAL);
+    madvise(mapped, size, MADV_WILLNEED);
+
+    const char* trailer = base + size - snapshot::kTrailerSize;
+    if (std::memcmp(base, snapshot::kMagic, sizeof(snapshot::kMagic)) != 0 ||
+        std::memcmp(trailer, snapshot::kTrailerMagic, sizeof(snapshot::kTrailerMagic)) != 0) {
+        munmap(mapped, size);
+        throw std::runtime_error("not a complete snapshot: " + path);
+    }
+    shards = snapshot::readU32(base + 8);
+    records = snapshot::readU64(trailer + 8);
+}
+
+SnapshotReader::~SnapshotReader() {
+    munmap(const_cast<char*>(base), size);
+}
+
+uint64_t SnapshotReader::countFor(bool any, uint32_t shard) const {
+    uint64_t total = 0;
+    forEachBlock(any, shard, [&](const char*, uint32_t, uint32_t count, uint64_t) {
+        total += count;
+        return true;
+    });
+    return total;
+}
@@ -0,0 +1,237 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+// Point-in-time dump of every shard's store, RDB style. Layout (integers
+// little-endian):
+//
+//   header   "RLSNAP01" | u32 shards | u32 0
+//   block    u32 length | u32 records | u32 shard | u32 0 | u64 checksum
+//            | records...
+//   trailer  "RLSNAPND" | u64 records | u64 blocks
+//
+//   record   u8 flags (1 = has expiry, 2 = typed) | varint key length
+//            | key | varint value length | value | [i64 expiry, unix ms]
+//
+// A typed record's value is a collection as serializeValue() writes it.
+//
+// Each block holds records of the one shard that produced it, so a
+// process started with the same shard count lets shard i read only the
+// blocks tagged i, and every block carries its own checksum.
+
+namespace snapshot {
+constexpr char kMagic[8] = {'R', 'L', 'S', 'N', 'A', 'P', '0', '1'};
+constexpr char kTrailerMagic[8] = {'R', 'L', 'S', 'N', 'A', 'P', 'N', 'D'};
+constexpr size_t kHeaderSize = 16;
+constexpr size_t kBlockHeaderSize = 24;
+constexpr size_t kTrailerSize = 24;
+
+uint64_t checksum(const char* data, size_t size);
+void encodeRecord(std::string& out, std::string_view key, std::string_view value,
+                  int64_t expireAtMs, bool typed = false);
+}
+
+class SnapshotReader;
+class CompletionSlot;
+
+// Shared by the shards loading one snapshot; lives on the loading
+// thread's stack like BatchResult
+struct SnapshotLoad {
+    const SnapshotReader* reader = nullptr;
+    std::atomic<size_t> pending{0};
+    std::atomic<bool> failed{false};
+    CompletionSlot* done = nullptr;
+    bool replace = false; // empty each shard first (a replica's full resync)
+};
+
+struct SnapshotStats {
+    bool inProgress = false;
+    uint64_t saves = 0;        // snapshots completed
+    uint64_t failedSaves = 0;
+    uint64_t lastSaveRecords = 0;
+    uint64_t lastSaveBytes = 0;
+};
+
+// Collects blocks from the shard workers while they scan, and writes them
+// to `<path>.tmp` on its own thread. Once every shard is done the trailer
+// goes out, the file is fsynced and renamed over `path`.
+class SnapshotWriter {
+private:
+    struct Block {
+        size_t shard;
+        uint32_t records;
+        std::string data;
+    };
+
+    std::string path;
+    std::string tmpPath;
+    size_t shardCount;
+    int fd = -1;
+
+    std::mutex mutex;
+    std::condition_variable cv;
+    std::vector<Block> pending;
+    size_t shardsDone = 0;
+    bool finished = false;
+    bool ok = false;
+
+    // Writer thread only
+    uint64_t records = 0;
+    uint64_t blocks = 0;
+    uint64_t bytes = 0;
+    bool failed = false;
+
+    std::thread writer;
+
+    void run();
+    void writeAll(const char* data, size_t size);
+
+public:
+    // Throws std::runtime_error if the temporary file cannot be created
+    SnapshotWriter(std::string path, size_t shards);
+    ~SnapshotWriter();
+
+    SnapshotWriter(const SnapshotWriter&) = delete;
+    SnapshotWriter& operator=(const SnapshotWriter&) = delete;
+
+    // Shard workers
+    void write(size_t shard, std::string&& data, uint32_t records);
+    void shardDone(size_t shard);
+
+    // Blocks until the file is in place (or failed); returns success
+    bool wait();
+    bool done();
+    uint64_t recordCount();
+    uint64_t byteCount();
+};
+
+// Read-only mmap of a snapshot file. Throws std::runtime_error if the
+// header or trailer is malformed.
+class SnapshotReader {
+private:
+    std::string path;
+    const char* base = nullptr;
+    size_t size = 0;
+    uint32_t shards = 0;
+    uint64_t records = 0;
+
+public:
+    struct Record {
+        std::string_view key;
+        std::string_view value;
+        int64_t expireAtMs; // 0 = none
+        bool typed;         // `value` is a serialized collection
+    };
+
+    explicit SnapshotReader(const std::string& path);
+    ~SnapshotReader();
+
+    SnapshotReader(const SnapshotReader&) = delete;
+    SnapshotReader& operator=(const SnapshotReader&) = delete;
+
+    uint32_t shardCount() const { return shards; }
+    uint64_t recordCount() const { return records; }
+
+    // fn(payload, length, records, checksum) for the blocks written by
+    // `shard`, or for every block if `any`. Returns false if the block
+    // framing is broken or fn returned false.
+    template <typename Fn>
+    bool forEachBlock(bool any, uint32_t shard, Fn&& fn) const;
+
+    // Sum of the record counts of the blocks forEachBlock() visits
+    uint64_t countFor(bool any, uint32_t shard) const;
+
+    // fn(const Record&) for every record of those blocks; false on a
+    // checksum mismatch or a malformed record
+    template <typename Fn>
+    bool forEach(bool any, uint32_t shard, Fn&& fn) const;
+};
+
+namespace snapshot {
+inline uint32_t readU32(const char* p) {
+    uint32_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline uint64_t readU64(const char* p) {
+    uint64_t v;
+    std::memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+inline bool readVarint(const char*& p, const char* end, uint64_t& out) {
+    out = 0;
+    for (int shift = 0; shift < 64 && p < end; shift += 7) {
+        uint8_t b = static_cast<uint8_t>(*p++);
+        out |= uint64_t(b & 0x7F) << shift;
+        if (!(b & 0x80))
+            return true;
+    }
+    return false;
+}
+}
+
+template <typename Fn>
+bool SnapshotReader::forEachBlock(bool any, uint32_t shard, Fn&& fn) const {
+    const char* p = base + snapshot::kHeaderSize;
+    const char* end = base + size - snapshot::kTrailerSize;
+    while (p < end) {
+        if (static_cast<size_t>(end - p) < snapshot::kBlockHeaderSize)
+            return false;
+        uint32_t length = snapshot::readU32(p);
+        uint32_t count = snapshot::readU32(p + 4);
+        uint32_t owner = snapshot::readU32(p + 8);
+        uint64_t sum = snapshot::readU64(p + 16);
+        const char* payload = p + snapshot::kBlockHeaderSize;
+        if (static_cast<size_t>(end - payload) < length)
+            return false;
+        if (any || owner == shard) {
+            if (!fn(payload, length, count, sum))
+                return false;
+        }
+        p = payload + length;
+    }
+    return true;
+}
+
+template <typename Fn>
+bool SnapshotReader::forEach(bool any, uint32_t shard, Fn&& fn) const {
+    return forEachBlock(any, shard, [&](const char* payload, uint32_t length,
+                                        uint32_t count, uint64_t sum) {
+        if (snapshot::checksum(payload, length) != sum)
+            return false;
+        const char* p = payload;
+        const char* end = payload + length;
+        for (uint32_t i = 0; i < count; i++) {
+            if (p >= end)
+                return false;
+            uint8_t flags = static_cast<uint8_t>(*p++);
+            uint64_t keyLen, valueLen;
+            if (!snapshot::readVarint(p, end, keyLen) || static_cast<uint64_t>(end - p) < keyLen)
+                return false;
+            Record rec{std::string_view(p, keyLen), {}, 0, (flags & 2) != 0};
+            p += keyLen;
+            if (!snapshot::readVarint(p, end, valueLen) ||
+                static_cast<uint64_t>(end - p) < valueLen)
+                return false;
+            rec.value = std::string_view(p, valueLen);
+            p += valueLen;
+            if (flags & 1) {
+                if (end - p < 8)
+                    return false;
+                rec.expireAtMs = static_cast<int64_t>(snapshot::readU64(p));
+                p += 8;
+            }
+            fn(rec);
+        }
+        return p == end;
+    });
+}
@@ -0,0 +1,108 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Hierarchical timing wheel of key timers: four levels of 64 slots, so
+// level L covers 64^(L+1) ticks ahead. Timers sit in the coarsest level
+// that fits and cascade down as the wheel turns; a timer further out than
+// the top level is parked in it and re-placed each time its slot comes
+// round. advance() hands out due keys under a caller-supplied budget and
+// picks up where it stopped on the next call, so a burst of expiries is
+// spread over several passes instead of stalling one.
+class TimingWheel {
+private:
+    static constexpr int kLevels = 4;
+    static constexpr int kSlotBits = 6;
+    static constexpr size_t kSlots = size_t(1) << kSlotBits;
+
+    struct Timer {
+        std::string key;
+        uint64_t tick;
+    };
+
+    std::vector<Timer> slots[kLevels][kSlots];
+    std::vector<Timer> due; // fired, not yet handed out
+    size_t dueNext = 0;
+    uint64_t current = 0;   // every timer at or before this tick has fired
+    size_t count = 0;
+    size_t keyBytes = 0;
+
+    void place(Timer&& timer) {
+        if (timer.tick <= current) {
+            due.push_back(std::move(timer));
+            return;
+        }
+        uint64_t delta = timer.tick - current;
+        int level = 0;
+        while (level < kLevels - 1 && delta >= (uint64_t(1) << (kSlotBits * (level + 1))))
+            level++;
+        size_t slot = (timer.tick >> (kSlotBits * level)) & (kSlots - 1);
+        slots[level][slot].push_back(std::move(timer));
+    }
+
+    void cascade(int level) {
+        size_t slot = (current >> (kSlotBits * level)) & (kSlots - 1);
+        std::vector<Timer> moving;
+        moving.swap(slots[level][slot]);
+        for (auto& timer : moving)
+            place(std::move(timer));
+    }
+
+    // Moves the wheel forward one tick and collects whatever fires on it
+    void tickOnce() {
+        current++;
+        for (int level = kLevels - 1; level > 0; level--) {
+            if ((current & ((uint64_t(1) << (kSlotBits * level)) - 1)) == 0)
+                cascade(level);
+        }
+        auto& slot = slots[0][current & (kSlots - 1)];
+        for (auto& timer : slot)
+            due.push_back(std::move(timer));
+        slot.clear();
+    }
+
+public:
+    void schedule(std::string key, uint64_t tick) {
+        keyBytes += key.size();
+        place(Timer{std::move(key), tick});
+        count++;
+    }
+
+    // Turns the wheel up to `tick`, calling fn(const std::string& key,
+    // uint64_t tick) for at most `budget` due timers, with the tick each
+    // was scheduled for. Returns how many were handed out.
+    template <typename Fn>
+    size_t advance(uint64_t tick, size_t budget, Fn&& fn) {
+        size_t handed = 0;
+        while (true) {
+            while (dueNext < due.size() && handed < budget) {
+                // Moved out: fn may schedule, which can grow `due`
+                Timer timer = std::move(due[dueNext++]);
+                keyBytes -= timer.key.size();
+                fn(static_cast<const std::string&>(timer.key), timer.tick);
+                count--;
+                handed++;
+            }
+            if (dueNext < due.size())
+                return handed;
+            due.clear();
+            dueNext = 0;
+
+            if (current >= tick)
+                return handed;
+            if (count == 0) {
+                current = tick;
+                return handed;
+            }
+            tickOnce();
+        }
+    }
+
+    size_t size() const { return count; }
+    // Heap held by pending timers, about
+    size_t bytes() const { return count * sizeof(Timer) + keyBytes; }
+    bool empty() const { return count == 0; }
+};
@@ -0,0 +1,80 @@
+#pragma once
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// Immutable bytes of a large string value with an atomic reference count.
+// The store holds one reference (see CompactString::share) and every
+// handle a GET gave out holds another, so a reader keeps the bytes alive
+// after the key is overwritten or deleted, and the worker never copies
+// them to answer.
+class ValueBuffer {
+private:
+    std::atomic<uint32_t> refs{1};
+    const std::string bytes;
+
+    explicit ValueBuffer(std::string&& bytes) : bytes(std::move(bytes)) {}
+
+    friend class ValueRef;
+};
+
+// Shared handle to a ValueBuffer; empty when the key was missing. Copies
+// are cheap and may be handed to and dropped on any thread.
+class ValueRef {
+private:
+    ValueBuffer* buffer = nullptr;
+
+    explicit ValueRef(ValueBuffer* buffer) : buffer(buffer) {}
+
+    void release() {
+        if (buffer && buffer->refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+            delete buffer;
+        buffer = nullptr;
+    }
+
+public:
+    ValueRef() = default;
+
+    // Takes the string over without copying it
+    static ValueRef adopt(std::string&& bytes) { return ValueRef(new ValueBuffer(std::move(bytes))); }
+    static ValueRef copy(std::string_view bytes) { return adopt(std::string(bytes)); }
+
+    // For CompactString, which keeps the bare pointer: detach() hands this
+    // reference over, attach() takes one back, retain() adds one
+    ValueBuffer* detach() { return std::exchange(buffer, nullptr); }
+    static ValueRef attach(ValueBuffer* buffer) { return ValueRef(buffer); }
+    static ValueRef retain(ValueBuffer* buffer) {
+        buffer->refs.fetch_add(1, std::memory_order_relaxed);
+        return ValueRef(buffer);
+    }
+    static std::string_view bytesOf(const ValueBuffer* buffer) { return buffer->bytes; }
+
+    ValueRef(const ValueRef& other) : buffer(other.buffer) {
+        if (buffer)
+            buffer->refs.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    ValueRef(ValueRef&& other) noexcept : buffer(other.detach()) {}
+
+    ValueRef& operator=(ValueRef other) noexcept {
+        std::swap(buffer, other.buffer);
+        return *this;
+    }
+
+    ~ValueRef() { release(); }
+
+    explicit operator bool() const { return buffer != nullptr; }
+
+    std::string_view view() const { return buffer ? std::string_view(buffer->bytes) : std::string_view(); }
+    const char* data() const { return view().data(); }
+    size_t size() const { return view().size(); }
+
+    // At most `length` bytes from `offset`; empty past the end
+    std::string_view slice(size_t offset, size_t length) const {
+        std::string_view all = view();
+        return offset < all.size() ? all.substr(offset, length) : std::string_view();
+    }
+};
@@ -0,0 +1,621 @@
+// Throughput and latency benchmark. A fixed number of client threads run
+// a GET / SET / DEL mix over a uniform or Zipfian keyspace, one op at a
+// time or in pipelines, against an in-process RedisLite or (Linux) a
+// RESP server, and report ops/sec with p50 / p99 / p99.9 latencies as
+// text or JSON. Every run preloads the keyspace and checks afterwards
+// that the writes were applied.
+//
+//   g++ -std=c++17 -O2 -pthread -o benchmark benchmark.cpp RedisLite.cpp Shard.cpp
+//       AppendOnlyFile.cpp Snapshot.cpp Replication.cpp Collections.cpp
+//   ./benchmark --threads 8 --mix 90:10:0 --zipf 0.99 --pipeline 16 --format json
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "HashSlot.h"
+#include "LatencyHistogram.h"
+#include "RedisLite.h"
+
+#ifdef __linux__
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+namespace {
+enum OpKind { kGet, kSet, kDel, kOpKinds };
+const char* const kOpNames[kOpKinds] = {"get", "set", "del"};
+
+struct Options {
+    size_t threads = 4;
+    size_t ops = 100000; // per thread
+    size_t keys = 100000;
+    size_t keySize = 16;
+    size_t valueSize = 64;
+    unsigned mix[kOpKinds] = {80, 20, 0}; // percent
+    double zipf = 0;                      // 0 = uniform
+    size_t pipeline = 1;
+    uint64_t seed = 1;
+    bool json = false;
+
+    // In-process instance
+    size_t shards = 4;
+    bool lockFreeReads = false;
+    size_t nearCacheEntries = 0;
+
+    // RESP server instead, when a port is given
+    std::string host = "127.0.0.1";
+    int port = 0;
+};
+
+struct Op {
+    OpKind kind;
+    size_t key;
+};
+
+uint64_t nowNs() {
+    return static_cast<uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Fixed-width keys, so --key-size is exact
+std::string keyName(size_t rank, size_t size) {
+    std::string digits = std::to_string(rank);
+    std::string key = "key:";
+    if (digits.size() + key.size() < size)
+        key.append(size - digits.size() - key.size(), '0');
+    return key + digits;
+}
+
+uint64_t nextRandom(uint64_t& state) {
+    // xorshift64*
+    state ^= state >> 12;
+    state ^= state << 25;
+    state ^= state >> 27;
+    return state * 0x2545F4914F6CDD1DULL;
+}
+
+double unitRandom(uint64_t& state) {
+    return static_cast<double>(nextRandom(state) >> 11) * (1.0 / 9007199254740992.0);
+}
+
+// Zipfian ranks as in YCSB (Gray et al., "Quickly generating billion-
+// record synthetic databases"): rank 0 is the hottest key. The zeta sum
+// is computed once and shared; drawing a rank is O(1).
+class Zipfian {
+private:
+    size_t n;
+    double theta, alpha, zetan, eta, half;
+
+public:
+    Zipfian(size_t n, double theta) : n(n), theta(theta) {
+        double zeta2 = 1 + std::pow(0.5, theta);
+        zetan = 0;
+        for (size_t i = 1; i <= n; i++)
+            zetan += 1 / std::pow(static_cast<double>(i), theta);
+        alpha = 1 / (1 - theta);
+        eta = (1 - std::pow(2.0 / static_cast<double>(n), 1 - theta)) / (1 - zeta2 / zetan);
+        half = 1 + std::pow(0.5, theta);
+    }
+
+    size_t next(uint64_t& state) const {
+        double u = unitRandom(state);
+        double uz = u * zetan;
+        if (uz < 1)
+            return 0;
+        if (uz < half)
+            return 1;
+        size_t rank = static_cast<size_t>(static_cast<double>(n) *
+                                          std::pow(eta * u - eta + 1, alpha));
+        return std::min(rank, n - 1);
+    }
+};
+
+// One round trip: a single op, or every op of `ops` as one pipeline.
+// Returns how many GETs found a value.
+class Client {
+public:
+    virtual ~Client() = default;
+    virtual size_t run(const std::vector<Op>& ops) = 0;
+    virtual void set(const std::string& key, const std::string& value) = 0;
+    virtual std::string get(const std::string& key) = 0;
+};
+
+class LocalClient : public Client {
+private:
+    RedisLite& redis;
+    const std::vector<std::string>& keys;
+    const std::string& value;
+
+public:
+    LocalClient(RedisLite& redis, const std::vector<std::string>& keys, const std::string& value)
+        : redis(redis), keys(keys), value(value) {}
+
+    size_t run(const std::vector<Op>& ops) override {
+        if (ops.size() == 1) {
+            const Op& op = ops[0];
+            if (op.kind == kGet)
+                return !redis.get(keys[op.key]).empty();
+            if (op.kind == kSet)
+                redis.set(keys[op.key], value);
+            else
+                redis.del(keys[op.key]);
+            return 0;
+        }
+        Pipeline p = redis.pipeline();
+        for (const Op& op : ops) {
+            if (op.kind == kGet)
+                p.get(keys[op.key]);
+            else if (op.kind == kSet)
+                p.set(keys[op.key], value);
+            else
+                p.del(keys[op.key]);
+        }
+        std::vector<std::string> results = p.exec();
+        size_t hits = 0;
+        for (size_t i = 0; i < ops.size(); i++)
+            hits += ops[i].kind == kGet && !results[i].empty();
+        return hits;
+    }
+
+    void set(const std::string& key, const std::string& v) override { redis.set(key, v); }
+    std::string get(const std::string& key) override { return redis.get(key); }
+};
+
+#ifdef __linux__
+// Blocking RESP connection; commands of one run() go out in one send()
+class RespClient : public Client {
+private:
+    int fd = -1;
+    const std::vector<std::string>& keys;
+    const std::string& value;
+    std::string out;
+    std::string in;
+    size_t used = 0;
+
+    static void append(std::string& out, const std::string& arg) {
+        out += "$" + std::to_string(arg.size()) + "\r\n";
+        out += arg;
+        out += "\r\n";
+    }
+
+    void encode(const char* name, const std::string& key, const std::string* v) {
+        out += v ? "*3\r\n" : "*2\r\n";
+        append(out, name);
+        append(out, key);
+        if (v)
+            append(out, *v);
+    }
+
+    void flush() {
+        size_t sent = 0;
+        while (sent < out.size()) {
+            ssize_t n = send(fd, out.data() + sent, out.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0)
+                throw std::runtime_error("send failed");
+            sent += static_cast<size_t>(n);
+        }
+        out.clear();
+    }
+
+    size_t fill(size_t needed) {
+        while (in.size() - used < needed) {
+            char buf[64 * 1024];
+            ssize_t n = recv(fd, buf, sizeof(buf), 0);
+            if (n <= 0)
+                throw std::runtime_error("connection closed");
+            in.append(buf, static_cast<size_t>(n));
+        }
+        return in.size() - used;
+    }
+
+    std::string line() {
+        size_t crlf;
+        while ((crlf = in.find("\r\n", used)) == std::string::npos)
+            fill(in.size() - used + 1);
+        std::string l = in.substr(used, crlf - used);
+        used = crlf + 2;
+        return l;
+    }
+
+    // One reply; `bulk` receives a bulk string's payload. False for a
+    // nil or an error.
+    bool reply(std::string* bulk) {
+        std::string l = line();
+        if (l.empty() || l[0] == '-')
+            return false;
+        if (l[0] != '$')
+            return true;
+        long long n = std::stoll(l.substr(1));
+        if (n < 0)
+            return false;
+        fill(static_cast<size_t>(n) + 2);
+        if (bulk)
+            bulk->assign(in, used, static_cast<size_t>(n));
+        used += static_cast<size_t>(n) + 2;
+        if (used > (1 << 20)) {
+            in.erase(0, used);
+            used = 0;
+        }
+        return true;
+    }
+
+public:
+    RespClient(const Options& opt, const std::vector<std::string>& keys, const std::string& value)
+        : keys(keys), value(value) {
+        addrinfo hints{};
+        hints.ai_family = AF_UNSPEC;
+        hints.ai_socktype = SOCK_STREAM;
+        addrinfo* addrs = nullptr;
+        if (getaddrinfo(opt.host.c_str(), std::to_string(opt.port).c_str(), &hints, &addrs) != 0)
+            throw std::runtime_error("cannot resolve " + opt.host);
+        for (addrinfo* a = addrs; a && fd < 0; a = a->ai_next) {
+            fd = socket(a->ai_family, a->ai_socktype, a->ai_protocol);
+            if (fd >= 0 && connect(fd, a->ai_addr, a->ai_addrlen) != 0) {
+                close(fd);
+                fd = -1;
+            }
+        }
+        freeaddrinfo(addrs);
+        if (fd < 0)
+            throw std::runtime_error("cannot connect to " + opt.host + ":" +
+                                     std::to_string(opt.port));
+        int one = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    ~RespClient() override {
+        if (fd >= 0)
+            close(fd);
+    }
+
+    size_t run(const std::vector<Op>& ops) override {
+        for (const Op& op : ops)
+            encode(kOpNames[op.kind], keys[op.key], op.kind == kSet ? &value : nullptr);
+        flush();
+        size_t hits = 0;
+        for (const Op& op : ops)
+            hits += reply(nullptr) && op.kind == kGet;
+        return hits;
+    }
+
+    void set(const std::string& key, const std::string& v) override {
+        encode("set", key, &v);
+        flush();
+        reply(nullptr);
+    }
+
+    std::string get(const std::string& key) override {
+        encode("get", key, nullptr);
+        flush();
+        std::string v;
+        return reply(&v) ? v : std::string();
+    }
+};
+#endif
+
+struct ThreadResult {
+    LatencyHistogram latency[kOpKinds];
+    LatencyHistogram pipelines;
+    uint64_t ops[kOpKinds] = {};
+    uint64_t hits = 0;
+};
+
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0
+              << " [--threads n] [--ops n-per-thread] [--keys n] [--key-size bytes]"
+                 " [--value-size bytes] [--mix get:set:del] [--zipf theta] [--pipeline n]"
+                 " [--seed n] [--format text|json] [--shards n] [--lock-free-reads yes|no]"
+                 " [--near-cache entries] [--host h] [--port n]\n";
+}
+
+bool parseMix(const std::string& s, unsigned (&mix)[kOpKinds]) {
+    unsigned parts[kOpKinds] = {};
+    size_t start = 0;
+    for (int i = 0; i < kOpKinds; i++) {
+        size_t colon = s.find(':', start);
+        if ((colon == std::string::npos) != (i == kOpKinds - 1))
+            return false;
+        parts[i] = static_cast<unsigned>(std::stoul(s.substr(start, colon - start)));
+        start = colon + 1;
+    }
+    if (parts[kGet] + parts[kSet] + parts[kDel] != 100)
+        return false;
+    std::copy(parts, parts + kOpKinds, mix);
+    return true;
+}
+
+void parseOptions(int argc, char** argv, Options& opt) {
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc)
+            throw std::invalid_argument(arg);
+        std::string value = argv[++i];
+        if (arg == "--threads")
+            opt.threads = std::stoul(value);
+        else if (arg == "--ops")
+            opt.ops = std::stoul(value);
+        else if (arg == "--keys")
+            opt.keys = std::stoul(value);
+        else if (arg == "--key-size")
+            opt.keySize = std::stoul(value);
+        else if (arg == "--value-size")
+            opt.valueSize = std::stoul(value);
+        else if (arg == "--mix") {
+            if (!parseMix(value, opt.mix))
+                throw std::invalid_argument(arg);
+        } else if (arg == "--zipf") {
+            opt.zipf = std::stod(value);
+            if (opt.zipf < 0 || opt.zipf >= 1)
+                throw std::invalid_argument(arg);
+        } else if (arg == "--pipeline")
+            opt.pipeline = std::stoul(value);
+        else if (arg == "--seed")
+            opt.seed = std::stoull(value);
+        else if (arg == "--format") {
+            if (value != "text" && value != "json")
+                throw std::invalid_argument(arg);
+            opt.json = value == "json";
+        } else if (arg == "--shards")
+            opt.shards = std::stoul(value);
+        else if (arg == "--lock-free-reads")
+            opt.lockFreeReads = value == "yes";
+        else if (arg == "--near-cache")
+            opt.nearCacheEntries = std::stoul(value);
+        else if (arg == "--host")
+            opt.host = value;
+        else if (arg == "--port")
+            opt.port = std::stoi(value);
+        else
+            throw std::invalid_argument(arg);
+    }
+    if (!opt.threads || !opt.keys || !opt.pipeline)
+        throw std::invalid_argument("--threads, --keys and --pipeline must be positive");
+}
+
+std::string latencyJson(const LatencyHistogram& h) {
+    char buf[256];
+    std::snprintf(buf, sizeof(buf),
+                  "{\"count\":%llu,\"mean\":%.3f,\"p50\":%.3f,\"p99\":%.3f,\"p999\":%.3f,"
+                  "\"max\":%.3f}",
+                  static_cast<unsigned long long>(h.count()), h.mean() / 1000,
+                  h.percentile(50) / 1000.0, h.percentile(99) / 1000.0,
+                  h.percentile(99.9) / 1000.0, h.max() / 1000.0);
+    return buf;
+}
+
+void printLatency(const char* name, const LatencyHistogram& h) {
+    std::printf("  %-9s %10llu  mean %9.2f  p50 %9.2f  p99 %9.2f  p99.9 %9.2f  max %10.2f\n",
+                name, static_cast<unsigned long long>(h.count()), h.mean() / 1000,
+                h.percentile(50) / 1000.0, h.percentile(99) / 1000.0,
+                h.percentile(99.9) / 1000.0, h.max() / 1000.0);
+}
+}
+
+int main(int argc, char** argv) {
+    Options opt;
+    try {
+        parseOptions(argc, argv, opt);
+    } catch (const std::exception& e) {
+        std::cerr << "benchmark: bad option " << e.what() << "\n";
+        usage(argv[0]);
+        return 1;
+    }
+#ifndef __linux__
+    if (opt.port) {
+        std::cerr << "benchmark: --port needs Linux\n";
+        return 1;
+    }
+#endif
+
+    std::vector<std::string> keys(opt.keys);
+    for (size_t i = 0; i < opt.keys; i++)
+        keys[i] = keyName(i, opt.keySize);
+    std::string value(opt.valueSize, 'v');
+    std::unique_ptr<Zipfian> zipf;
+    if (opt.zipf > 0)
+        zipf = std::make_unique<Zipfian>(opt.keys, opt.zipf);
+
+    std::unique_ptr<RedisLite> redis;
+    if (!opt.port) {
+        RedisLiteConfig config;
+        config.shards = opt.shards;
+        config.lockFreeReads = opt.lockFreeReads;
+        config.nearCacheEntries = opt.nearCacheEntries;
+        redis = std::make_unique<RedisLite>(config);
+    }
+    auto connect = [&]() -> std::unique_ptr<Client> {
+#ifdef __linux__
+        if (opt.port)
+            return std::make_unique<RespClient>(opt, keys, value);
+#endif
+        return std::make_unique<LocalClient>(*redis, keys, value);
+    };
+
+    // Preload every key, then read them all back: a GET miss in the run
+    // must come from a DEL, not from a write still in flight
+    bool verified = true;
+    try {
+        std::unique_ptr<Client> loader = connect();
+        std::vector<Op> batch;
+        for (int pass = 0; pass < 2; pass++) {
+            size_t found = 0;
+            for (size_t i = 0; i < opt.keys; i++) {
+                batch.push_back(Op{pass ? kGet : kSet, i});
+                if (batch.size() == 1000 || i + 1 == opt.keys) {
+                    found += loader->run(batch);
+                    batch.clear();
+                }
+            }
+            if (pass && found != opt.keys) {
+                std::cerr << "benchmark: preload: only " << found << " of " << opt.keys
+                          << " keys readable\n";
+                verified = false;
+            }
+        }
+    } catch (const std::exception& e) {
+        std::cerr << "benchmark: " << e.what() << "\n";
+        return 1;
+    }
+
+    WorkerStats before = redis ? redis->stats() : WorkerStats();
+    std::vector<ThreadResult> results(opt.threads);
+    std::atomic<size_t> ready{0};
+    std::atomic<bool> go{false};
+    std::atomic<bool> failed{false};
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t < opt.threads; t++) {
+        threads.emplace_back([&, t]() {
+            ThreadResult& r = results[t];
+            std::unique_ptr<Client> client;
+            try {
+                client = connect();
+            } catch (const std::exception& e) {
+                std::cerr << "benchmark: " << e.what() << "\n";
+                failed = true;
+            }
+            uint64_t rng = (opt.seed + t) * 0x9E3779B97F4A7C15ULL | 1;
+            std::vector<Op> batch;
+            batch.reserve(opt.pipeline);
+            ready++;
+            while (!go.load(std::memory_order_acquire))
+                std::this_thread::yield();
+            for (size_t done = 0; client && done < opt.ops;) {
+                batch.clear();
+                for (; batch.size() < opt.pipeline && done < opt.ops; done++) {
+                    unsigned roll = static_cast<unsigned>(nextRandom(rng) % 100);
+                    OpKind kind = roll < opt.mix[kGet]                  ? kGet
+                                  : roll < opt.mix[kGet] + opt.mix[kSet] ? kSet
+                                                                         : kDel;
+                    size_t key = zipf ? zipf->next(rng) : nextRandom(rng) % opt.keys;
+                    batch.push_back(Op{kind, key});
+                    r.ops[kind]++;
+                }
+                uint64_t start = nowNs();
+                try {
+                    r.hits += client->run(batch);
+                } catch (const std::exception& e) {
+                    std::cerr << "benchmark: " << e.what() << "\n";
+                    failed = true;
+                    break;
+                }
+                uint64_t elapsed = nowNs() - start;
+                if (batch.size() == 1)
+                    r.latency[batch[0].kind].record(elapsed);
+                else
+                    r.pipelines.record(elapsed);
+            }
+            // Written last: seeing it proves this thread's writes landed
+            if (client && !failed)
+                client->set("bench:done:" + std::to_string(t), std::to_string(opt.ops));
+        });
+    }
+    while (ready.load() < opt.threads)
+        std::this_thread::yield();
+    uint64_t start = nowNs();
+    go.store(true, std::memory_order_release);
+    for (auto& thread : threads)
+        thread.join();
+    // Fire-and-forget writes count once the workers have run them: a
+    // queued read on every shard waits out the queues
+    if (redis) {
+        std::vector<std::string> drain;
+        for (size_t s = 0; s < std::max<size_t>(opt.shards, 1); s++) {
+            for (size_t i = 0; i < opt.keys; i++) {
+                if (shardOfKey(keys[i], opt.shards) == s) {
+                    drain.push_back(keys[i]);
+                    break;
+                }
+            }
+        }
+        redis->mget(drain);
+    }
+    double seconds = static_cast<double>(nowNs() - start) / 1e9;
+    if (failed)
+        return 1;
+
+    std::unique_ptr<Client> checker = connect();
+    for (size_t t = 0; t < opt.threads; t++) {
+        if (checker->get("bench:done:" + std::to_string(t)) != std::to_string(opt.ops)) {
+            std::cerr << "benchmark: thread " << t << " writes not applied\n";
+            verified = false;
+        }
+    }
+
+    ThreadResult total;
+    for (const ThreadResult& r : results) {
+        for (int k = 0; k < kOpKinds; k++) {
+            total.latency[k].merge(r.latency[k]);
+            total.ops[k] += r.ops[k];
+        }
+        total.pipelines.merge(r.pipelines);
+        total.hits += r.hits;
+    }
+    uint64_t ops = total.ops[kGet] + total.ops[kSet] + total.ops[kDel];
+    double opsPerSec = seconds > 0 ? static_cast<double>(ops) / seconds : 0;
+    WorkerStats after = redis ? redis->stats() : WorkerStats();
+    std::string target = opt.port ? opt.host + ":" + std::to_string(opt.port) : "in-process";
+
+    if (opt.json) {
+        std::printf("{\"target\":\"%s\",\"threads\":%zu,\"ops_per_thread\":%zu,\"keys\":%zu,"
+                    "\"key_size\":%zu,\"value_size\":%zu,\"mix\":{\"get\":%u,\"set\":%u,"
+                    "\"del\":%u},\"zipf\":%g,\"pipeline\":%zu,\"shards\":%zu,",
+                    target.c_str(), opt.threads, opt.ops, opt.keys, opt.keySize, opt.valueSize,
+                    opt.mix[kGet], opt.mix[kSet], opt.mix[kDel], opt.zipf, opt.pipeline,
+                    opt.port ? 0 : opt.shards);
+        std::printf("\"ops\":%llu,\"seconds\":%.6f,\"ops_per_sec\":%.1f,\"get_hits\":%llu,"
+                    "\"verified\":%s,\"latency_us\":{",
+                    static_cast<unsigned long long>(ops), seconds, opsPerSec,
+                    static_cast<unsigned long long>(total.hits), verified ? "true" : "false");
+        const char* sep = "";
+        for (int k = 0; k < kOpKinds; k++) {
+            if (total.latency[k].count()) {
+                std::printf("%s\"%s\":%s", sep, kOpNames[k], latencyJson(total.latency[k]).c_str());
+                sep = ",";
+            }
+        }
+        if (total.pipelines.count())
+            std::printf("%s\"pipeline\":%s", sep, latencyJson(total.pipelines).c_str());
+        std::printf("}");
+        if (redis)
+            std::printf(",\"worker\":{\"batches\":%llu,\"commands\":%llu,\"max_batch\":%llu}",
+                        static_cast<unsigned long long>(after.batches - before.batches),
+                        static_cast<unsigned long long>(after.commands - before.commands),
+                        static_cast<unsigned long long>(after.maxBatchSize));
+        std::printf("}\n");
+    } else {
+        std::printf("%s: %zu threads x %zu ops, %zu keys (%s), %zu-byte keys, %zu-byte values\n",
+                    target.c_str(), opt.threads, opt.ops, opt.keys,
+                    zipf ? ("zipf " + std::to_string(opt.zipf)).c_str() : "uniform",
+                    opt.keySize, opt.valueSize);
+        std::printf("mix get:set:del %u:%u:%u, pipeline %zu\n", opt.mix[kGet], opt.mix[kSet],
+                    opt.mix[kDel], opt.pipeline);
+        std::printf("%llu ops in %.3f s: %.0f ops/sec, %llu GET hits, writes %s\n",
+                    static_cast<unsigned long long>(ops), seconds, opsPerSec,
+                    static_cast<unsigned long long>(total.hits),
+                    verified ? "verified" : "NOT VERIFIED");
+        std::printf("latency (us)   count\n");
+        for (int k = 0; k < kOpKinds; k++) {
+            if (total.latency[k].count())
+                printLatency(kOpNames[k], total.latency[k]);
+        }
+        if (total.pipelines.count())
+            printLatency("pipeline", total.pipelines);
+        if (redis)
+            std::printf("worker: %llu batches, %llu commands, largest batch %llu\n",
+                        static_cast<unsigned long long>(after.batches - before.batches),
+                        static_cast<unsigned long long>(after.commands - before.commands),
+                        static_cast<unsigned long long>(after.maxBatchSize));
+    }
+    return verified ? 0 : 1;
+}
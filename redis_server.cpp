@@ -0,0 +1,248 @@
+#include <csignal>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <string>
+#include <vector>
+#include "RedisLite.h"
+#include "RespServer.h"
+
+namespace {
+volatile std::sig_atomic_t stopRequested = 0;
+
+void onSignal(int) {
+    stopRequested = 1;
+}
+
+void usage(const char* argv0) {
+    std::cerr << "usage: " << argv0
+              << " [--bind addr] [--port n] [--io-threads n] [--shards n] [--maxmemory bytes]"
+                 " [--maxmemory-policy noeviction|allkeys-lru|allkeys-lfu|volatile-ttl]"
+                 " [--aof path] [--appendfsync always|everysec|no] [--snapshot path]"
+                 " [--replicaof host:port] [--repl-backlog-size bytes]"
+                 " [--cluster announce-host:port] [--lock-free-reads yes|no]"
+                 " [--key-index yes|no] [--worker-cpus list] [--busy-poll yes|no]"
+                 " [--metrics-port n] [--latency-tracking yes|no]"
+                 " [--slowlog-log-slower-than us] [--slowlog-max-len n]"
+                 " [--latency-monitor-threshold us] [--compress-min bytes]"
+                 " [--queue-capacity n] [--queue-overflow block|reject|shed]"
+                 " [--priority-queue-capacity n]\n";
+}
+
+bool parsePolicy(const std::string& name, EvictionPolicy& out) {
+    if (name == "noeviction")
+        out = EvictionPolicy::NoEviction;
+    else if (name == "allkeys-lru")
+        out = EvictionPolicy::AllKeysLru;
+    else if (name == "allkeys-lfu")
+        out = EvictionPolicy::AllKeysLfu;
+    else if (name == "volatile-ttl")
+        out = EvictionPolicy::VolatileTtl;
+    else
+        return false;
+    return true;
+}
+
+bool parseFsync(const std::string& name, AofFsync& out) {
+    if (name == "always")
+        out = AofFsync::Always;
+    else if (name == "everysec")
+        out = AofFsync::EverySec;
+    else if (name == "no")
+        out = AofFsync::No;
+    else
+        return false;
+    return true;
+}
+
+bool parseOverflow(const std::string& name, QueueOverflow& out) {
+    if (name == "block")
+        out = QueueOverflow::Block;
+    else if (name == "reject")
+        out = QueueOverflow::Reject;
+    else if (name == "shed")
+        out = QueueOverflow::Shed;
+    else
+        return false;
+    return true;
+}
+
+// "0,2,4-7" as taskset takes it
+bool parseCpuList(const std::string& list, std::vector<int>& out) {
+    out.clear();
+    size_t pos = 0;
+    while (pos <= list.size()) {
+        size_t comma = list.find(',', pos);
+        std::string item = list.substr(pos, comma == std::string::npos ? std::string::npos
+                                                                        : comma - pos);
+        size_t dash = item.find('-');
+        char* end;
+        long first = std::strtol(item.c_str(), &end, 10);
+        long last = first;
+        if (item.empty() || end != item.c_str() + (dash == std::string::npos ? item.size() : dash))
+            return false;
+        if (dash != std::string::npos) {
+            last = std::strtol(item.c_str() + dash + 1, &end, 10);
+            if (dash + 1 == item.size() || *end != '\0')
+                return false;
+        }
+        if (first < 0 || last < first || last > 4095)
+            return false;
+        for (long cpu = first; cpu <= last; cpu++)
+            out.push_back(static_cast<int>(cpu));
+        if (comma == std::string::npos)
+            break;
+        pos = comma + 1;
+    }
+    return !out.empty();
+}
+}
+
+int main(int argc, char** argv) {
+    RedisLiteConfig config;
+    RespServerConfig serverConfig;
+
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return 1;
+        }
+        std::string value = argv[++i];
+        if (arg == "--bind") {
+            serverConfig.bindAddress = value;
+        } else if (arg == "--port") {
+            serverConfig.port = static_cast<uint16_t>(std::stoi(value));
+        } else if (arg == "--io-threads") {
+            serverConfig.ioThreads = static_cast<size_t>(std::stoul(value));
+        } else if (arg == "--shards") {
+            config.shards = static_cast<size_t>(std::stoul(value));
+        } else if (arg == "--queue-capacity") {
+            config.queueCapacity = static_cast<size_t>(std::stoul(value));
+        } else if (arg == "--queue-overflow") {
+            if (!parseOverflow(value, config.queueOverflow)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--priority-queue-capacity") {
+            config.priorityQueueCapacity = static_cast<size_t>(std::stoul(value));
+        } else if (arg == "--maxmemory") {
+            config.maxMemory = static_cast<size_t>(std::stoull(value));
+        } else if (arg == "--maxmemory-policy") {
+            if (!parsePolicy(value, config.evictionPolicy)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--aof") {
+            config.aofPath = value;
+        } else if (arg == "--replicaof") {
+            size_t colon = value.rfind(':');
+            if (colon == std::string::npos || colon == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+            serverConfig.replicaOfHost = value.substr(0, colon);
+            serverConfig.replicaOfPort = static_cast<uint16_t>(std::stoi(value.substr(colon + 1)));
+        } else if (arg == "--repl-backlog-size") {
+            config.replBacklogSize = static_cast<size_t>(std::stoull(value));
+        } else if (arg == "--cluster") {
+            if (value.rfind(':') == std::string::npos) {
+                usage(argv[0]);
+                return 1;
+            }
+            serverConfig.clusterAddress = value;
+        } else if (arg == "--lock-free-reads") {
+            if (value != "yes" && value != "no") {
+                usage(argv[0]);
+                return 1;
+            }
+            config.lockFreeReads = value == "yes";
+        } else if (arg == "--worker-cpus") {
+            if (!parseCpuList(value, config.workerCpus)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (arg == "--busy-poll") {
+            if (value != "yes" && value != "no") {
+                usage(argv[0]);
+                return 1;
+            }
+            config.busyPoll = value == "yes";
+        } else if (arg == "--key-index") {
+            if (value != "yes" && value != "no") {
+                usage(argv[0]);
+                return 1;
+            }
+            config.keyIndex = value == "yes";
+        } else if (arg == "--latency-tracking") {
+            if (value != "yes" && value != "no") {
+                usage(argv[0]);
+                return 1;
+            }
+            config.latencyTracking = value == "yes";
+        } else if (arg == "--slowlog-log-slower-than") {
+            config.slowlogSlowerThanUs = std::stoll(value);
+        } else if (arg == "--slowlog-max-len") {
+            config.slowlogMaxLen = static_cast<size_t>(std::stoul(value));
+        } else if (arg == "--latency-monitor-threshold") {
+            config.latencyMonitorThresholdUs = std::stoull(value);
+        } else if (arg == "--compress-min") {
+            config.compressMin = static_cast<size_t>(std::stoull(value));
+        } else if (arg == "--metrics-port") {
+            serverConfig.metricsPort = static_cast<uint16_t>(std::stoi(value));
+        } else if (arg == "--snapshot") {
+            config.snapshotPath = value;
+        } else if (arg == "--appendfsync") {
+            if (!parseFsync(value, config.aofFsync)) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else {
+            usage(argv[0]);
+            return 1;
+        }
+    }
+
+    if (config.queueOverflow == QueueOverflow::Shed && !config.priorityQueueCapacity) {
+        std::cerr << "redis_server: --queue-overflow shed needs --priority-queue-capacity"
+                  << std::endl;
+        return 1;
+    }
+
+    std::signal(SIGINT, onSignal);
+    std::signal(SIGTERM, onSignal);
+    std::signal(SIGPIPE, SIG_IGN);
+
+    std::unique_ptr<RedisLite> redis;
+    try {
+        redis = std::make_unique<RedisLite>(config); // replays the AOF or loads the snapshot, if any
+    } catch (const std::exception& e) {
+        std::cerr << "redis_server: " << e.what() << std::endl;
+        return 1;
+    }
+    RespServer server(*redis, serverConfig);
+    try {
+        server.start();
+    } catch (const std::exception& e) {
+        std::cerr << "redis_server: " << e.what() << std::endl;
+        return 1;
+    }
+    std::cout << "Listening on " << serverConfig.bindAddress << ":" << server.port()
+              << " with " << serverConfig.ioThreads << " I/O thread(s) and "
+              << redis->shardCount() << " shard(s)";
+    if (!serverConfig.replicaOfHost.empty())
+        std::cout << ", replica of " << serverConfig.replicaOfHost << ":"
+                  << serverConfig.replicaOfPort;
+    if (!serverConfig.clusterAddress.empty())
+        std::cout << ", cluster node " << serverConfig.clusterAddress;
+    if (serverConfig.metricsPort)
+        std::cout << ", metrics on :" << serverConfig.metricsPort << "/metrics";
+    std::cout << std::endl;
+
+    while (!stopRequested)
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+
+    server.stop();
+    return 0;
+}